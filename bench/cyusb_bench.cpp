@@ -0,0 +1,662 @@
+/************************************************************************************************
+ * Program Name		:	cyusb_bench.cpp							*
+ * Description		:	This is a CLI program which measures the host side cost of	*
+ *				libcyusb without any hardware: streams, control request	*
+ *				batches and firmware downloads are run against a simulated	*
+ *				device (see mock_libusb.h), and the firmware parsers and	*
+ *				checksums on images generated on the fly. The results are	*
+ *				written as CSV or JSON, one row per measurement.		*
+ * License		:	LGPL Ver 2.1							*
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS				*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mock_libusb.h"
+
+/********** Cut and paste the following & modify as required  **********/
+static const char * program_name;
+static const char *const short_options = "hvl:r:t:b:o:j";
+static const struct option long_options[] = {
+		{ "help",	0,	NULL,	'h'	},
+		{ "version",	0,	NULL,	'v'	},
+		{ "latency",	1,	NULL,	'l'	},
+		{ "rate",	1,	NULL,	'r'	},
+		{ "time",	1,	NULL,	't'	},
+		{ "bench",	1,	NULL,	'b'	},
+		{ "output",	1,	NULL,	'o'	},
+		{ "json",	0,	NULL,	'j'	},
+		{ NULL,		0,	NULL,	 0	}
+};
+
+static int next_option;
+
+static void print_usage(FILE *stream, int exit_code)
+{
+	fprintf(stream, "Usage: %s options\n", program_name);
+	fprintf(stream,
+		"  -h  --help               Display this usage information.\n"
+		"  -v  --version            Print version.\n"
+		"  -l  --latency <us>       Completion latency of the simulated device (default 125).\n"
+		"  -r  --rate <KBps>        Data rate of the simulated bus, 0 for no limit (default 0).\n"
+		"  -t  --time <s>           Run time of each streaming benchmark (default 2).\n"
+		"  -b  --bench <name>       Only run the named benchmark: stream_callback, stream_queue,\n"
+		"                           control_batch, fx2_hex_parse, fx2_download, fx3_checksum\n"
+		"                           or fx3_download.\n"
+		"  -o  --output <file>      Write the results to a file instead of stdout.\n"
+		"  -j  --json               Write the results as JSON instead of CSV.\n");
+
+	exit(exit_code);
+}
+/***********************************************************************/
+
+// Streams: transfers of BENCH_REQSIZE packets, BENCH_QUEUEDEPTH of them in flight.
+#define BENCH_REQSIZE		(16)
+#define BENCH_QUEUEDEPTH	(16)
+
+// Control batches: BENCH_CONTROL_COUNT requests of BENCH_CONTROL_SIZE bytes, as for I2C pages.
+#define BENCH_CONTROL_COUNT	(1024)
+#define BENCH_CONTROL_SIZE	(64)
+
+// FX2 images: BENCH_FX2_FILES different hex files of BENCH_FX2_SIZE bytes each. There are more
+// files than the image cache holds, so that loading them in turn parses each one again.
+#define BENCH_FX2_FILES		(16)
+#define BENCH_FX2_SIZE		(16 * 1024)
+#define BENCH_FX2_LOADS		(160)
+#define BENCH_FX2_CACHED_LOADS	(10000)
+
+// FX3 images: one section of BENCH_FX3_SIZE bytes.
+#define BENCH_FX3_SIZE		(512 * 1024)
+#define BENCH_FX3_CHECKS	(200)
+#define BENCH_FX3_DOWNLOADS	(4)
+
+// Most results a run can produce.
+#define BENCH_MAX_RESULTS	(64)
+
+// One measurement.
+struct bench_result {
+	const char *bench;
+	const char *metric;
+	double      value;
+	const char *unit;
+};
+
+static struct bench_result results[BENCH_MAX_RESULTS];
+static unsigned int        nresults    = 0;
+static unsigned int        run_seconds = 2;
+static bool                write_json  = false;
+
+// Function: bench_now
+// Returns the current time from the monotonic clock, in nanoseconds.
+static unsigned long long
+bench_now (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Function: bench_cpu_ns
+// Returns the user and system CPU time used by the process so far, in nanoseconds.
+static unsigned long long
+bench_cpu_ns (
+		void)
+{
+	struct rusage ru;
+
+	getrusage (RUSAGE_SELF, &ru);
+	return ((unsigned long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+			ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+// Function: add_result
+// Records one measurement of a benchmark.
+static void
+add_result (
+		const char *bench,
+		const char *metric,
+		double      value,
+		const char *unit)
+{
+	if (nresults >= BENCH_MAX_RESULTS)
+		return;
+
+	results[nresults].bench  = bench;
+	results[nresults].metric = metric;
+	results[nresults].value  = value;
+	results[nresults].unit   = unit;
+	nresults++;
+}
+
+// Function: write_results
+// Writes the measurements in CSV or JSON format.
+static void
+write_results (
+		FILE *fp)
+{
+	unsigned int i;
+
+	if (write_json) {
+		fprintf (fp, "[\n");
+		for (i = 0; i < nresults; i++) {
+			fprintf (fp, "  { \"benchmark\": \"%s\", \"metric\": \"%s\", \"value\": %.3f, \"unit\": \"%s\" }%s\n",
+					results[i].bench, results[i].metric, results[i].value, results[i].unit,
+					(i + 1 < nresults) ? "," : "");
+		}
+		fprintf (fp, "]\n");
+	} else {
+		fprintf (fp, "benchmark,metric,value,unit\n");
+		for (i = 0; i < nresults; i++)
+			fprintf (fp, "%s,%s,%.3f,%s\n", results[i].bench, results[i].metric, results[i].value,
+					results[i].unit);
+	}
+}
+
+// Data seen by the stream callback.
+struct stream_data {
+	unsigned long long bytes;
+	unsigned long long sum;
+};
+
+// Function: stream_cb
+// Stream callback doing the usual per transfer work of the test programs: counting the data and
+// reading it.
+static int
+stream_cb (
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		unsigned int            length,
+		void                   *arg)
+{
+	struct stream_data *sd = (struct stream_data *)arg;
+
+	sd->bytes += length;
+	if (length != 0)
+		sd->sum += transfer->buffer[0] + transfer->buffer[length - 1];
+	return CYUSB_STREAM_RESUBMIT;
+}
+
+// Function: bench_stream
+// Streams from the IN endpoint of the simulated device for the run time, with the data either
+// handled in the stream callback or taken from the completion queue on this thread. Reports the
+// completion rate, the CPU time per completion and the submission to completion and completion
+// to resubmission times.
+static int
+bench_stream (
+		const char *name,
+		bool        queued)
+{
+	libusb_device_handle   *h;
+	cyusb_stream           *strm = NULL;
+	struct stream_data      sd;
+	struct cyusb_stream_stats stats;
+	struct cyusb_hist       latency, resubmit;
+	struct libusb_transfer *transfer;
+	unsigned long long      t0, t1, cpu0, cpu1, end;
+	unsigned int            length;
+	double                  secs;
+	int                     r;
+
+	h = mock_open ();
+	if (h == NULL)
+		return -ENOMEM;
+
+	memset (&sd, 0, sizeof (sd));
+	r = cyusb_stream_open (h, MOCK_EP_IN, MOCK_PKTSIZE, BENCH_REQSIZE, BENCH_QUEUEDEPTH, &strm);
+	if (r == 0) {
+		if (queued)
+			r = cyusb_stream_enable_queue (strm);
+		else
+			cyusb_stream_set_callback (strm, stream_cb, &sd);
+	}
+	if (r == 0)
+		r = cyusb_event_thread_start (NULL);
+	if (r != 0) {
+		if (strm != NULL)
+			cyusb_stream_close (strm);
+		mock_close (h);
+		return r;
+	}
+
+	mock_resubmit_hist (&resubmit);
+	cpu0 = bench_cpu_ns ();
+	t0   = bench_now ();
+	r    = cyusb_stream_start (strm);
+	if (r == 0) {
+		end = t0 + run_seconds * 1000000000ULL;
+		if (queued) {
+			while (bench_now () < end) {
+				r = cyusb_stream_next (strm, &transfer, &length, 100);
+				if (r == LIBUSB_ERROR_TIMEOUT)
+					continue;
+				if (r != 0)
+					break;
+				stream_cb (strm, transfer, length, &sd);
+				r = cyusb_stream_submit (strm, transfer);
+				if (r != 0)
+					break;
+			}
+		} else {
+			while (bench_now () < end)
+				usleep (10000);
+		}
+		cyusb_stream_stop (strm);
+	}
+	t1   = bench_now ();
+	cpu1 = bench_cpu_ns ();
+
+	cyusb_stream_get_stats (strm, &stats);
+	cyusb_stream_get_latency (strm, &latency, NULL);
+	mock_resubmit_hist (&resubmit);
+	cyusb_stream_close (strm);
+	cyusb_event_thread_stop (NULL);
+	mock_close (h);
+	if (r != 0)
+		return r;
+
+	secs = (double)(t1 - t0) / 1e9;
+	add_result (name, "completions", stats.success_count / secs, "1/s");
+	add_result (name, "throughput", ((double)stats.bytes / (1024 * 1024)) / secs, "MBps");
+	if (stats.success_count != 0)
+		add_result (name, "cpu_per_completion", (double)(cpu1 - cpu0) / stats.success_count, "ns");
+	add_result (name, "latency_p50", cyusb_hist_percentile (&latency, 50) / 1e3, "us");
+	add_result (name, "latency_p99", cyusb_hist_percentile (&latency, 99) / 1e3, "us");
+	add_result (name, "resubmit_p50", cyusb_hist_percentile (&resubmit, 50), "ns");
+	add_result (name, "resubmit_p99", cyusb_hist_percentile (&resubmit, 99), "ns");
+	add_result (name, "resubmit_max", resubmit.max, "ns");
+	return 0;
+}
+
+// Function: bench_control_batch
+// Writes a list of small vendor requests with synchronous transfers, and with batches of a few
+// queue depths, and reports the request rate of each.
+static int
+bench_control_batch (
+		void)
+{
+	static const unsigned int depths[] = { 1, 4, CYUSB_CONTROL_DEPTH };
+	static const char *const  metrics[] = { "depth_1", "depth_4", "depth_8" };
+	libusb_device_handle     *h;
+	struct cyusb_control_req *reqs;
+	unsigned char            *data;
+	unsigned long long        t0, t1;
+	unsigned int              i, d;
+	int                       r = 0;
+
+	h    = mock_open ();
+	reqs = (struct cyusb_control_req *)calloc (BENCH_CONTROL_COUNT, sizeof (struct cyusb_control_req));
+	data = (unsigned char *)malloc (BENCH_CONTROL_COUNT * BENCH_CONTROL_SIZE);
+	if ((h == NULL) || (reqs == NULL) || (data == NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	memset (data, 0x5A, BENCH_CONTROL_COUNT * BENCH_CONTROL_SIZE);
+	for (i = 0; i < BENCH_CONTROL_COUNT; i++) {
+		reqs[i].bmRequestType = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT;
+		reqs[i].bRequest      = 0xBA;
+		reqs[i].wValue        = 0;
+		reqs[i].wIndex        = i * BENCH_CONTROL_SIZE;
+		reqs[i].wLength       = BENCH_CONTROL_SIZE;
+		reqs[i].data          = data + i * BENCH_CONTROL_SIZE;
+	}
+
+	t0 = bench_now ();
+	for (i = 0; i < BENCH_CONTROL_COUNT; i++) {
+		r = libusb_control_transfer (h, reqs[i].bmRequestType, reqs[i].bRequest, reqs[i].wValue,
+				reqs[i].wIndex, reqs[i].data, reqs[i].wLength, CYUSB_CONTROL_TIMEOUT);
+		if (r != BENCH_CONTROL_SIZE)
+			goto out;
+	}
+	t1 = bench_now ();
+	add_result ("control_batch", "sync", BENCH_CONTROL_COUNT / ((double)(t1 - t0) / 1e9), "req/s");
+
+	for (d = 0; d < sizeof (depths) / sizeof (depths[0]); d++) {
+		t0 = bench_now ();
+		r  = cyusb_control_batch (h, reqs, BENCH_CONTROL_COUNT, depths[d], 0);
+		t1 = bench_now ();
+		if (r != 0)
+			goto out;
+		add_result ("control_batch", metrics[d], BENCH_CONTROL_COUNT / ((double)(t1 - t0) / 1e9), "req/s");
+	}
+
+out:
+	free (data);
+	free (reqs);
+	if (h != NULL)
+		mock_close (h);
+	return (r < 0) ? r : 0;
+}
+
+// Function: write_fx2_hex
+// Writes an Intel hex file of BENCH_FX2_SIZE bytes, with 16 data bytes per record. The data
+// depends on the seed, so that files of different seeds have different contents.
+static int
+write_fx2_hex (
+		const char  *path,
+		unsigned int seed)
+{
+	unsigned int addr, i;
+	unsigned char sum, b;
+	FILE *fp;
+
+	fp = fopen (path, "w");
+	if (fp == NULL)
+		return -errno;
+
+	for (addr = 0; addr < BENCH_FX2_SIZE; addr += 16) {
+		sum = 16 + (addr >> 8) + (addr & 0xFF);
+		fprintf (fp, ":10%04X00", addr);
+		for (i = 0; i < 16; i++) {
+			b = (addr + i) * 7 + seed;
+			sum += b;
+			fprintf (fp, "%02X", b);
+		}
+		fprintf (fp, "%02X\n", (unsigned char)(-sum));
+	}
+	fprintf (fp, ":00000001FF\n");
+
+	if (fclose (fp) != 0)
+		return -errno;
+	return 0;
+}
+
+// Function: bench_fx2
+// Parses FX2 hex files, both files that are not in the image cache and one that is, and writes
+// a parsed image to the simulated device as a firmware download would.
+static int
+bench_fx2 (
+		bool parse,
+		bool download)
+{
+	char dir[] = "/tmp/cyusb_bench.XXXXXX";
+	char path[BENCH_FX2_FILES][64];
+	struct cyusb_fx2_image *img;
+	libusb_device_handle *h;
+	unsigned long long t0, t1;
+	unsigned int i, n = 0;
+	int r = 0;
+
+	if (mkdtemp (dir) == NULL)
+		return -errno;
+
+	for (n = 0; n < BENCH_FX2_FILES; n++) {
+		snprintf (path[n], sizeof (path[n]), "%s/fw%02u.hex", dir, n);
+		r = write_fx2_hex (path[n], n);
+		if (r != 0)
+			goto out;
+	}
+
+	if (parse) {
+		t0 = bench_now ();
+		for (i = 0; i < BENCH_FX2_LOADS; i++) {
+			r = cyusb_fx2_image_load (path[i % BENCH_FX2_FILES], &img);
+			if (r != 0)
+				goto out;
+			cyusb_fx2_image_release (img);
+		}
+		t1 = bench_now ();
+		add_result ("fx2_hex_parse", "load", (double)(t1 - t0) / BENCH_FX2_LOADS / 1e3, "us");
+		add_result ("fx2_hex_parse", "image_rate",
+				((double)BENCH_FX2_LOADS * BENCH_FX2_SIZE / (1024 * 1024)) / ((double)(t1 - t0) / 1e9), "MBps");
+
+		t0 = bench_now ();
+		for (i = 0; i < BENCH_FX2_CACHED_LOADS; i++) {
+			r = cyusb_fx2_image_load (path[0], &img);
+			if (r != 0)
+				goto out;
+			cyusb_fx2_image_release (img);
+		}
+		t1 = bench_now ();
+		add_result ("fx2_hex_parse", "cached_load", (double)(t1 - t0) / BENCH_FX2_CACHED_LOADS / 1e3, "us");
+	}
+
+	if (download) {
+		h = mock_open ();
+		if (h == NULL) {
+			r = -ENOMEM;
+			goto out;
+		}
+		r = cyusb_fx2_image_load (path[0], &img);
+		if (r == 0) {
+			t0 = bench_now ();
+			r  = cyusb_fx2_image_write (h, img, 0xA0, 0, CYUSB_FX2_MAX_SIZE);
+			t1 = bench_now ();
+			cyusb_fx2_image_release (img);
+		}
+		mock_close (h);
+		if (r < 0)
+			goto out;
+		add_result ("fx2_download", "write", (double)(t1 - t0) / 1e6, "ms");
+		r = 0;
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		unlink (path[i]);
+	rmdir (dir);
+	return r;
+}
+
+// Function: make_fx3_image
+// Builds a FX3 firmware image with a single section of BENCH_FX3_SIZE bytes, along with its
+// entry point and checksum. Returns the length of the image through length.
+static unsigned char *
+make_fx3_image (
+		size_t *length)
+{
+	unsigned int  words = BENCH_FX3_SIZE / 4;
+	unsigned int  addr = 0x40000000, entry = 0x40000100, sum = 0, w, i;
+	unsigned char *img;
+	size_t         off = 0;
+
+	*length = 4 + 8 + BENCH_FX3_SIZE + 8 + 4;
+	img = (unsigned char *)malloc (*length);
+	if (img == NULL)
+		return NULL;
+
+	img[0] = 'C';
+	img[1] = 'Y';
+	img[2] = 0x1C;
+	img[3] = 0xB0;
+	off    = 4;
+
+	memcpy (img + off, &words, 4);
+	memcpy (img + off + 4, &addr, 4);
+	off += 8;
+	for (i = 0; i < words; i++) {
+		w    = i * 2654435761U;
+		sum += w;
+		memcpy (img + off, &w, 4);
+		off += 4;
+	}
+
+	w = 0;
+	memcpy (img + off, &w, 4);
+	memcpy (img + off + 4, &entry, 4);
+	memcpy (img + off + 8, &sum, 4);
+	return img;
+}
+
+// Function: bench_fx3
+// Checks a FX3 firmware image as a download does before writing it, and downloads it to the
+// simulated device.
+static int
+bench_fx3 (
+		bool check,
+		bool download)
+{
+	libusb_device_handle *h;
+	unsigned long long    t0, t1;
+	unsigned char        *img;
+	unsigned int          entry, i;
+	size_t                length;
+	int                   r = 0;
+
+	img = make_fx3_image (&length);
+	if (img == NULL)
+		return -ENOMEM;
+
+	if (check) {
+		t0 = bench_now ();
+		for (i = 0; (i < BENCH_FX3_CHECKS) && (r == 0); i++)
+			r = cyusb_fx3_image_check (img, length, &entry);
+		t1 = bench_now ();
+		if (r != 0)
+			goto out;
+		add_result ("fx3_checksum", "check", (double)(t1 - t0) / BENCH_FX3_CHECKS / 1e3, "us");
+		add_result ("fx3_checksum", "image_rate",
+				((double)BENCH_FX3_CHECKS * length / (1024 * 1024)) / ((double)(t1 - t0) / 1e9), "MBps");
+	}
+
+	if (download) {
+		h = mock_open ();
+		if (h == NULL) {
+			r = -ENOMEM;
+			goto out;
+		}
+		t0 = bench_now ();
+		for (i = 0; (i < BENCH_FX3_DOWNLOADS) && (r == 0); i++)
+			r = cyusb_download_fx3_image (h, img, length);
+		t1 = bench_now ();
+		mock_close (h);
+		if (r != 0)
+			goto out;
+		add_result ("fx3_download", "download", (double)(t1 - t0) / BENCH_FX3_DOWNLOADS / 1e6, "ms");
+	}
+
+out:
+	free (img);
+	return r;
+}
+
+// Function: selected
+// Checks whether a benchmark is to be run.
+static bool
+selected (
+		const char *only,
+		const char *name)
+{
+	return ((only == NULL) || (strcmp (only, name) == 0));
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	static const char *const names[] = { "stream_callback", "stream_queue", "control_batch",
+		"fx2_hex_parse", "fx2_download", "fx3_checksum", "fx3_download" };
+	struct mock_config cfg;
+	const char *only = NULL;
+	const char *outfile = NULL;
+	const char *failed = NULL;
+	FILE *fp = stdout;
+	unsigned int i;
+	int r = 0;
+
+	cfg.latency_us = 125;
+	cfg.rate_kbps  = 0;
+
+	program_name = argv[0];
+	while ( (next_option = getopt_long(argc, argv, short_options,
+					   long_options, NULL) ) != -1 ) {
+		switch ( next_option ) {
+			case 'h': /* -h or --help  */
+				  print_usage(stdout, 0);
+			case 'v': /* -v or --version */
+				  printf("cyusb_bench (Ver 1.0)\n");
+				  printf("Copyright (C) Cypress Semiconductors / ATR-LABS\n");
+				  exit(0);
+			case 'l': /* -l or --latency */
+				  cfg.latency_us = strtoul(optarg, NULL, 0);
+				  break;
+			case 'r': /* -r or --rate */
+				  cfg.rate_kbps = strtoul(optarg, NULL, 0);
+				  break;
+			case 't': /* -t or --time */
+				  run_seconds = strtoul(optarg, NULL, 0);
+				  if ( run_seconds == 0 )
+					  print_usage(stdout, 1);
+				  break;
+			case 'b': /* -b or --bench */
+				  only = optarg;
+				  break;
+			case 'o': /* -o or --output */
+				  outfile = optarg;
+				  break;
+			case 'j': /* -j or --json */
+				  write_json = true;
+				  break;
+			case '?': /* Invalid option */
+				  print_usage(stdout, 1);
+			default : /* Something else, unexpected */
+				  abort();
+		}
+	}
+	if ( optind != argc )
+		print_usage(stdout, 1);
+
+	if ( only != NULL ) {
+		for ( i = 0; i < sizeof(names) / sizeof(names[0]); ++i ) {
+			if ( strcmp(only, names[i]) == 0 )
+				break;
+		}
+		if ( i == sizeof(names) / sizeof(names[0]) ) {
+			fprintf(stderr, "Unknown benchmark %s\n", only);
+			print_usage(stdout, 1);
+		}
+	}
+
+	mock_configure(&cfg);
+	add_result("config", "latency", cfg.latency_us, "us");
+	add_result("config", "rate", cfg.rate_kbps, "KBps");
+
+	if ( (r == 0) && selected(only, "stream_callback") ) {
+		r = bench_stream("stream_callback", false);
+		failed = "stream_callback";
+	}
+	if ( (r == 0) && selected(only, "stream_queue") ) {
+		r = bench_stream("stream_queue", true);
+		failed = "stream_queue";
+	}
+	if ( (r == 0) && selected(only, "control_batch") ) {
+		r = bench_control_batch();
+		failed = "control_batch";
+	}
+	if ( (r == 0) && (selected(only, "fx2_hex_parse") || selected(only, "fx2_download")) ) {
+		r = bench_fx2(selected(only, "fx2_hex_parse"), selected(only, "fx2_download"));
+		failed = "fx2";
+	}
+	if ( (r == 0) && (selected(only, "fx3_checksum") || selected(only, "fx3_download")) ) {
+		r = bench_fx3(selected(only, "fx3_checksum"), selected(only, "fx3_download"));
+		failed = "fx3";
+	}
+	if ( r != 0 ) {
+		fprintf(stderr, "Error %d in %s benchmark\n", r, failed);
+		cyusb_error(r);
+		return r;
+	}
+
+	if ( outfile != NULL ) {
+		fp = fopen(outfile, "w");
+		if ( fp == NULL ) {
+			fprintf(stderr, "Error opening output file %s: %s\n", outfile, strerror(errno));
+			return -errno;
+		}
+	}
+	write_results(fp);
+	if ( fp != stdout )
+		fclose(fp);
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*******************************************************************************\
+ * Program Name		:	mock_enum.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Device enumeration part of the libusb API for the simulated device. The	*
+ * benchmarks get their handle from mock_open(), so these only have to be	*
+ * there for libcyusb to link: no devices are found. The descriptors of the	*
+ * simulated device are in mock_libusb.cpp. libusb.h is not included here, as	*
+ * the parameter types of some of these functions differ between libusb	*
+ * versions; they are all pointers and integers, so the plain declarations	*
+ * below have the same ABI.							*
+ \*******************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Error codes returned by the stubs; these are fixed by the libusb ABI. */
+#define MOCK_ERROR_NO_DEVICE		(-4)
+#define MOCK_ERROR_NOT_FOUND		(-5)
+#define MOCK_ERROR_NOT_SUPPORTED	(-12)
+
+extern "C" {
+
+int libusb_init (void **ctx)
+{
+	if ( ctx != NULL )
+		*ctx = NULL;
+	return 0;
+}
+
+void libusb_exit (void *ctx)
+{
+}
+
+int libusb_has_capability (uint32_t capability)
+{
+	return 0;
+}
+
+ssize_t libusb_get_device_list (void *ctx, void ***list)
+{
+	static void *empty[1] = { NULL };
+
+	*list = empty;
+	return 0;
+}
+
+void libusb_free_device_list (void **list, int unref_devices)
+{
+}
+
+void * libusb_ref_device (void *dev)
+{
+	return dev;
+}
+
+void libusb_unref_device (void *dev)
+{
+}
+
+int libusb_open (void *dev, void **dev_handle)
+{
+	return MOCK_ERROR_NO_DEVICE;
+}
+
+void * libusb_open_device_with_vid_pid (void *ctx, uint16_t vendor_id, uint16_t product_id)
+{
+	return NULL;
+}
+
+void libusb_close (void *dev_handle)
+{
+}
+
+int libusb_get_ss_endpoint_companion_descriptor (void *ctx, const void *endpoint, void **ep_comp)
+{
+	return MOCK_ERROR_NOT_FOUND;
+}
+
+void libusb_free_ss_endpoint_companion_descriptor (void *ep_comp)
+{
+}
+
+int libusb_get_max_iso_packet_size (void *dev, unsigned char endpoint)
+{
+	return MOCK_ERROR_NOT_SUPPORTED;
+}
+
+uint8_t libusb_get_bus_number (void *dev)
+{
+	return 0;
+}
+
+uint8_t libusb_get_device_address (void *dev)
+{
+	return 0;
+}
+
+int libusb_get_port_numbers (void *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+	return 0;
+}
+
+int libusb_claim_interface (void *dev_handle, int interface_number)
+{
+	return 0;
+}
+
+int libusb_release_interface (void *dev_handle, int interface_number)
+{
+	return 0;
+}
+
+int libusb_set_interface_alt_setting (void *dev_handle, int interface_number, int alternate_setting)
+{
+	return 0;
+}
+
+int libusb_kernel_driver_active (void *dev_handle, int interface_number)
+{
+	return 0;
+}
+
+int libusb_detach_kernel_driver (void *dev_handle, int interface_number)
+{
+	return 0;
+}
+
+int libusb_hotplug_register_callback (void *ctx, int events, int flags, int vendor_id, int product_id,
+		int dev_class, void *cb_fn, void *user_data, int *callback_handle)
+{
+	return MOCK_ERROR_NOT_SUPPORTED;
+}
+
+void libusb_hotplug_deregister_callback (void *ctx, int callback_handle)
+{
+}
+
+}
+
+/*[]*/
@@ -0,0 +1,484 @@
+/*******************************************************************************\
+ * Program Name		:	mock_libusb.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Simulated device: the transfer and event handling part of the libusb API,	*
+ * backed by a single device that completes every transfer after the	*
+ * configured latency, with the transfers sharing a bus of the configured	*
+ * data rate. As in libusb, only one thread at a time runs completion		*
+ * callbacks; other threads handling events wait for it. The device		*
+ * enumeration part of the API is in mock_enum.cpp.				*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mock_libusb.h"
+
+/*
+   struct mock_xfer
+   Bookkeeping kept in front of every libusb_transfer allocated by the mock.
+ */
+struct mock_xfer {
+	struct mock_xfer	*next;			/* Next transfer queued on the device. */
+	unsigned long long	due;			/* Time at which the transfer completes. */
+	unsigned long long	cb_ns;			/* Time its last completion callback started, 0 if it
+							   has been submitted again since. */
+	int			queued;			/* Whether the transfer is queued on the device. */
+	int			cancelled;		/* Whether it has been cancelled while queued. */
+	unsigned long long	pad;			/* Keeps the libusb_transfer that follows aligned. */
+};
+
+/* The simulated device behind every handle. */
+struct libusb_device {
+	int			dummy;
+};
+
+struct libusb_device_handle {
+	struct libusb_device	*dev;
+};
+
+static struct libusb_device mock_dev;
+
+/* Descriptors of the simulated device: a high speed device with a single interface. */
+static const struct libusb_endpoint_descriptor mock_endpoints[] = {
+	{ LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, MOCK_EP_IN,  LIBUSB_TRANSFER_TYPE_BULK, MOCK_PKTSIZE, 0, 0, 0, NULL, 0 },
+	{ LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, MOCK_EP_OUT, LIBUSB_TRANSFER_TYPE_BULK, MOCK_PKTSIZE, 0, 0, 0, NULL, 0 },
+};
+
+static const struct libusb_interface_descriptor mock_altsetting = {
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 2, LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+	mock_endpoints, NULL, 0
+};
+
+static const struct libusb_interface mock_interface = { &mock_altsetting, 1 };
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  mock_cond;			/* Signalled when there is work for the handler. */
+static pthread_cond_t  mock_waiters;			/* Signalled when the handler is done with a round. */
+static pthread_once_t  mock_once = PTHREAD_ONCE_INIT;
+
+static struct mock_config mock_cfg;
+static struct mock_xfer *mock_pending;			/* Transfers queued on the device. */
+static unsigned long long mock_bus_free;		/* Time from which the bus is idle. */
+static bool mock_handler;				/* Whether a thread is running callbacks. */
+static bool mock_interrupted;				/* Set by libusb_interrupt_event_handler(). */
+static unsigned long long mock_submitted;
+static unsigned long long mock_completed;
+static struct cyusb_hist mock_resubmit;
+
+/* mock_now:
+   Get the current time in nanoseconds.
+ */
+static unsigned long long
+mock_now (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* mock_init:
+   Set up the condition variables, which wait on the monotonic clock.
+ */
+static void
+mock_init (
+		void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mock_cond, &attr);
+	pthread_cond_init(&mock_waiters, &attr);
+	pthread_condattr_destroy(&attr);
+	cyusb_hist_reset(&mock_resubmit);
+}
+
+/* mock_wait:
+   Wait on a condition variable until it is signalled or the deadline (in ns) has passed.
+ */
+static void
+mock_wait (
+		pthread_cond_t *cond,
+		unsigned long long deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	pthread_cond_timedwait(cond, &mock_lock, &ts);
+}
+
+/* mock_duration:
+   Get the time (in ns) that length bytes take on the bus.
+ */
+static unsigned long long
+mock_duration (
+		unsigned int length)
+{
+	if ( mock_cfg.rate_kbps == 0 )
+		return 0;
+	return (unsigned long long)length * 1000000000ULL / ((unsigned long long)mock_cfg.rate_kbps * 1024);
+}
+
+/* mock_complete:
+   Fill in the results of a transfer that the device has finished with.
+ */
+static void
+mock_complete (
+		struct libusb_transfer *t,
+		int cancelled)
+{
+	int i;
+
+	if ( cancelled ) {
+		t->status        = LIBUSB_TRANSFER_CANCELLED;
+		t->actual_length = 0;
+		return;
+	}
+
+	t->status = LIBUSB_TRANSFER_COMPLETED;
+	if ( t->type == LIBUSB_TRANSFER_TYPE_CONTROL )
+		t->actual_length = t->length - LIBUSB_CONTROL_SETUP_SIZE;
+	else
+		t->actual_length = t->length;
+
+	for ( i = 0; i < t->num_iso_packets; ++i ) {
+		t->iso_packet_desc[i].actual_length = t->iso_packet_desc[i].length;
+		t->iso_packet_desc[i].status        = LIBUSB_TRANSFER_COMPLETED;
+	}
+}
+
+/* mock_configure:
+   Set the latency and data rate of the simulated device.
+ */
+void
+mock_configure (
+		const struct mock_config *cfg)
+{
+	pthread_once(&mock_once, mock_init);
+	pthread_mutex_lock(&mock_lock);
+	mock_cfg = *cfg;
+	pthread_mutex_unlock(&mock_lock);
+}
+
+/* mock_open:
+   Get a handle to the simulated device.
+ */
+libusb_device_handle *
+mock_open (
+		void)
+{
+	struct libusb_device_handle *h;
+
+	pthread_once(&mock_once, mock_init);
+	h = (struct libusb_device_handle *)calloc(1, sizeof(struct libusb_device_handle));
+	if ( h != NULL )
+		h->dev = &mock_dev;
+	return h;
+}
+
+/* mock_close:
+   Release a handle to the simulated device.
+ */
+void
+mock_close (
+		libusb_device_handle *h)
+{
+	free(h);
+}
+
+/* mock_resubmit_hist:
+   Get the completion to resubmission times recorded so far, and start over.
+ */
+void
+mock_resubmit_hist (
+		struct cyusb_hist *hist)
+{
+	pthread_once(&mock_once, mock_init);
+	pthread_mutex_lock(&mock_lock);
+	*hist = mock_resubmit;
+	cyusb_hist_reset(&mock_resubmit);
+	pthread_mutex_unlock(&mock_lock);
+}
+
+/* mock_counters:
+   Get the number of transfers submitted and completed.
+ */
+void
+mock_counters (
+		unsigned long long *submitted,
+		unsigned long long *completed)
+{
+	pthread_mutex_lock(&mock_lock);
+	*submitted = mock_submitted;
+	*completed = mock_completed;
+	pthread_mutex_unlock(&mock_lock);
+}
+
+struct libusb_transfer *
+libusb_alloc_transfer (
+		int iso_packets)
+{
+	struct mock_xfer *x;
+
+	x = (struct mock_xfer *)calloc(1, sizeof(struct mock_xfer) + sizeof(struct libusb_transfer) +
+			iso_packets * sizeof(struct libusb_iso_packet_descriptor));
+	if ( x == NULL )
+		return NULL;
+
+	return (struct libusb_transfer *)(x + 1);
+}
+
+void
+libusb_free_transfer (
+		struct libusb_transfer *transfer)
+{
+	if ( transfer != NULL )
+		free((struct mock_xfer *)transfer - 1);
+}
+
+int
+libusb_submit_transfer (
+		struct libusb_transfer *transfer)
+{
+	struct mock_xfer *x = (struct mock_xfer *)transfer - 1;
+	struct mock_xfer **p;
+	unsigned long long now;
+
+	pthread_once(&mock_once, mock_init);
+	pthread_mutex_lock(&mock_lock);
+	if ( x->queued ) {
+		pthread_mutex_unlock(&mock_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	now = mock_now();
+	if ( x->cb_ns != 0 ) {
+		cyusb_hist_record(&mock_resubmit, now - x->cb_ns);
+		x->cb_ns = 0;
+	}
+
+	/* The transfer has the bus once the ones before it are done, and completes one latency
+	   after its data is through. */
+	if ( mock_bus_free < now )
+		mock_bus_free = now;
+	mock_bus_free += mock_duration(transfer->length);
+	x->due       = mock_bus_free + mock_cfg.latency_us * 1000ULL;
+	x->queued    = 1;
+	x->cancelled = 0;
+
+	for ( p = &mock_pending; *p != NULL; p = &(*p)->next )
+		;
+	x->next = NULL;
+	*p = x;
+
+	mock_submitted++;
+	pthread_cond_signal(&mock_cond);
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+int
+libusb_cancel_transfer (
+		struct libusb_transfer *transfer)
+{
+	struct mock_xfer *x = (struct mock_xfer *)transfer - 1;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&mock_lock);
+	if ( (x->queued) && (!x->cancelled) ) {
+		x->cancelled = 1;
+		pthread_cond_signal(&mock_cond);
+		r = 0;
+	}
+	pthread_mutex_unlock(&mock_lock);
+	return r;
+}
+
+int
+libusb_handle_events_timeout_completed (
+		libusb_context *ctx,
+		struct timeval *tv,
+		int *completed)
+{
+	struct mock_xfer *ready = NULL, **tail = &ready, **p, *x;
+	unsigned long long deadline, now, wake;
+
+	pthread_once(&mock_once, mock_init);
+	deadline = mock_now() + (unsigned long long)tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+
+	pthread_mutex_lock(&mock_lock);
+
+	/* Only one thread runs callbacks at a time; the others wait for it to finish a round. */
+	while ( mock_handler ) {
+		if ( ((completed != NULL) && (__atomic_load_n(completed, __ATOMIC_ACQUIRE))) ||
+				(mock_now() >= deadline) ) {
+			pthread_mutex_unlock(&mock_lock);
+			return 0;
+		}
+		mock_wait(&mock_waiters, deadline);
+	}
+	mock_handler = true;
+
+	while ( 1 ) {
+		if ( ((completed != NULL) && (__atomic_load_n(completed, __ATOMIC_ACQUIRE))) || (mock_interrupted) ) {
+			mock_interrupted = false;
+			break;
+		}
+
+		now  = mock_now();
+		wake = deadline;
+		for ( p = &mock_pending; *p != NULL; ) {
+			x = *p;
+			if ( (x->cancelled) || (x->due <= now) ) {
+				*p = x->next;
+				x->next = NULL;
+				*tail = x;
+				tail = &x->next;
+				continue;
+			}
+			if ( x->due < wake )
+				wake = x->due;
+			p = &x->next;
+		}
+
+		if ( (ready != NULL) || (now >= deadline) )
+			break;
+		mock_wait(&mock_cond, wake);
+	}
+
+	/* Callbacks run without the lock, as they submit transfers again. */
+	while ( ready != NULL ) {
+		x = ready;
+		ready = x->next;
+
+		mock_complete((struct libusb_transfer *)(x + 1), x->cancelled);
+		x->queued = 0;
+		x->cb_ns  = mock_now();
+		mock_completed++;
+
+		pthread_mutex_unlock(&mock_lock);
+		((struct libusb_transfer *)(x + 1))->callback((struct libusb_transfer *)(x + 1));
+		pthread_mutex_lock(&mock_lock);
+	}
+
+	mock_handler = false;
+	pthread_cond_broadcast(&mock_waiters);
+	pthread_mutex_unlock(&mock_lock);
+	return 0;
+}
+
+void
+libusb_interrupt_event_handler (
+		libusb_context *ctx)
+{
+	pthread_mutex_lock(&mock_lock);
+	mock_interrupted = true;
+	pthread_cond_broadcast(&mock_cond);
+	pthread_mutex_unlock(&mock_lock);
+}
+
+int
+libusb_control_transfer (
+		libusb_device_handle *dev_handle,
+		uint8_t request_type,
+		uint8_t bRequest,
+		uint16_t wValue,
+		uint16_t wIndex,
+		unsigned char *data,
+		uint16_t wLength,
+		unsigned int timeout)
+{
+	unsigned long long ns = mock_cfg.latency_us * 1000ULL + mock_duration(wLength);
+	struct timespec ts;
+
+	ts.tv_sec  = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	if ( ns != 0 )
+		nanosleep(&ts, NULL);
+
+	if ( (request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN )
+		memset(data, 0, wLength);
+	return wLength;
+}
+
+int
+libusb_get_device_descriptor (
+		libusb_device *dev,
+		struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(struct libusb_device_descriptor));
+	desc->bLength            = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType    = LIBUSB_DT_DEVICE;
+	desc->bcdUSB             = 0x0200;
+	desc->bMaxPacketSize0    = 64;
+	desc->idVendor           = 0x04b4;
+	desc->idProduct          = 0x1004;
+	desc->bNumConfigurations = 1;
+	return 0;
+}
+
+int
+libusb_get_active_config_descriptor (
+		libusb_device *dev,
+		struct libusb_config_descriptor **config)
+{
+	struct libusb_config_descriptor *c;
+
+	c = (struct libusb_config_descriptor *)calloc(1, sizeof(struct libusb_config_descriptor));
+	if ( c == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	c->bLength             = LIBUSB_DT_CONFIG_SIZE;
+	c->bDescriptorType     = LIBUSB_DT_CONFIG;
+	c->bNumInterfaces      = 1;
+	c->bConfigurationValue = 1;
+	c->interface           = &mock_interface;
+	*config = c;
+	return 0;
+}
+
+void
+libusb_free_config_descriptor (
+		struct libusb_config_descriptor *config)
+{
+	free(config);
+}
+
+libusb_device *
+libusb_get_device (
+		libusb_device_handle *dev_handle)
+{
+	return dev_handle->dev;
+}
+
+unsigned char *
+libusb_dev_mem_alloc (
+		libusb_device_handle *dev_handle,
+		size_t length)
+{
+	/* No usbfs, so the buffer pools fall back to ordinary memory. */
+	return NULL;
+}
+
+int
+libusb_dev_mem_free (
+		libusb_device_handle *dev_handle,
+		unsigned char *buffer,
+		size_t length)
+{
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/*[]*/
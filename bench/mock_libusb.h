@@ -0,0 +1,61 @@
+#ifndef __MOCK_LIBUSB_H
+#define __MOCK_LIBUSB_H
+
+/*******************************************************************************\
+ * Program Name		:	mock_libusb.h					*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Simulated device behind the libusb API, for running libcyusb without any	*
+ * hardware. The benchmarks are linked against mock_libusb.cpp instead of	*
+ * libusb-1.0; all transfers go to a single simulated device, which		*
+ * completes them after a fixed latency and at a fixed data rate.		*
+ \*******************************************************************************/
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Endpoints of the simulated device: one bulk endpoint in each direction, at high speed. */
+#define MOCK_EP_IN		(0x81)
+#define MOCK_EP_OUT		(0x02)
+#define MOCK_PKTSIZE		(512)
+
+/* Behaviour of the simulated device. */
+struct mock_config {
+	unsigned int	latency_us;		/* Time from submission to completion of a transfer. */
+	unsigned int	rate_kbps;		/* Data rate of the bus in KBps, 0 for no limit. */
+};
+
+/*
+   mock_configure:
+   Set the latency and data rate of the simulated device. Applies to transfers submitted afterwards.
+ */
+extern void mock_configure(const struct mock_config *cfg);
+
+/*
+   mock_open:
+   Get a handle to the simulated device.
+ */
+extern libusb_device_handle * mock_open(void);
+
+/*
+   mock_close:
+   Release a handle obtained from mock_open(). All transfers on it must be complete.
+ */
+extern void mock_close(libusb_device_handle *h);
+
+/*
+   mock_resubmit_hist:
+   Get the histogram of the time (in ns) from the start of each completion callback to the
+   next submission of the same transfer, and start a new one.
+ */
+extern void mock_resubmit_hist(struct cyusb_hist *hist);
+
+/*
+   mock_counters:
+   Get the number of transfers submitted to and completed by the simulated device so far.
+ */
+extern void mock_counters(unsigned long long *submitted, unsigned long long *completed);
+
+#endif /* __MOCK_LIBUSB_H */
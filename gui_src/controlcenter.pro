@@ -1,7 +1,8 @@
 TEMPLATE	= app
 HEADERS		= ../include/controlcenter.h
 FORMS		= controlcenter.ui
-SOURCES		= controlcenter.cpp main.cpp fx2_download.cpp fx3_download.cpp streamer.cpp
+SOURCES		= controlcenter.cpp main.cpp fx2_download.cpp fx3_download.cpp streamer.cpp isostream.cpp filestream.cpp hexview.cpp
 LIBS		+= -L../lib -lcyusb -lusb-1.0
 QT		+= widgets network
+CONFIG		+= c++11
 TARGET		= ../bin/cyusb_linux
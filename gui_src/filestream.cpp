@@ -0,0 +1,558 @@
+/*
+ * Filename             : filestream.cpp
+ * Description          : Streams a file through the bulk endpoints for the Bulk tab.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "../include/cyusb.h"
+#include "usbmethods.h"
+
+// Size of each transfer, and the number of transfers kept queued in each direction. Together
+// the OUT and IN transfers stay well inside the default usbfs memory limit of 16 MB.
+#define FILE_CHUNK_SIZE		(256 * 1024)
+#define FILE_QUEUE_DEPTH	(16)
+
+// Number of IN buffers. When the received data is written to a file, a buffer stays with the
+// writer thread until it has been written, so there are enough for two full queues.
+#define FILE_IN_BUFFERS		(2 * FILE_QUEUE_DEPTH)
+
+// Largest number of buffers passed to a single writev() call.
+#define FILE_WRITE_BATCH	(16)
+
+#define FILE_IN_TIMEOUT		(1000)		// Timeout for an IN transfer, in ms
+#define FILE_OUT_TIMEOUT	(5000)		// Timeout for an OUT transfer, in ms
+
+// Received buffer waiting to be written to the file.
+struct fs_wentry {
+	unsigned char	*buf;
+	unsigned int	 len;
+};
+
+// All state is protected by fs_lock. The transfer callbacks run on the library event thread.
+static pthread_mutex_t	fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	fs_cond = PTHREAD_COND_INITIALIZER;
+
+static bool		fs_running = false;	// Whether a file is being streamed
+static bool		fs_stopping;		// No more transfers are to be submitted
+static bool		fs_done;		// All transfers and writes have completed
+static int		fs_error;		// First transfer error, as a LIBUSB_ERROR code
+static int		fs_write_error;		// errno of the first failed write to the file
+
+static int		fs_srcfd = -1;		// File being sent
+static int		fs_dstfd = -1;		// File receiving the IN data, or -1
+static unsigned char	*fs_map = NULL;		// Mapping of the file being sent
+static unsigned long long fs_size;		// Size of the file being sent
+static unsigned long long fs_offset;		// Offset of the next chunk to be sent
+static unsigned long long fs_bytes_out;		// Data sent to the device
+static unsigned long long fs_bytes_in;		// Data received from the device
+static unsigned long long fs_bytes_written;	// Received data written to the file
+static struct timespec	fs_start;		// Time when streaming was started
+
+static libusb_context	*fs_ctx;		// libusb context of the device handle
+static int		fs_event_thread;	// Whether the library event thread was started
+static struct libusb_transfer *fs_out[FILE_QUEUE_DEPTH];
+static struct libusb_transfer *fs_in[FILE_QUEUE_DEPTH];
+static unsigned int	fs_nin;			// Number of IN transfers used
+static unsigned int	fs_out_flight;		// OUT transfers submitted and not yet completed
+static unsigned int	fs_in_flight;		// IN transfers submitted and not yet completed
+
+static unsigned char	*fs_bufs[FILE_IN_BUFFERS];	// IN buffers
+static unsigned int	fs_nbufs;
+static unsigned char	*fs_free[FILE_IN_BUFFERS];	// IN buffers not in use
+static unsigned int	fs_nfree;
+static struct libusb_transfer *fs_starved[FILE_QUEUE_DEPTH];	// IN transfers waiting for a buffer
+static unsigned int	fs_nstarved;
+
+static struct fs_wentry	fs_wq[FILE_IN_BUFFERS];	// Buffers queued for the writer thread
+static unsigned int	fs_wq_head, fs_wq_count;
+static unsigned int	fs_writing;		// Buffers currently being written
+static bool		fs_writer_exit;
+static pthread_t	fs_writer;
+static bool		fs_writer_started;
+
+// Function: fs_transfer_error
+// Converts the status of a failed transfer into a LIBUSB_ERROR code.
+static int
+fs_transfer_error (
+		enum libusb_transfer_status status)
+{
+	switch (status) {
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+// Function: fs_fail
+// Records the first error, and stops submitting transfers. Called with fs_lock held.
+static void
+fs_fail (
+		int err)
+{
+	if (fs_error == 0)
+		fs_error = err;
+	fs_stopping = true;
+}
+
+// Function: fs_check_done
+// Marks the stream as done once nothing is in flight and all received data has been written.
+// Called with fs_lock held.
+static void
+fs_check_done (
+		void)
+{
+	if ((fs_out_flight == 0) && (fs_in_flight == 0) && (fs_wq_count == 0) && (fs_writing == 0)) {
+		fs_done = true;
+		pthread_cond_broadcast (&fs_cond);
+	}
+}
+
+// Function: fs_submit_out
+// Submits the next chunk of the file on an OUT transfer. The transfer points straight into the
+// file mapping, so the data is never copied in user space. Called with fs_lock held.
+static void
+fs_submit_out (
+		struct libusb_transfer *transfer)
+{
+	unsigned long long len = fs_size - fs_offset;
+
+	if (len > FILE_CHUNK_SIZE)
+		len = FILE_CHUNK_SIZE;
+
+	transfer->buffer = fs_map + fs_offset;
+	transfer->length = (int)len;
+	if (libusb_submit_transfer (transfer) != 0) {
+		fs_fail (LIBUSB_ERROR_IO);
+		return;
+	}
+
+	fs_offset += len;
+	fs_out_flight++;
+}
+
+// Function: fs_submit_in
+// Submits an IN transfer with the given buffer. Called with fs_lock held.
+static void
+fs_submit_in (
+		struct libusb_transfer *transfer,
+		unsigned char          *buf)
+{
+	transfer->buffer = buf;
+	transfer->length = FILE_CHUNK_SIZE;
+	if (libusb_submit_transfer (transfer) != 0) {
+		fs_free[fs_nfree++] = buf;
+		fs_fail (LIBUSB_ERROR_IO);
+		return;
+	}
+
+	fs_in_flight++;
+}
+
+// Function: fs_out_cb
+// Handles a completed OUT transfer, and sends the next chunk of the file on it.
+static void LIBUSB_CALL
+fs_out_cb (
+		struct libusb_transfer *transfer)
+{
+	pthread_mutex_lock (&fs_lock);
+	fs_out_flight--;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+		fs_bytes_out += transfer->actual_length;
+	else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+		fs_fail (fs_transfer_error (transfer->status));
+
+	if ((!fs_stopping) && (fs_offset < fs_size))
+		fs_submit_out (transfer);
+
+	fs_check_done ();
+	pthread_mutex_unlock (&fs_lock);
+}
+
+// Function: fs_in_cb
+// Handles a completed IN transfer. The buffer is handed to the writer thread, and the transfer
+// is submitted again with a free buffer, so that receiving never waits for the disk unless all
+// the buffers are waiting to be written.
+static void LIBUSB_CALL
+fs_in_cb (
+		struct libusb_transfer *transfer)
+{
+	unsigned char *buf = transfer->buffer;
+	unsigned int len = transfer->actual_length;
+
+	pthread_mutex_lock (&fs_lock);
+	fs_in_flight--;
+
+	switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			break;
+
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			// Once all of the file has been sent, a timeout means that the device has
+			// nothing more to return.
+			if ((fs_out_flight == 0) && (fs_offset == fs_size))
+				fs_stopping = true;
+			break;
+
+		case LIBUSB_TRANSFER_CANCELLED:
+			break;
+
+		default:
+			fs_fail (fs_transfer_error (transfer->status));
+			break;
+	}
+
+	fs_bytes_in += len;
+	if ((len != 0) && (fs_dstfd >= 0)) {
+		fs_wq[(fs_wq_head + fs_wq_count) % FILE_IN_BUFFERS].buf = buf;
+		fs_wq[(fs_wq_head + fs_wq_count) % FILE_IN_BUFFERS].len = len;
+		fs_wq_count++;
+		pthread_cond_broadcast (&fs_cond);
+		buf = NULL;
+	}
+
+	if ((!fs_stopping) && (fs_bytes_in < fs_size)) {
+		if (buf == NULL) {
+			if (fs_nfree != 0)
+				buf = fs_free[--fs_nfree];
+		}
+		if (buf != NULL)
+			fs_submit_in (transfer, buf);
+		else
+			fs_starved[fs_nstarved++] = transfer;
+	} else if (buf != NULL)
+		fs_free[fs_nfree++] = buf;
+
+	fs_check_done ();
+	pthread_mutex_unlock (&fs_lock);
+}
+
+// Function: fs_writev_all
+// Writes all of the buffers, continuing after partial writes.
+static int
+fs_writev_all (
+		int           fd,
+		struct iovec *iov,
+		int           cnt)
+{
+	ssize_t r;
+
+	while (cnt > 0) {
+		r = writev (fd, iov, cnt);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		while ((cnt > 0) && ((size_t)r >= iov->iov_len)) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+// Function: fs_writer_func
+// Writes the received data to the file. All buffers queued at the time are written with a
+// single writev() call, so the file sees large writes from page aligned buffers.
+static void *
+fs_writer_func (
+		void *arg)
+{
+	struct iovec iov[FILE_WRITE_BATCH];
+	unsigned char *bufs[FILE_WRITE_BATCH];
+	unsigned long long total;
+	unsigned int i, n;
+	int r;
+
+	pthread_mutex_lock (&fs_lock);
+	for (;;) {
+		while ((fs_wq_count == 0) && (!fs_writer_exit))
+			pthread_cond_wait (&fs_cond, &fs_lock);
+		if (fs_wq_count == 0)
+			break;
+
+		n = (fs_wq_count < FILE_WRITE_BATCH) ? fs_wq_count : FILE_WRITE_BATCH;
+		total = 0;
+		for (i = 0; i < n; i++) {
+			bufs[i]         = fs_wq[fs_wq_head].buf;
+			iov[i].iov_base = fs_wq[fs_wq_head].buf;
+			iov[i].iov_len  = fs_wq[fs_wq_head].len;
+			total          += fs_wq[fs_wq_head].len;
+			fs_wq_head      = (fs_wq_head + 1) % FILE_IN_BUFFERS;
+		}
+		fs_wq_count -= n;
+		fs_writing   = n;
+		pthread_mutex_unlock (&fs_lock);
+
+		// Data is still received while the write is in progress.
+		r = (fs_write_error == 0) ? fs_writev_all (fs_dstfd, iov, n) : 0;
+
+		pthread_mutex_lock (&fs_lock);
+		if (r != 0) {
+			fs_write_error = r;
+			fs_stopping    = true;
+		} else if (fs_write_error == 0)
+			fs_bytes_written += total;
+
+		// Give the buffers back, to the transfers waiting for one first.
+		for (i = 0; i < n; i++) {
+			if ((fs_nstarved != 0) && (!fs_stopping))
+				fs_submit_in (fs_starved[--fs_nstarved], bufs[i]);
+			else
+				fs_free[fs_nfree++] = bufs[i];
+		}
+		fs_writing = 0;
+		fs_check_done ();
+	}
+	pthread_mutex_unlock (&fs_lock);
+
+	return NULL;
+}
+
+// Function: fs_release
+// Frees everything allocated for the stream. Nothing may be in flight.
+static void
+fs_release (
+		void)
+{
+	unsigned int i;
+
+	if (fs_event_thread) {
+		cyusb_event_thread_stop (fs_ctx);
+		fs_event_thread = 0;
+	}
+
+	for (i = 0; i < FILE_QUEUE_DEPTH; i++) {
+		if (fs_out[i] != NULL)
+			libusb_free_transfer (fs_out[i]);
+		if (fs_in[i] != NULL)
+			libusb_free_transfer (fs_in[i]);
+		fs_out[i] = fs_in[i] = NULL;
+	}
+	for (i = 0; i < fs_nbufs; i++)
+		free (fs_bufs[i]);
+	fs_nbufs = 0;
+
+	if (fs_map != NULL)
+		munmap (fs_map, fs_size);
+	fs_map = NULL;
+	if (fs_srcfd >= 0)
+		close (fs_srcfd);
+	if (fs_dstfd >= 0)
+		close (fs_dstfd);
+	fs_srcfd = fs_dstfd = -1;
+}
+
+// Function: filestream_start
+// Starts sending a file on the OUT endpoint ep_out. If ep_in is not zero, the data is also read
+// back on ep_in, and written to infile unless it is NULL.
+int
+filestream_start (
+		libusb_device_handle *handle,
+		unsigned char         ep_out,
+		const char           *outfile,
+		unsigned char         ep_in,
+		const char           *infile)
+{
+	struct stat st;
+	unsigned int i;
+	int r = 0;
+
+	if (fs_running)
+		return -EBUSY;
+
+	fs_srcfd = open (outfile, O_RDONLY);
+	if (fs_srcfd < 0)
+		return -errno;
+	if ((fstat (fs_srcfd, &st) != 0) || (st.st_size == 0)) {
+		fs_release ();
+		return -EINVAL;
+	}
+
+	fs_size = st.st_size;
+	fs_map  = (unsigned char *)mmap (NULL, fs_size, PROT_READ, MAP_PRIVATE, fs_srcfd, 0);
+	if (fs_map == MAP_FAILED) {
+		fs_map = NULL;
+		r = -errno;
+		fs_release ();
+		return r;
+	}
+	madvise (fs_map, fs_size, MADV_SEQUENTIAL);
+
+	if ((ep_in != 0) && (infile != NULL)) {
+		fs_dstfd = open (infile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (fs_dstfd < 0) {
+			r = -errno;
+			fs_release ();
+			return r;
+		}
+	}
+
+	fs_stopping    = false;
+	fs_done        = false;
+	fs_error       = 0;
+	fs_write_error = 0;
+	fs_offset      = 0;
+	fs_bytes_out   = fs_bytes_in = fs_bytes_written = 0;
+	fs_out_flight  = fs_in_flight = 0;
+	fs_nfree       = fs_nstarved = 0;
+	fs_wq_head     = fs_wq_count = fs_writing = 0;
+	fs_writer_exit = false;
+	fs_nin         = (ep_in != 0) ? FILE_QUEUE_DEPTH : 0;
+
+	// IN buffers are page aligned, which is what the file system prefers for large writes.
+	fs_nbufs = (fs_nin == 0) ? 0 : ((fs_dstfd >= 0) ? FILE_IN_BUFFERS : FILE_QUEUE_DEPTH);
+	for (i = 0; i < fs_nbufs; i++) {
+		if (posix_memalign ((void **)&fs_bufs[i], 4096, FILE_CHUNK_SIZE) != 0) {
+			fs_nbufs = i;
+			fs_release ();
+			return -ENOMEM;
+		}
+		fs_free[fs_nfree++] = fs_bufs[i];
+	}
+
+	for (i = 0; i < FILE_QUEUE_DEPTH; i++) {
+		fs_out[i] = libusb_alloc_transfer (0);
+		if (fs_out[i] == NULL) {
+			fs_release ();
+			return -ENOMEM;
+		}
+		libusb_fill_bulk_transfer (fs_out[i], handle, ep_out, NULL, 0, fs_out_cb, NULL, FILE_OUT_TIMEOUT);
+
+		if (i < fs_nin) {
+			fs_in[i] = libusb_alloc_transfer (0);
+			if (fs_in[i] == NULL) {
+				fs_release ();
+				return -ENOMEM;
+			}
+			libusb_fill_bulk_transfer (fs_in[i], handle, ep_in, NULL, 0, fs_in_cb, NULL, FILE_IN_TIMEOUT);
+		}
+	}
+
+	fs_ctx = cyusb_handle_context (handle);
+	r = cyusb_event_thread_start (fs_ctx);
+	if (r != 0) {
+		fs_release ();
+		return r;
+	}
+	fs_event_thread = 1;
+
+	if (fs_dstfd >= 0) {
+		if (pthread_create (&fs_writer, NULL, fs_writer_func, NULL) != 0) {
+			fs_release ();
+			return -ENOMEM;
+		}
+		fs_writer_started = true;
+	}
+
+	// Queue the IN transfers first, so that a loopback device can always return its data.
+	clock_gettime (CYUSB_CLOCK, &fs_start);
+	fs_running = true;
+	pthread_mutex_lock (&fs_lock);
+	for (i = 0; (i < fs_nin) && (!fs_stopping); i++)
+		fs_submit_in (fs_in[i], fs_free[--fs_nfree]);
+	for (i = 0; (i < FILE_QUEUE_DEPTH) && (fs_offset < fs_size) && (!fs_stopping); i++)
+		fs_submit_out (fs_out[i]);
+	fs_check_done ();
+	pthread_mutex_unlock (&fs_lock);
+
+	return 0;
+}
+
+// Function: filestream_stop
+// Cancels any transfers still in flight, waits for the received data to be written, and
+// releases all resources. Also used to clean up after the stream has completed.
+void
+filestream_stop (
+		void)
+{
+	unsigned int i;
+
+	if (!fs_running)
+		return;
+
+	pthread_mutex_lock (&fs_lock);
+	fs_stopping = true;
+	if (!fs_done) {
+		for (i = 0; i < FILE_QUEUE_DEPTH; i++) {
+			libusb_cancel_transfer (fs_out[i]);
+			if (i < fs_nin)
+				libusb_cancel_transfer (fs_in[i]);
+		}
+	}
+	while ((fs_out_flight != 0) || (fs_in_flight != 0))
+		pthread_cond_wait (&fs_cond, &fs_lock);
+	fs_writer_exit = true;
+	pthread_cond_broadcast (&fs_cond);
+	pthread_mutex_unlock (&fs_lock);
+
+	if (fs_writer_started) {
+		pthread_join (fs_writer, NULL);
+		fs_writer_started = false;
+	}
+
+	fs_release ();
+	fs_running = false;
+}
+
+// Function: filestream_is_running
+// Checks whether a file stream has been started and not yet stopped.
+bool
+filestream_is_running (
+		void)
+{
+	return fs_running;
+}
+
+// Function: filestream_get_status
+// Gets the progress of the file stream.
+void
+filestream_get_status (
+		struct filestream_status *st)
+{
+	struct timespec now;
+
+	clock_gettime (CYUSB_CLOCK, &now);
+
+	pthread_mutex_lock (&fs_lock);
+	st->seconds       = (now.tv_sec - fs_start.tv_sec) + (now.tv_nsec - fs_start.tv_nsec) / 1e9;
+	st->size          = fs_size;
+	st->bytes_out     = fs_bytes_out;
+	st->bytes_in      = fs_bytes_in;
+	st->bytes_written = fs_bytes_written;
+	st->error         = fs_error;
+	st->write_error   = fs_write_error;
+	st->done          = fs_done;
+	pthread_mutex_unlock (&fs_lock);
+}
+
+/*[]*/
+
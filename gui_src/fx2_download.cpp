@@ -254,7 +254,6 @@ static char fx2_vendax[][256] = {
 #define FX2_INT_RAMSIZE		(0x4000)
 
 #define VENDORCMD_TIMEOUT	(5000)
-#define MAX_LINE_LENGTH		(512)
 #define MAX_BYTES_PER_LINE	(256)
 #define EEPROM_WRITE_SIZE	(1024)
 
@@ -271,15 +270,6 @@ extern libusb_device_handle *h;
 extern QStatusBar *sb;
 extern QMainWindow *mw;
 
-/* List of FX2LP firmware formats. */
-typedef enum {
-	FW_FORMAT_INVALID = 0,  // Invalid type, typically due to file access error.
-	FW_FORMAT_HEX = 0,      // Intel Hex Format, download to RAM only.
-	FW_FORMAT_BIN,          // Binary format, download to RAM only.
-	FW_FORMAT_C2LOAD,       // Firmware in C2 load format.
-	FW_FORMAT_C0LOAD	// USB IDs in C0 load format.
-} fx2_fw_fmt;
-
 static void dump_buffer(unsigned char num_bytes, short address, unsigned char *dbuf)
 {
 	int i;
@@ -312,205 +302,6 @@ static int fx2_reset(int cpu_enable)
 	return 0;
 }
 
-static fx2_fw_fmt
-get_fw_format (
-		FILE *fw_fil_p)
-{
-	fx2_fw_fmt fmt = FW_FORMAT_HEX;
-	unsigned char hexdata[MAX_LINE_LENGTH], *fw_p;
-	unsigned char num_bytes;
-	unsigned int  len;
-
-	if (fw_fil_p != 0) {
-		fseek (fw_fil_p, 0, SEEK_SET);
-
-		/* Check for valid HEX file first. Each line should begin with ':' and
-		 * have enough data to cover the byte count per line. */
-		while (fgets ((char *)hexdata, MAX_LINE_LENGTH, fw_fil_p) != NULL) {
-
-			if (hexdata[0] != ':')
-				fmt = FW_FORMAT_BIN;
-
-			fw_p      = &hexdata[1];
-			len       = (unsigned int)strlen ((const char *)hexdata);
-			num_bytes = GET_HEX_BYTE(fw_p);
-
-			if (len < (unsigned int)(num_bytes * 2 + 9))
-				fmt = FW_FORMAT_BIN;
-		}
-
-		if (fmt != FW_FORMAT_HEX) {
-			fseek (fw_fil_p, 0, SEEK_SET);
-			if (fgets ((char *)hexdata, MAX_LINE_LENGTH, fw_fil_p) == NULL) {
-				fmt = FW_FORMAT_INVALID;
-			} else {
-				switch (hexdata[0]) {
-					case 0xC0:
-						fmt = FW_FORMAT_C0LOAD;
-						printf ("Found C0 Load IIC format file\n");
-						break;
-					case 0xC2:
-						printf ("Found C2 Load IIC format file\n");
-						fmt = FW_FORMAT_C2LOAD;
-						break;
-					default:
-						printf ("Found binary format file\n");
-						fmt = FW_FORMAT_BIN;
-						break;
-				}
-			}
-		} else
-			printf ("Found Hex format file\n");
-	} else
-		fmt = FW_FORMAT_INVALID;
-
-	return fmt;
-}
-
-/* Function to read the FX2LP firmware from in_file into the fw_buf buffer.
-   max_addr is used to return the maximum valid address found in the input.
- */
-static fx2_fw_fmt
-read_fx2_firmware (
-		const char    *filename,
-		unsigned char *fw_buf,
-		unsigned int  *max_addr)
-{
-	FILE         *in_file = NULL;
-	fx2_fw_fmt    fmt;
-	int           ret;
-	struct stat   filbuf;
-	unsigned char scratch[MAX_LINE_LENGTH], *tmp;
-	unsigned int  i, address, length;
-
-
-	if ((filename == NULL) || (fw_buf == NULL) || (max_addr == NULL)) {
-		fprintf (stderr, "Invalid parameter\n");
-		return FW_FORMAT_INVALID;
-	}
-
-	ret = stat (filename, &filbuf);
-	if (ret != 0) {
-		fprintf (stderr, "Failed to stat file %s\n", filename);
-		return FW_FORMAT_INVALID;
-	}
-
-	in_file = fopen (filename, "rb");
-	if (in_file == NULL) {
-		fprintf (stderr, "Failed to open file %s\n", filename);
-		return FW_FORMAT_INVALID;
-	}
-
-	*max_addr = 0;
-	fmt = get_fw_format (in_file);
-	fseek (in_file, 0, SEEK_SET);
-	memset (fw_buf, 0, FX2_MAX_FW_SIZE);
-
-	switch (fmt)
-	{
-		case FW_FORMAT_HEX:
-			{
-				fmt    = FW_FORMAT_INVALID;
-				length = 0;
-
-				while (fgets ((char *)scratch, MAX_LINE_LENGTH, in_file) != NULL) {
-					/* If this is the end of file record, stop reading. */
-					if ((scratch[7] == '0') && (scratch[8] == '1')) {
-						fmt = FW_FORMAT_BIN;
-						break;
-					}
-
-					/* Ignore all except data records. */
-					if ((scratch[7] != '0') || (scratch[8] != '0'))
-						continue;
-
-					tmp = &scratch[1];
-					length  = GET_HEX_BYTE (tmp);
-					tmp += 2;
-					address = GET_HEX_WORD (tmp);
-
-					if ((address + length) > FX2_MAX_FW_SIZE) {
-						fprintf (stderr, "Firmware address out of range\n");
-						break;
-					}
-
-					if ((address + length) > *max_addr)
-						*max_addr = address + length;
-
-					tmp += 6;
-					for (i = 0; i < length; i++) {
-						fw_buf[address + i] = GET_HEX_BYTE (tmp);
-						tmp += 2;
-					}
-				}
-			}
-			break;
-
-		case FW_FORMAT_C2LOAD:
-			{
-				fmt = FW_FORMAT_INVALID;
-
-				/* Read and skip the 8 byte header. */
-				ret = fread (scratch, 1, 8, in_file);
-				if (ret == 8) {
-					ret = fread (scratch, 1, 4, in_file);
-					while (ret == 4) {
-						length  = (scratch[0] << 8) | scratch[1];
-						address = (scratch[2] << 8) | scratch[3];
-
-						/* We have received the footer. Stop reading file. */
-						if ((address == FX2_CPUCS_ADDR) && (length == 0x8001)) {
-							fmt = FW_FORMAT_BIN;
-							break;
-						}
-
-						if ((address + length) > FX2_MAX_FW_SIZE) {
-							fprintf (stderr, "Firmware address out of range\n");
-							break;
-						}
-
-						if ((address + length) > *max_addr)
-							*max_addr = address + length;
-						ret = fread (fw_buf + address, 1, length, in_file);
-						if (ret != (int)length) {
-							fprintf (stderr, "Failed to read file\n");
-							break;
-						}
-
-						ret = fread (scratch, 1, 4, in_file);
-					}
-				}
-			}
-			break;
-
-		case FW_FORMAT_BIN:
-			{
-				/* Binary file, just read contents into memory as it is. */
-				if (filbuf.st_size <= FX2_MAX_FW_SIZE) {
-					ret = fread (fw_buf, 1, filbuf.st_size, in_file);
-					if (ret == filbuf.st_size) {
-						*max_addr = ret;
-						ret = 0;
-					} else {
-						fprintf (stderr, "File %s read failed\n", filename);
-						fmt = FW_FORMAT_INVALID;
-					}
-				} else {
-					fprintf (stderr, "File %s is too large. Not likely to be a FX2 firmware binary\n", filename);
-					fmt = FW_FORMAT_INVALID;
-				}
-			}
-			break;
-
-		default:
-			fmt = FW_FORMAT_INVALID;
-			break;
-	}
-
-	fclose (in_file);
-	return (fmt);
-}
-
 /* Function to load the Vend_Ax firmware into the FX3 RAM. */
 static int fx2_load_vendax(void)
 {
@@ -563,19 +354,20 @@ static int fx2_load_vendax(void)
 
 int fx2_ram_download(const char *filename, int extended)
 {
-	unsigned char fw_buf[FX2_MAX_FW_SIZE];
-	fx2_fw_fmt    fmt;
-	unsigned int  i, maxaddr = 0, length = 0, done = 0;
+	struct cyusb_fx2_image *img;
+	unsigned int  maxaddr;
 	int           r;
 
-	fmt = read_fx2_firmware (filename, fw_buf, &maxaddr);
-	if (fmt != FW_FORMAT_BIN) {
+	/* The library parses the file only once, and caches the parsed segments. */
+	if (cyusb_fx2_image_load (filename, &img) != 0) {
 		fprintf (stderr, "Error: Invalid firmware file format\n");
 		return -1;
 	}
+	maxaddr = img->max_addr;
 
 	if ((maxaddr > FX2_INT_RAMSIZE) && (!extended)) {
 		fprintf (stderr, "Error: Firmware too big to fit in internal RAM\n");
+		cyusb_fx2_image_release (img);
 		return -2;
 	}
 
@@ -583,14 +375,15 @@ int fx2_ram_download(const char *filename, int extended)
 	r = fx2_reset (0);
 	if ( r != 0 ) {
 		printf ("Failed to force FX2 into reset\n");
+		cyusb_fx2_image_release (img);
 		return -3;
 	}
-	sleep(1);
 
 	if ((extended) && (maxaddr > FX2_INT_RAMSIZE)) {
 		r = fx2_load_vendax();
 		if ( r != 0 ) {
 			printf("Failed to download Vend_Ax firmware to aid programming\n");
+			cyusb_fx2_image_release (img);
 			return -4;
 		}
 	}
@@ -602,18 +395,14 @@ int fx2_ram_download(const char *filename, int extended)
 	if ((extended) && (maxaddr > FX2_INT_RAMSIZE)) {
 
 		/* Load the external RAM part first. */
-		for (i = FX2_INT_RAMSIZE; i < maxaddr; i += EEPROM_WRITE_SIZE) {
-			length = ((maxaddr - i) > EEPROM_WRITE_SIZE) ? EEPROM_WRITE_SIZE : (maxaddr - i);
-			r = libusb_control_transfer (h, 0x40, 0xA3, i, 0x00, &fw_buf[i], length, VENDORCMD_TIMEOUT);
-			if (r != (int)length) {
-				fprintf (stderr, "Vendor write to RAM failed\n");
-				sb->removeWidget(bar);
-				return -5;
-			}
-
-			done += length;
-			bar->setValue (done);
+		r = cyusb_fx2_image_write (h, img, 0xA3, FX2_INT_RAMSIZE, FX2_MAX_FW_SIZE);
+		if (r < 0) {
+			fprintf (stderr, "Vendor write to RAM failed\n");
+			sb->removeWidget(bar);
+			cyusb_fx2_image_release (img);
+			return -5;
 		}
+		bar->setValue (maxaddr - FX2_INT_RAMSIZE);
 
 		/* All data has been loaded on external RAM. Now halt the CPU and load the internal RAM. */
 		printf ("Info: Forcing FX2 CPU into reset\n");
@@ -622,27 +411,20 @@ int fx2_ram_download(const char *filename, int extended)
 		if ( r != 0 ) {
 			fprintf (stderr, "Error: Failed to halt FX2 CPU\n");
 			sb->removeWidget(bar);
+			cyusb_fx2_image_release (img);
 			return -6;
 		}
-
-		/* We can reduce the size to the internal RAM size now. */
-		maxaddr = FX2_INT_RAMSIZE;
 	}
 
-	/* Load the internal RAM part now. */
-	for (i = 0; i < maxaddr; i += EEPROM_WRITE_SIZE) {
-		length = ((maxaddr - i) > EEPROM_WRITE_SIZE) ? EEPROM_WRITE_SIZE : (maxaddr - i);
-		r = libusb_control_transfer (h, 0x40, 0xA0, i, 0x00, &fw_buf[i], length, VENDORCMD_TIMEOUT);
-		if (r != (int)length) {
-			fprintf (stderr, "Vendor write to RAM failed\n");
-			sb->removeWidget(bar);
-			return -7;
-		}
-
-		done += length;
-		bar->setValue (done);
+	/* Load the internal RAM part now, skipping any gaps in the image. */
+	r = cyusb_fx2_image_write (h, img, 0xA0, 0, FX2_INT_RAMSIZE);
+	cyusb_fx2_image_release (img);
+	if (r < 0) {
+		fprintf (stderr, "Vendor write to RAM failed\n");
+		sb->removeWidget(bar);
+		return -7;
 	}
-
+	bar->setValue (maxaddr);
 
 	sb->removeWidget(bar);
 
@@ -62,29 +62,6 @@ const int i2c_eeprom_size[] =
 static int filesize;
 static int current_count;
 
-static int ram_write(unsigned char *buf, unsigned int ramAddress, int len)
-{
-	int r;
-	int index = 0;
-	int size;
-
-	while ( len > 0 ) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = libusb_control_transfer(h, 0x40, 0xA0, GET_LSW(ramAddress), GET_MSW(ramAddress),
-				&buf[index], size, VENDORCMD_TIMEOUT);
-		if ( r != size ) {
-			printf("Vendor write to FX3 RAM failed\n");
-			return -1;
-		}
-
-		ramAddress += size;
-		index      += size;
-		len        -= size;
-	}
-
-	return 0;
-}
-
 static int read_firmware_image(const char *filename, unsigned char *buf, int *romsize)
 {
 	int fd;
@@ -138,10 +115,7 @@ static int read_firmware_image(const char *filename, unsigned char *buf, int *ro
 int fx3_usbboot_download(const char *filename)
 {
 	unsigned char *fwBuf;
-	unsigned int  *data_p;
-	unsigned int i, checksum;
-	unsigned int address, length;
-	int r, index;
+	int r;
 
 	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
 	if ( fwBuf == 0 ) {
@@ -159,39 +133,18 @@ int fx3_usbboot_download(const char *filename)
 		return -2;
 	}
 
-	// Run through each section of code, and use vendor commands to download them to RAM.
-	index    = 4;
-	checksum = 0;
-	while ( index < filesize ) {
-		data_p  = (unsigned int *)(fwBuf + index);
-		length  = data_p[0];
-		address = data_p[1];
-		if (length != 0) {
-			for (i = 0; i < length; i++)
-				checksum += data_p[2 + i];
-			r = ram_write(fwBuf + index + 8, address, length * 4);
-			if (r != 0) {
-				printf("Failed to download data to FX3 RAM\n");
-				sb->showMessage("Error: Write to FX3 RAM failed", 5000);
-				free(fwBuf);
-				return -3;
-			}
-		} else {
-			if (checksum != data_p[2]) {
-				printf ("Checksum error in firmware binary\n");
-				sb->showMessage("Error: Firmware checksum error", 5000);
-				free(fwBuf);
-				return -4;
-			}
-
-			r = libusb_control_transfer(h, 0x40, 0xA0, GET_LSW(address), GET_MSW(address), NULL,
-					0, VENDORCMD_TIMEOUT);
-			if ( r != 0 )
-				printf("Ignored error in control transfer: %d\n", r);
-			break;
-		}
-
-		index += (8 + length * 4);
+	// The library checks the image and keeps several vendor commands queued at a time.
+	r = cyusb_download_fx3_image(h, fwBuf, filesize);
+	if ( r == -EINVAL ) {
+		sb->showMessage("Error: Invalid firmware binary", 5000);
+		free(fwBuf);
+		return -4;
+	}
+	if ( r != 0 ) {
+		printf("Failed to download data to FX3 RAM\n");
+		sb->showMessage("Error: Write to FX3 RAM failed", 5000);
+		free(fwBuf);
+		return -3;
 	}
 
 	free(fwBuf);
@@ -0,0 +1,183 @@
+/*
+ * Filename             : hexview.cpp
+ * Description          : Item model that shows captured data as a hex dump in a list view.
+ */
+
+#include <QtCore>
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "hexview.h"
+
+// Function: HexDumpModel
+// Creates an empty model, which keeps up to capacity bytes of captured data.
+HexDumpModel::HexDumpModel (
+		size_t   capacity,
+		QObject *parent)
+	: QAbstractListModel (parent), ring (capacity), head (0), tail (0), next_line (0), first_line (0)
+{
+}
+
+// Function: rowCount
+// Gets the number of lines in the dump.
+int
+HexDumpModel::rowCount (
+		const QModelIndex &parent) const
+{
+	if (parent.isValid ())
+		return 0;
+
+	return (int)(next_line - first_line);
+}
+
+// Function: format
+// Formats one line of a block, in the same layout used by the original list items.
+QString
+HexDumpModel::format (
+		const struct block &b,
+		unsigned int        line) const
+{
+	unsigned long long pos = b.start + (unsigned long long)line * HEXVIEW_LINE_BYTES;
+	unsigned int i, j;
+	unsigned char c;
+	char tbuf[HEXVIEW_LINE_BYTES * 5 + 4];
+	char *p = tbuf;
+
+	// The separator line, and the part of a block that has already been dropped.
+	if ((line * HEXVIEW_LINE_BYTES >= b.len) || (pos < tail))
+		return QString ();
+
+	j = b.len - line * HEXVIEW_LINE_BYTES;
+	if (j > HEXVIEW_LINE_BYTES)
+		j = HEXVIEW_LINE_BYTES;
+
+	for (i = 0; i < HEXVIEW_LINE_BYTES; i++) {
+		if (i < j)
+			p += sprintf (p, "%02x ", ring[(pos + i) % ring.size ()]);
+		else
+			p += sprintf (p, "   ");
+	}
+	p += sprintf (p, ": ");
+	for (i = 0; i < j; i++) {
+		c = ring[(pos + i) % ring.size ()];
+		*p++ = isprint (c) ? c : '.';
+		*p++ = ' ';
+	}
+	*p = '\0';
+
+	return QString::fromLatin1 (tbuf);
+}
+
+// Function: data
+// Gets the text of a line. This is only called for the rows the view needs to draw.
+QVariant
+HexDumpModel::data (
+		const QModelIndex &index,
+		int                role) const
+{
+	std::deque<struct block>::const_iterator it;
+	unsigned long long line;
+
+	if ((role != Qt::DisplayRole) || (!index.isValid ()) || (index.row () >= rowCount ()))
+		return QVariant ();
+
+	// Find the block holding the line; blocks are sorted by their first line.
+	line = first_line + index.row ();
+	it   = std::upper_bound (blocks.begin (), blocks.end (), line,
+			[] (unsigned long long l, const struct block &b) { return l < b.line; });
+	if (it == blocks.begin ())
+		return QVariant ();
+	--it;
+
+	return format (*it, (unsigned int)(line - it->line));
+}
+
+// Function: drop
+// Drops the oldest captured data, so that the given number of bytes can be added.
+void
+HexDumpModel::drop (
+		unsigned long long bytes)
+{
+	unsigned long long new_first = first_line;
+
+	if (head + bytes - tail <= ring.size ())
+		return;
+
+	tail = head + bytes - ring.size ();
+
+	// Whole blocks that are no longer in the ring are removed along with their lines. A block
+	// that is partly dropped keeps its lines, which show up empty until it is dropped too.
+	while ((!blocks.empty ()) && (blocks.front ().start + blocks.front ().len <= tail)) {
+		new_first = blocks.front ().line + blocks.front ().lines;
+		blocks.pop_front ();
+	}
+	if (blocks.empty ())
+		new_first = next_line;
+
+	if (new_first != first_line) {
+		beginRemoveRows (QModelIndex (), 0, (int)(new_first - first_line - 1));
+		first_line = new_first;
+		endRemoveRows ();
+	}
+}
+
+// Function: append
+// Adds a block of captured data to the end of the dump, optionally followed by an empty line.
+void
+HexDumpModel::append (
+		const unsigned char *buf,
+		unsigned int         len,
+		bool                 separator)
+{
+	struct block b;
+	unsigned int n;
+	size_t off;
+
+	if (len == 0)
+		return;
+
+	// Only the end of a block larger than the whole ring can be kept.
+	if (len > ring.size ()) {
+		head += len - ring.size ();
+		buf  += len - ring.size ();
+		len   = ring.size ();
+	}
+	drop (len);
+
+	b.start = head;
+	b.len   = len;
+	b.line  = next_line;
+	b.lines = (len + HEXVIEW_LINE_BYTES - 1) / HEXVIEW_LINE_BYTES + (separator ? 1 : 0);
+
+	// Copy the data into the ring, in at most two pieces.
+	off = head % ring.size ();
+	n   = std::min ((size_t)len, ring.size () - off);
+	memcpy (&ring[off], buf, n);
+	memcpy (&ring[0], buf + n, len - n);
+	head += len;
+
+	beginInsertRows (QModelIndex (), rowCount (), rowCount () + b.lines - 1);
+	blocks.push_back (b);
+	next_line += b.lines;
+	endInsertRows ();
+}
+
+// Function: clear
+// Drops all captured data.
+void
+HexDumpModel::clear (
+		void)
+{
+	beginResetModel ();
+	blocks.clear ();
+	tail       = head;
+	first_line = next_line;
+	endResetModel ();
+}
+
+/*[]*/
+
@@ -0,0 +1,57 @@
+/*
+ * Filename             : hexview.h
+ * Description          : Item model that shows captured data as a hex dump in a list view.
+ */
+
+#ifndef INCLUDED_HEXVIEW_H
+#define INCLUDED_HEXVIEW_H
+
+#include <QAbstractListModel>
+
+#include <deque>
+#include <vector>
+
+// Number of bytes shown on each line of the dump.
+#define HEXVIEW_LINE_BYTES	(8)
+
+// Default amount of captured data kept for display. Older data is dropped once it is exceeded.
+#define HEXVIEW_CAPACITY	(4 * 1024 * 1024)
+
+// The captured data is kept as raw bytes in a ring, and a line is only formatted when the view
+// asks for it, which is only done for the rows that are visible. Every block of data appended
+// starts on a new line, as the dump of each transfer did when it was a list of items.
+class HexDumpModel : public QAbstractListModel
+{
+public:
+	HexDumpModel(size_t capacity = HEXVIEW_CAPACITY, QObject *parent = 0);
+
+	void append(const unsigned char *buf, unsigned int len, bool separator = false);
+	void clear();
+
+	int rowCount(const QModelIndex &parent = QModelIndex()) const;
+	QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+
+private:
+	// A block of data that was appended, at an absolute position in the capture.
+	struct block {
+		unsigned long long start;	// Position of the first byte
+		unsigned int	   len;		// Number of bytes
+		unsigned long long line;	// Absolute number of the first line
+		unsigned int	   lines;	// Lines used, including the separator line
+	};
+
+	void drop(unsigned long long bytes);
+	QString format(const struct block &b, unsigned int line) const;
+
+	std::vector<unsigned char> ring;	// Captured data, indexed by position modulo the size
+	std::deque<struct block>   blocks;	// Blocks that are still (partly) in the ring
+	unsigned long long	   head;	// Position of the next byte to be captured
+	unsigned long long	   tail;	// Position of the oldest byte still kept
+	unsigned long long	   next_line;	// Absolute number of the next line
+	unsigned long long	   first_line;	// Absolute number of row 0
+};
+
+#endif
+
+/*[]*/
+
@@ -0,0 +1,257 @@
+/*
+ * Filename             : isostream.cpp
+ * Description          : Continuous isochronous data streaming for the Isochronous tab.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "../include/cyusb.h"
+#include "usbmethods.h"
+
+// Number of iso transfers kept queued on the endpoint.
+#define ISO_QUEUE_DEPTH		(8)
+
+// Counters updated by the event thread for every completed transfer. They are only ever written
+// from the stream callback, and are read by the UI with atomic loads.
+static unsigned long long iso_packets;		// Packets (service intervals) completed
+static unsigned long long iso_good;		// Packets that completed without error
+static unsigned long long iso_errors;		// Packets that completed with an error
+static unsigned long long iso_empty;		// Packets that completed without error but carried no data
+static unsigned long long iso_bytes;		// Data bytes actually delivered
+static unsigned long long iso_gaps;		// Runs of consecutive packets that delivered no data
+static unsigned long long iso_longest_gap;	// Length of the longest such run, in packets
+static unsigned int	iso_cur_gap;		// Length of the current run
+
+// Copy of the last packet that carried data, for the data display.
+static pthread_mutex_t	sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char	*sample_buf = NULL;
+static unsigned int	sample_len = 0;
+static unsigned int	sample_seq = 0;
+
+static cyusb_stream	*iso_strm = NULL;	// Stream used for the iso transfers
+static unsigned int	iso_pktsize;		// Packet size used on the endpoint
+static libusb_context	*iso_ctx;		// libusb context of the device handle
+static int		iso_event_thread;	// Whether the library event thread was started
+static struct timespec	iso_start;		// Time when the stream was started
+
+// Function: iso_count
+// Adds a value to one of the stream counters.
+static inline void
+iso_count (
+		unsigned long long *counter,
+		unsigned long long  value)
+{
+	__atomic_store_n (counter, __atomic_load_n (counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Function: iso_stream_cb
+// Accounts for every packet of a completed iso transfer, and queues the transfer again.
+static int
+iso_stream_cb (
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		unsigned int            length,
+		void                   *arg)
+{
+	unsigned int good = 0, errors = 0, empty = 0, gaps = 0;
+	unsigned char *last = NULL;
+	unsigned int last_len = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+		if (desc->status != LIBUSB_TRANSFER_COMPLETED)
+			errors++;
+		else if (desc->actual_length == 0)
+			empty++;
+		else {
+			good++;
+			last     = libusb_get_iso_packet_buffer_simple (transfer, i);
+			last_len = desc->actual_length;
+			iso_cur_gap = 0;
+			continue;
+		}
+
+		// A packet without data is a gap in the stream; count the runs and the longest one.
+		if (iso_cur_gap++ == 0)
+			gaps++;
+		if (iso_cur_gap > __atomic_load_n (&iso_longest_gap, __ATOMIC_RELAXED))
+			__atomic_store_n (&iso_longest_gap, iso_cur_gap, __ATOMIC_RELAXED);
+	}
+
+	iso_count (&iso_packets, transfer->num_iso_packets);
+	iso_count (&iso_good, good);
+	iso_count (&iso_errors, errors);
+	iso_count (&iso_empty, empty);
+	iso_count (&iso_gaps, gaps);
+	iso_count (&iso_bytes, length);
+
+	// Never wait for the UI here; the sample is skipped if the UI is copying the previous one.
+	if ((last != NULL) && (pthread_mutex_trylock (&sample_lock) == 0)) {
+		if (last_len > iso_pktsize)
+			last_len = iso_pktsize;
+		memcpy (sample_buf, last, last_len);
+		sample_len = last_len;
+		sample_seq++;
+		pthread_mutex_unlock (&sample_lock);
+	}
+
+	return CYUSB_STREAM_RESUBMIT;
+}
+
+// Function: iso_stream_fill
+// Fills every packet of an OUT transfer with its packet number, as the single shot send did.
+static void
+iso_stream_fill (
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		void                   *arg)
+{
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++)
+		memset (libusb_get_iso_packet_buffer_simple (transfer, i), i + 1, transfer->iso_packet_desc[i].length);
+}
+
+// Function: isostream_start
+// Starts continuous streaming on an iso endpoint, with numpkts packets per transfer.
+int
+isostream_start (
+		libusb_device_handle *handle,
+		unsigned char         ep,
+		unsigned int          numpkts)
+{
+	struct cyusb_stream_stats stats;
+	int r;
+
+	if (iso_strm != NULL)
+		return -EBUSY;
+
+	r = cyusb_stream_open (handle, ep, 0, numpkts, ISO_QUEUE_DEPTH, &iso_strm);
+	if (r != 0) {
+		iso_strm = NULL;
+		return r;
+	}
+
+	cyusb_stream_get_stats (iso_strm, &stats);
+	iso_pktsize = stats.pktsize;
+	sample_buf  = (unsigned char *)malloc (iso_pktsize);
+	if (sample_buf == NULL) {
+		cyusb_stream_close (iso_strm);
+		iso_strm = NULL;
+		return -ENOMEM;
+	}
+	sample_len = 0;
+	sample_seq = 0;
+
+	iso_packets = iso_good = iso_errors = iso_empty = iso_bytes = 0;
+	iso_gaps    = iso_longest_gap = 0;
+	iso_cur_gap = 0;
+
+	cyusb_stream_set_callback (iso_strm, iso_stream_cb, NULL);
+	if ((ep & LIBUSB_ENDPOINT_IN) == 0)
+		cyusb_stream_set_fill (iso_strm, iso_stream_fill, NULL);
+
+	iso_ctx = cyusb_handle_context (handle);
+	r = cyusb_event_thread_start (iso_ctx);
+	if (r == 0) {
+		iso_event_thread = 1;
+		clock_gettime (CYUSB_CLOCK, &iso_start);
+		r = cyusb_stream_start (iso_strm);
+	}
+
+	if (r != 0) {
+		isostream_stop ();
+		return r;
+	}
+
+	return 0;
+}
+
+// Function: isostream_stop
+// Stops the iso stream, and waits for all of its transfers to be returned.
+void
+isostream_stop (
+		void)
+{
+	if (iso_strm == NULL)
+		return;
+
+	cyusb_stream_stop (iso_strm);
+	cyusb_stream_close (iso_strm);
+	iso_strm = NULL;
+
+	if (iso_event_thread) {
+		cyusb_event_thread_stop (iso_ctx);
+		iso_event_thread = 0;
+	}
+
+	pthread_mutex_lock (&sample_lock);
+	free (sample_buf);
+	sample_buf = NULL;
+	sample_len = 0;
+	pthread_mutex_unlock (&sample_lock);
+}
+
+// Function: isostream_is_running
+// Checks whether the iso stream is running.
+bool
+isostream_is_running (
+		void)
+{
+	return (iso_strm != NULL);
+}
+
+// Function: isostream_get_results
+// Takes a snapshot of the stream counters.
+void
+isostream_get_results (
+		struct isostream_results *res)
+{
+	struct timespec now;
+
+	clock_gettime (CYUSB_CLOCK, &now);
+	res->seconds     = (now.tv_sec - iso_start.tv_sec) + (now.tv_nsec - iso_start.tv_nsec) / 1e9;
+	res->pktsize     = iso_pktsize;
+	res->packets     = __atomic_load_n (&iso_packets, __ATOMIC_RELAXED);
+	res->good        = __atomic_load_n (&iso_good, __ATOMIC_RELAXED);
+	res->errors      = __atomic_load_n (&iso_errors, __ATOMIC_RELAXED);
+	res->empty       = __atomic_load_n (&iso_empty, __ATOMIC_RELAXED);
+	res->bytes       = __atomic_load_n (&iso_bytes, __ATOMIC_RELAXED);
+	res->gaps        = __atomic_load_n (&iso_gaps, __ATOMIC_RELAXED);
+	res->longest_gap = __atomic_load_n (&iso_longest_gap, __ATOMIC_RELAXED);
+}
+
+// Function: isostream_get_sample
+// Copies the last packet that carried data into buf, if it has changed since *seq.
+// Returns the packet length, or 0 if there is no new packet.
+unsigned int
+isostream_get_sample (
+		unsigned char *buf,
+		unsigned int   len,
+		unsigned int  *seq)
+{
+	unsigned int n = 0;
+
+	pthread_mutex_lock (&sample_lock);
+	if ((sample_buf != NULL) && (sample_seq != *seq)) {
+		n = (sample_len < len) ? sample_len : len;
+		memcpy (buf, sample_buf, n);
+		*seq = sample_seq;
+	}
+	pthread_mutex_unlock (&sample_lock);
+
+	return n;
+}
+
+/*[]*/
+
@@ -19,12 +19,15 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <libusb-1.0/libusb.h>
 #include "usbmethods.h"
+#include "hexview.h"
 #include "../include/controlcenter.h"
 #include "../include/cyusb.h"
 
@@ -37,7 +40,6 @@ int num_devices_detected;
 int current_device_index = -1;
 
 static QLocalServer server(0);
-static QTime *isoc_time;
 
 
 extern int sigusr1_fd[2];
@@ -61,11 +63,49 @@ static int summ_count = 0;
 static unsigned int cum_data_in;
 static unsigned int cum_data_out;
 static int data_count;
-static struct libusb_transfer *transfer = NULL;
-static unsigned char *isoc_databuf = NULL;
-static int totalout, totalin, pkts_success, pkts_failure;
 
-static int fd_outfile, fd_infile;
+// Continuous isochronous stream on the Isochronous tab.
+static QTimer *isoc_timer = NULL;			// Refreshes the stream statistics
+static unsigned char isoc_dir;				// Direction of the running stream
+static struct isostream_results isoc_last;		// Counters at the previous refresh
+static unsigned int isoc_sample_seq;			// Last packet shown in the data display
+static unsigned char isoc_sample[49152];		// Largest iso packet (SuperSpeed, 16 x 3 x 1 KB)
+
+static void isoc_stop(void);
+
+// Live statistics of the Streamer tab, sampled from the streamer thread's snapshot.
+#define STREAMER_SAMPLE_MS	250			// Sampling period of the statistics
+#define STREAMER_WINDOW		120			// Samples shown in the graph (30 seconds)
+
+struct streamer_sample {
+	double		   kbps;			// Throughput over the sample period
+	unsigned long long lat_count;			// Transfers completed in the sample period
+	unsigned long long lat_sum;			// and their latencies, in ns
+	unsigned long long lat_min;
+	unsigned long long lat_max;
+};
+
+static QTimer *streamer_timer = NULL;			// Samples the streamer statistics
+static struct streamer_sample streamer_samples[STREAMER_WINDOW];
+static unsigned int streamer_nsamples;			// Valid entries in streamer_samples
+static unsigned int streamer_head;			// Next entry to be written
+static struct streamer_results streamer_last;		// Snapshot at the previous sample
+
+// Hex dumps of the data shown on the Bulk and Isochronous tabs.
+static HexDumpModel *hex6_out, *hex6_in;
+static HexDumpModel *hex7_out, *hex7_in;
+
+// File streamed through the bulk endpoints on the Bulk tab.
+static QTimer *file6_timer = NULL;			// Refreshes the progress
+static struct filestream_status file6_last;		// Progress at the previous refresh
+
+static void file6_finish(bool report);
+
+// Capture file that single reads on the Bulk tab are recorded to, with their time stamps. This
+// is kept apart from the input file, which receives a plain copy of the data streamed back.
+static cyusb_capture *cap6_in = NULL;
+
+static void capture6_close(void);
 
 // Buffer used to assemble vendor command data to be transferred
 static char le3_out_data[4096] = {0};
@@ -238,6 +278,127 @@ void ControlCenter::on_pb4_clear_clicked()
 	mainwin->lw4_display->clear();
 }
 
+// Draw one series of the streamer graph into a pane, scaled to its largest value.
+static void streamer_draw_series(QPainter &p, const QRect &r, const double *v, unsigned int n,
+		const QColor &colour, const QString &legend)
+{
+	QPolygonF line;
+	double ymax = 0;
+	double xstep = (double)r.width() / (STREAMER_WINDOW - 1);
+	unsigned int i;
+
+	for ( i = 0; i < n; ++i )
+		if ( v[i] > ymax ) ymax = v[i];
+	if ( ymax <= 0 )
+		ymax = 1;
+	ymax *= 1.1;
+
+	// The newest sample is always at the right edge.
+	for ( i = 0; i < n; ++i )
+		line << QPointF(r.right() - (n - 1 - i) * xstep, r.bottom() - (v[i] / ymax) * r.height());
+
+	p.setPen(Qt::lightGray);
+	p.drawRect(r);
+	p.setPen(QPen(colour, 1.5));
+	p.drawPolyline(line);
+	p.setPen(Qt::black);
+	p.drawText(r.adjusted(4, 2, -4, -2), Qt::AlignLeft | Qt::AlignTop, legend);
+	p.drawText(r.adjusted(4, 2, -4, -2), Qt::AlignRight | Qt::AlignTop, QString::number(ymax, 'f', 0));
+}
+
+// Redraw the throughput and latency graph, with the min/avg/max of the samples in the window.
+static void streamer_draw_graph()
+{
+	double tp[STREAMER_WINDOW], lat[STREAMER_WINDOW];
+	double tp_min = 0, tp_max = 0, tp_sum = 0;
+	unsigned long long lat_min = 0, lat_max = 0, lat_sum = 0, lat_count = 0;
+	unsigned int i, n = streamer_nsamples;
+	QSize size = mainwin->streamer_graph->size();
+
+	for ( i = 0; i < n; ++i ) {
+		struct streamer_sample *smp =
+			&streamer_samples[(streamer_head + STREAMER_WINDOW - n + i) % STREAMER_WINDOW];
+
+		tp[i]  = smp->kbps;
+		lat[i] = ( smp->lat_count ) ? (double)smp->lat_sum / smp->lat_count / 1000 : 0;
+
+		if ( (i == 0) || (smp->kbps < tp_min) ) tp_min = smp->kbps;
+		if ( smp->kbps > tp_max ) tp_max = smp->kbps;
+		tp_sum += smp->kbps;
+
+		if ( smp->lat_count ) {
+			if ( (lat_count == 0) || (smp->lat_min < lat_min) ) lat_min = smp->lat_min;
+			if ( smp->lat_max > lat_max ) lat_max = smp->lat_max;
+			lat_sum   += smp->lat_sum;
+			lat_count += smp->lat_count;
+		}
+	}
+
+	QPixmap pm(size);
+	pm.fill(Qt::white);
+	QPainter p(&pm);
+	QRect top(0, 0, size.width() - 1, size.height() / 2 - 2);
+	QRect bottom(0, size.height() / 2 + 1, size.width() - 1, size.height() - size.height() / 2 - 2);
+
+	QString tp_legend = QString("Throughput (KBps)  min %1  avg %2  max %3")
+		.arg(tp_min, 0, 'f', 0).arg(( n ) ? tp_sum / n : 0, 0, 'f', 0).arg(tp_max, 0, 'f', 0);
+	if ( streamer_last.adaptive )
+		tp_legend += QString("  (%1 x %2)").arg(streamer_last.reqsize).arg(streamer_last.queuedepth);
+	streamer_draw_series(p, top, tp, n, Qt::darkBlue, tp_legend);
+	streamer_draw_series(p, bottom, lat, n, Qt::darkRed,
+		QString("Latency (us)  min %1  avg %2  max %3")
+		.arg(lat_min / 1000.0, 0, 'f', 1)
+		.arg(( lat_count ) ? (double)lat_sum / lat_count / 1000 : 0, 0, 'f', 1)
+		.arg(lat_max / 1000.0, 0, 'f', 1));
+	p.end();
+
+	mainwin->streamer_graph->setPixmap(pm);
+}
+
+// Sample the streamer statistics. This runs on the UI thread; the streamer thread only
+// publishes its counters and never touches the widgets.
+static void streamer_update_view()
+{
+	static struct streamer_results res;
+	static struct cyusb_hist lat;
+	struct streamer_sample *smp;
+	bool running = streamer_is_running();
+	double secs;
+	char tbuf[64];
+
+	streamer_get_results(&res);
+	secs = res.seconds - streamer_last.seconds;
+	if ( secs > 0 ) {
+		cyusb_hist_diff(&lat, &res.latency, &streamer_last.latency);
+
+		smp = &streamer_samples[streamer_head];
+		smp->kbps      = ((double)(res.bytes - streamer_last.bytes) / 1024) / secs;
+		smp->lat_count = lat.count;
+		smp->lat_sum   = lat.sum;
+		smp->lat_min   = lat.min;
+		smp->lat_max   = lat.max;
+		streamer_head  = (streamer_head + 1) % STREAMER_WINDOW;
+		if ( streamer_nsamples < STREAMER_WINDOW )
+			streamer_nsamples++;
+
+		sprintf(tbuf, "%llu", res.success);
+		mainwin->streamer_out_passcnt->setText(tbuf);
+		sprintf(tbuf, "%llu", res.failure);
+		mainwin->streamer_out_failcnt->setText(tbuf);
+		sprintf(tbuf, "%.0f", smp->kbps);
+		mainwin->streamer_out_perf->setText(tbuf);
+		sprintf(tbuf, "%.1f", ( lat.count ) ? (double)lat.sum / lat.count / 1000 : 0);
+		mainwin->streamer_out_latency->setText(tbuf);
+
+		streamer_last = res;
+		streamer_draw_graph();
+	}
+
+	// The final snapshot is published before the streamer thread exits.
+	if ( !running )
+		streamer_timer->stop();
+}
+
 void ControlCenter::on_streamer_control_start_clicked ()
 {
 	const char  *temp;
@@ -282,10 +443,21 @@ void ControlCenter::on_streamer_control_start_clicked ()
 	temp = mainwin->streamer_queue_sel->currentText().toStdString().c_str();
 	sscanf (temp, "%d", &queuedepth);
 
-	streamer_set_params (ep, eptype, pktsize, reqsize, queuedepth);
+	streamer_set_params (ep, eptype, pktsize, reqsize, queuedepth, mainwin->streamer_adaptive->isChecked());
 	if (streamer_start_xfer () == 0) {
 		// Test started properly. Enable the stop button.
 		mainwin->streamer_control_stop->setEnabled (true);
+
+		// Sample the statistics from the UI thread.
+		memset (&streamer_last, 0, sizeof (streamer_last));
+		cyusb_hist_reset (&streamer_last.latency);
+		streamer_nsamples = 0;
+		streamer_head     = 0;
+		if (streamer_timer == NULL) {
+			streamer_timer = new QTimer (mainwin);
+			QObject::connect (streamer_timer, &QTimer::timeout, streamer_update_view);
+		}
+		streamer_timer->start (STREAMER_SAMPLE_MS);
 	} else {
 		// Test could not start. Re-enable the start button.
 		mainwin->streamer_control_start->setEnabled (false);
@@ -297,7 +469,9 @@ void ControlCenter::on_streamer_control_stop_clicked ()
 	// Wait until streamer operation is stopped.
 	streamer_stop_xfer ();
 	while (streamer_is_running ())
-		sleep (1);
+		usleep (10000);
+	if (streamer_timer != NULL)
+		streamer_timer->stop ();
 
 	// Now disable the stop button and enable the start button.
 	mainwin->streamer_control_stop->setEnabled (false);
@@ -306,6 +480,7 @@ void ControlCenter::on_streamer_control_stop_clicked ()
 	mainwin->streamer_out_passcnt->setText ("0");
 	mainwin->streamer_out_failcnt->setText ("0");
 	mainwin->streamer_out_perf->setText ("0");
+	mainwin->streamer_out_latency->setText ("0");
 }
 
 static void check_for_kernel_driver(void)
@@ -352,6 +527,7 @@ static void update_endpoints()
 	mainwin->streamer_out_passcnt->setText ("0");
 	mainwin->streamer_out_failcnt->setText ("0");
 	mainwin->streamer_out_perf->setText ("0");
+	mainwin->streamer_out_latency->setText ("0");
 	mainwin->streamer_control_start->setEnabled (false);
 	mainwin->streamer_control_stop->setEnabled (false);
 
@@ -559,6 +735,7 @@ void get_config_details()
 	char tbuf[60];
 	char tval[3];
 	struct libusb_config_descriptor *desc = NULL;
+	const struct cyusb_desc *snap = NULL;
 
 	h = cyusb_gethandle(current_device_index);
 	dev = libusb_get_device(h);
@@ -626,9 +803,6 @@ void get_config_details()
 				sprintf(tbuf,"\t\t<ENDPOINT>");
 				mainwin->lw_desc->addItem(QString(tbuf));
 				const struct libusb_endpoint_descriptor *ep = ifd[j].endpoint;
-				struct libusb_ss_endpoint_companion_descriptor *compd = NULL;
-
-				libusb_get_ss_endpoint_companion_descriptor (NULL, ep, &compd);
 
 				sprintf(tbuf,"\t\tbLength             = %0d",  ep[k].bLength);
 				mainwin->lw_desc->addItem(QString(tbuf));
@@ -639,30 +813,6 @@ void get_config_details()
 				sprintf(tbuf,"\t\tbmAttributes        = %d",   ep[k].bmAttributes);
 				mainwin->lw_desc->addItem(QString(tbuf));
 
-				summ[summ_count].ifnum    = ifd[j].bInterfaceNumber;
-				summ[summ_count].altnum   = ifd[j].bAlternateSetting;
-				summ[summ_count].epnum    = ep[k].bEndpointAddress;
-				summ[summ_count].eptype   = ep[k].bmAttributes;
-				summ[summ_count].maxps    = ep[k].wMaxPacketSize & 0x7ff;  /* ignoring bits 11,12 */
-				summ[summ_count].interval = ep[k].bInterval;
-
-				if (compd != NULL) {
-					// USB 3.0. Multiple max packet size by burst size.
-					if (summ[summ_count].eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-						summ[summ_count].reqsize = (summ[summ_count].maxps * (compd->bMaxBurst + 1) *
-							(compd->bmAttributes + 1));
-					else
-						summ[summ_count].reqsize = (summ[summ_count].maxps * (compd->bMaxBurst + 1));
-				} else {
-					// USB 2.0. Multiply packet size by mult for ISO endpoints
-					if (summ[summ_count].eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-						summ[summ_count].reqsize =
-							libusb_get_max_iso_packet_size (dev, summ[summ_count].epnum);
-					else
-						summ[summ_count].reqsize  = summ[summ_count].maxps;
-				}
-
-				++summ_count;
 				sprintf(tbuf,"\t\twMaxPacketSize      = %04x", (ep[k].wMaxPacketSize));
 				mainwin->lw_desc->addItem(QString(tbuf));
 				sprintf(tbuf,"\t\tbInterval           = %d",   ep[k].bInterval);
@@ -685,6 +835,25 @@ void get_config_details()
 
 	libusb_free_config_descriptor(desc);
 
+	// The endpoint summary comes from the descriptor snapshot, which has the packet sizes worked out.
+	r = cyusb_desc_get(dev, &snap);
+	if ( r == 0 ) {
+		for ( i = 0; (i < (int)snap->count) && (summ_count < (int)(sizeof(summ) / sizeof(summ[0]))); ++i ) {
+			summ[summ_count].ifnum    = snap->endpoints[i].interface;
+			summ[summ_count].altnum   = snap->endpoints[i].altsetting;
+			summ[summ_count].epnum    = snap->endpoints[i].address;
+			summ[summ_count].eptype   = snap->endpoints[i].type;
+			summ[summ_count].maxps    = snap->endpoints[i].maxpacket;
+			summ[summ_count].interval = snap->endpoints[i].interval;
+			summ[summ_count].reqsize  = snap->endpoints[i].pktsize;
+			++summ_count;
+		}
+		cyusb_desc_release(snap);
+	}
+	else {
+		libusb_error(r, "Error getting endpoint details");
+	}
+
 	check_for_kernel_driver();
 	update_summary();
 	mainwin->on_pb_setIFace_clicked();
@@ -762,6 +931,8 @@ void get_device_details()
 
 static void clear_widgets()
 {
+	isoc_stop();
+	file6_finish(false);
 	mainwin->lw_desc->clear();
 	mainwin->label_if->clear();
 	mainwin->label_aif->clear();
@@ -786,6 +957,7 @@ static void clear_widgets()
 	mainwin->streamer_out_passcnt->setText ("0");
 	mainwin->streamer_out_failcnt->setText ("0");
 	mainwin->streamer_out_perf->setText ("0");
+	mainwin->streamer_out_latency->setText ("0");
 	mainwin->streamer_control_start->setEnabled (false);
 	mainwin->streamer_control_stop->setEnabled (false);
 }
@@ -1339,15 +1511,19 @@ void ControlCenter::on_le6_out_ascii_textChanged()
 
 void ControlCenter::on_pb6_clear_clicked()
 {
-	mainwin->lw6->clear();
-	mainwin->lw6_out->clear();
+	hex6_in->clear();
+	hex6_out->clear();
 	mainwin->le6_out_hex->clear();
 	mainwin->le6_out_ascii->clear();
 	mainwin->label6_out->clear();
 	mainwin->label6_in->clear();
+	mainwin->label6_rate->clear();
+	mainwin->pb6_progress->setValue(0);
 	mainwin->le6_outfile->clear();
 	mainwin->le6_infile->clear();
+	mainwin->le6_capfile->clear();
 	mainwin->le6_size->clear();
+	capture6_close();
 	cum_data_in = cum_data_out = 0;
 }
 
@@ -1381,86 +1557,39 @@ void ControlCenter::on_cb6_loop_clicked()
 	}
 }
 
-static void dump_data6_out(int num_bytes, unsigned char *dbuf)
+// Close the capture file of the Bulk tab, writing out its index.
+static void capture6_close(void)
 {
-	int i, j, k, index, filler;
-	char ttbuf[10];
-	char finalbuf[256];
-	char tbuf[256];
-	int balance = 0;
-
-	balance = num_bytes;
-	index = 0;
-
-	while ( balance > 0 ) {
-		tbuf[0]  = '\0';
-		if ( balance < 8 )
-			j = balance;
-		else j = 8;
-		for ( i = 0; i < j; ++i ) {
-			sprintf(ttbuf,"%02x ",(unsigned char)dbuf[index+i]);
-			strcat(tbuf,ttbuf);
-		}
-		if ( balance < 8 ) {
-			filler = 8-balance;
-			for ( k = 0; k < filler; ++k ) 
-				strcat(tbuf,"   ");
-		}
-		strcat(tbuf,": ");
-		for ( i = 0; i < j; ++i ) {
-			if ( !isprint(dbuf[index+i]) )
-				strcat(tbuf,". ");
-			else {
-				sprintf(ttbuf,"%c ",dbuf[index+i]);
-				strcat(tbuf,ttbuf);
-			}
-		}
-		sprintf(finalbuf,"%s",tbuf);
-		mainwin->lw6_out->addItem(finalbuf);
-		balance -= j;
-		index += j;
-	}
+	if ( cap6_in != NULL )
+		cyusb_capture_close(cap6_in);
+	cap6_in = NULL;
 }
 
-static void dump_data6_in(int num_bytes, unsigned char *dbuf)
+// Record a read from the Bulk tab in the capture file, creating it on the first read.
+static void capture6_in(unsigned char ep, int r, unsigned char *buf, int transferred)
 {
-	int i, j, k, index, filler;
-	char ttbuf[10];
-	char finalbuf[256];
-	char tbuf[256];
-	int balance = 0;
+	struct timespec ts;
+	int status;
+	int err;
 
-	balance = num_bytes;
-	index = 0;
-
-	while ( balance > 0 ) {
-		tbuf[0]  = '\0';
-		if ( balance < 8 )
-			j = balance;
-		else j = 8;
-		for ( i = 0; i < j; ++i ) {
-			sprintf(ttbuf,"%02x ",(unsigned char)dbuf[index+i]);
-			strcat(tbuf,ttbuf);
-		}
-		if ( balance < 8 ) {
-			filler = 8-balance;
-			for ( k = 0; k < filler; ++k ) 
-				strcat(tbuf,"   ");
-		}
-		strcat(tbuf,": ");
-		for ( i = 0; i < j; ++i ) {
-			if ( !isprint(dbuf[index+i]) )
-				strcat(tbuf,". ");
-			else {
-				sprintf(ttbuf,"%c ",dbuf[index+i]);
-				strcat(tbuf,ttbuf);
-			}
+	if ( cap6_in == NULL ) {
+		err = cyusb_capture_create(mainwin->le6_capfile->text().toLocal8Bit().constData(), 0, 0, &cap6_in);
+		if ( err ) {
+			printf("Cannot create capture file: %s\n", strerror(-err));
+			return;
 		}
-		sprintf(finalbuf,"%s",tbuf);
-		mainwin->lw6->addItem(finalbuf);
-		balance -= j;
-		index += j;
 	}
+
+	if ( r == 0 )
+		status = LIBUSB_TRANSFER_COMPLETED;
+	else if ( r == LIBUSB_ERROR_TIMEOUT )
+		status = LIBUSB_TRANSFER_TIMED_OUT;
+	else
+		status = LIBUSB_TRANSFER_ERROR;
+
+	clock_gettime(CYUSB_CLOCK, &ts);
+	cyusb_capture_write(cap6_in, ep, LIBUSB_TRANSFER_TYPE_BULK, status,
+			(unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec, buf, transferred, NULL, 0);
 }
 
 static void clearhalt_in()
@@ -1511,15 +1640,12 @@ void ControlCenter::on_pb6_rcv_clicked()
 			libusb_error(r, "Data Read Error");
 			clearhalt_in();
 		}
-		dump_data6_in(transferred, buf);
+		hex6_in->append(buf, transferred);
 		cum_data_in += transferred;
 		sprintf(tmpbuf,"%d",cum_data_in);
 		mainwin->label6_in->setText(tmpbuf);
-		if ( mainwin->le6_infile->text() != "" ) {
-			r = write(fd_infile, buf, transferred);
-			if (r < 0)
-				printf ("write returned %d\n", r);
-		}
+		if ( mainwin->le6_capfile->text() != "" )
+			capture6_in(ep, r, buf, transferred);
 	}
 	else {
 		r = mainwin->le6_size->text().toInt(&ok, 10);
@@ -1527,15 +1653,12 @@ void ControlCenter::on_pb6_rcv_clicked()
 		r = libusb_bulk_transfer(h, ep, buf, 
 				r, &transferred, 1000);
 		printf("Bytes read from device = %d\n",transferred);
-		dump_data6_in(transferred, buf);
+		hex6_in->append(buf, transferred);
 		cum_data_in += transferred;
 		sprintf(tmpbuf,"%d",cum_data_in);
 		mainwin->label6_in->setText(tmpbuf);
-		if ( mainwin->le6_infile->text() != "" ) {
-			r = write(fd_infile, buf, transferred);
-			if (r < 0)
-				printf ("write returned %d\n", r);
-		}
+		if ( mainwin->le6_capfile->text() != "" )
+			capture6_in(ep, r, buf, transferred);
 	}
 	free(buf);
 }
@@ -1557,7 +1680,7 @@ void ControlCenter::pb6_send_file_selected(unsigned char *buf, int sz)
 	cum_data_out += transferred;
 	sprintf(tmpbuf,"%d",cum_data_out);
 	mainwin->label6_out->setText(tmpbuf);
-	dump_data6_out(transferred, buf);
+	hex6_out->append(buf, transferred);
 
 	if ( mainwin->cb6_loop->isChecked() ) {
 		data_count = transferred;
@@ -1617,7 +1740,7 @@ void ControlCenter::pb6_send_nofile_selected()
 	sprintf(tmpbuf,"%d",cum_data_out);
 	mainwin->label6_out->setText(tmpbuf);
 
-	dump_data6_out(transferred, buf);
+	hex6_out->append(buf, transferred);
 	free(buf);
 
 	if ( mainwin->cb6_loop->isChecked() ) {
@@ -1699,43 +1822,127 @@ void ControlCenter::on_pb7_clearhalt_in_clicked()
 	return;
 }
 
+// Refresh the progress of the file being streamed, and clean up once it has completed.
+static void file6_update()
+{
+	struct filestream_status st;
+	double secs;
+	char tbuf[40];
+
+	filestream_get_status(&st);
+
+	sprintf(tbuf, "%llu", st.bytes_out);
+	mainwin->label6_out->setText(tbuf);
+	sprintf(tbuf, "%llu", st.bytes_in);
+	mainwin->label6_in->setText(tbuf);
+	mainwin->pb6_progress->setValue((int)((st.bytes_out * 1000) / st.size));
+
+	secs = st.seconds - file6_last.seconds;
+	if ( secs > 0 ) {
+		sprintf(tbuf, "%.0f", ((double)(st.bytes_out - file6_last.bytes_out) / 1024) / secs);
+		mainwin->label6_rate->setText(tbuf);
+	}
+	file6_last = st;
+
+	if ( st.done )
+		file6_finish(true);
+}
+
+// Stop streaming the file, if a file is being streamed. When report is set, any error is shown,
+// along with the average throughput of the whole file.
+static void file6_finish(bool report)
+{
+	struct filestream_status st;
+	char tbuf[40];
+
+	if ( !filestream_is_running() )
+		return;
+
+	file6_timer->stop();
+	filestream_stop();
+	filestream_get_status(&st);
+
+	mainwin->pb6_send->setText("SEND");
+	mainwin->pb6_rcv->setEnabled(!mainwin->cb6_loop->isChecked());
+	if ( !report )
+		return;
+
+	sprintf(tbuf, "%llu", st.bytes_out);
+	mainwin->label6_out->setText(tbuf);
+	sprintf(tbuf, "%llu", st.bytes_in);
+	mainwin->label6_in->setText(tbuf);
+	if ( st.seconds > 0 ) {
+		sprintf(tbuf, "%.0f", ((double)st.bytes_out / 1024) / st.seconds);
+		mainwin->label6_rate->setText(tbuf);
+	}
+	printf("Bytes sent to device = %llu, read from device = %llu\n", st.bytes_out, st.bytes_in);
+
+	if ( st.error ) {
+		libusb_error(st.error, "Error while streaming the file");
+		clearhalt_out();
+		if ( mainwin->cb6_loop->isChecked() )
+			clearhalt_in();
+	}
+	if ( st.write_error ) {
+		QMessageBox mb;
+		mb.setText(QString("Error writing the input file: %1").arg(strerror(st.write_error)));
+		mb.exec();
+	}
+}
+
 void ControlCenter::on_pb6_send_clicked()
 {
-	int nbr;
-	unsigned char *buf;
-	int maxps = 0;
+	unsigned char ep_out, ep_in = 0;
+	QByteArray outfile, infile;
+	bool ok;
+	int r;
 
-	if ( mainwin->le6_outfile->text() == "" )
+	if ( filestream_is_running() ) {
+		file6_finish(true);
+		return;
+	}
+
+	if ( mainwin->le6_outfile->text() == "" ) {
 		pb6_send_nofile_selected();
-	else {
-		fd_outfile = open(qPrintable(mainwin->le6_outfile->text()), O_RDONLY);
-		if ( fd_outfile < 0 ) {
-			QMessageBox mb;
+		return;
+	}
+
+	// The file is streamed in the background. With loopback, the data is read back on the IN
+	// endpoint while it is being sent, and is written to the input file if there is one.
+	ep_out  = mainwin->cb6_out->currentText().toInt(&ok, 16);
+	outfile = mainwin->le6_outfile->text().toLocal8Bit();
+	if ( mainwin->cb6_loop->isChecked() ) {
+		ep_in  = mainwin->cb6_in->currentText().toInt(&ok, 16);
+		infile = mainwin->le6_infile->text().toLocal8Bit();
+	}
+
+	r = filestream_start(h, ep_out, outfile.constData(), ep_in,
+			( infile.isEmpty() ) ? NULL : infile.constData());
+	if ( r ) {
+		QMessageBox mb;
+		if ( r == -ENOENT )
 			mb.setText("Output file not found!");
-			mb.exec();
-			return ;
-		}
-		if ( mainwin->le6_infile->text() != "" ) {
-			fd_infile = open(qPrintable(mainwin->le6_infile->text()), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-			if ( fd_infile < 0 ) {
-				QMessageBox mb;
-				mb.setText("Input file creation error");
-				mb.exec();
-				return;
-			}
-		}
+		else
+			mb.setText(QString("Cannot stream the file: %1").arg(( r < 0 ) ? strerror(-r) : "USB error"));
+		mb.exec();
+		return;
+	}
 
-		maxps = 4096;	/* If sending a file, then data is sent in 4096 byte packets */
+	memset(&file6_last, 0, sizeof(file6_last));
+	mainwin->label6_out->setText("0");
+	mainwin->label6_in->setText("0");
+	mainwin->label6_rate->clear();
+	mainwin->pb6_progress->setRange(0, 1000);
+	mainwin->pb6_progress->setValue(0);
+	mainwin->pb6_send->setText("STOP");
+	mainwin->pb6_rcv->setEnabled(false);
 
-		buf = (unsigned char *)malloc(maxps);
-		while ( (nbr = read(fd_outfile, buf, maxps)) ) {
-			pb6_send_file_selected(buf, nbr);
-		}
-		free(buf);
-		::close(fd_outfile);
-		::close(fd_infile);
+	if ( file6_timer == NULL ) {
+		file6_timer = new QTimer(mainwin);
+		QObject::connect(file6_timer, &QTimer::timeout, file6_update);
 	}
-}  
+	file6_timer->start(250);
+}
 
 
 void ControlCenter::on_pb6_selout_clicked()
@@ -1771,206 +1978,146 @@ void ControlCenter::on_pb6_selin_clicked()
 		mb.exec();
 		return ;
 	}
+	else if ( filename == mainwin->le6_capfile->text() ) {
+		QMessageBox mb;
+		mb.setText("Infile and Capture file cannot be the same !!");
+		mb.exec();
+		return ;
+	}
 	else mainwin->le6_infile->setText(filename);
 }
 
-static void dump_data7_in(int num_bytes, unsigned char *dbuf)
+void ControlCenter::on_pb6_selcap_clicked()
 {
-	int i, j, k, index, filler;
-	char ttbuf[10];
-	char finalbuf[256];
-	char tbuf[256];
-	int balance = 0;
-
-	balance = num_bytes;
-	index = 0;
+	QString filename;
 
-	while ( balance > 0 ) {
-		tbuf[0]  = '\0';
-		if ( balance < 8 )
-			j = balance;
-		else j = 8;
-		for ( i = 0; i < j; ++i ) {
-			sprintf(ttbuf,"%02x ",(unsigned char)dbuf[index+i]);
-			strcat(tbuf,ttbuf);
-		}
-		if ( balance < 8 ) {
-			filler = 8-balance;
-			for ( k = 0; k < filler; ++k ) 
-				strcat(tbuf,"   ");
-		}
-		strcat(tbuf,": ");
-		for ( i = 0; i < j; ++i ) {
-			if ( !isprint(dbuf[index+i]) )
-				strcat(tbuf,". ");
-			else {
-				sprintf(ttbuf,"%c ",dbuf[index+i]);
-				strcat(tbuf,ttbuf);
-			}
-		}
-		sprintf(finalbuf,"%s",tbuf);
-		mainwin->lw7_in->addItem(finalbuf);
-		balance -= j;
-		index += j;
+	filename = QFileDialog::getSaveFileName(this, "Select file to capture reads to...", ".", "Any file (*)");
+	if ( filename == "" )
+		return;
+	if ( (filename == mainwin->le6_outfile->text()) || (filename == mainwin->le6_infile->text()) ) {
+		QMessageBox mb;
+		mb.setText("Capture file cannot be the same as Outfile or Infile !!");
+		mb.exec();
+		return ;
 	}
-}
 
-static void dump_data7_out(int num_bytes, unsigned char *dbuf)
-{
-	int i, j, k, index, filler;
-	char ttbuf[10];
-	char finalbuf[256];
-	char tbuf[256];
-	int balance = 0;
-
-	balance = num_bytes;
-	index = 0;
-
-	while ( balance > 0 ) {
-		tbuf[0]  = '\0';
-		if ( balance < 8 )
-			j = balance;
-		else j = 8;
-		for ( i = 0; i < j; ++i ) {
-			sprintf(ttbuf,"%02x ",(unsigned char)dbuf[index+i]);
-			strcat(tbuf,ttbuf);
-		}
-		if ( balance < 8 ) {
-			filler = 8-balance;
-			for ( k = 0; k < filler; ++k ) 
-				strcat(tbuf,"   ");
-		}
-		strcat(tbuf,": ");
-		for ( i = 0; i < j; ++i ) {
-			if ( !isprint(dbuf[index+i]) )
-				strcat(tbuf,". ");
-			else {
-				sprintf(ttbuf,"%c ",dbuf[index+i]);
-				strcat(tbuf,ttbuf);
-			}
-		}
-		sprintf(finalbuf,"%s",tbuf);
-		mainwin->lw7_out->addItem(finalbuf);
-		balance -= j;
-		index += j;
-	}
+	// Reads made from now on go to a new capture file.
+	capture6_close();
+	mainwin->le6_capfile->setText(filename);
 }
 
-static void in_callback( struct libusb_transfer *transfer)
+// Refresh the statistics of the running isochronous stream. The counters are sampled from the
+// stream, which runs on the library event thread; the rate is the data actually delivered since
+// the previous refresh.
+static void isoc_update_results()
 {
-	bool ok;
-	int pktsin, act_len;
-	char tbuf[8];
-	unsigned char *ptr;
-	int elapsed;
-	unsigned char ep_in;
-	int pktsize_in;
-	char ttbuf[10];
-	double inrate;
-
-	printf("Callback function called\n");
+	struct isostream_results res;
+	QLabel *total, *good, *dropped, *rate, *gaps;
+	HexDumpModel *hex;
+	unsigned int n;
+	double secs;
+	char tbuf[40];
 
-	if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
-		libusb_error(transfer->status, "Transfer not completed normally");
+	isostream_get_results(&res);
+	if ( isoc_dir == LIBUSB_ENDPOINT_IN ) {
+		total   = mainwin->label7_totalin;
+		good    = mainwin->label7_pktsin;
+		dropped = mainwin->label7_dropped_in;
+		rate    = mainwin->label7_ratein;
+		gaps    = mainwin->label7_gaps_in;
+		hex     = hex7_in;
+	}
+	else {
+		total   = mainwin->label7_totalout;
+		good    = mainwin->label7_pktsout;
+		dropped = mainwin->label7_dropped_out;
+		rate    = mainwin->label7_rateout;
+		gaps    = mainwin->label7_gaps_out;
+		hex     = hex7_out;
 	}
 
-	totalin = pkts_success = pkts_failure = 0;
-
-	pktsin = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-
-	elapsed = isoc_time->elapsed();
+	sprintf(tbuf, "%6llu", res.packets);
+	total->setText(tbuf);
+	sprintf(tbuf, "%6llu", res.good);
+	good->setText(tbuf);
+	sprintf(tbuf, "%6llu", res.errors + res.empty);
+	dropped->setText(tbuf);
+	dropped->setToolTip(QString("%1 with errors, %2 without data").arg(res.errors).arg(res.empty));
+	sprintf(tbuf, "%llu/%llu", res.gaps, res.longest_gap);
+	gaps->setText(tbuf);
 
-	printf("Milliseconds elapsed = %d\n",elapsed);
+	secs = res.seconds - isoc_last.seconds;
+	if ( secs > 0 ) {
+		sprintf(tbuf, "%8.1f", ((double)(res.bytes - isoc_last.bytes) / 1024.0) / secs);
+		rate->setText(tbuf);
+	}
+	isoc_last = res;
 
-	for ( int i = 0; i < pktsin; ++i ) {
-		ptr = libusb_get_iso_packet_buffer_simple(transfer, i);
-		act_len = transfer->iso_packet_desc[i].actual_length;
-		totalin += 1;
-		if ( transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) {
-			pkts_success += 1;
-			if ( mainwin->rb7_enable->isChecked() ) {
-				dump_data7_in(act_len, ptr);
-				mainwin->lw7_in->addItem("");
-			}
-		}
-		else pkts_failure += 1;
-	}
-	sprintf(tbuf,"%6d",totalin);
-	mainwin->label7_totalin->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_success);
-	mainwin->label7_pktsin->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_failure);
-	mainwin->label7_dropped_in->setText(tbuf);
-	ep_in = mainwin->cb7_in->currentText().toInt(&ok, 16);  
-	pktsize_in = libusb_get_max_iso_packet_size(dev, ep_in);
-	inrate = ( (((double)totalin * (double)pktsize_in) / (double)elapsed ) * (1000.0 / 1024.0) );
-	sprintf(ttbuf, "%8.1f", inrate);
-	mainwin->label7_ratein->setText(ttbuf);
-}	
+	if ( mainwin->rb7_enable->isChecked() ) {
+		n = isostream_get_sample(isoc_sample, sizeof(isoc_sample), &isoc_sample_seq);
+		if ( n )
+			hex->append(isoc_sample, n, true);
+	}
+}
 
-static void out_callback( struct libusb_transfer *transfer)
+// Start a continuous stream on the selected iso endpoint. The button that started it becomes
+// the stop button, and the other direction is disabled until the stream is stopped.
+static void isoc_start(unsigned char ep, QPushButton *self, QPushButton *other, QLabel *pktsize)
 {
+	struct isostream_results res;
 	bool ok;
-	int pktsout, act_len;
-	char tbuf[8];
-	unsigned char *ptr;
-	int elapsed;
-	unsigned char ep_out;
-	int pktsize_out;
-	char ttbuf[10];
-	double outrate;
-
-
-	printf("Callback function called\n");
+	int numpkts;
+	int r;
+	char tbuf[10];
 
-	if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
-		libusb_error(transfer->status, "Transfer not completed normally");
+	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
+	r = isostream_start(h, ep, numpkts);
+	if ( r ) {
+		libusb_error(r, "Failed to start the isochronous stream");
+		return;
 	}
 
-	totalout = pkts_success = pkts_failure = 0;
+	isoc_dir = ep & LIBUSB_ENDPOINT_DIR_MASK;
+	isostream_get_results(&isoc_last);
+	isoc_sample_seq = 0;
+	res = isoc_last;
+	sprintf(tbuf, "%9d", res.pktsize);
+	pktsize->setText(tbuf);
 
-	pktsout = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
+	self->setText("STOP");
+	other->setEnabled(false);
+	if ( isoc_timer == NULL ) {
+		isoc_timer = new QTimer(mainwin);
+		QObject::connect(isoc_timer, &QTimer::timeout, isoc_update_results);
+	}
+	isoc_timer->start(500);
+}
 
-	elapsed = isoc_time->elapsed();
+// Stop the isochronous stream, if one is running.
+static void isoc_stop(void)
+{
+	if ( !isostream_is_running() )
+		return;
 
-	printf("Milliseconds elapsed = %d\n",elapsed);
+	isoc_timer->stop();
+	isostream_stop();
+	isoc_update_results();
 
-	for ( int i = 0; i < pktsout; ++i ) {
-		ptr = libusb_get_iso_packet_buffer_simple(transfer, i);
-		act_len = transfer->iso_packet_desc[i].actual_length;
-		totalout += 1;
-		if ( transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) {
-			pkts_success += 1;
-			if ( mainwin->rb7_enable->isChecked() ) {
-				dump_data7_out(act_len, ptr);
-				mainwin->lw7_out->addItem("");
-			}
-		}
-		else pkts_failure += 1;
-	}
-	sprintf(tbuf,"%6d",totalout);
-	mainwin->label7_totalout->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_success);
-	mainwin->label7_pktsout->setText(tbuf);
-	sprintf(tbuf,"%6d",pkts_failure);
-	mainwin->label7_dropped_out->setText(tbuf);
-	ep_out = mainwin->cb7_out->currentText().toInt(&ok, 16);  
-	pktsize_out = libusb_get_max_iso_packet_size(dev, ep_out);
-	outrate = ( (((double)totalout * (double)pktsize_out) / (double)elapsed ) * (1000.0 / 1024.0) );
-	sprintf(ttbuf, "%8.1f", outrate);
-	mainwin->label7_rateout->setText(ttbuf);
-}	
+	mainwin->pb7_rcv->setText("RECEIVE");
+	mainwin->pb7_send->setText("SEND");
+	mainwin->pb7_rcv->setEnabled(true);
+	mainwin->pb7_send->setEnabled(true);
+}
 
 void ControlCenter::on_pb7_rcv_clicked()
 {
-	int numpkts;	
 	bool ok;
-	int pktsize_in;
-	int bufsize_in;
 	unsigned char ep_in;
-	int r;
-	char tbuf[10];
-	struct timeval tv;
+
+	if ( isostream_is_running() ) {
+		isoc_stop();
+		return;
+	}
 
 	if ( cb7_in->currentText() == "" ) {  /* No ep_in exists */
 		QMessageBox mb;
@@ -1980,54 +2127,18 @@ void ControlCenter::on_pb7_rcv_clicked()
 	} 
 
 	ep_in = cb7_in->currentText().toInt(&ok, 16);  
-	pktsize_in = libusb_get_max_iso_packet_size(dev, ep_in);
-	sprintf(tbuf,"%9d",pktsize_in);
-	mainwin->label7_pktsize_in->setText(tbuf);
-
-	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-	bufsize_in = pktsize_in * numpkts;
-	isoc_databuf = (unsigned char *)malloc(bufsize_in);
-
-	transfer = libusb_alloc_transfer(numpkts);
-	if ( !transfer ) {
-		QMessageBox mb;
-		mb.setText("Alloc failure");
-		mb.exec();
-		return;
-	}
-
-	libusb_fill_iso_transfer(transfer, h, ep_in, isoc_databuf, bufsize_in, numpkts, in_callback, NULL, 10000 );
-
-	libusb_set_iso_packet_lengths(transfer, pktsize_in);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-
-	isoc_time = new QTime();
-	isoc_time->start();
-
-	r = libusb_submit_transfer(transfer);
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 50;
-
-	for ( int i = 0; i < 100; ++i ) {
-		libusb_handle_events_timeout(NULL,&tv);
-	}
-
-	if ( r ) {
-		printf("Error %d submitting transfer\n", r);
-	}
+	isoc_start(ep_in, pb7_rcv, pb7_send, label7_pktsize_in);
 }
 
 void ControlCenter::on_pb7_send_clicked()
 {
-	int numpkts;	
 	bool ok;
-	int pktsize_out;
-	int bufsize_out;
 	unsigned char ep_out;
-	int r;
-	char tbuf[10];
-	struct timeval tv;
+
+	if ( isostream_is_running() ) {
+		isoc_stop();
+		return;
+	}
 
 	if ( cb7_out->currentText() == "" ) {  /* No ep_out exists */
 		QMessageBox mb;
@@ -2037,47 +2148,7 @@ void ControlCenter::on_pb7_send_clicked()
 	} 
 
 	ep_out = cb7_out->currentText().toInt(&ok, 16);  
-	pktsize_out = libusb_get_max_iso_packet_size(dev, ep_out);
-	sprintf(tbuf,"%9d",pktsize_out);
-	mainwin->label7_pktsize_out->setText(tbuf);
-
-	numpkts = mainwin->cb7_numpkts->currentText().toInt(&ok, 10);
-	bufsize_out = pktsize_out * numpkts;
-	isoc_databuf = (unsigned char *)malloc(bufsize_out);
-
-	for ( int i = 0; i < numpkts; ++i )
-		for ( int j = 0; j < pktsize_out; ++j )
-			isoc_databuf[i*pktsize_out+j] = i + 1;
-
-	transfer = libusb_alloc_transfer(numpkts);
-	if ( !transfer ) {
-		QMessageBox mb;
-		mb.setText("Alloc failure");
-		mb.exec();
-		return;
-	}
-
-	libusb_fill_iso_transfer(transfer, h, ep_out, isoc_databuf, bufsize_out, numpkts, out_callback, NULL, 10000 );
-
-	libusb_set_iso_packet_lengths(transfer, pktsize_out);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
-
-	isoc_time = new QTime();
-	isoc_time->start();
-
-	r = libusb_submit_transfer(transfer);
-
-
-	tv.tv_sec = 0;
-	tv.tv_usec = 50;
-
-	for ( int i = 0; i < 100; ++i ) {
-		libusb_handle_events_timeout(NULL,&tv);
-	}
-
-	if ( r ) {
-		printf("Error %d submitting transfer\n", r);
-	}
+	isoc_start(ep_out, pb7_send, pb7_rcv, label7_pktsize_out);
 }
 
 void ControlCenter::on_pb7_clear_clicked()
@@ -2090,10 +2161,12 @@ void ControlCenter::on_pb7_clear_clicked()
 	mainwin->label7_pktsin->clear();
 	mainwin->label7_dropped_out->clear();
 	mainwin->label7_dropped_in->clear();
+	mainwin->label7_gaps_out->clear();
+	mainwin->label7_gaps_in->clear();
 	mainwin->label7_rateout->clear();
 	mainwin->label7_ratein->clear();
-	mainwin->lw7_out->clear();
-	mainwin->lw7_in->clear();
+	hex7_out->clear();
+	hex7_in->clear();
 }
 
 void ControlCenter::on_rb7_enable_clicked()
@@ -2122,6 +2195,9 @@ static int multiple_instances()
 
 void ControlCenter::appExit()
 {
+	isoc_stop();
+	file6_finish(false);
+	capture6_close();
 	exit(0);
 }
 
@@ -2134,6 +2210,26 @@ void ControlCenter::about()
 	return;
 }
 
+// Attach the hex dump models to the data displays of the Bulk and Isochronous tabs. All rows
+// have the same height, so the views never need to format lines that are not visible.
+static void setup_hex_views()
+{
+	hex6_out = new HexDumpModel(HEXVIEW_CAPACITY, mainwin);
+	hex6_in  = new HexDumpModel(HEXVIEW_CAPACITY, mainwin);
+	hex7_out = new HexDumpModel(HEXVIEW_CAPACITY, mainwin);
+	hex7_in  = new HexDumpModel(HEXVIEW_CAPACITY, mainwin);
+
+	mainwin->lw6_out->setModel(hex6_out);
+	mainwin->lw6->setModel(hex6_in);
+	mainwin->lw7_out->setModel(hex7_out);
+	mainwin->lw7_in->setModel(hex7_in);
+
+	mainwin->lw6_out->setUniformItemSizes(true);
+	mainwin->lw6->setUniformItemSizes(true);
+	mainwin->lw7_out->setUniformItemSizes(true);
+	mainwin->lw7_in->setUniformItemSizes(true);
+}
+
 int main(int argc, char **argv)
 {
 	int r;
@@ -2158,6 +2254,7 @@ int main(int argc, char **argv)
 	signal(SIGUSR1, setup_handler);
 
 	mainwin = new ControlCenter;
+	setup_hex_views();
 	QMainWindow *mw = new QMainWindow(0);
 	mw->setCentralWidget(mainwin);
 	QIcon *qic = new QIcon("cypress.png");
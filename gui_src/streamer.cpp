@@ -3,9 +3,6 @@
  * Description          : Provides functions to test USB data transfer performance.
  */
 
-#include <QtCore>
-#include <QtWidgets>
-
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -14,35 +11,37 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <time.h>
+#include <sched.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include "../include/cyusb.h"
-#include "../include/controlcenter.h"
+#include "usbmethods.h"
 
-extern ControlCenter *mainwin;
 extern libusb_device_handle  *h;
 
+// Interval at which the streamer thread publishes its statistics, in nanoseconds.
+#define RESULTS_INTERVAL_NS	(100000000ULL)
+
 // Variables storing the user provided application configuration.
 static unsigned int	endpoint   = 0;		// Endpoint to be tested
 static unsigned int	reqsize    = 16;	// Request size in number of packets
 static unsigned int	queuedepth = 16;	// Number of requests to queue
+static bool		adaptive   = false;	// Whether the size and depth are tuned, up to the above
 static unsigned char	eptype;			// Type of endpoint (transfer type)
 static unsigned int	pktsize;		// Maximum packet size for the endpoint
 
-static unsigned int	success_count = 0;	// Number of successful transfers
-static unsigned int	failure_count = 0;	// Number of failed transfers
-static unsigned int	transfer_size = 0;	// Size of data transfers performed so far
-static unsigned int	transfer_index = 0;	// Write index into the transfer_size array
-static unsigned int	transfer_perf = 0;	// Performance in KBps
-static volatile bool	stop_transfers = false;	// Request to stop data transfers
-static volatile int	rqts_in_flight = 0;	// Number of transfers that are in progress
-static volatile bool	app_running = false;	// Whether the streamer application is running
+static bool		stop_transfers = false;	// Request to stop data transfers
+static bool		app_running = false;	// Whether the streamer application is running
 static pthread_t	strm_thread;		// Thread used for the streamer operation
+static cyusb_stream	*strm = NULL;		// Data stream used for the streamer operation
 
-static struct timeval	start_ts;		// Data transfer start time stamp.
-static struct timeval	end_ts;			// Data transfer stop time stamp.
+// Statistics snapshot published by the streamer thread. The thread is the only writer, and the
+// UI reads it with streamer_get_results(); results_seq is odd while an update is in progress.
+static struct streamer_results results;
+static unsigned int	results_seq = 0;
+static unsigned long long start_ns;		// Data transfer start time stamp
 
 // Function: streamer_set_params
 // Sets the streamer test parameters
@@ -52,13 +51,15 @@ streamer_set_params (
 		unsigned int type,
 		unsigned int maxpkt,
 		unsigned int numpkts,
-		unsigned int numrqts)
+		unsigned int numrqts,
+		bool         adapt)
 {
 	endpoint   = ep;
 	eptype     = type;
 	pktsize    = maxpkt;
 	reqsize    = numpkts;
 	queuedepth = numrqts;
+	adaptive   = adapt;
 }
 
 // Function: streamer_stop_xfer
@@ -67,7 +68,7 @@ void
 streamer_stop_xfer (
 		void)
 {
-	stop_transfers = true;
+	__atomic_store_n (&stop_transfers, true, __ATOMIC_RELEASE);
 }
 
 // Function: streamer_is_running
@@ -76,141 +77,64 @@ bool
 streamer_is_running (
 		void)
 {
-	return app_running;
+	return __atomic_load_n (&app_running, __ATOMIC_ACQUIRE);
 }
 
-// Function: streamer_update_results
-// Gets the streamer test results on an ongoing basis
-static void
-streamer_update_results (
+// Function: monotonic_ns
+// Gets the clock the stream engine times transfers with (CYUSB_CLOCK), in nanoseconds.
+static inline unsigned long long
+monotonic_ns (
 		void)
 {
-	char buffer[64];
-
-	// Print the transfer statistics into the character strings and update UI.
-	sprintf (buffer, "%d", success_count);
-	mainwin->streamer_out_passcnt->setText (buffer);
+	struct timespec ts;
 
-	sprintf (buffer, "%d", failure_count);
-	mainwin->streamer_out_failcnt->setText (buffer);
-
-	sprintf (buffer, "%d", transfer_perf);
-	mainwin->streamer_out_perf->setText (buffer);
+	clock_gettime (CYUSB_CLOCK, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
 }
 
-// Function: xfer_callback
-// This is the call back function called by libusb upon completion of a queued data transfer.
+// Function: streamer_publish_results
+// Publishes a new snapshot of the stream statistics. This only copies the counters that the
+// stream engine maintains; all formatting and drawing is left to the UI thread.
 static void
-xfer_callback (
-		struct libusb_transfer *transfer)
+streamer_publish_results (
+		unsigned long long now)
 {
-	unsigned int elapsed_time;
-	double       performance;
-	int          size = 0;
-
-	// Check if the transfer has succeeded.
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-
-		failure_count++;
+	struct cyusb_stream_stats stats;
+	unsigned int seq = results_seq;
 
-	} else {
+	cyusb_stream_get_stats (strm, &stats);
 
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
-
-			// Loop through all the packets and check the status of each packet transfer
-			for (unsigned int i = 0; i < reqsize; ++i) {
-
-				// Calculate the actual size of data transferred in each micro-frame.
-				if (transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED) {
-					size += transfer->iso_packet_desc[i].actual_length;
-				}
-			}
-
-		} else {
-			size = reqsize * pktsize;
-		}
-
-		success_count++;
-	}
+	__atomic_store_n (&results_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
 
-	// Update the actual transfer size for this request.
-	transfer_size += size;
+	results.seconds = (double)(now - start_ns) / 1e9;
+	results.success = stats.success_count;
+	results.failure = stats.failure_count;
+	results.bytes   = stats.bytes;
+	results.adaptive   = stats.adaptive;
+	results.reqsize    = stats.reqsize;
+	results.queuedepth = stats.queuedepth;
+	cyusb_stream_get_latency (strm, &results.latency, NULL);
 
-	// Print the transfer statistics when queuedepth transfers are completed.
-	transfer_index++;
-	if (transfer_index == queuedepth) {
-
-		gettimeofday (&end_ts, NULL);
-		elapsed_time = ((end_ts.tv_sec - start_ts.tv_sec) * 1000000 +
-			(end_ts.tv_usec - start_ts.tv_usec));
-
-		// Calculate the performance in KBps.
-		performance    = (((double)transfer_size / 1024) / ((double)elapsed_time / 1000000));
-		transfer_perf  = (unsigned int)performance;
-
-		transfer_index = 0;
-		transfer_size  = 0;
-		start_ts = end_ts;
-	}
-
-	// Reduce the number of requests in flight.
-	rqts_in_flight--;
-
-	// Prepare and re-submit the read request.
-	if (!stop_transfers) {
-
-		// We do not expect a transfer queue attempt to fail in the general case.
-		// However, if it does fail; we just ignore the error.
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_set_iso_packet_lengths (transfer, pktsize);
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
-
-			default:
-				break;
-		}
-	}
+	__atomic_store_n (&results_seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-// Function to free data buffers and transfer structures
-static void
-free_transfer_buffers (
-		unsigned char          **databuffers,
-		struct libusb_transfer **transfers)
+// Function: streamer_get_results
+// Gets a consistent copy of the latest statistics snapshot. This never blocks the streamer
+// thread; the copy is simply taken again if an update happened while it was being made.
+void
+streamer_get_results (
+		struct streamer_results *res)
 {
-	// Free up any allocated transfer structures
-	if (transfers != NULL) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (transfers[i] != NULL) {
-				libusb_free_transfer (transfers[i]);
-			}
-			transfers[i] = NULL;
-		}
-		free (transfers);
-	}
+	unsigned int seq;
 
-	// Free up any allocated data buffers
-	if (databuffers != NULL) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (databuffers[i] != NULL) {
-				free (databuffers[i]);
-			}
-			databuffers[i] = NULL;
-		}
-		free (databuffers);
-	}
+	do {
+		while ((seq = __atomic_load_n (&results_seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield ();
+
+		memcpy (res, &results, sizeof (struct streamer_results));
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n (&results_seq, __ATOMIC_RELAXED) != seq);
 }
 
 // Function: streamer_thread_func
@@ -221,13 +145,16 @@ streamer_thread_func (
 		void *arg)
 {
 	libusb_device_handle *dev_handle = (libusb_device_handle *)arg;
-	struct libusb_transfer **transfers = NULL;		// List of transfer structures.
-	unsigned char **databuffers = NULL;			// List of data buffers.
+	struct libusb_transfer *transfer;
+	struct cyusb_stream_stats stats;
+	unsigned long long now, next_ns;
+	unsigned int length;
 	int  rStatus;
 
 	// Check for validity of the device handle
 	if (dev_handle == NULL) {
 		printf ("Failed to get CyUSB device handle\n");
+		__atomic_store_n (&app_running, false, __ATOMIC_RELEASE);
 		pthread_exit (NULL);
 	}
 
@@ -240,106 +167,76 @@ streamer_thread_func (
 	printf ("\tQueue depth      : 0x%x\n", queuedepth);
 	printf ("\n");
 
-	// Allocate buffers and transfer structures
-	bool allocfail = false;
-
-	databuffers = (unsigned char **)calloc (queuedepth, sizeof (unsigned char *));
-	transfers   = (struct libusb_transfer **)calloc (queuedepth, sizeof (struct libusb_transfer *));
-
-	if ((databuffers != NULL) && (transfers != NULL)) {
-
-		for (unsigned int i = 0; i < queuedepth; i++) {
-
-			databuffers[i] = (unsigned char *)malloc (reqsize * pktsize);
-			transfers[i]   = libusb_alloc_transfer (
-					(eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? reqsize : 0);
-
-			if ((databuffers[i] == NULL) || (transfers[i] == NULL)) {
-				allocfail = true;
-				break;
-			}
-		}
-
-	} else {
-
-		allocfail = true;
-
+	// Allocate the stream along with all its buffers and transfer structures
+	rStatus = cyusb_stream_open (dev_handle, endpoint, pktsize, reqsize, queuedepth, &strm);
+	if (rStatus != 0) {
+		printf ("Failed to allocate buffers and transfer structures\n");
+		__atomic_store_n (&app_running, false, __ATOMIC_RELEASE);
+		pthread_exit (NULL);
 	}
 
-	// Check if all memory allocations have succeeded
-	if (allocfail) {
-		printf ("Failed to allocate buffers and transfer structures\n");
-		free_transfer_buffers (databuffers, transfers);
+	// Report whether the transfers complete straight into the stream buffers.
+	cyusb_stream_get_stats (strm, &stats);
+	printf ("\tBuffer memory    : %s\n\n", (stats.zerocopy) ? "zero-copy (usbfs mapped)" : "user space");
+
+	// The library event thread handles the USB events, and passes the completed transfers
+	// back to this thread through the stream completion queue.
+	if ((cyusb_stream_enable_queue (strm) != 0) || (cyusb_event_thread_start (NULL) != 0)) {
+		printf ("Failed to set up completion handling\n");
+		cyusb_stream_close (strm);
+		strm = NULL;
+		__atomic_store_n (&app_running, false, __ATOMIC_RELEASE);
 		pthread_exit (NULL);
 	}
 
-	// Take the transfer start timestamp
-	gettimeofday (&start_ts, NULL);
+	// Let the stream tune the request size and queue depth, with the selected values as limits.
+	if (adaptive) {
+		struct cyusb_stream_adapt adapt;
 
-	// Launch all the transfers till queue depth is complete
-	for (unsigned int i = 0; i < queuedepth; i++) {
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				libusb_fill_bulk_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, NULL, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				libusb_fill_interrupt_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, NULL, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_fill_iso_transfer (transfers[i], dev_handle, endpoint, databuffers[i],
-						reqsize * pktsize, reqsize, xfer_callback, NULL, 5000);
-				libusb_set_iso_packet_lengths (transfers[i], pktsize);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			default:
-				break;
-		}
+		memset (&adapt, 0, sizeof (adapt));
+		if (cyusb_stream_set_adaptive (strm, &adapt) != 0)
+			printf ("Failed to set up adaptive mode, using a fixed size and depth\n");
 	}
 
-	printf ("Queued %d requests\n", rqts_in_flight);
+	// Take the transfer start timestamp
+	start_ns = monotonic_ns ();
+	next_ns  = start_ns + RESULTS_INTERVAL_NS;
 
-	struct timeval t1, t2, tout;
-	gettimeofday (&t1, NULL);
+	// Launch all the transfers till queue depth is complete
+	rStatus = cyusb_stream_start (strm);
+	if (rStatus != 0) {
+		printf ("Failed to queue requests\n");
+		cyusb_stream_close (strm);
+		cyusb_event_thread_stop (NULL);
+		strm = NULL;
+		__atomic_store_n (&app_running, false, __ATOMIC_RELEASE);
+		pthread_exit (NULL);
+	}
 
-	// Use a 1 second timeout for the libusb_handle_events_timeout call
-	tout.tv_sec  = 1;
-	tout.tv_usec = 0;
+	printf ("Queued %d requests\n", queuedepth);
 
-	// Keep handling events until transfer stop is requested.
+	// Process completed transfers and queue them again until transfer stop is requested. The
+	// completed transfer is queued again before anything else is done with the statistics.
 	do {
-		libusb_handle_events_timeout (NULL, &tout);
-
-		// Refresh the performance statistics about once in 0.5 seconds.
-		gettimeofday (&t2, NULL);
-		if (t2.tv_sec > t1.tv_sec) {
-			streamer_update_results ();
-			t1 = t2;
+		rStatus = cyusb_stream_next (strm, &transfer, &length, 100);
+		if (rStatus == 0)
+			cyusb_stream_submit (strm, transfer);
+
+		now = monotonic_ns ();
+		if (now >= next_ns) {
+			streamer_publish_results (now);
+			next_ns = now + RESULTS_INTERVAL_NS;
 		}
 
-	} while (!stop_transfers);
+	} while (!__atomic_load_n (&stop_transfers, __ATOMIC_ACQUIRE));
 
 	printf ("Stopping streamer app\n");
-	while (rqts_in_flight != 0) {
-		printf ("%d requests are pending\n", rqts_in_flight);
-		libusb_handle_events_timeout (NULL, &tout);
-		sleep (1);
-	}
-
-	free_transfer_buffers (databuffers, transfers);
-	app_running = false;
+	cyusb_stream_stop (strm);
+	streamer_publish_results (monotonic_ns ());
+	cyusb_stream_close (strm);
+	cyusb_event_thread_stop (NULL);
+	strm = NULL;
+	__atomic_store_n (&app_running, false, __ATOMIC_RELEASE);
 
 	printf ("Streamer test completed\n\n");
 	pthread_exit (NULL);
@@ -355,14 +252,11 @@ streamer_start_xfer (
 	if (app_running)
 		return -EBUSY;
 
-	// Default initialization for variables
-	success_count  = 0;
-	failure_count  = 0;
-	transfer_index = 0;
-	transfer_size  = 0;
-	transfer_perf  = 0;
-	rqts_in_flight = 0;
+	// Default initialization for variables. The streamer thread is not running, so the
+	// snapshot can be cleared directly.
 	stop_transfers = false;
+	memset (&results, 0, sizeof (results));
+	cyusb_hist_reset (&results.latency);
 
 	// Mark application running
 	app_running    = true;
@@ -370,6 +264,7 @@ streamer_start_xfer (
 		app_running = false;
 		return -ENOMEM;
 	}
+	pthread_detach (strm_thread);
 
 	return 0;
 }
@@ -10,6 +10,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <libusb-1.0/libusb.h>
+
+#include "../include/cyusb.h"
+
 extern int
 fx2_ram_download (
 		const char *filename,
@@ -38,7 +42,8 @@ streamer_set_params (
 		unsigned int type,
 		unsigned int pktsize,
 		unsigned int numpkts,
-		unsigned int numrqts);
+		unsigned int numrqts,
+		bool         adapt);
 
 extern void
 streamer_stop_xfer (
@@ -52,6 +57,91 @@ extern int
 streamer_start_xfer (
 		void);
 
+/* Snapshot of the streamer statistics. */
+struct streamer_results {
+	double             seconds;		// Time since the test was started
+	unsigned long long success;		// Transfers completed successfully
+	unsigned long long failure;		// Transfers that failed
+	unsigned long long bytes;		// Data bytes transferred
+	struct cyusb_hist  latency;		// Submit to completion time of each transfer, in ns
+	bool               adaptive;		// Whether the size and depth are tuned while running
+	unsigned int       reqsize;		// Request size currently used, in packets
+	unsigned int       queuedepth;		// Number of requests currently queued
+};
+
+extern void
+streamer_get_results (
+		struct streamer_results *res);
+
+/* Progress of a file streamed through the bulk endpoints. */
+struct filestream_status {
+	double             seconds;		// Time since streaming was started
+	unsigned long long size;		// Size of the file being sent
+	unsigned long long bytes_out;		// Data sent to the device
+	unsigned long long bytes_in;		// Data received from the device
+	unsigned long long bytes_written;	// Received data written to the file
+	int                error;		// First transfer error (LIBUSB_ERROR code), or 0
+	int                write_error;		// errno of the first failed file write, or 0
+	bool               done;		// All transfers and writes have completed
+};
+
+extern int
+filestream_start (
+		libusb_device_handle *handle,
+		unsigned char ep_out,
+		const char *outfile,
+		unsigned char ep_in,
+		const char *infile);
+
+extern void
+filestream_stop (
+		void);
+
+extern bool
+filestream_is_running (
+		void);
+
+extern void
+filestream_get_status (
+		struct filestream_status *st);
+
+/* Snapshot of the isochronous stream counters. */
+struct isostream_results {
+	double             seconds;		// Time since the stream was started
+	unsigned int       pktsize;		// Packet size used on the endpoint
+	unsigned long long packets;		// Packets (service intervals) completed
+	unsigned long long good;		// Packets that delivered data
+	unsigned long long errors;		// Packets that completed with an error
+	unsigned long long empty;		// Packets that completed without data
+	unsigned long long bytes;		// Data bytes actually delivered
+	unsigned long long gaps;		// Runs of consecutive packets without data
+	unsigned long long longest_gap;		// Longest such run, in packets
+};
+
+extern int
+isostream_start (
+		libusb_device_handle *handle,
+		unsigned char ep,
+		unsigned int numpkts);
+
+extern void
+isostream_stop (
+		void);
+
+extern bool
+isostream_is_running (
+		void);
+
+extern void
+isostream_get_results (
+		struct isostream_results *res);
+
+extern unsigned int
+isostream_get_sample (
+		unsigned char *buf,
+		unsigned int len,
+		unsigned int *seq);
+
 #endif /* INCLUDED_USBMETHODS_H */
 
 /*[]*/
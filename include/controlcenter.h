@@ -68,6 +68,7 @@ private slots:
 	void on_cb6_loop_clicked();
 	void on_pb6_selout_clicked();
 	void on_pb6_selin_clicked();
+	void on_pb6_selcap_clicked();
 	void on_pb6_clearhalt_out_clicked();
 	void on_pb6_clearhalt_in_clicked();
 	void on_pb7_clear_clicked();
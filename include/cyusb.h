@@ -12,13 +12,44 @@
  *    1. Cypress Semiconductor, January 23, 2013                                  *
  *       Added function documentation.                                            *
  *       Added new constant to specify number of device ID entries.               *
+ *    2. Added the asynchronous streaming API (cyusb_stream_*).                   *
+ *    3. Added library owned event handling threads, and a completion queue for   *
+ *       streams.                                                                 *
+ *    4. Added transfer buffer pools (cyusb_bufpool_*), with zero-copy support.   *
+ *    5. Added latency histograms (cyusb_hist_*) and per-stream latency data.     *
+ *    6. Added data pattern generation and verification (cyusb_pattern_*).        *
+ *    7. Added pipelined FX3 RAM download (cyusb_download_fx3_image).             *
+ *    8. Added parsed and cached FX2 firmware images (cyusb_fx2_image_*).         *
+ *    9. Added hotplug handling, with incremental updates of the cydev[] table    *
+ *       (cyusb_hotplug_*, cyusb_refresh).                                        *
+ *   10. Added library contexts (cyusb_context), with _ctx variants of the device *
+ *       table functions. Device tables are no longer limited to MAXDEVICES.      *
+ *   11. Added per-endpoint metrics in a shared memory segment (cyusb_metrics_*). *
+ *   12. Added stream fan-out to several processes through shared memory         *
+ *       (cyusb_fanout_*).                                                        *
+ *   13. Added adaptive queue depth and request size for streams                  *
+ *       (cyusb_stream_set_adaptive).                                             *
+ *   14. Added an indexed capture file format, with a writer that streams can     *
+ *       feed, and a reader (cyusb_capture_*).                                    *
+ *   15. Added payload sources for OUT streams, from a pattern or a file          *
+ *       (cyusb_payload_*, cyusb_stream_set_payload).                             *
+ *   16. Added batched asynchronous control requests (cyusb_control_batch), and   *
+ *       moved the firmware downloads over to them.                               *
+ *   17. Added cyusb_fx3_image_check, and a benchmark suite with a simulated      *
+ *       device backend (bench/).                                                 *
+ *   18. Added event thread CPU pinning and real-time priority, locked stream     *
+ *       buffers, and timing on the raw monotonic clock (CYUSB_CLOCK).            *
+ *   19. Added cyusb_hist_add, for combining the histograms of several streams.   *
+ *   20. Added cached descriptor snapshots with endpoint lookup by address        *
+ *       (cyusb_desc_*), used by streams for the packet size.                     *
  *                                                                                *
  \********************************************************************************/
 
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
-/* This is the maximum number of 'devices of interest' we are willing to store as default. */
-/* These are the maximum number of devices we will communicate with simultaneously */
+/* This is the number of 'devices of interest' a device table is allocated for at first. */
+/* The table grows as required, so this is not a limit on the number of devices. */
 #define MAXDEVICES        10
 
 /* This is the maximum number of VID/PID pairs that this library will consider. This limits
@@ -43,6 +74,409 @@ struct cydev {
     unsigned char filler;       /* Padding to make struct = 16 bytes */
 };
 
+/* Opaque handle to a library context, with its own device table and libusb context.
+   See cyusb_open_ctx(). */
+typedef struct cyusb_context cyusb_context;
+
+/* Resolution of the latency histograms. Each power of two range of values is split into
+   2^CYUSB_HIST_SUB_BITS buckets, so that reported values are within 1/16 of the actual value.
+ */
+#define CYUSB_HIST_SUB_BITS	4
+#define CYUSB_HIST_BUCKETS	((64 - CYUSB_HIST_SUB_BITS + 1) << CYUSB_HIST_SUB_BITS)
+
+/* Clock that the library takes all latency and rate measurements with. The raw monotonic clock
+   is not slewed by NTP, so intervals measured with it do not stretch or shrink while the system
+   time is being adjusted.
+ */
+#ifdef CLOCK_MONOTONIC_RAW
+#define CYUSB_CLOCK		CLOCK_MONOTONIC_RAW
+#else
+#define CYUSB_CLOCK		CLOCK_MONOTONIC
+#endif
+
+/* Histogram of 64-bit values, such as latencies in nanoseconds. See cyusb_hist_record(). */
+struct cyusb_hist {
+	unsigned long long count;		/* Number of values recorded. */
+	unsigned long long sum;			/* Sum of all values, for the mean. */
+	unsigned long long min;			/* Smallest value recorded. */
+	unsigned long long max;			/* Largest value recorded. */
+	unsigned long long buckets[CYUSB_HIST_BUCKETS];
+};
+
+/* Data patterns for cyusb_pattern_init(). */
+#define CYUSB_PATTERN_CONST	0	/* Every byte equal to the seed. */
+#define CYUSB_PATTERN_INC8	1	/* Incrementing 8-bit counter. */
+#define CYUSB_PATTERN_INC16	2	/* Incrementing 16-bit little endian counter. */
+#define CYUSB_PATTERN_INC32	3	/* Incrementing 32-bit little endian counter. */
+#define CYUSB_PATTERN_LFSR	4	/* 32-bit Galois LFSR, x^32 + x^22 + x^2 + x + 1. */
+
+/* Value of first_error when no mismatch has been found. */
+#define CYUSB_PATTERN_NO_ERROR	(~0ULL)
+
+/* State of a pattern generator or checker. See cyusb_pattern_init(). */
+struct cyusb_pattern {
+	int		   type;		/* One of the CYUSB_PATTERN_ values. */
+	unsigned int	   width;		/* Size of one pattern element in bytes. */
+	unsigned int	   next;		/* Next element expected (or generated). */
+	int		   synced;		/* 0 if the next element starts a new sequence. */
+	unsigned long long offset;		/* Number of bytes generated or checked so far. */
+	unsigned long long errors;		/* Number of elements that did not match. */
+	unsigned long long first_error;		/* Byte offset of the first mismatch. */
+};
+
+/* Source of the data sent by an OUT stream: a pattern, or a file. See cyusb_payload_create(). */
+typedef struct cyusb_payload cyusb_payload;
+
+/* When a stream fills its transfers from a payload. See cyusb_stream_set_payload(). */
+#define CYUSB_PAYLOAD_ONCE	0	/* Fill every buffer once; the same data is sent again. */
+#define CYUSB_PAYLOAD_EACH	1	/* Fill each transfer again before it is queued. */
+
+/* Events reported to a cyusb_hotplug_cb. */
+#define CYUSB_HOTPLUG_ARRIVED	1	/* Device was added to the cydev[] table. */
+#define CYUSB_HOTPLUG_LEFT	2	/* Device is about to be closed and removed from the table. */
+
+/*
+   Hotplug notification callback. index is the slot of the device in the cydev[] table. For
+   CYUSB_HOTPLUG_LEFT, the handle in dev (if the device was opened) is still open when the
+   callback is called, and is closed as soon as it returns.
+ */
+typedef void (*cyusb_hotplug_cb)(int event, int index, struct cydev *dev, void *arg);
+
+/* Size of the FX2/FX2LP address space that firmware can be loaded into. */
+#define CYUSB_FX2_MAX_SIZE	(0x10000)
+
+/* Largest amount of data written to FX2 RAM with one vendor request. */
+#define CYUSB_FX2_MAX_WRITE	(4096)
+
+/* Formats of FX2 firmware files. */
+#define CYUSB_FX2_FORMAT_HEX	(0)		/* Intel hex. */
+#define CYUSB_FX2_FORMAT_BIN	(1)		/* Raw binary, loaded from address 0. */
+#define CYUSB_FX2_FORMAT_C2LOAD	(2)		/* C2 load (IIC) format. */
+
+/* One contiguous range of bytes in a FX2 firmware image. */
+struct cyusb_fx2_segment {
+	unsigned int	     address;		/* Start address in the FX2 memory. */
+	unsigned int	     length;		/* Number of bytes. */
+	const unsigned char *data;		/* Segment data. */
+};
+
+/* A parsed FX2 firmware image. See cyusb_fx2_image_load(). */
+struct cyusb_fx2_image {
+	int			  format;	/* One of the CYUSB_FX2_FORMAT_ values. */
+	unsigned int		  max_addr;	/* One past the highest address used by the image. */
+	unsigned int		  count;	/* Number of segments. */
+	struct cyusb_fx2_segment *segments;	/* Segments, sorted by address. */
+	unsigned char		 *mem;		/* Image contents over the full address space. */
+};
+
+/* One endpoint in a descriptor snapshot. See cyusb_desc_get(). */
+struct cyusb_ep_desc {
+	unsigned char	address;		/* Endpoint address, including the direction bit. */
+	unsigned char	type;			/* Transfer type (LIBUSB_TRANSFER_TYPE_). */
+	unsigned char	interface;		/* Interface number the endpoint is in. */
+	unsigned char	altsetting;		/* Alternate setting the endpoint is in. */
+	unsigned short	maxpacket;		/* Maximum packet size, without the high bandwidth bits. */
+	unsigned char	burst;			/* Packets per burst (bMaxBurst + 1), 1 below USB 3.0. */
+	unsigned char	mult;			/* Bursts (or packets) per service interval for iso and
+						   high bandwidth endpoints, 1 otherwise. */
+	unsigned char	interval;		/* bInterval of the endpoint descriptor. */
+	unsigned int	pktsize;		/* Packet (or burst) size used by streams: maxpacket *
+						   burst * mult. */
+};
+
+/* Parsed descriptors of a device, for its active configuration. See cyusb_desc_get(). */
+struct cyusb_desc {
+	unsigned short	      vid;		/* Vendor ID. */
+	unsigned short	      pid;		/* Product ID. */
+	unsigned short	      bcdUSB;		/* USB version of the device. */
+	unsigned char	      config;		/* bConfigurationValue of the active configuration. */
+	unsigned char	      num_interfaces;	/* Number of interfaces in the configuration. */
+	unsigned int	      count;		/* Number of endpoints, over all alternate settings. */
+	struct cyusb_ep_desc *endpoints;	/* Endpoints, by interface and alternate setting. */
+	short		      index[32];	/* First entry for each endpoint address, or -1. */
+};
+
+/* Number of control requests kept in flight by cyusb_control_batch() if no depth is given. */
+#define CYUSB_CONTROL_DEPTH	(8)
+
+/* Timeout (in milliseconds) of a control request that does not give one. */
+#define CYUSB_CONTROL_TIMEOUT	(1000)
+
+/* Flags for a request in cyusb_control_batch(). */
+#define CYUSB_CONTROL_BARRIER	0x01	/* Queue only once all earlier requests are done, and
+					   queue nothing after it until it is done. */
+#define CYUSB_CONTROL_SHORT_OK	0x02	/* Less data than wLength is not a failure. */
+#define CYUSB_CONTROL_NO_FAIL	0x04	/* A failure is reported in status, but does not fail
+					   the batch (e.g. a jump to new firmware). */
+
+/* Flags for cyusb_control_batch(). */
+#define CYUSB_CONTROL_CONTINUE	0x01	/* Carry on after a failed request, instead of not
+					   queuing the requests that follow it. */
+
+/* One control request in a batch. See cyusb_control_batch(). */
+struct cyusb_control_req {
+	unsigned char	bmRequestType;		/* Request type, including the direction bit. */
+	unsigned char	bRequest;		/* Request. */
+	unsigned short	wValue;			/* Value field of the setup packet. */
+	unsigned short	wIndex;			/* Index field of the setup packet. */
+	unsigned short	wLength;		/* Number of bytes to send or read. */
+	unsigned char	*data;			/* Data sent, or buffer for the data read. */
+	unsigned int	timeout;		/* Timeout in milliseconds, 0 for CYUSB_CONTROL_TIMEOUT. */
+	unsigned int	flags;			/* CYUSB_CONTROL_ request flags. */
+	int		status;			/* Returns the bytes transferred, or a LIBUSB_ERROR. */
+};
+
+/* Opaque handle to a pool of transfer buffers. See cyusb_bufpool_create(). */
+typedef struct cyusb_bufpool cyusb_bufpool;
+
+/* Flags for cyusb_bufpool_create(). */
+#define CYUSB_BUFPOOL_HUGEPAGE	0x01	/* Use huge pages if zero-copy memory is not available. */
+#define CYUSB_BUFPOOL_NO_DEVMEM	0x02	/* Do not try to allocate zero-copy memory. */
+
+/* Opaque handle to an asynchronous data stream on an endpoint. See cyusb_stream_open(). */
+typedef struct cyusb_stream cyusb_stream;
+
+/* Return values for the stream data callback. */
+#define CYUSB_STREAM_RESUBMIT	0	/* Queue the transfer again as soon as the callback returns. */
+#define CYUSB_STREAM_HOLD	1	/* Keep the transfer; it is queued later by cyusb_stream_submit(). */
+
+/*
+   Stream data callback. This is called once for every completed transfer in the stream, with
+   length set to the number of bytes actually transferred. For isochronous endpoints, only the
+   packets that completed without error are counted.
+ */
+typedef int (*cyusb_stream_cb)(cyusb_stream *strm, struct libusb_transfer *transfer,
+		unsigned int length, void *arg);
+
+/*
+   Stream fill callback. This is called just before each transfer in the stream is queued
+   (including the first time), so that data for OUT endpoints can be generated in place. The
+   callback may reduce transfer->length for a short transfer.
+ */
+typedef void (*cyusb_stream_fill_cb)(cyusb_stream *strm, struct libusb_transfer *transfer,
+		void *arg);
+
+/* Statistics collected by a stream since it was last started. */
+struct cyusb_stream_stats {
+	unsigned long long success_count;	/* Number of transfers completed successfully. */
+	unsigned long long failure_count;	/* Number of transfers that failed. */
+	unsigned long long bytes;		/* Number of bytes transferred. */
+	unsigned int	   in_flight;		/* Number of transfers currently queued. */
+	unsigned char	   eptype;		/* Transfer type of the endpoint. */
+	unsigned int	   pktsize;		/* Packet (or burst) size used for the endpoint. */
+	unsigned char	   zerocopy;		/* Whether the stream uses zero-copy buffers. */
+	unsigned long long iso_errors;		/* Number of isochronous packets that failed. */
+	unsigned long long short_packets;	/* Number of short packets (or short transfers on
+						   bulk and interrupt endpoints). */
+	unsigned long long verify_errors;	/* Number of pattern elements that did not match. */
+	unsigned long long verify_first_error;	/* Stream offset of the first mismatch, or
+						   CYUSB_PATTERN_NO_ERROR. */
+	unsigned long long verify_bytes;	/* Number of bytes checked against the pattern. */
+	unsigned char	   adaptive;		/* Whether the depth and size are tuned at run time. */
+	unsigned int	   reqsize;		/* Request size (in packets) currently used. */
+	unsigned int	   queuedepth;		/* Number of transfers currently kept in flight. */
+	unsigned long long adapt_windows;	/* Number of measurement windows evaluated. */
+	unsigned long long adapt_grows;		/* Number of increases of the depth or size. */
+	unsigned long long adapt_shrinks;	/* Number of decreases of the depth or size. */
+	unsigned int	   adapt_reason;	/* CYUSB_STREAM_ADAPT_ reason for the last change. */
+	unsigned char	   locked;		/* Whether the buffers are locked into memory. */
+};
+
+/* Reasons for a change made by an adaptive stream. See cyusb_stream_set_adaptive(). */
+#define CYUSB_STREAM_ADAPT_UNDERRUN	0x01	/* The endpoint was left with nothing queued. */
+#define CYUSB_STREAM_ADAPT_ISO_ERRORS	0x02	/* Isochronous packets were missed. */
+#define CYUSB_STREAM_ADAPT_SHORT	0x04	/* Most transfers came back short. */
+#define CYUSB_STREAM_ADAPT_FAILED	0x08	/* Transfers failed. */
+#define CYUSB_STREAM_ADAPT_LATENCY	0x10	/* Transfers took longer than the latency target. */
+#define CYUSB_STREAM_ADAPT_RATE		0x20	/* Throughput was off the throughput target. */
+
+/*
+   Limits and targets of an adaptive stream. Zero limits stand for the widest range possible:
+   a request size of 1 packet up to the one the stream was opened with, and likewise for the
+   queue depth. With neither target set, the stream only reacts to underruns, missed
+   isochronous packets and short or failed transfers.
+ */
+struct cyusb_stream_adapt {
+	unsigned int	min_reqsize;		/* Smallest request size, in packets. */
+	unsigned int	max_reqsize;		/* Largest request size, in packets. */
+	unsigned int	min_queuedepth;		/* Fewest transfers kept in flight. */
+	unsigned int	max_queuedepth;		/* Most transfers kept in flight. */
+	unsigned int	reqsize;		/* Starting request size, or 0. */
+	unsigned int	queuedepth;		/* Starting queue depth, or 0. */
+	unsigned int	latency_target;		/* Highest average transfer latency wanted, in us. */
+	unsigned int	rate_target;		/* Throughput wanted, in KBps. */
+	unsigned int	interval;		/* Measurement window, in ms; 0 for the default. */
+};
+
+/* Name of the shared memory segment holding the metrics tables. See cyusb_metrics_create(). */
+#define CYUSB_METRICS_NAME	"/cyusb_metrics"
+
+/* Layout identification of the metrics segment. The version changes with any layout change. */
+#define CYUSB_METRICS_MAGIC	0x544d5943	/* "CYMT" */
+#define CYUSB_METRICS_VERSION	1
+
+/* Sizes of the metrics tables. Endpoint slot n is OUT endpoint n, and slot 16 + n is IN
+   endpoint n; see CYUSB_METRICS_EP_SLOT(). */
+#define CYUSB_METRICS_DEVICES	64
+#define CYUSB_METRICS_ENDPOINTS	32
+#define CYUSB_METRICS_EP_SLOT(ep)	(((ep) & 0x0f) | (((ep) & LIBUSB_ENDPOINT_IN) >> 3))
+
+/* States of a device slot in the metrics segment. */
+#define CYUSB_METRICS_FREE	0	/* Slot is not used. */
+#define CYUSB_METRICS_CLAIMED	1	/* Slot is being set up. */
+#define CYUSB_METRICS_PRESENT	2	/* Device is connected. */
+#define CYUSB_METRICS_GONE	3	/* Device has left; its counters are kept until it is back. */
+
+/* Size of a cache line; every set of endpoint counters takes up a line of its own. */
+#define CYUSB_CACHE_LINE	64
+
+/*
+   Counters of one endpoint. They are only ever increased, with relaxed atomic operations, by
+   the process streaming on the endpoint; readers see every counter, but not necessarily all of
+   them from the same instant.
+ */
+struct cyusb_ep_metrics {
+	unsigned long long bytes;		/* Number of bytes transferred. */
+	unsigned long long transfers;		/* Number of transfers completed successfully. */
+	unsigned long long failures;		/* Number of transfers that failed, timeouts included. */
+	unsigned long long timeouts;		/* Number of transfers that timed out. */
+	unsigned long long resubmits;		/* Number of times a completed transfer was queued again. */
+	unsigned long long resubmit_ns;		/* Total time from completion to resubmission. */
+	unsigned long long resubmit_max_ns;	/* Longest time from completion to resubmission. */
+	unsigned long long reserved;
+} __attribute__((aligned(CYUSB_CACHE_LINE)));
+
+/* Identification and counters of one device. A device is identified by its bus and port path,
+   so that it keeps its slot when it re-enumerates. */
+struct cyusb_dev_metrics {
+	unsigned int	   state;		/* One of the CYUSB_METRICS_ states. */
+	unsigned short	   vid;			/* Vendor ID, at the last enumeration. */
+	unsigned short	   pid;			/* Product ID, at the last enumeration. */
+	unsigned char	   busnum;		/* Bus number. */
+	unsigned char	   devaddr;		/* Device address, at the last enumeration. */
+	unsigned char	   nports;		/* Number of entries in ports[]. */
+	unsigned char	   ports[7];		/* Port path from the root hub. */
+	unsigned int	   enumerations;	/* Number of times the device has arrived. */
+	unsigned long long arrived;		/* Time of the last arrival, in seconds since the epoch. */
+	struct cyusb_ep_metrics ep[CYUSB_METRICS_ENDPOINTS];
+} __attribute__((aligned(CYUSB_CACHE_LINE)));
+
+/* Layout of the metrics segment. */
+struct cyusb_metrics {
+	unsigned int	   magic;		/* CYUSB_METRICS_MAGIC. */
+	unsigned int	   version;		/* CYUSB_METRICS_VERSION. */
+	unsigned int	   size;		/* Size of the segment in bytes. */
+	unsigned int	   ndevices;		/* Number of entries in dev[]. */
+	unsigned int	   nendpoints;		/* Number of entries in each ep[]. */
+	unsigned int	   publisher;		/* Process ID of the daemon that created the segment. */
+	unsigned long long created;		/* Creation time, in seconds since the epoch. */
+	struct cyusb_dev_metrics dev[CYUSB_METRICS_DEVICES];
+} __attribute__((aligned(CYUSB_CACHE_LINE)));
+
+/* Opaque handles to the producer and consumer sides of a stream fan-out. See
+   cyusb_fanout_create() and cyusb_fanout_attach(). */
+typedef struct cyusb_fanout cyusb_fanout;
+typedef struct cyusb_fanout_consumer cyusb_fanout_consumer;
+
+/* Path prefix of the socket that consumers of a fan-out connect to; the fan-out name is
+   appended to it. */
+#define CYUSB_FANOUT_SOCKET	"/var/run/cyusb_fanout."
+
+/* Largest number of consumers attached to a fan-out at the same time. */
+#define CYUSB_FANOUT_CONSUMERS	16
+
+/* Number of entries the array passed to cyusb_fanout_pollfds() needs. */
+#define CYUSB_FANOUT_POLLFDS	(CYUSB_FANOUT_CONSUMERS + 2)
+
+/* Flags for cyusb_fanout_create(). */
+#define CYUSB_FANOUT_HUGEPAGE	0x01	/* Back the ring with huge pages if they are available. */
+
+/* What happens to a consumer that falls a whole ring behind the stream. */
+#define CYUSB_FANOUT_DROP	0	/* The consumer loses the oldest data. */
+#define CYUSB_FANOUT_BLOCK	1	/* The stream is held back until the consumer catches up. */
+
+/* State of one consumer of a fan-out. See cyusb_fanout_get_consumer(). */
+struct cyusb_fanout_info {
+	unsigned int	   pid;			/* Process ID of the consumer, 0 if not known. */
+	int		   policy;		/* CYUSB_FANOUT_DROP or CYUSB_FANOUT_BLOCK. */
+	unsigned long long lag;			/* Number of blocks the consumer has yet to read. */
+	unsigned long long dropped;		/* Number of blocks the consumer has lost. */
+};
+
+struct pollfd;
+
+/* Opaque handles to a capture file being written, and to one being read. See
+   cyusb_capture_create() and cyusb_capture_open(). */
+typedef struct cyusb_capture cyusb_capture;
+typedef struct cyusb_capture_reader cyusb_capture_reader;
+
+/* Layout identification of a capture file. The version changes with any layout change. */
+#define CYUSB_CAPTURE_MAGIC	0x50414359	/* "CYAP" */
+#define CYUSB_CAPTURE_VERSION	1
+
+/* Space reserved for the file header; the first record starts at this offset. Also the
+   alignment of all writes to the file. */
+#define CYUSB_CAPTURE_ALIGN	4096
+
+/* Flags for cyusb_capture_create(). */
+#define CYUSB_CAPTURE_BUFFERED	0x01	/* Write through the page cache instead of with O_DIRECT. */
+
+/*
+   Header at the start of a capture file. The file is a sequence of records, each a struct
+   cyusb_capture_record followed by its iso packet descriptors (if any) and its data, padded
+   to a multiple of 8 bytes. Closing the file adds a sparse time index after the records;
+   data_end stays 0 in a file that was not closed, and its index is rebuilt when it is read.
+ */
+struct cyusb_capture_header {
+	unsigned int	   magic;		/* CYUSB_CAPTURE_MAGIC. */
+	unsigned int	   version;		/* CYUSB_CAPTURE_VERSION. */
+	unsigned int	   header_size;		/* Offset of the first record. */
+	unsigned int	   index_interval;	/* Time between index entries, in ms. */
+	unsigned long long start_ns;		/* Monotonic time at which the file was created. */
+	unsigned long long start_time;		/* Creation time, in seconds since the epoch. */
+	unsigned long long data_end;		/* Offset just past the last record. */
+	unsigned long long index_offset;	/* Offset of the index. */
+	unsigned long long index_count;		/* Number of index entries. */
+	unsigned long long records;		/* Number of records. */
+	unsigned long long dropped;		/* Number of records lost as the writer fell behind. */
+	unsigned int	   max_length;		/* Largest amount of data in a record. */
+	unsigned int	   max_packets;		/* Largest number of iso packets in a record. */
+};
+
+/* Header of one record: the data of one completed transfer. */
+struct cyusb_capture_record {
+	unsigned int	   size;		/* Size of the whole record, padding included. */
+	unsigned int	   length;		/* Number of bytes of data. */
+	unsigned long long timestamp;		/* Monotonic time of the completion, in ns. */
+	int		   status;		/* libusb_transfer_status of the transfer. */
+	unsigned char	   endpoint;		/* Endpoint address. */
+	unsigned char	   type;		/* Transfer type of the endpoint. */
+	unsigned short	   npackets;		/* Number of iso packet descriptors that follow. */
+};
+
+/* Isochronous packet of a record. The data of all packets is stored back to back, in the
+   order of the packets (which is also the layout libusb expects for OUT transfers). */
+struct cyusb_capture_packet {
+	unsigned int	   length;		/* Number of bytes of data in the packet. */
+	int		   status;		/* libusb_transfer_status of the packet. */
+};
+
+/* Entry of the time index: the first record at or after a point in time. */
+struct cyusb_capture_index {
+	unsigned long long timestamp;		/* Time stamp of the record. */
+	unsigned long long offset;		/* Offset of the record in the file. */
+};
+
+/* Counters of a capture file being written. See cyusb_capture_get_stats(). */
+struct cyusb_capture_stats {
+	unsigned long long records;		/* Number of records written. */
+	unsigned long long bytes;		/* Number of bytes of records written. */
+	unsigned long long dropped;		/* Number of records lost as the writer fell behind. */
+	unsigned long long written;		/* Number of bytes that have reached the file. */
+	int		   error;		/* First write error (negative errno), or 0. */
+	unsigned char	   direct;		/* Whether the file is written with O_DIRECT. */
+};
+
 /* Function prototypes */
 
 /*******************************************************************************************
@@ -60,6 +494,8 @@ extern void cyusb_error(int err);
   Description  : This initializes the underlying libusb library, populates the cydev[]
                  array, and returns the number of devices of interest detected. A
                  'device of interest' is a device which appears in the /etc/cyusb.conf file.
+                 The file is only parsed by the first call in a process. The devices are
+                 not opened until cyusb_gethandle() is called for them.
   Parameters   : None
   Return Value : Returns an integer, equal to number of devices of interest detected.
  *******************************************************************************************/
@@ -81,10 +517,12 @@ extern int cyusb_open(unsigned short vid, unsigned short pid);
 /*******************************************************************************************
   Prototype    : libusb_device_handle * cyusb_gethandle(int index);
   Description  : This function returns a libusb_device_handle given an index from the cydev[] array.
+                 The device is opened by the first call for its index.
   Parameters   :
                  int index : Equal to the index in the cydev[] array that gets populated
                              during the cyusb_open() call described above.
-  Return Value : Returns the pointer to a struct of type libusb_device_handle.
+  Return Value : Returns the pointer to a struct of type libusb_device_handle, or NULL if
+                 there is no device at the index or it could not be opened.
  *******************************************************************************************/
 extern libusb_device_handle * cyusb_gethandle(int index);
 
@@ -106,27 +544,1262 @@ extern unsigned short cyusb_getvendor(libusb_device_handle *);
  *******************************************************************************************/
 extern void cyusb_close(void);
 
+/*******************************************************************************************
+  Prototype    : int cyusb_getcount(void);
+  Description  : Returns the number of slots used in the cydev[] table. Once hotplug events
+                 are handled, a slot whose device has left stays empty (cyusb_gethandle()
+                 returns NULL for it) until another device arrives, so that the index of
+                 every other device stays the same.
+  Parameters   : none.
+  Return Value : Number of slots used in the cydev[] table.
+ *******************************************************************************************/
+extern int cyusb_getcount(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_hotplug_start(cyusb_hotplug_cb cb, void *arg);
+  Description  : Starts handling libusb hotplug events after cyusb_open(). Devices of interest
+                 that arrive are added to the cydev[] table, and are opened on first use by
+                 cyusb_gethandle(); devices that leave are closed (if they were opened) and
+                 removed, and devices that did not change are not touched. The
+                 library event thread is started to handle the events, and cb is called from
+                 it for every change. cb must not call cyusb_close() or cyusb_refresh().
+  Parameters   :
+                 cyusb_hotplug_cb cb : Notification callback, may be NULL
+                 void *arg           : Argument passed to cb
+  Return Value : 0 on success, LIBUSB_ERROR_NOT_SUPPORTED if libusb has no hotplug support
+                 on this system, or another LIBUSB_ERROR.
+ *******************************************************************************************/
+extern int cyusb_hotplug_start(cyusb_hotplug_cb cb, void *arg);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_hotplug_stop(void);
+  Description  : Stops handling hotplug events. This is also done by cyusb_close().
+  Parameters   : none.
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_hotplug_stop(void);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_refresh(cyusb_hotplug_cb cb, void *arg);
+  Description  : Brings the cydev[] table up to date with the devices currently attached,
+                 for use when hotplug events are not available. As with hotplug events, only
+                 the devices that arrived or left are added or removed, and cb is called for
+                 each of them. New devices are opened on first use by cyusb_gethandle().
+  Parameters   :
+                 cyusb_hotplug_cb cb : Notification callback, may be NULL
+                 void *arg           : Argument passed to cb
+  Return Value : Number of devices of interest in the table, or -ENODEV.
+ *******************************************************************************************/
+extern int cyusb_refresh(cyusb_hotplug_cb cb, void *arg);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_getdev(int index, struct cydev *dev);
+  Description  : Gets a copy of an entry in the cydev[] table.
+  Parameters   :
+                 int index         : Index in the cydev[] table
+                 struct cydev *dev : Returns the table entry
+  Return Value : 0 on success, or -ENODEV if there is no device at the index.
+ *******************************************************************************************/
+extern int cyusb_getdev(int index, struct cydev *dev);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_open_ctx(cyusb_context **ctx);
+  Description  : Creates a library context with its own libusb context, and stores the devices
+                 of interest in its device table, like cyusb_open(). Contexts are independent
+                 of each other and of the default context used by the functions without a
+                 context, so each can be used (with its own event thread) from a different
+                 thread. Every function that uses the cydev[] table has a _ctx variant that
+                 works on a context instead.
+  Parameters   :
+                 cyusb_context **ctx : Returns the context. Must be closed with
+                                       cyusb_close_ctx(), even if no device was found.
+  Return Value : Number of devices of interest detected, or a negative error code.
+ *******************************************************************************************/
+extern int cyusb_open_ctx(cyusb_context **ctx);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_open_ctx(cyusb_context **ctx, unsigned short vid, unsigned short pid);
+  Description  : Creates a library context holding just the device with the given vendor ID
+                 and product ID, like cyusb_open(vid, pid).
+  Parameters   :
+                 cyusb_context **ctx : Returns the context
+                 unsigned short vid  : Vendor ID
+                 unsigned short pid  : Product ID
+  Return Value : 1 if the device was found, or a negative error code.
+ *******************************************************************************************/
+extern int cyusb_open_ctx(cyusb_context **ctx, unsigned short vid, unsigned short pid);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_close_ctx(cyusb_context *ctx);
+  Description  : Closes all device handles of a context, stops its hotplug handling and frees
+                 it. Any event thread started for the context must be stopped first.
+  Parameters   :
+                 cyusb_context *ctx : Context
+  Return Value : none.
+ *******************************************************************************************/
+extern void cyusb_close_ctx(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : libusb_device_handle * cyusb_gethandle_ctx(cyusb_context *ctx, int index);
+  Description  : Context variant of cyusb_gethandle().
+ *******************************************************************************************/
+extern libusb_device_handle * cyusb_gethandle_ctx(cyusb_context *ctx, int index);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_getcount_ctx(cyusb_context *ctx);
+  Description  : Context variant of cyusb_getcount().
+ *******************************************************************************************/
+extern int cyusb_getcount_ctx(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_getdev_ctx(cyusb_context *ctx, int index, struct cydev *dev);
+  Description  : Context variant of cyusb_getdev().
+ *******************************************************************************************/
+extern int cyusb_getdev_ctx(cyusb_context *ctx, int index, struct cydev *dev);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_hotplug_start_ctx(cyusb_context *ctx, cyusb_hotplug_cb cb, void *arg);
+  Description  : Context variant of cyusb_hotplug_start(). The event thread of the context's
+                 libusb context is used.
+ *******************************************************************************************/
+extern int cyusb_hotplug_start_ctx(cyusb_context *ctx, cyusb_hotplug_cb cb, void *arg);
+
+/*******************************************************************************************
+  Prototype    : void cyusb_hotplug_stop_ctx(cyusb_context *ctx);
+  Description  : Context variant of cyusb_hotplug_stop().
+ *******************************************************************************************/
+extern void cyusb_hotplug_stop_ctx(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : int cyusb_refresh_ctx(cyusb_context *ctx, cyusb_hotplug_cb cb, void *arg);
+  Description  : Context variant of cyusb_refresh().
+ *******************************************************************************************/
+extern int cyusb_refresh_ctx(cyusb_context *ctx, cyusb_hotplug_cb cb, void *arg);
+
+/*******************************************************************************************
+  Prototype    : libusb_context * cyusb_get_libusb_context(cyusb_context *ctx);
+  Description  : Returns the libusb context used by a library context, for use with
+                 cyusb_event_thread_start() and the libusb event handling functions.
+  Parameters   :
+                 cyusb_context *ctx : Context
+  Return Value : libusb context.
+ *******************************************************************************************/
+extern libusb_context * cyusb_get_libusb_context(cyusb_context *ctx);
+
+/*******************************************************************************************
+  Prototype    : libusb_context * cyusb_handle_context(libusb_device_handle *h);
+  Description  : Returns the libusb context a device handle was opened with. The functions
+                 that take a device handle (downloads, streams) use this to handle their
+                 events on the right context, so they need no _ctx variants.
+  Parameters   :
+                 libusb_device_handle *h : Device handle
+  Return Value : libusb context, NULL for the default context.
+ *******************************************************************************************/
+extern libusb_context * cyusb_handle_context(libusb_device_handle *h);
+
+/****************************************************************************************
+  Prototype    : int cyusb_desc_get(libusb_device *dev, const struct cyusb_desc **desc);
+  Description  : Gets a snapshot of the descriptors of a device's active configuration, with
+                 all the endpoints of all interfaces and alternate settings in one array.
+                 The snapshot is taken once and cached until the device leaves the device
+                 table. It must be released with cyusb_desc_release().
+  Parameters   :
+                 libusb_device *dev             : USB device
+                 const struct cyusb_desc **desc : Returns the snapshot
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_desc_get(libusb_device *dev, const struct cyusb_desc **desc);
+
+/****************************************************************************************
+  Prototype    : void cyusb_desc_release(const struct cyusb_desc *desc);
+  Description  : Drops a reference to a snapshot obtained from cyusb_desc_get().
+  Parameters   :
+                 const struct cyusb_desc *desc : Descriptor snapshot
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_desc_release(const struct cyusb_desc *desc);
+
+/****************************************************************************************
+  Prototype    : const struct cyusb_ep_desc * cyusb_desc_endpoint(const struct cyusb_desc *desc,
+                     unsigned char address);
+  Description  : Looks up an endpoint of a snapshot by its address, in constant time. For an
+                 endpoint found in several alternate settings, the first one is returned.
+  Parameters   :
+                 const struct cyusb_desc *desc : Descriptor snapshot
+                 unsigned char address         : Endpoint address, including the direction bit
+  Return Value : The endpoint, or NULL if the configuration has no such endpoint.
+ ****************************************************************************************/
+extern const struct cyusb_ep_desc * cyusb_desc_endpoint(const struct cyusb_desc *desc,
+		unsigned char address);
+
+/****************************************************************************************
+  Prototype    : void cyusb_desc_forget(libusb_device *dev);
+  Description  : Drops the cached snapshot of a device, so that the next cyusb_desc_get()
+                 takes it again. Needed after the configuration of a device is changed.
+                 Snapshots still in use stay valid until they are released.
+  Parameters   :
+                 libusb_device *dev : USB device, or NULL for all devices
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_desc_forget(libusb_device *dev);
+
 /****************************************************************************************
-  Prototype    : void cyusb_download_fx2(libusb_device_handle *h, char *filename,
+  Prototype    : int cyusb_control_batch(libusb_device_handle *h,
+                     struct cyusb_control_req *reqs, unsigned int count, unsigned int depth,
+                     unsigned int flags);
+  Description  : Performs a list of control requests, keeping up to depth of them queued
+                 at once so that each one does not cost a full round trip. The device
+                 handles requests on the control endpoint in the order they are queued. A
+                 request flagged CYUSB_CONTROL_BARRIER is only queued once all requests
+                 before it have completed, and nothing after it is queued until it has
+                 completed (e.g. a CPU reset ahead of a download). Once a request fails,
+                 the requests after it are not queued (unless CYUSB_CONTROL_CONTINUE is
+                 set), and their status is set to LIBUSB_ERROR_INTERRUPTED; requests that
+                 were already queued still complete. The status of every request is set
+                 to the number of bytes transferred or to an error. The caller must not be
+                 holding the libusb event lock.
+  Parameters   :
+                 libusb_device_handle *h        : Device handle
+                 struct cyusb_control_req *reqs : Requests, in the order they are to be done
+                 unsigned int count             : Number of requests
+                 unsigned int depth             : Requests kept queued, 0 for CYUSB_CONTROL_DEPTH
+                 unsigned int flags             : CYUSB_CONTROL_CONTINUE or 0
+  Return Value : 0 if all requests succeeded, or the error of the first request that
+                 failed (LIBUSB_ERROR_IO for a short transfer).
+ ****************************************************************************************/
+extern int cyusb_control_batch(libusb_device_handle *h, struct cyusb_control_req *reqs, unsigned int count,
+		unsigned int depth, unsigned int flags);
+
+/****************************************************************************************
+  Prototype    : void cyusb_download_fx2(libusb_device_handle *h, const char *filename,
                      unsigned char vendor_command);
-  Description  : Performs firmware download on FX2.
+  Description  : Performs firmware download on FX2. The file is parsed (or taken from the
+                 image cache) with cyusb_fx2_image_load().
   Parameters   :
                  libusb_device_handle *h              : Device handle
-                 char * filename              : Path where the firmware file is stored
+                 const char * filename        : Path where the firmware file is stored
                  unsigned char vendor_command : Vendor command that needs to be passed during download
   Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
  ****************************************************************************************/
-extern int cyusb_download_fx2(libusb_device_handle *h, char *filename, unsigned char vendor_command);
+extern int cyusb_download_fx2(libusb_device_handle *h, const char *filename, unsigned char vendor_command);
+
+
+/****************************************************************************************
+  Prototype    : int cyusb_fx2_image_load(const char *filename, struct cyusb_fx2_image **image);
+  Description  : Parses a FX2 firmware file (Intel hex, C2 load or binary) into contiguous
+                 segments. Parsed images are cached, and a file whose path, modification
+                 time or contents match a cached image is not parsed again. The image must
+                 be released with cyusb_fx2_image_release().
+  Parameters   :
+                 const char *filename            : Path of the firmware file
+                 struct cyusb_fx2_image **image  : Returns the parsed image
+  Return Value : 0 on success, -ENOENT if the file is missing, or -EINVAL if it is invalid.
+ ****************************************************************************************/
+extern int cyusb_fx2_image_load(const char *filename, struct cyusb_fx2_image **image);
+
+/****************************************************************************************
+  Prototype    : void cyusb_fx2_image_release(struct cyusb_fx2_image *image);
+  Description  : Drops a reference to an image obtained from cyusb_fx2_image_load().
+  Parameters   :
+                 struct cyusb_fx2_image *image : Parsed image
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_fx2_image_release(struct cyusb_fx2_image *image);
 
+/****************************************************************************************
+  Prototype    : int cyusb_fx2_image_write(libusb_device_handle *h,
+                     const struct cyusb_fx2_image *image, unsigned char vendor_command,
+                     unsigned int start, unsigned int end);
+  Description  : Writes the parts of an image between the addresses start and end (not
+                 included) to the device, in requests of up to CYUSB_FX2_MAX_WRITE bytes,
+                 queued several at a time with cyusb_control_batch(). 0xA0 writes internal
+                 RAM with the CPU in reset; 0xA3 needs the Vend_Ax firmware running.
+  Parameters   :
+                 libusb_device_handle *h              : Device handle
+                 const struct cyusb_fx2_image *image  : Parsed image
+                 unsigned char vendor_command         : Vendor request to write with
+                 unsigned int start                   : First address to write
+                 unsigned int end                     : Address to stop writing at
+  Return Value : Number of bytes written, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_fx2_image_write(libusb_device_handle *h, const struct cyusb_fx2_image *image,
+		unsigned char vendor_command, unsigned int start, unsigned int end);
 
 /****************************************************************************************
-  Prototype    : void cyusb_download_fx3(libusb_device_handle *h, char *filename);
-  Description  : Performs firmware download on FX3.
+  Prototype    : void cyusb_download_fx3(libusb_device_handle *h, const char *filename);
+  Description  : Performs firmware download on FX3. The file is mapped into memory and
+                 downloaded with cyusb_download_fx3_image().
   Parameters   :
                  libusb_device_handle *h : Device handle
-                 char *filename  : Path where the firmware file is stored
+                 const char *filename    : Path where the firmware file is stored
   Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
  ***************************************************************************************/
-extern int cyusb_download_fx3(libusb_device_handle *h, char *filename);
+extern int cyusb_download_fx3(libusb_device_handle *h, const char *filename);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fx3_image_check(const unsigned char *image, size_t length,
+                     unsigned int *entry);
+  Description  : Checks the header, section list and checksum of a FX3 firmware image held
+                 in memory, as cyusb_download_fx3_image() does before writing to a device.
+  Parameters   :
+                 const unsigned char *image : Firmware image (.img file contents)
+                 size_t length              : Length of the image in bytes
+                 unsigned int *entry        : Returns the entry point, or NULL
+  Return Value : 0 for a good image, or -EINVAL.
+ ****************************************************************************************/
+extern int cyusb_fx3_image_check(const unsigned char *image, size_t length, unsigned int *entry);
+
+/****************************************************************************************
+  Prototype    : int cyusb_download_fx3_image(libusb_device_handle *h,
+                     const unsigned char *image, size_t length);
+  Description  : Downloads a FX3 firmware image held in memory to the FX3 RAM, and jumps
+                 to its entry point. The image checksum is verified before anything is
+                 written to the device. Several vendor requests are kept queued at once,
+                 so the caller must not be holding the libusb event lock.
+  Parameters   :
+                 libusb_device_handle *h    : Device handle
+                 const unsigned char *image : Firmware image (.img file contents)
+                 size_t length              : Length of the image in bytes
+  Return Value : 0 on success, -EINVAL for a bad image, or -EIO if a request failed.
+ ***************************************************************************************/
+extern int cyusb_download_fx3_image(libusb_device_handle *h, const unsigned char *image, size_t length);
+
+/****************************************************************************************
+  Prototype    : void cyusb_hist_reset(struct cyusb_hist *hist);
+  Description  : Clears a histogram. Must be called before a histogram is first used.
+  Parameters   :
+                 struct cyusb_hist *hist : Histogram
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_hist_reset(struct cyusb_hist *hist);
+
+/****************************************************************************************
+  Prototype    : void cyusb_hist_record(struct cyusb_hist *hist, unsigned long long value);
+  Description  : Records a value in a histogram.
+  Parameters   :
+                 struct cyusb_hist *hist  : Histogram
+                 unsigned long long value : Value to record
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_hist_record(struct cyusb_hist *hist, unsigned long long value);
+
+/****************************************************************************************
+  Prototype    : void cyusb_hist_diff(struct cyusb_hist *result, const struct cyusb_hist *now,
+                     const struct cyusb_hist *before);
+  Description  : Computes the values recorded since an earlier copy of a histogram was
+                 taken. Used to report statistics for an interval of a longer run.
+  Parameters   :
+                 struct cyusb_hist *result       : Returns the difference
+                 const struct cyusb_hist *now    : Current copy of the histogram
+                 const struct cyusb_hist *before : Earlier copy of the same histogram
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_hist_diff(struct cyusb_hist *result, const struct cyusb_hist *now,
+		const struct cyusb_hist *before);
+
+/****************************************************************************************
+  Prototype    : void cyusb_hist_add(struct cyusb_hist *total, const struct cyusb_hist *hist);
+  Description  : Adds the values recorded in one histogram to another. Used to combine the
+                 histograms of several streams.
+  Parameters   :
+                 struct cyusb_hist *total      : Histogram to add to
+                 const struct cyusb_hist *hist : Histogram to add
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_hist_add(struct cyusb_hist *total, const struct cyusb_hist *hist);
+
+/****************************************************************************************
+  Prototype    : unsigned long long cyusb_hist_percentile(const struct cyusb_hist *hist,
+                     double percentile);
+  Description  : Gets the value at a percentile (for example 50.0, 99.0 or 99.9) of the
+                 values recorded in a histogram.
+  Parameters   :
+                 const struct cyusb_hist *hist : Histogram
+                 double percentile             : Percentile, from 0 to 100
+  Return Value : The value at the percentile, or 0 if the histogram is empty.
+ ****************************************************************************************/
+extern unsigned long long cyusb_hist_percentile(const struct cyusb_hist *hist, double percentile);
+
+/****************************************************************************************
+  Prototype    : unsigned long long cyusb_hist_count_below(const struct cyusb_hist *hist,
+                     unsigned long long value);
+  Description  : Gets the number of values recorded in a histogram that are below a value.
+                 Values in the same bucket as the given value are not counted; the result
+                 has the resolution of the histogram.
+  Parameters   :
+                 const struct cyusb_hist *hist : Histogram
+                 unsigned long long value      : Value to count up to
+  Return Value : The number of values below the given value.
+ ****************************************************************************************/
+extern unsigned long long cyusb_hist_count_below(const struct cyusb_hist *hist, unsigned long long value);
+
+/****************************************************************************************
+  Prototype    : int cyusb_pattern_parse(const char *spec, int *type, unsigned int *seed);
+  Description  : Parses a pattern specification of the form name[:seed], where name is one
+                 of const, inc8, inc16, inc32 or lfsr. The seed defaults to 0 (1 for lfsr).
+  Parameters   :
+                 const char *spec   : Pattern specification
+                 int *type          : Returns the pattern type
+                 unsigned int *seed : Returns the seed value
+  Return Value : 0 on success, or LIBUSB_ERROR_INVALID_PARAM.
+ ****************************************************************************************/
+extern int cyusb_pattern_parse(const char *spec, int *type, unsigned int *seed);
+
+/****************************************************************************************
+  Prototype    : const char * cyusb_pattern_name(int type);
+  Description  : Gets the name of a pattern type.
+  Parameters   :
+                 int type : Pattern type
+  Return Value : Name of the pattern.
+ ****************************************************************************************/
+extern const char * cyusb_pattern_name(int type);
+
+/****************************************************************************************
+  Prototype    : void cyusb_pattern_init(struct cyusb_pattern *pat, int type, unsigned int seed);
+  Description  : Sets up a pattern generator or checker. The sequence starts at the seed
+                 value; for a constant pattern, the seed is the byte value.
+  Parameters   :
+                 struct cyusb_pattern *pat : Pattern state
+                 int type                  : Pattern type
+                 unsigned int seed         : First element of the pattern
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_pattern_init(struct cyusb_pattern *pat, int type, unsigned int seed);
+
+/****************************************************************************************
+  Prototype    : void cyusb_pattern_resync(struct cyusb_pattern *pat);
+  Description  : Makes the checker take the next element as the new start of the sequence.
+                 Used when the starting point of the data is not known, or after data has
+                 been lost.
+  Parameters   :
+                 struct cyusb_pattern *pat : Pattern state
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_pattern_resync(struct cyusb_pattern *pat);
+
+/****************************************************************************************
+  Prototype    : void cyusb_pattern_fill(struct cyusb_pattern *pat, unsigned char *buf,
+                     unsigned int length);
+  Description  : Fills a buffer with the next part of the pattern.
+  Parameters   :
+                 struct cyusb_pattern *pat : Pattern state
+                 unsigned char *buf        : Buffer to fill
+                 unsigned int length       : Length of the buffer in bytes
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_pattern_fill(struct cyusb_pattern *pat, unsigned char *buf, unsigned int length);
+
+/****************************************************************************************
+  Prototype    : unsigned long long cyusb_pattern_verify(struct cyusb_pattern *pat,
+                     const unsigned char *buf, unsigned int length);
+  Description  : Checks a buffer against the pattern, continuing from the end of the last
+                 buffer checked. A single corrupt element counts as one error. If data has
+                 been lost or inserted, the sequence restarts from the first bad element.
+                 Bytes after the last complete element in the buffer are not checked.
+  Parameters   :
+                 struct cyusb_pattern *pat : Pattern state
+                 const unsigned char *buf  : Buffer to check
+                 unsigned int length       : Length of the data in bytes
+  Return Value : Number of elements in the buffer that did not match.
+ ****************************************************************************************/
+extern unsigned long long cyusb_pattern_verify(struct cyusb_pattern *pat, const unsigned char *buf,
+		unsigned int length);
+
+/****************************************************************************************
+  Prototype    : int cyusb_payload_create(const char *spec, cyusb_payload **pl);
+  Description  : Sets up a payload source. The specification is either a pattern, in the
+                 form taken by cyusb_pattern_parse(), or "file:<path>". A file is mapped
+                 into memory, and sent from the start again once it has all been sent.
+  Parameters   :
+                 const char *spec  : Payload specification
+                 cyusb_payload **pl : Returns the payload handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_payload_create(const char *spec, cyusb_payload **pl);
+
+/****************************************************************************************
+  Prototype    : void cyusb_payload_fill(cyusb_payload *pl, unsigned char *buf,
+                     unsigned int length);
+  Description  : Fills a buffer with the next part of the payload.
+  Parameters   :
+                 cyusb_payload *pl   : Payload handle
+                 unsigned char *buf  : Buffer to fill
+                 unsigned int length : Length of the buffer in bytes
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_payload_fill(cyusb_payload *pl, unsigned char *buf, unsigned int length);
+
+/****************************************************************************************
+  Prototype    : const char * cyusb_payload_name(cyusb_payload *pl);
+  Description  : Gets a printable description of a payload: the pattern name, or "file".
+  Parameters   :
+                 cyusb_payload *pl : Payload handle
+  Return Value : Description of the payload.
+ ****************************************************************************************/
+extern const char * cyusb_payload_name(cyusb_payload *pl);
+
+/****************************************************************************************
+  Prototype    : void cyusb_payload_destroy(cyusb_payload *pl);
+  Description  : Releases a payload source. Streams using it must have been closed first.
+  Parameters   :
+                 cyusb_payload *pl : Payload handle
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_payload_destroy(cyusb_payload *pl);
+
+/****************************************************************************************
+  Prototype    : int cyusb_bufpool_create(libusb_device_handle *h, unsigned int bufsize,
+                     unsigned int count, unsigned int flags, cyusb_bufpool **pool);
+  Description  : Allocates a pool of page aligned transfer buffers. If the kernel supports
+                 it, the memory is mapped through usbfs with libusb_dev_mem_alloc(), so that
+                 transfers to and from the buffers need no copy. Otherwise anonymous memory
+                 is used, backed by huge pages if CYUSB_BUFPOOL_HUGEPAGE is set. Zero-copy
+                 buffers are only valid while the device handle is open.
+  Parameters   :
+                 libusb_device_handle *h : Device handle, or NULL for ordinary memory
+                 unsigned int bufsize    : Size of each buffer in bytes
+                 unsigned int count      : Number of buffers
+                 unsigned int flags      : CYUSB_BUFPOOL_ flags
+                 cyusb_bufpool **pool    : Returns the pool handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_bufpool_create(libusb_device_handle *h, unsigned int bufsize, unsigned int count,
+		unsigned int flags, cyusb_bufpool **pool);
+
+/****************************************************************************************
+  Prototype    : unsigned char * cyusb_bufpool_get(cyusb_bufpool *pool, unsigned int index);
+  Description  : Gets the address of one of the buffers in a pool.
+  Parameters   :
+                 cyusb_bufpool *pool : Pool handle
+                 unsigned int index  : Index of the buffer, from 0 to count - 1
+  Return Value : Pointer to the buffer, or NULL if the index is out of range.
+ ****************************************************************************************/
+extern unsigned char * cyusb_bufpool_get(cyusb_bufpool *pool, unsigned int index);
+
+/****************************************************************************************
+  Prototype    : int cyusb_bufpool_is_zerocopy(cyusb_bufpool *pool);
+  Description  : Checks whether the buffers in a pool are zero-copy (usbfs mapped) memory.
+  Parameters   :
+                 cyusb_bufpool *pool : Pool handle
+  Return Value : 1 for zero-copy memory, 0 otherwise.
+ ****************************************************************************************/
+extern int cyusb_bufpool_is_zerocopy(cyusb_bufpool *pool);
+
+/****************************************************************************************
+  Prototype    : int cyusb_bufpool_lock(cyusb_bufpool *pool);
+  Description  : Locks the buffers of a pool into memory with mlock(), so that no transfer
+                 ever waits for one of them to be paged in. The lock is dropped when the
+                 pool is destroyed. Zero-copy buffers are always resident.
+  Parameters   :
+                 cyusb_bufpool *pool : Pool handle
+  Return Value : 0 on success, LIBUSB_ERROR_ACCESS if the process may not lock memory, or
+                 LIBUSB_ERROR_NO_MEM if the pool is larger than the RLIMIT_MEMLOCK limit.
+ ****************************************************************************************/
+extern int cyusb_bufpool_lock(cyusb_bufpool *pool);
+
+/****************************************************************************************
+  Prototype    : int cyusb_bufpool_is_locked(cyusb_bufpool *pool);
+  Description  : Checks whether the buffers in a pool have been locked into memory.
+  Parameters   :
+                 cyusb_bufpool *pool : Pool handle
+  Return Value : 1 for locked memory, 0 otherwise.
+ ****************************************************************************************/
+extern int cyusb_bufpool_is_locked(cyusb_bufpool *pool);
+
+/****************************************************************************************
+  Prototype    : void cyusb_bufpool_destroy(cyusb_bufpool *pool);
+  Description  : Frees a buffer pool. Must be called before the device handle is closed.
+  Parameters   :
+                 cyusb_bufpool *pool : Pool handle
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_bufpool_destroy(cyusb_bufpool *pool);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_open(libusb_device_handle *h, unsigned char endpoint,
+                     unsigned int pktsize, unsigned int reqsize, unsigned int queuedepth,
+                     cyusb_stream **strm);
+  Description  : Allocates a stream on a bulk, interrupt or isochronous endpoint. All of the
+                 transfer structures and data buffers are allocated here, so that no memory
+                 is allocated while the stream is running. The buffers come from a buffer
+                 pool, and are zero-copy where the kernel supports it. The interface containing the
+                 endpoint should already be claimed, with the right alternate setting.
+  Parameters   :
+                 libusb_device_handle *h : Device handle
+                 unsigned char endpoint  : Endpoint address, including the direction bit
+                 unsigned int pktsize    : Packet (or burst) size. Pass 0 to compute it from
+                                           the endpoint descriptors.
+                 unsigned int reqsize    : Size of each transfer in packets
+                 unsigned int queuedepth : Number of transfers to keep queued
+                 cyusb_stream **strm     : Returns the stream handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_open(libusb_device_handle *h, unsigned char endpoint, unsigned int pktsize,
+		unsigned int reqsize, unsigned int queuedepth, cyusb_stream **strm);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_set_callback(cyusb_stream *strm, cyusb_stream_cb callback,
+                     void *arg);
+  Description  : Registers the data callback for a stream. The callback runs in the context
+                 of the thread handling libusb events, and returns CYUSB_STREAM_RESUBMIT or
+                 CYUSB_STREAM_HOLD.
+  Parameters   :
+                 cyusb_stream *strm       : Stream handle
+                 cyusb_stream_cb callback : Function to call on each transfer completion
+                 void *arg                : Argument passed to the callback
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_set_callback(cyusb_stream *strm, cyusb_stream_cb callback, void *arg);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_set_fill(cyusb_stream *strm, cyusb_stream_fill_cb fill,
+                     void *arg);
+  Description  : Registers the fill callback for a stream. The callback runs in the thread
+                 that starts the stream for the first round of transfers, and in the thread
+                 handling libusb events after that.
+  Parameters   :
+                 cyusb_stream *strm        : Stream handle
+                 cyusb_stream_fill_cb fill : Function to call before each transfer is queued
+                 void *arg                 : Argument passed to the callback
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_set_fill(cyusb_stream *strm, cyusb_stream_fill_cb fill, void *arg);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_set_capture(cyusb_stream *strm, cyusb_capture *cap);
+  Description  : Makes the stream write every completed transfer (failed ones included) to
+                 a capture file, before the data callback is called. Records are only
+                 copied into the capture buffers on the event thread; a record that does
+                 not fit because the file can not keep up is dropped and counted, so the
+                 stream is never held back. Must be called before the stream is started.
+                 Pass NULL to stop capturing.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+                 cyusb_capture *cap : Capture file, or NULL
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_set_capture(cyusb_stream *strm, cyusb_capture *cap);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_set_verify(cyusb_stream *strm, int type, unsigned int seed);
+  Description  : Makes the stream check all data received on an IN endpoint against a
+                 pattern, before the data callback is called. The first element received is
+                 taken as the start of the sequence (except for constant patterns), and the
+                 sequence is picked up again after any failed transfer or packet. The
+                 results are returned by cyusb_stream_get_stats(). Must be called before the
+                 stream is started. Pass a type of -1 to turn verification off.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+                 int type           : Pattern type, or -1
+                 unsigned int seed  : Pattern seed
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_set_verify(cyusb_stream *strm, int type, unsigned int seed);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_set_payload(cyusb_stream *strm, cyusb_payload *pl,
+                     int mode);
+  Description  : Makes an OUT stream send data from a payload source. With
+                 CYUSB_PAYLOAD_ONCE, every transfer buffer is filled here, and the same data
+                 is sent each time the buffer is queued again, so generating the data costs
+                 nothing while the stream runs. With CYUSB_PAYLOAD_EACH, each transfer is
+                 filled with the next part of the payload before it is queued, so the data
+                 sent is one continuous sequence. Either way, the fill callback (if any) is
+                 called after the payload is in place. Must be called before the stream is
+                 started. Pass NULL to stop using a payload.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+                 cyusb_payload *pl  : Payload source, or NULL
+                 int mode           : CYUSB_PAYLOAD_ONCE or CYUSB_PAYLOAD_EACH
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_set_payload(cyusb_stream *strm, cyusb_payload *pl, int mode);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_set_adaptive(cyusb_stream *strm,
+                     const struct cyusb_stream_adapt *adapt);
+  Description  : Makes the stream tune the number of transfers it keeps in flight, and
+                 the size of each request, while it runs. The stream is measured over
+                 windows of adapt->interval; after each window, it queues more (a deeper
+                 queue first, then larger requests) if the endpoint ran dry or missed
+                 isochronous packets, uses smaller requests if transfers came back short
+                 or failed, and queues less if the average latency is above the latency
+                 target. With a throughput target, it also queues more while below the
+                 target, and less after staying well above it for a while. The limits can
+                 not be above the request size and queue depth the stream was opened with,
+                 as all buffers are allocated up front. The current values and the changes
+                 made are returned by cyusb_stream_get_stats(). Must be called before the
+                 stream is started. Pass NULL to turn the tuning off.
+  Parameters   :
+                 cyusb_stream *strm                     : Stream handle
+                 const struct cyusb_stream_adapt *adapt : Limits and targets, or NULL
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_set_adaptive(cyusb_stream *strm, const struct cyusb_stream_adapt *adapt);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_lock_buffers(cyusb_stream *strm);
+  Description  : Locks the data buffers of a stream into memory (see cyusb_bufpool_lock()),
+                 so that page faults on them cannot delay the event thread.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_lock_buffers(cyusb_stream *strm);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_start(cyusb_stream *strm);
+  Description  : Clears the stream statistics and queues all transfers. The application
+                 should keep handling libusb events while the stream is running, unless an
+                 event thread has been started with cyusb_event_thread_start().
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_start(cyusb_stream *strm);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_start_held(cyusb_stream *strm);
+  Description  : Starts a stream without queueing any transfers. All transfers are placed
+                 on the completion queue instead (with a length of 0), so that an
+                 application thread can fill OUT transfers with data, set their length and
+                 queue them with cyusb_stream_submit() as the data becomes available. The
+                 completion queue must have been enabled.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_start_held(cyusb_stream *strm);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_submit(cyusb_stream *strm, struct libusb_transfer *transfer);
+  Description  : Queues a transfer which the data callback held back with CYUSB_STREAM_HOLD,
+                 or which was returned by cyusb_stream_next().
+  Parameters   :
+                 cyusb_stream *strm               : Stream handle
+                 struct libusb_transfer *transfer : Transfer owned by the application
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_submit(cyusb_stream *strm, struct libusb_transfer *transfer);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_enable_queue(cyusb_stream *strm);
+  Description  : Makes the stream pass completed transfers to the application through a
+                 lock-free completion queue, instead of calling the data callback. This
+                 lets the data be processed on an application thread while the completions
+                 are handled by an event thread. Must be called before the stream is started.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_enable_queue(cyusb_stream *strm);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_next(cyusb_stream *strm, struct libusb_transfer **transfer,
+                     unsigned int *length, unsigned int timeout);
+  Description  : Waits for the next transfer on the completion queue. The transfer is owned
+                 by the application until it is queued again with cyusb_stream_submit().
+                 Only one thread may take transfers from the queue of a stream.
+  Parameters   :
+                 cyusb_stream *strm                : Stream handle
+                 struct libusb_transfer **transfer : Returns the completed transfer
+                 unsigned int *length              : Returns the number of bytes transferred
+                 unsigned int timeout              : Timeout in milliseconds, 0 to wait forever
+  Return Value : 0 on success, LIBUSB_ERROR_TIMEOUT if nothing completed in time, or
+                 LIBUSB_ERROR_INTERRUPTED if the stream is being stopped.
+ ****************************************************************************************/
+extern int cyusb_stream_next(cyusb_stream *strm, struct libusb_transfer **transfer,
+		unsigned int *length, unsigned int timeout);
+
+/****************************************************************************************
+  Prototype    : int cyusb_stream_stop(cyusb_stream *strm);
+  Description  : Stops re-queueing transfers, cancels the transfers that are still queued
+                 and handles events until all of them have been returned.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_stream_stop(cyusb_stream *strm);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_get_stats(cyusb_stream *strm, struct cyusb_stream_stats *stats);
+  Description  : Gets the statistics collected since the stream was last started.
+  Parameters   :
+                 cyusb_stream *strm               : Stream handle
+                 struct cyusb_stream_stats *stats : Returns the statistics
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_get_stats(cyusb_stream *strm, struct cyusb_stream_stats *stats);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_get_latency(cyusb_stream *strm, struct cyusb_hist *latency,
+                     struct cyusb_hist *interval);
+  Description  : Gets copies of the histograms collected since the stream was last started.
+                 Values are in nanoseconds, measured with CYUSB_CLOCK. The latency
+                 of a transfer is the time from its submission to its completion; the
+                 interval is the time between two consecutive transfer completions.
+  Parameters   :
+                 cyusb_stream *strm          : Stream handle
+                 struct cyusb_hist *latency  : Returns the latency histogram, may be NULL
+                 struct cyusb_hist *interval : Returns the interval histogram, may be NULL
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_get_latency(cyusb_stream *strm, struct cyusb_hist *latency,
+		struct cyusb_hist *interval);
+
+/****************************************************************************************
+  Prototype    : void cyusb_stream_close(cyusb_stream *strm);
+  Description  : Stops the stream if required, and frees all of its transfers and buffers.
+                 Must be called before the device handle is closed.
+  Parameters   :
+                 cyusb_stream *strm : Stream handle
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_stream_close(cyusb_stream *strm);
+
+/****************************************************************************************
+  Prototype    : int cyusb_event_thread_start(libusb_context *ctx);
+  Description  : Starts a thread which handles all libusb events for a context, so that
+                 transfer and stream callbacks are run without the application having to
+                 call libusb_handle_events(). Only one thread is run per context; further
+                 calls take a reference on the running thread. All event threads must be
+                 stopped before cyusb_close() is called.
+  Parameters   :
+                 libusb_context *ctx : libusb context, NULL for the default context
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_event_thread_start(libusb_context *ctx);
+
+/****************************************************************************************
+  Prototype    : void cyusb_event_thread_stop(libusb_context *ctx);
+  Description  : Drops a reference on the event thread of a context. The thread is stopped
+                 and joined when the last reference is dropped.
+  Parameters   :
+                 libusb_context *ctx : libusb context, NULL for the default context
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_event_thread_stop(libusb_context *ctx);
+
+/****************************************************************************************
+  Prototype    : int cyusb_event_thread_running(libusb_context *ctx);
+  Description  : Checks whether an event thread is running for a context.
+  Parameters   :
+                 libusb_context *ctx : libusb context, NULL for the default context
+  Return Value : 1 if the event thread is running, 0 otherwise.
+ ****************************************************************************************/
+extern int cyusb_event_thread_running(libusb_context *ctx);
+
+/****************************************************************************************
+  Prototype    : int cyusb_event_thread_set_sched(libusb_context *ctx, int cpu, int priority);
+  Description  : Pins the running event thread of a context to a CPU, and selects its
+                 scheduling policy. With a priority, the thread runs under SCHED_FIFO, so
+                 that transfer completions are not held up by other work on the system;
+                 this normally needs CAP_SYS_NICE or an RLIMIT_RTPRIO limit.
+  Parameters   :
+                 libusb_context *ctx : libusb context, NULL for the default context
+                 int cpu             : CPU to run the thread on, or -1 for any CPU
+                 int priority        : SCHED_FIFO priority, or 0 for normal scheduling
+  Return Value : 0 on success, LIBUSB_ERROR_NOT_FOUND if no event thread is running,
+                 LIBUSB_ERROR_INVALID_PARAM for a CPU or priority that is out of range, or
+                 LIBUSB_ERROR_ACCESS if the process may not use the priority.
+ ****************************************************************************************/
+extern int cyusb_event_thread_set_sched(libusb_context *ctx, int cpu, int priority);
+
+/****************************************************************************************
+  Prototype    : int cyusb_metrics_create(void);
+  Description  : Creates the metrics segment CYUSB_METRICS_NAME, and maps it into the
+                 calling process. An existing segment with the same layout is reused along
+                 with its counters. This is done by the cyusbd daemon; other processes only
+                 attach to an existing segment. The segment is made writable by its group
+                 (and readable by all), and given to the MetricsGroup of /etc/cyusb.conf if
+                 one is set, so that streams run by other users can update their counters.
+  Parameters   : none
+  Return Value : 0 on success, or a negative errno value.
+ ****************************************************************************************/
+extern int cyusb_metrics_create(void);
+
+/****************************************************************************************
+  Prototype    : void cyusb_metrics_release(void);
+  Description  : Unmaps the metrics segment from the calling process. The segment itself is
+                 kept, so that the counters survive a restart of the daemon, and processes
+                 that are streaming keep updating it.
+  Parameters   : none
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_metrics_release(void);
+
+/****************************************************************************************
+  Prototype    : const struct cyusb_metrics *cyusb_metrics_map(void);
+  Description  : Maps an existing metrics segment read-only, for a reader of the counters.
+                 Reading the counters needs no system calls, and has no effect on the
+                 processes that update them.
+  Parameters   : none
+  Return Value : The segment, or NULL if it does not exist or has an unknown layout.
+ ****************************************************************************************/
+extern const struct cyusb_metrics *cyusb_metrics_map(void);
+
+/****************************************************************************************
+  Prototype    : void cyusb_metrics_unmap(const struct cyusb_metrics *m);
+  Description  : Unmaps a segment mapped with cyusb_metrics_map().
+  Parameters   :
+                 const struct cyusb_metrics *m : Segment
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_metrics_unmap(const struct cyusb_metrics *m);
+
+/****************************************************************************************
+  Prototype    : int cyusb_metrics_arrived(libusb_device *dev);
+  Description  : Records the arrival of a device. The device gets the slot it had before if
+                 it was seen on the same port, and its enumeration count is increased.
+  Parameters   :
+                 libusb_device *dev : Device that arrived
+  Return Value : Slot of the device, or a negative errno value.
+ ****************************************************************************************/
+extern int cyusb_metrics_arrived(libusb_device *dev);
+
+/****************************************************************************************
+  Prototype    : void cyusb_metrics_left(libusb_device *dev);
+  Description  : Records that a device has left. Its counters are kept.
+  Parameters   :
+                 libusb_device *dev : Device that left
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_metrics_left(libusb_device *dev);
+
+/****************************************************************************************
+  Prototype    : struct cyusb_ep_metrics *cyusb_metrics_endpoint(libusb_device *dev,
+                     unsigned char endpoint);
+  Description  : Gets the counters of an endpoint, attaching to the metrics segment on first
+                 use. Streams look up their counters when they are opened; applications that
+                 do their own transfers can update the counters with cyusb_metrics_add().
+                 A segment that exists but cannot be attached to (for example, because the
+                 process is not in its group) is reported once.
+  Parameters   :
+                 libusb_device *dev     : Device
+                 unsigned char endpoint : Endpoint address
+  Return Value : The counters, or NULL if there is no metrics segment.
+ ****************************************************************************************/
+extern struct cyusb_ep_metrics *cyusb_metrics_endpoint(libusb_device *dev, unsigned char endpoint);
+
+/****************************************************************************************
+  Prototype    : void cyusb_metrics_add(struct cyusb_ep_metrics *m,
+                     enum libusb_transfer_status status, unsigned int length);
+  Description  : Accounts for a completed transfer.
+  Parameters   :
+                 struct cyusb_ep_metrics *m          : Counters, may be NULL
+                 enum libusb_transfer_status status  : Status of the transfer
+                 unsigned int length                 : Bytes transferred
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_metrics_add(struct cyusb_ep_metrics *m, enum libusb_transfer_status status,
+		unsigned int length);
+
+/****************************************************************************************
+  Prototype    : void cyusb_metrics_resubmit(struct cyusb_ep_metrics *m,
+                     unsigned long long ns);
+  Description  : Accounts for a transfer that was queued again ns nanoseconds after it had
+                 completed.
+  Parameters   :
+                 struct cyusb_ep_metrics *m : Counters, may be NULL
+                 unsigned long long ns      : Time from completion to resubmission
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_metrics_resubmit(struct cyusb_ep_metrics *m, unsigned long long ns);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_create(libusb_device_handle *h, unsigned char endpoint,
+                     const char *name, unsigned int reqsize, unsigned int queuedepth,
+                     size_t ringsize, int flags, cyusb_fanout **fanout);
+  Description  : Sets up a stream on an IN endpoint whose data is shared with any number of
+                 consumer processes. The interface holding the endpoint is claimed. Every
+                 transfer of the stream is pointed at the next slot of a ring held in a
+                 memfd, so that the data is only ever written to memory once; consumers
+                 map the ring and the state of the fan-out read-only and read the ring in
+                 place. The only memory a consumer can write is a page of its own holding
+                 its read position. Consumers connect to the
+                 socket CYUSB_FANOUT_SOCKET followed by name. The owner of the fan-out has
+                 to wait on the descriptors from cyusb_fanout_pollfds(), and call
+                 cyusb_fanout_handle() whenever it wakes up.
+  Parameters   :
+                 libusb_device_handle *h  : Device handle
+                 unsigned char endpoint   : IN endpoint address
+                 const char *name         : Name of the fan-out
+                 unsigned int reqsize     : Size of each transfer (and ring slot) in packets
+                 unsigned int queuedepth  : Number of transfers to keep queued
+                 size_t ringsize          : Size of the ring in bytes; it must hold at least
+                                            twice queuedepth transfers
+                 int flags                : CYUSB_FANOUT_ flags
+                 cyusb_fanout **fanout    : Returns the fan-out handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_fanout_create(libusb_device_handle *h, unsigned char endpoint, const char *name,
+		unsigned int reqsize, unsigned int queuedepth, size_t ringsize, int flags,
+		cyusb_fanout **fanout);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_start(cyusb_fanout *fan);
+  Description  : Starts the stream of a fan-out, along with an event thread for its context.
+  Parameters   :
+                 cyusb_fanout *fan : Fan-out handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_fanout_start(cyusb_fanout *fan);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_pollfds(cyusb_fanout *fan, struct pollfd *fds, int max);
+  Description  : Gets the descriptors the owner of a fan-out has to wait on for input. The
+                 set changes as consumers come and go, so this is called before each wait.
+  Parameters   :
+                 cyusb_fanout *fan  : Fan-out handle
+                 struct pollfd *fds : Returns the descriptors
+                 int max            : Number of entries in fds, at least CYUSB_FANOUT_POLLFDS
+  Return Value : Number of entries filled in, or LIBUSB_ERROR_INVALID_PARAM.
+ ****************************************************************************************/
+extern int cyusb_fanout_pollfds(cyusb_fanout *fan, struct pollfd *fds, int max);
+
+/****************************************************************************************
+  Prototype    : void cyusb_fanout_handle(cyusb_fanout *fan, const struct pollfd *fds,
+                     int nfds);
+  Description  : Accepts new consumers, drops consumers that have disconnected, and queues
+                 transfers that were held back for blocking consumers that have caught up.
+                 Should also be called every second or so when nothing happens.
+  Parameters   :
+                 cyusb_fanout *fan        : Fan-out handle
+                 const struct pollfd *fds : Descriptors from cyusb_fanout_pollfds(), with
+                                            revents set by poll()
+                 int nfds                 : Number of entries in fds
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_fanout_handle(cyusb_fanout *fan, const struct pollfd *fds, int nfds);
+
+/****************************************************************************************
+  Prototype    : void cyusb_fanout_drop(cyusb_fanout *fan, int index);
+  Description  : Disconnects a consumer of a fan-out.
+  Parameters   :
+                 cyusb_fanout *fan : Fan-out handle
+                 int index         : Consumer, from 0 to CYUSB_FANOUT_CONSUMERS - 1
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_fanout_drop(cyusb_fanout *fan, int index);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_get_consumer(cyusb_fanout *fan, int index,
+                     struct cyusb_fanout_info *info);
+  Description  : Gets the state of one of the consumers of a fan-out.
+  Parameters   :
+                 cyusb_fanout *fan              : Fan-out handle
+                 int index                      : Consumer, from 0 to CYUSB_FANOUT_CONSUMERS - 1
+                 struct cyusb_fanout_info *info : Returns the state of the consumer
+  Return Value : 0 on success, or LIBUSB_ERROR_NOT_FOUND if there is no such consumer.
+ ****************************************************************************************/
+extern int cyusb_fanout_get_consumer(cyusb_fanout *fan, int index, struct cyusb_fanout_info *info);
+
+/****************************************************************************************
+  Prototype    : void cyusb_fanout_close(cyusb_fanout *fan);
+  Description  : Stops the stream of a fan-out, disconnects all consumers and releases the
+                 interface. Consumers can still read the data left in the ring. Must be
+                 called before the device handle is closed.
+  Parameters   :
+                 cyusb_fanout *fan : Fan-out handle
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_fanout_close(cyusb_fanout *fan);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_attach(const char *name, int policy,
+                     cyusb_fanout_consumer **consumer);
+  Description  : Connects to a fan-out as a consumer. The consumer starts with the next
+                 block of data that is received. A CYUSB_FANOUT_BLOCK consumer never loses
+                 data, but holds the stream (and all other consumers) back while it is a
+                 whole ring behind; a CYUSB_FANOUT_DROP consumer skips ahead instead.
+  Parameters   :
+                 const char *name                 : Name of the fan-out
+                 int policy                       : CYUSB_FANOUT_DROP or CYUSB_FANOUT_BLOCK
+                 cyusb_fanout_consumer **consumer : Returns the consumer handle
+  Return Value : 0 on success, or an appropriate LIBUSB_ERROR.
+ ****************************************************************************************/
+extern int cyusb_fanout_attach(const char *name, int policy, cyusb_fanout_consumer **consumer);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_next(cyusb_fanout_consumer *cons, const unsigned char **data,
+                     unsigned int *length, unsigned int timeout);
+  Description  : Waits for the next block of data, which is returned in place in the ring.
+                 The block stays valid until it is handed back with cyusb_fanout_release();
+                 calling this again before that returns the same block.
+  Parameters   :
+                 cyusb_fanout_consumer *cons : Consumer handle
+                 const unsigned char **data  : Returns the data
+                 unsigned int *length        : Returns the number of bytes of data
+                 unsigned int timeout        : Timeout in milliseconds, 0 to wait forever
+  Return Value : 0 on success, LIBUSB_ERROR_TIMEOUT if no data arrived in time, or
+                 LIBUSB_ERROR_NO_DEVICE once the producer has gone away.
+ ****************************************************************************************/
+extern int cyusb_fanout_next(cyusb_fanout_consumer *cons, const unsigned char **data,
+		unsigned int *length, unsigned int timeout);
+
+/****************************************************************************************
+  Prototype    : int cyusb_fanout_release(cyusb_fanout_consumer *cons);
+  Description  : Hands the block returned by cyusb_fanout_next() back to the ring. For a
+                 CYUSB_FANOUT_DROP consumer, this also checks that the block was not
+                 overwritten while it was being read.
+  Parameters   :
+                 cyusb_fanout_consumer *cons : Consumer handle
+  Return Value : 0 on success, or LIBUSB_ERROR_OVERFLOW if the data read from the block
+                 may have been overwritten.
+ ****************************************************************************************/
+extern int cyusb_fanout_release(cyusb_fanout_consumer *cons);
+
+/****************************************************************************************
+  Prototype    : unsigned long long cyusb_fanout_dropped(cyusb_fanout_consumer *cons);
+  Description  : Gets the number of blocks a consumer has lost by falling behind.
+  Parameters   :
+                 cyusb_fanout_consumer *cons : Consumer handle
+  Return Value : Number of blocks lost.
+ ****************************************************************************************/
+extern unsigned long long cyusb_fanout_dropped(cyusb_fanout_consumer *cons);
+
+/****************************************************************************************
+  Prototype    : void cyusb_fanout_detach(cyusb_fanout_consumer *cons);
+  Description  : Disconnects a consumer from its fan-out.
+  Parameters   :
+                 cyusb_fanout_consumer *cons : Consumer handle
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_fanout_detach(cyusb_fanout_consumer *cons);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_create(const char *path, size_t bufsize, int flags,
+                     cyusb_capture **cap);
+  Description  : Creates a capture file. Records are collected in a buffer of bufsize bytes
+                 (rounded up to a whole number of write chunks), and written out in large
+                 aligned chunks by a thread of the capture, with O_DIRECT where the file
+                 system supports it.
+  Parameters   :
+                 const char *path    : File name
+                 size_t bufsize      : Size of the buffer, 0 for the default
+                 int flags           : CYUSB_CAPTURE_ flags
+                 cyusb_capture **cap : Returns the capture handle
+  Return Value : 0 on success, or a negative errno value.
+ ****************************************************************************************/
+extern int cyusb_capture_create(const char *path, size_t bufsize, int flags, cyusb_capture **cap);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_write(cyusb_capture *cap, unsigned char endpoint,
+                     unsigned char type, int status, unsigned long long timestamp,
+                     const unsigned char *data, unsigned int length,
+                     const struct cyusb_capture_packet *packets, unsigned int npackets);
+  Description  : Adds a record to a capture file. This only copies the record into the
+                 buffer. May be called from several threads at once.
+  Parameters   :
+                 cyusb_capture *cap                         : Capture handle
+                 unsigned char endpoint                     : Endpoint address
+                 unsigned char type                         : Transfer type
+                 int status                                 : Transfer status
+                 unsigned long long timestamp               : Monotonic time, in ns
+                 const unsigned char *data                  : Data
+                 unsigned int length                        : Number of bytes of data
+                 const struct cyusb_capture_packet *packets : Iso packets, or NULL
+                 unsigned int npackets                      : Number of iso packets
+  Return Value : 0 on success, -ENOBUFS if the record was dropped because the buffer is
+                 full, or the error with which writing the file failed.
+ ****************************************************************************************/
+extern int cyusb_capture_write(cyusb_capture *cap, unsigned char endpoint, unsigned char type,
+		int status, unsigned long long timestamp, const unsigned char *data, unsigned int length,
+		const struct cyusb_capture_packet *packets, unsigned int npackets);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_transfer(cyusb_capture *cap, struct libusb_transfer *transfer,
+                     unsigned long long timestamp);
+  Description  : Adds a completed transfer to a capture file. For isochronous transfers,
+                 the data of the packets is stored back to back.
+  Parameters   :
+                 cyusb_capture *cap               : Capture handle
+                 struct libusb_transfer *transfer : Completed transfer
+                 unsigned long long timestamp     : Monotonic time of the completion, in ns
+  Return Value : As for cyusb_capture_write().
+ ****************************************************************************************/
+extern int cyusb_capture_transfer(cyusb_capture *cap, struct libusb_transfer *transfer,
+		unsigned long long timestamp);
+
+/****************************************************************************************
+  Prototype    : void cyusb_capture_get_stats(cyusb_capture *cap, struct cyusb_capture_stats *stats);
+  Description  : Gets the counters of a capture file being written.
+  Parameters   :
+                 cyusb_capture *cap                : Capture handle
+                 struct cyusb_capture_stats *stats : Returns the counters
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_capture_get_stats(cyusb_capture *cap, struct cyusb_capture_stats *stats);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_close(cyusb_capture *cap);
+  Description  : Writes out the records still buffered, the index and the final header,
+                 and closes the file. Streams feeding the capture must be stopped first.
+  Parameters   :
+                 cyusb_capture *cap : Capture handle
+  Return Value : 0 on success, or the first error with which writing the file failed.
+ ****************************************************************************************/
+extern int cyusb_capture_close(cyusb_capture *cap);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_open(const char *path, cyusb_capture_reader **rd);
+  Description  : Maps a capture file for reading, positioned at its first record. The index
+                 of a file that was not closed properly is rebuilt from its records.
+  Parameters   :
+                 const char *path          : File name
+                 cyusb_capture_reader **rd : Returns the reader handle
+  Return Value : 0 on success, -EINVAL if the file is not a valid capture, or another
+                 negative errno value.
+ ****************************************************************************************/
+extern int cyusb_capture_open(const char *path, cyusb_capture_reader **rd);
+
+/****************************************************************************************
+  Prototype    : const struct cyusb_capture_header *cyusb_capture_info(cyusb_capture_reader *rd);
+  Description  : Gets the header of a capture file. For a file that was not closed
+                 properly, the counts are the ones found when it was opened.
+  Parameters   :
+                 cyusb_capture_reader *rd : Reader handle
+  Return Value : Pointer to the header.
+ ****************************************************************************************/
+extern const struct cyusb_capture_header *cyusb_capture_info(cyusb_capture_reader *rd);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_next(cyusb_capture_reader *rd,
+                     const struct cyusb_capture_record **rec,
+                     const struct cyusb_capture_packet **packets, const unsigned char **data);
+  Description  : Gets the next record of a capture file. The pointers returned point into
+                 the mapped file, and stay valid until the reader is closed.
+  Parameters   :
+                 cyusb_capture_reader *rd                    : Reader handle
+                 const struct cyusb_capture_record **rec     : Returns the record header
+                 const struct cyusb_capture_packet **packets : Returns the iso packets, may
+                                                               be NULL
+                 const unsigned char **data                  : Returns the data, may be NULL
+  Return Value : 0 on success, -ENODATA after the last record, or -EINVAL if the record is
+                 corrupt.
+ ****************************************************************************************/
+extern int cyusb_capture_next(cyusb_capture_reader *rd, const struct cyusb_capture_record **rec,
+		const struct cyusb_capture_packet **packets, const unsigned char **data);
+
+/****************************************************************************************
+  Prototype    : int cyusb_capture_seek(cyusb_capture_reader *rd, unsigned long long timestamp);
+  Description  : Positions a reader at the first record with a time stamp at or after the
+                 one given. The index is searched first, so only the records of one index
+                 interval are looked at.
+  Parameters   :
+                 cyusb_capture_reader *rd     : Reader handle
+                 unsigned long long timestamp : Monotonic time, in ns
+  Return Value : 0 on success, or -ENODATA if all records are older.
+ ****************************************************************************************/
+extern int cyusb_capture_seek(cyusb_capture_reader *rd, unsigned long long timestamp);
+
+/****************************************************************************************
+  Prototype    : void cyusb_capture_close_reader(cyusb_capture_reader *rd);
+  Description  : Unmaps a capture file opened with cyusb_capture_open().
+  Parameters   :
+                 cyusb_capture_reader *rd : Reader handle
+  Return Value : none
+ ****************************************************************************************/
+extern void cyusb_capture_close_reader(cyusb_capture_reader *rd);
 
 #endif /* __CYUSB_H */
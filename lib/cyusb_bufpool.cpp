@@ -0,0 +1,203 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_bufpool.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Transfer buffer pools for the cyusb library. A pool is one region of memory	*
+ * split into equal sized buffers. Where the kernel supports it, the region is	*
+ * allocated through usbfs so that transfers complete without a copy into user	*
+ * memory. Otherwise page aligned (and optionally huge page backed) anonymous	*
+ * memory is used. Pools can be locked into memory, so that transfers never	*
+ * wait on a page fault.							*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Size of a huge page. Only used to round up the size of huge page backed pools. */
+#define BUFPOOL_HUGEPAGE_SIZE			(2 * 1024 * 1024)
+
+/* Where the memory for a pool came from. */
+#define BUFPOOL_MEM_DEVMEM			(0)	/* libusb_dev_mem_alloc(), zero-copy. */
+#define BUFPOOL_MEM_HUGETLB			(1)	/* mmap() with MAP_HUGETLB. */
+#define BUFPOOL_MEM_ANON			(2)	/* Plain anonymous mmap(). */
+
+/*
+   struct cyusb_bufpool
+   A region of memory split into count buffers of bufsize bytes each.
+ */
+struct cyusb_bufpool {
+	libusb_device_handle	*handle;		/* Device the memory was mapped for. */
+	unsigned char		*base;			/* Start of the region. */
+	size_t			length;			/* Length of the region. */
+	unsigned int		bufsize;		/* Size of each buffer. */
+	unsigned int		stride;			/* Distance between buffers (page aligned). */
+	unsigned int		count;			/* Number of buffers. */
+	int			memtype;		/* One of the BUFPOOL_MEM_ values. */
+	int			locked;			/* Whether the region is locked into memory. */
+};
+
+/* cyusb_bufpool_create:
+   Allocate a pool of count transfer buffers of bufsize bytes each.
+ */
+int
+cyusb_bufpool_create (
+		libusb_device_handle *h,
+		unsigned int bufsize,
+		unsigned int count,
+		unsigned int flags,
+		cyusb_bufpool **pool)
+{
+	struct cyusb_bufpool *bp;
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	void *mem;
+
+	if ( (pool == NULL) || (bufsize == 0) || (count == 0) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*pool = NULL;
+
+	bp = (struct cyusb_bufpool *)calloc(1, sizeof(struct cyusb_bufpool));
+	if ( bp == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* Each buffer starts on a page boundary, so that the buffers never share a page. */
+	bp->handle  = h;
+	bp->bufsize = bufsize;
+	bp->stride  = (bufsize + pagesize - 1) & ~(pagesize - 1);
+	bp->count   = count;
+	bp->length  = (size_t)bp->stride * count;
+	bp->base    = NULL;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	/* This fails if the kernel does not support usbfs memory mapping, or if the request is
+	   larger than the usbfs memory limit (usbcore.usbfs_memory_mb). */
+	if ( (h != NULL) && !(flags & CYUSB_BUFPOOL_NO_DEVMEM) ) {
+		bp->base = libusb_dev_mem_alloc(h, bp->length);
+		if ( bp->base != NULL )
+			bp->memtype = BUFPOOL_MEM_DEVMEM;
+	}
+#endif
+
+#ifdef MAP_HUGETLB
+	if ( (bp->base == NULL) && (flags & CYUSB_BUFPOOL_HUGEPAGE) ) {
+		size_t length = (bp->length + BUFPOOL_HUGEPAGE_SIZE - 1) & ~((size_t)BUFPOOL_HUGEPAGE_SIZE - 1);
+
+		mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if ( mem != MAP_FAILED ) {
+			bp->base    = (unsigned char *)mem;
+			bp->length  = length;
+			bp->memtype = BUFPOOL_MEM_HUGETLB;
+		}
+	}
+#endif
+
+	if ( bp->base == NULL ) {
+		mem = mmap(NULL, bp->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if ( mem == MAP_FAILED ) {
+			free(bp);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		bp->base    = (unsigned char *)mem;
+		bp->memtype = BUFPOOL_MEM_ANON;
+
+#ifdef MADV_HUGEPAGE
+		/* No huge pages are reserved; ask for transparent huge pages instead. */
+		if ( flags & CYUSB_BUFPOOL_HUGEPAGE )
+			madvise(mem, bp->length, MADV_HUGEPAGE);
+#endif
+	}
+
+	*pool = bp;
+	return 0;
+}
+
+/* cyusb_bufpool_get:
+   Get the address of one of the buffers in a pool.
+ */
+unsigned char *
+cyusb_bufpool_get (
+		cyusb_bufpool *pool,
+		unsigned int index)
+{
+	if ( index >= pool->count )
+		return NULL;
+
+	return pool->base + (size_t)index * pool->stride;
+}
+
+/* cyusb_bufpool_is_zerocopy:
+   Check whether the buffers in a pool are mapped by usbfs for zero-copy transfers.
+ */
+int
+cyusb_bufpool_is_zerocopy (
+		cyusb_bufpool *pool)
+{
+	return (pool->memtype == BUFPOOL_MEM_DEVMEM);
+}
+
+/* cyusb_bufpool_lock:
+   Lock all the buffers in a pool into memory.
+ */
+int
+cyusb_bufpool_lock (
+		cyusb_bufpool *pool)
+{
+	if ( pool->locked )
+		return 0;
+
+	/* usbfs memory is allocated by the kernel and can never be paged out. */
+	if ( pool->memtype != BUFPOOL_MEM_DEVMEM ) {
+		if ( mlock(pool->base, pool->length) != 0 )
+			return ( errno == EPERM ) ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_NO_MEM;
+	}
+
+	pool->locked = 1;
+	return 0;
+}
+
+/* cyusb_bufpool_is_locked:
+   Check whether the buffers in a pool are locked into memory.
+ */
+int
+cyusb_bufpool_is_locked (
+		cyusb_bufpool *pool)
+{
+	return pool->locked;
+}
+
+/* cyusb_bufpool_destroy:
+   Free a buffer pool, and the memory for all of its buffers.
+ */
+void
+cyusb_bufpool_destroy (
+		cyusb_bufpool *pool)
+{
+	if ( pool == NULL )
+		return;
+
+	switch ( pool->memtype ) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		case BUFPOOL_MEM_DEVMEM:
+			libusb_dev_mem_free(pool->handle, pool->base, pool->length);
+			break;
+#endif
+
+		default:
+			munmap(pool->base, pool->length);
+			break;
+	}
+
+	free(pool);
+}
+
+/*[]*/
@@ -0,0 +1,769 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_capture.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Capture files: every completed transfer is kept as a record with its time	*
+ * stamp, endpoint, status and iso packets, so that transfer boundaries are	*
+ * not lost. Records are copied into a large buffer by the thread producing	*
+ * them, and written out by a thread of the capture in aligned chunks, with	*
+ * O_DIRECT where possible, so that the page cache does not get in the way of	*
+ * the stream. A sparse time index is added when the file is closed, so that	*
+ * readers can map even a very large file and seek in it in O(log n).		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Size of the chunks in which the buffer is written to the file. */
+#define CAPTURE_CHUNK			(1024 * 1024)
+
+/* Default size of the buffer that records are collected in. */
+#define CAPTURE_DEFAULT_BUFSIZE		(16 * CAPTURE_CHUNK)
+
+/* Time (in milliseconds) between two entries of the time index. */
+#define CAPTURE_INDEX_INTERVAL		(10)
+
+/* Number of index entries the index array is first allocated for. */
+#define CAPTURE_INDEX_INITIAL		(1024)
+
+/* Records are padded to a multiple of this. */
+#define CAPTURE_RECORD_ALIGN(n)		(((n) + 7) & ~7U)
+
+/* Capture file being written. */
+struct cyusb_capture {
+	int			fd;			/* Capture file. */
+	bool			direct;			/* Whether the file is open with O_DIRECT. */
+	unsigned char		*buf;			/* Buffer the records are collected in. */
+	size_t			bufsize;		/* Size of buf, a multiple of CAPTURE_CHUNK. */
+	pthread_mutex_t		lock;			/* Protects everything below. */
+	pthread_cond_t		cond;			/* Wakes up the writer thread. */
+	pthread_t		thread;			/* Writer thread. */
+	bool			closing;		/* Request to the writer thread to exit. */
+	int			error;			/* First write error, or 0. */
+	unsigned long long	head;			/* Bytes of records added to the buffer. */
+	unsigned long long	written;		/* Bytes of records written to the file. */
+	unsigned long long	records;		/* Number of records added. */
+	unsigned long long	dropped;		/* Number of records dropped. */
+	unsigned int		max_length;		/* Largest amount of data in a record. */
+	unsigned int		max_packets;		/* Largest number of iso packets in a record. */
+	unsigned long long	start_ns;		/* Time at which the capture was created. */
+	unsigned long long	start_time;		/* Creation time, in seconds since the epoch. */
+	unsigned long long	next_index_ns;		/* Time from which the next index entry is due. */
+	struct cyusb_capture_index *index;		/* Time index. */
+	size_t			nindex;			/* Number of entries in index. */
+	size_t			maxindex;		/* Number of entries index is allocated for. */
+};
+
+/* Capture file being read. */
+struct cyusb_capture_reader {
+	unsigned char		*map;			/* File, mapped read-only. */
+	size_t			size;			/* Size of the file. */
+	struct cyusb_capture_header hdr;		/* File header, with the counts fixed up. */
+	const struct cyusb_capture_index *index;	/* Time index. */
+	struct cyusb_capture_index *built;		/* Index rebuilt from the records, if any. */
+	unsigned long long	pos;			/* Offset of the next record. */
+	unsigned long long	end;			/* Offset just past the last record. */
+};
+
+/* capture_now:
+   Get the current time from CYUSB_CLOCK (which streams time their transfers with), in
+   nanoseconds.
+ */
+static inline unsigned long long
+capture_now (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime(CYUSB_CLOCK, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* capture_pwrite:
+   Write a block to the file at the given offset, looping over short writes.
+ */
+static int
+capture_pwrite (
+		int fd,
+		const unsigned char *buf,
+		size_t len,
+		unsigned long long offset)
+{
+	ssize_t n;
+
+	while ( len != 0 ) {
+		n = pwrite(fd, buf, len, offset);
+		if ( n < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return -errno;
+		}
+		buf    += n;
+		len    -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/* capture_put:
+   Copy part of a record into the buffer at position pos, wrapping around its end. The caller
+   holds the lock.
+ */
+static void
+capture_put (
+		struct cyusb_capture *cap,
+		unsigned long long *pos,
+		const void *src,
+		size_t len)
+{
+	size_t off = *pos % cap->bufsize;
+	size_t n   = ( len < cap->bufsize - off ) ? len : cap->bufsize - off;
+
+	memcpy(cap->buf + off, src, n);
+	memcpy(cap->buf, (const unsigned char *)src + n, len - n);
+	*pos += len;
+}
+
+/* capture_begin:
+   Make room for a record of the given size, and write its header. On success, returns with
+   the lock held; the caller adds the rest of the record and calls capture_end().
+ */
+static int
+capture_begin (
+		struct cyusb_capture *cap,
+		const struct cyusb_capture_record *rec,
+		unsigned long long *pos)
+{
+	struct cyusb_capture_index *index;
+
+	pthread_mutex_lock(&cap->lock);
+	if ( cap->error ) {
+		pthread_mutex_unlock(&cap->lock);
+		return cap->error;
+	}
+
+	/* Never wait for the file: a record that does not fit is lost. */
+	if ( cap->head + rec->size - cap->written > cap->bufsize ) {
+		cap->dropped++;
+		pthread_mutex_unlock(&cap->lock);
+		return -ENOBUFS;
+	}
+
+	if ( rec->timestamp >= cap->next_index_ns ) {
+		if ( cap->nindex == cap->maxindex ) {
+			index = (struct cyusb_capture_index *)realloc(cap->index,
+					2 * cap->maxindex * sizeof(struct cyusb_capture_index));
+			if ( index != NULL ) {
+				cap->index     = index;
+				cap->maxindex *= 2;
+			}
+		}
+		if ( cap->nindex < cap->maxindex ) {
+			cap->index[cap->nindex].timestamp = rec->timestamp;
+			cap->index[cap->nindex].offset    = CYUSB_CAPTURE_ALIGN + cap->head;
+			cap->nindex++;
+			cap->next_index_ns = rec->timestamp + CAPTURE_INDEX_INTERVAL * 1000000ULL;
+		}
+	}
+
+	*pos = cap->head;
+	capture_put(cap, pos, rec, sizeof(struct cyusb_capture_record));
+	return 0;
+}
+
+/* capture_end:
+   Complete a record started with capture_begin(), and release the lock.
+ */
+static void
+capture_end (
+		struct cyusb_capture *cap,
+		const struct cyusb_capture_record *rec,
+		unsigned long long pos)
+{
+	static const unsigned char pad[8] = { 0 };
+	unsigned long long end = cap->head + rec->size;
+
+	capture_put(cap, &pos, pad, end - pos);
+
+	cap->records++;
+	if ( rec->length > cap->max_length )
+		cap->max_length = rec->length;
+	if ( rec->npackets > cap->max_packets )
+		cap->max_packets = rec->npackets;
+
+	/* The writer thread only cares about whole chunks. */
+	if ( cap->head / CAPTURE_CHUNK != end / CAPTURE_CHUNK )
+		pthread_cond_signal(&cap->cond);
+	cap->head = end;
+
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* capture_thread:
+   Write the buffer to the file, one whole chunk at a time. The part of the last chunk that is
+   not complete is left to cyusb_capture_close().
+ */
+static void *
+capture_thread (
+		void *arg)
+{
+	struct cyusb_capture *cap = (struct cyusb_capture *)arg;
+	unsigned long long offset;
+	int r;
+
+	pthread_mutex_lock(&cap->lock);
+	for ( ; ; ) {
+		while ( (!cap->closing) && (cap->head - cap->written < CAPTURE_CHUNK) )
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		if ( cap->head - cap->written < CAPTURE_CHUNK )
+			break;
+
+		/* Producers never overwrite data that is not written yet, so the chunk can be
+		   written without the lock. */
+		offset = cap->written;
+		pthread_mutex_unlock(&cap->lock);
+		r = capture_pwrite(cap->fd, cap->buf + offset % cap->bufsize, CAPTURE_CHUNK,
+				CYUSB_CAPTURE_ALIGN + offset);
+		pthread_mutex_lock(&cap->lock);
+
+		if ( r ) {
+			cap->error = r;
+			break;
+		}
+		cap->written += CAPTURE_CHUNK;
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+
+/* capture_fill_header:
+   Fill in a file header from the state of a capture.
+ */
+static void
+capture_fill_header (
+		struct cyusb_capture *cap,
+		struct cyusb_capture_header *hdr,
+		bool closed)
+{
+	memset(hdr, 0, sizeof(struct cyusb_capture_header));
+	hdr->magic          = CYUSB_CAPTURE_MAGIC;
+	hdr->version        = CYUSB_CAPTURE_VERSION;
+	hdr->header_size    = CYUSB_CAPTURE_ALIGN;
+	hdr->index_interval = CAPTURE_INDEX_INTERVAL;
+	hdr->start_ns       = cap->start_ns;
+	hdr->start_time     = cap->start_time;
+	if ( closed ) {
+		hdr->data_end     = CYUSB_CAPTURE_ALIGN + cap->head;
+		hdr->index_offset = hdr->data_end;
+		hdr->index_count  = cap->nindex;
+		hdr->records      = cap->records;
+		hdr->dropped      = cap->dropped;
+		hdr->max_length   = cap->max_length;
+		hdr->max_packets  = cap->max_packets;
+	}
+}
+
+/* capture_write_header:
+   Write the file header, from an aligned buffer as O_DIRECT requires.
+ */
+static int
+capture_write_header (
+		struct cyusb_capture *cap,
+		bool closed)
+{
+	void *block;
+	int r;
+
+	if ( posix_memalign(&block, CYUSB_CAPTURE_ALIGN, CYUSB_CAPTURE_ALIGN) != 0 )
+		return -ENOMEM;
+
+	memset(block, 0, CYUSB_CAPTURE_ALIGN);
+	capture_fill_header(cap, (struct cyusb_capture_header *)block, closed);
+	r = capture_pwrite(cap->fd, (const unsigned char *)block, CYUSB_CAPTURE_ALIGN, 0);
+	free(block);
+
+	return r;
+}
+
+/* cyusb_capture_create:
+   Create a capture file, and start its writer thread.
+ */
+int
+cyusb_capture_create (
+		const char *path,
+		size_t bufsize,
+		int flags,
+		cyusb_capture **cap_p)
+{
+	struct cyusb_capture *cap;
+	void *buf;
+	int r;
+
+	*cap_p = NULL;
+
+	if ( bufsize == 0 )
+		bufsize = CAPTURE_DEFAULT_BUFSIZE;
+	bufsize = (bufsize + CAPTURE_CHUNK - 1) / CAPTURE_CHUNK * CAPTURE_CHUNK;
+
+	cap = (struct cyusb_capture *)calloc(1, sizeof(struct cyusb_capture));
+	if ( cap == NULL )
+		return -ENOMEM;
+
+	/* Not all file systems take O_DIRECT; those get buffered writes. */
+	cap->fd = -1;
+	if ( !(flags & CYUSB_CAPTURE_BUFFERED) ) {
+		cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		cap->direct = ( cap->fd >= 0 );
+	}
+	if ( cap->fd < 0 )
+		cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if ( cap->fd < 0 ) {
+		r = -errno;
+		free(cap);
+		return r;
+	}
+
+	cap->bufsize  = bufsize;
+	cap->maxindex = CAPTURE_INDEX_INITIAL;
+	cap->index    = (struct cyusb_capture_index *)malloc(cap->maxindex * sizeof(struct cyusb_capture_index));
+	if ( (cap->index == NULL) || (posix_memalign(&buf, CYUSB_CAPTURE_ALIGN, bufsize) != 0) ) {
+		free(cap->index);
+		close(cap->fd);
+		free(cap);
+		return -ENOMEM;
+	}
+	cap->buf = (unsigned char *)buf;
+
+	cap->start_ns   = capture_now();
+	cap->start_time = time(NULL);
+
+	r = capture_write_header(cap, false);
+	if ( r ) {
+		free(cap->buf);
+		free(cap->index);
+		close(cap->fd);
+		free(cap);
+		return r;
+	}
+
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+	r = pthread_create(&cap->thread, NULL, capture_thread, cap);
+	if ( r ) {
+		pthread_cond_destroy(&cap->cond);
+		pthread_mutex_destroy(&cap->lock);
+		free(cap->buf);
+		free(cap->index);
+		close(cap->fd);
+		free(cap);
+		return -r;
+	}
+
+	*cap_p = cap;
+	return 0;
+}
+
+/* cyusb_capture_write:
+   Add a record to a capture file.
+ */
+int
+cyusb_capture_write (
+		cyusb_capture *cap,
+		unsigned char endpoint,
+		unsigned char type,
+		int status,
+		unsigned long long timestamp,
+		const unsigned char *data,
+		unsigned int length,
+		const struct cyusb_capture_packet *packets,
+		unsigned int npackets)
+{
+	struct cyusb_capture_record rec;
+	unsigned long long pos;
+	int r;
+
+	rec.size      = CAPTURE_RECORD_ALIGN(sizeof(rec) + npackets * sizeof(struct cyusb_capture_packet) + length);
+	rec.length    = length;
+	rec.timestamp = timestamp;
+	rec.status    = status;
+	rec.endpoint  = endpoint;
+	rec.type      = type;
+	rec.npackets  = npackets;
+
+	r = capture_begin(cap, &rec, &pos);
+	if ( r )
+		return r;
+
+	if ( npackets != 0 )
+		capture_put(cap, &pos, packets, npackets * sizeof(struct cyusb_capture_packet));
+	capture_put(cap, &pos, data, length);
+	capture_end(cap, &rec, pos);
+
+	return 0;
+}
+
+/* cyusb_capture_transfer:
+   Add a completed transfer to a capture file, gathering the data of its iso packets.
+ */
+int
+cyusb_capture_transfer (
+		cyusb_capture *cap,
+		struct libusb_transfer *transfer,
+		unsigned long long timestamp)
+{
+	struct cyusb_capture_record rec;
+	struct cyusb_capture_packet pkt;
+	unsigned long long pos;
+	unsigned int offset;
+	int i;
+	int r;
+
+	if ( transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+		return cyusb_capture_write(cap, transfer->endpoint, transfer->type, transfer->status, timestamp,
+				transfer->buffer, transfer->actual_length, NULL, 0);
+
+	rec.length = 0;
+	for ( i = 0; i < transfer->num_iso_packets; ++i )
+		rec.length += transfer->iso_packet_desc[i].actual_length;
+
+	rec.size      = CAPTURE_RECORD_ALIGN(sizeof(rec) + transfer->num_iso_packets * sizeof(pkt) + rec.length);
+	rec.timestamp = timestamp;
+	rec.status    = transfer->status;
+	rec.endpoint  = transfer->endpoint;
+	rec.type      = transfer->type;
+	rec.npackets  = transfer->num_iso_packets;
+
+	r = capture_begin(cap, &rec, &pos);
+	if ( r )
+		return r;
+
+	for ( i = 0; i < transfer->num_iso_packets; ++i ) {
+		pkt.length = transfer->iso_packet_desc[i].actual_length;
+		pkt.status = transfer->iso_packet_desc[i].status;
+		capture_put(cap, &pos, &pkt, sizeof(pkt));
+	}
+
+	/* Each packet sits at the start of its slot in the transfer buffer. */
+	offset = 0;
+	for ( i = 0; i < transfer->num_iso_packets; ++i ) {
+		capture_put(cap, &pos, transfer->buffer + offset, transfer->iso_packet_desc[i].actual_length);
+		offset += transfer->iso_packet_desc[i].length;
+	}
+	capture_end(cap, &rec, pos);
+
+	return 0;
+}
+
+/* cyusb_capture_get_stats:
+   Get the counters of a capture file being written.
+ */
+void
+cyusb_capture_get_stats (
+		cyusb_capture *cap,
+		struct cyusb_capture_stats *stats)
+{
+	pthread_mutex_lock(&cap->lock);
+	stats->records = cap->records;
+	stats->bytes   = cap->head;
+	stats->dropped = cap->dropped;
+	stats->written = cap->written;
+	stats->error   = cap->error;
+	stats->direct  = cap->direct;
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* cyusb_capture_close:
+   Write out the rest of the records, the index and the final header, and close the file.
+ */
+int
+cyusb_capture_close (
+		cyusb_capture *cap)
+{
+	unsigned long long tail;
+	int r;
+
+	pthread_mutex_lock(&cap->lock);
+	cap->closing = true;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+
+	r = cap->error;
+	if ( r == 0 ) {
+		/* The rest is not a whole chunk, nor is the index: these are the only writes that
+		   go through the page cache. */
+		if ( cap->direct )
+			fcntl(cap->fd, F_SETFL, fcntl(cap->fd, F_GETFL) & ~O_DIRECT);
+
+		tail = cap->head - cap->written;
+		r = capture_pwrite(cap->fd, cap->buf + cap->written % cap->bufsize, tail,
+				CYUSB_CAPTURE_ALIGN + cap->written);
+		if ( r == 0 )
+			r = capture_pwrite(cap->fd, (const unsigned char *)cap->index,
+					cap->nindex * sizeof(struct cyusb_capture_index), CYUSB_CAPTURE_ALIGN + cap->head);
+		if ( r == 0 )
+			r = capture_write_header(cap, true);
+	}
+
+	if ( (close(cap->fd) != 0) && (r == 0) )
+		r = -errno;
+
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap->buf);
+	free(cap->index);
+	free(cap);
+
+	return r;
+}
+
+/* capture_record_valid:
+   Check that a record at the given offset lies within the data and is consistent.
+ */
+static bool
+capture_record_valid (
+		const struct cyusb_capture_reader *rd,
+		unsigned long long pos,
+		unsigned long long end)
+{
+	const struct cyusb_capture_record *rec = (const struct cyusb_capture_record *)(rd->map + pos);
+
+	if ( pos + sizeof(struct cyusb_capture_record) > end )
+		return false;
+
+	return ( (rec->size % 8 == 0) && (rec->size <= end - pos) &&
+		 (rec->size >= sizeof(struct cyusb_capture_record) +
+				rec->npackets * sizeof(struct cyusb_capture_packet) + (unsigned long long)rec->length) );
+}
+
+/* capture_rebuild:
+   Recover the records, and rebuild the index, of a file that was not closed properly. The
+   data ends at the first record that is incomplete.
+ */
+static int
+capture_rebuild (
+		struct cyusb_capture_reader *rd)
+{
+	const struct cyusb_capture_record *rec;
+	struct cyusb_capture_index *index;
+	size_t nindex = 0, maxindex = CAPTURE_INDEX_INITIAL;
+	unsigned long long next_ns = 0;
+	unsigned long long pos = rd->hdr.header_size;
+
+	rd->built = (struct cyusb_capture_index *)malloc(maxindex * sizeof(struct cyusb_capture_index));
+	if ( rd->built == NULL )
+		return -ENOMEM;
+
+	rd->hdr.records     = 0;
+	rd->hdr.max_length  = 0;
+	rd->hdr.max_packets = 0;
+	while ( capture_record_valid(rd, pos, rd->size) ) {
+		rec = (const struct cyusb_capture_record *)(rd->map + pos);
+		if ( rec->timestamp >= next_ns ) {
+			if ( nindex == maxindex ) {
+				index = (struct cyusb_capture_index *)realloc(rd->built,
+						2 * maxindex * sizeof(struct cyusb_capture_index));
+				if ( index == NULL )
+					return -ENOMEM;
+				rd->built = index;
+				maxindex *= 2;
+			}
+			rd->built[nindex].timestamp = rec->timestamp;
+			rd->built[nindex].offset    = pos;
+			nindex++;
+			next_ns = rec->timestamp + rd->hdr.index_interval * 1000000ULL;
+		}
+
+		rd->hdr.records++;
+		if ( rec->length > rd->hdr.max_length )
+			rd->hdr.max_length = rec->length;
+		if ( rec->npackets > rd->hdr.max_packets )
+			rd->hdr.max_packets = rec->npackets;
+		pos += rec->size;
+	}
+
+	rd->hdr.data_end    = pos;
+	rd->hdr.index_count = nindex;
+	rd->index           = rd->built;
+	return 0;
+}
+
+/* cyusb_capture_open:
+   Map a capture file for reading.
+ */
+int
+cyusb_capture_open (
+		const char *path,
+		cyusb_capture_reader **rd_p)
+{
+	struct cyusb_capture_reader *rd;
+	struct stat st;
+	void *map;
+	int fd;
+	int r;
+
+	*rd_p = NULL;
+
+	fd = open(path, O_RDONLY);
+	if ( fd < 0 )
+		return -errno;
+
+	if ( fstat(fd, &st) != 0 ) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+	if ( (size_t)st.st_size < CYUSB_CAPTURE_ALIGN ) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	r = ( map == MAP_FAILED ) ? -errno : 0;
+	close(fd);
+	if ( r )
+		return r;
+
+	rd = (struct cyusb_capture_reader *)calloc(1, sizeof(struct cyusb_capture_reader));
+	if ( rd == NULL ) {
+		munmap(map, st.st_size);
+		return -ENOMEM;
+	}
+	rd->map  = (unsigned char *)map;
+	rd->size = st.st_size;
+	memcpy(&rd->hdr, map, sizeof(struct cyusb_capture_header));
+
+	if ( (rd->hdr.magic != CYUSB_CAPTURE_MAGIC) || (rd->hdr.version != CYUSB_CAPTURE_VERSION) ||
+			(rd->hdr.header_size < sizeof(struct cyusb_capture_header)) ||
+			(rd->hdr.header_size > rd->size) || (rd->hdr.index_interval == 0) ) {
+		cyusb_capture_close_reader(rd);
+		return -EINVAL;
+	}
+
+	if ( rd->hdr.data_end == 0 ) {
+		r = capture_rebuild(rd);
+		if ( r ) {
+			cyusb_capture_close_reader(rd);
+			return r;
+		}
+	}
+	else {
+		if ( (rd->hdr.data_end < rd->hdr.header_size) || (rd->hdr.index_offset < rd->hdr.data_end) ||
+				(rd->hdr.index_offset > rd->size) || (rd->hdr.index_offset % 8 != 0) ||
+				(rd->hdr.index_count > (rd->size - rd->hdr.index_offset) / sizeof(struct cyusb_capture_index)) ) {
+			cyusb_capture_close_reader(rd);
+			return -EINVAL;
+		}
+		rd->index = (const struct cyusb_capture_index *)(rd->map + rd->hdr.index_offset);
+	}
+
+	rd->pos = rd->hdr.header_size;
+	rd->end = rd->hdr.data_end;
+	*rd_p = rd;
+	return 0;
+}
+
+/* cyusb_capture_info:
+   Get the header of a capture file.
+ */
+const struct cyusb_capture_header *
+cyusb_capture_info (
+		cyusb_capture_reader *rd)
+{
+	return &rd->hdr;
+}
+
+/* cyusb_capture_next:
+   Get the next record of a capture file.
+ */
+int
+cyusb_capture_next (
+		cyusb_capture_reader *rd,
+		const struct cyusb_capture_record **rec,
+		const struct cyusb_capture_packet **packets,
+		const unsigned char **data)
+{
+	const struct cyusb_capture_record *r;
+
+	if ( rd->pos >= rd->end )
+		return -ENODATA;
+	if ( !capture_record_valid(rd, rd->pos, rd->end) )
+		return -EINVAL;
+
+	r = (const struct cyusb_capture_record *)(rd->map + rd->pos);
+	*rec = r;
+	if ( packets != NULL )
+		*packets = (const struct cyusb_capture_packet *)(r + 1);
+	if ( data != NULL )
+		*data = (const unsigned char *)(r + 1) + r->npackets * sizeof(struct cyusb_capture_packet);
+
+	rd->pos += r->size;
+	return 0;
+}
+
+/* cyusb_capture_seek:
+   Position a reader at the first record at or after a point in time.
+ */
+int
+cyusb_capture_seek (
+		cyusb_capture_reader *rd,
+		unsigned long long timestamp)
+{
+	const struct cyusb_capture_record *rec;
+	unsigned long long lo = 0, hi = rd->hdr.index_count, mid;
+	unsigned long long pos;
+
+	/* Find the last index entry at or before the time, and look at the records from there. */
+	while ( lo < hi ) {
+		mid = lo + (hi - lo) / 2;
+		if ( rd->index[mid].timestamp <= timestamp )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	pos = ( lo == 0 ) ? rd->hdr.header_size : rd->index[lo - 1].offset;
+	if ( (pos < rd->hdr.header_size) || (pos > rd->end) )
+		pos = rd->hdr.header_size;
+
+	while ( capture_record_valid(rd, pos, rd->end) ) {
+		rec = (const struct cyusb_capture_record *)(rd->map + pos);
+		if ( rec->timestamp >= timestamp ) {
+			rd->pos = pos;
+			return 0;
+		}
+		pos += rec->size;
+	}
+
+	rd->pos = rd->end;
+	return -ENODATA;
+}
+
+/* cyusb_capture_close_reader:
+   Unmap a capture file being read.
+ */
+void
+cyusb_capture_close_reader (
+		cyusb_capture_reader *rd)
+{
+	munmap(rd->map, rd->size);
+	free(rd->built);
+	free(rd);
+}
+
+/*[]*/
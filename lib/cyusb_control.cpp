@@ -0,0 +1,262 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_control.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Batched control requests: firmware downloads and EEPROM/flash programming	*
+ * are long lists of vendor requests, and doing them one at a time costs a	*
+ * full round trip each. A batch keeps several of them queued on the control	*
+ * endpoint instead, which the device works through in order. Barriers stop	*
+ * the pipelining where a request has to be done before the next is sent.	*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Time (in milliseconds) for which events are handled before checking for completions again. */
+#define CONTROL_WAIT_INTERVAL		(100)
+
+struct control_batch;
+
+/*
+   struct control_slot
+   One of the transfers that requests of a batch are queued with.
+ */
+struct control_slot {
+	struct control_batch	 *batch;		/* Batch this transfer belongs to. */
+	struct libusb_transfer	 *transfer;		/* libusb transfer structure. */
+	unsigned char		 *buffer;		/* Setup packet followed by the data. */
+	struct cyusb_control_req *req;			/* Request queued on the transfer, or NULL. */
+	int			 busy;			/* Whether the transfer is queued with libusb. */
+};
+
+/*
+   struct control_batch
+   State shared between a batch and the completion callbacks of its transfers.
+ */
+struct control_batch {
+	int			in_flight;		/* Number of transfers queued with libusb. */
+	int			completed;		/* Set by each completion, to wake up the batch. */
+};
+
+/* control_status:
+   Get the result of a completed control transfer: the bytes transferred, or a LIBUSB_ERROR.
+ */
+static int
+control_status (
+		struct libusb_transfer *transfer)
+{
+	switch ( transfer->status ) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return transfer->actual_length;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return LIBUSB_ERROR_INTERRUPTED;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+/* control_cb:
+   Completion callback for the transfers of a batch. The results are picked up by the batch itself.
+ */
+static void LIBUSB_CALL
+control_cb (
+		struct libusb_transfer *transfer)
+{
+	struct control_slot *slot = (struct control_slot *)transfer->user_data;
+	struct control_batch *b = slot->batch;
+
+	__atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&b->in_flight, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->completed, 1, __ATOMIC_RELEASE);
+}
+
+/* control_failed:
+   Check the status of a request that is done. Returns the error for a failed request, 0 otherwise.
+ */
+static int
+control_failed (
+		struct cyusb_control_req *req)
+{
+	if ( req->status < 0 )
+		return req->status;
+	if ( (!(req->flags & CYUSB_CONTROL_SHORT_OK)) && (req->status != req->wLength) )
+		return LIBUSB_ERROR_IO;
+	return 0;
+}
+
+/* cyusb_control_batch:
+   Perform a list of control requests, with up to depth of them queued at a time.
+ */
+int
+cyusb_control_batch (
+		libusb_device_handle *h,
+		struct cyusb_control_req *reqs,
+		unsigned int count,
+		unsigned int depth,
+		unsigned int flags)
+{
+	struct control_batch b;
+	struct control_slot *slots, *slot = NULL;
+	struct cyusb_control_req *req;
+	libusb_context *ctx = cyusb_handle_context(h);
+	unsigned int maxlen = 0, next = 0, first_failed = count;
+	unsigned int queued = 0;
+	unsigned int i;
+	struct timeval tv;
+	bool fence = false, stop = false;
+	int result = 0;
+	int err, r;
+
+	if ( count == 0 )
+		return 0;
+	if ( depth == 0 )
+		depth = CYUSB_CONTROL_DEPTH;
+	if ( depth > count )
+		depth = count;
+
+	for ( i = 0; i < count; ++i ) {
+		reqs[i].status = LIBUSB_ERROR_INTERRUPTED;
+		if ( reqs[i].wLength > maxlen )
+			maxlen = reqs[i].wLength;
+	}
+
+	slots = (struct control_slot *)calloc(depth, sizeof(struct control_slot));
+	if ( slots == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	b.in_flight = 0;
+	b.completed = 0;
+	for ( i = 0; i < depth; ++i ) {
+		slots[i].batch    = &b;
+		slots[i].transfer = libusb_alloc_transfer(0);
+		slots[i].buffer   = (unsigned char *)malloc(LIBUSB_CONTROL_SETUP_SIZE + maxlen);
+		if ( (slots[i].transfer == NULL) || (slots[i].buffer == NULL) ) {
+			result = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+	}
+
+	tv.tv_sec  = 0;
+	tv.tv_usec = CONTROL_WAIT_INTERVAL * 1000;
+	while ( 1 ) {
+		/* Pick up the requests that are done. */
+		for ( i = 0; i < depth; ++i ) {
+			slot = &slots[i];
+			if ( (slot->req == NULL) || (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE)) )
+				continue;
+
+			req = slot->req;
+			slot->req   = NULL;
+			queued--;
+			req->status = control_status(slot->transfer);
+			if ( ((req->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) && (req->status > 0) )
+				memcpy(req->data, libusb_control_transfer_get_data(slot->transfer), req->status);
+
+			err = control_failed(req);
+			if ( (err != 0) && (!(req->flags & CYUSB_CONTROL_NO_FAIL)) ) {
+				if ( (unsigned int)(req - reqs) < first_failed ) {
+					first_failed = req - reqs;
+					result = err;
+				}
+				if ( !(flags & CYUSB_CONTROL_CONTINUE) )
+					stop = true;
+			}
+		}
+
+		/* Queue the next requests on the free transfers, up to the next barrier. A barrier is
+		   only passed once every request before it has been picked up above, not just completed:
+		   with an event thread of the context, a completion may arrive after the pickup, and its
+		   status has to be checked before anything else is sent. */
+		for ( i = 0; (next < count) && (!stop) && (i < depth); ++i ) {
+			slot = &slots[i];
+			if ( slot->req != NULL )
+				continue;
+
+			req = &reqs[next];
+			if ( (fence || (req->flags & CYUSB_CONTROL_BARRIER)) && (queued != 0) )
+				break;
+
+			libusb_fill_control_setup(slot->buffer, req->bmRequestType, req->bRequest, req->wValue,
+					req->wIndex, req->wLength);
+			if ( (req->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT )
+				memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, req->data, req->wLength);
+			libusb_fill_control_transfer(slot->transfer, h, slot->buffer, control_cb, slot,
+					(req->timeout != 0) ? req->timeout : CYUSB_CONTROL_TIMEOUT);
+
+			next++;
+			fence = (req->flags & CYUSB_CONTROL_BARRIER) != 0;
+			slot->req  = req;
+			slot->busy = 1;
+			queued++;
+			__atomic_add_fetch(&b.in_flight, 1, __ATOMIC_RELAXED);
+			r = libusb_submit_transfer(slot->transfer);
+			if ( r != 0 ) {
+				__atomic_sub_fetch(&b.in_flight, 1, __ATOMIC_RELAXED);
+				queued--;
+				slot->req   = NULL;
+				slot->busy  = 0;
+				req->status = r;
+				if ( (!(req->flags & CYUSB_CONTROL_NO_FAIL)) && (!(flags & CYUSB_CONTROL_CONTINUE)) )
+					stop = true;
+				if ( (!(req->flags & CYUSB_CONTROL_NO_FAIL)) && ((unsigned int)(req - reqs) < first_failed) ) {
+					first_failed = req - reqs;
+					result = r;
+				}
+			}
+
+			/* A barrier has to complete before anything else is queued. */
+			if ( fence )
+				break;
+		}
+
+		if ( queued == 0 ) {
+			if ( (next >= count) || (stop) )
+				break;
+			fence = false;
+			continue;
+		}
+
+		/* Requests that have completed but not been picked up yet need no waiting for. */
+		if ( __atomic_load_n(&b.in_flight, __ATOMIC_ACQUIRE) == 0 )
+			continue;
+
+		/* Wait for at least one of the requests to complete. */
+		__atomic_store_n(&b.completed, 0, __ATOMIC_RELAXED);
+		r = libusb_handle_events_timeout_completed(ctx, &tv, &b.completed);
+		if ( (r != 0) && (r != LIBUSB_ERROR_INTERRUPTED) && (!stop) ) {
+			for ( i = 0; i < depth; ++i ) {
+				if ( __atomic_load_n(&slots[i].busy, __ATOMIC_ACQUIRE) )
+					libusb_cancel_transfer(slots[i].transfer);
+			}
+			if ( result == 0 )
+				result = r;
+			stop = true;
+		}
+	}
+
+out:
+	for ( i = 0; i < depth; ++i ) {
+		if ( slots[i].transfer != NULL )
+			libusb_free_transfer(slots[i].transfer);
+		free(slots[i].buffer);
+	}
+	free(slots);
+	return result;
+}
+
+/*[]*/
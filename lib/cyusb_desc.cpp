@@ -0,0 +1,301 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_desc.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Parsed descriptor snapshots. The configuration descriptor of a device is	*
+ * walked once, into a flat array of all the endpoints of all the interfaces	*
+ * and alternate settings, with the packet size that streams use already	*
+ * worked out from the SuperSpeed companion or high bandwidth bits. Snapshots	*
+ * are cached per device until the device leaves the device table, and an	*
+ * endpoint is looked up by its address with a single table index.		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Number of descriptor snapshots kept in the cache. */
+#define DESC_CACHE_SIZE				(16)
+
+/* Slot of an endpoint address in the lookup table: IN endpoints follow the 16 OUT endpoints. */
+#define DESC_INDEX(address)	((((address) & LIBUSB_ENDPOINT_DIR_MASK) >> 3) | ((address) & 0x0F))
+
+/*
+   struct desc_cache_entry
+   A descriptor snapshot, with the device it was taken of.
+ */
+struct desc_cache_entry {
+	struct cyusb_desc	desc;			/* Snapshot; must be the first member. */
+	libusb_device		*dev;			/* Device, referenced while the entry exists. */
+	int			refcount;		/* References held by the cache and by callers. */
+	unsigned long long	last_used;		/* For least recently used replacement. */
+};
+
+static struct desc_cache_entry *desc_cache[DESC_CACHE_SIZE];
+static unsigned long long desc_cache_clock;
+static pthread_mutex_t desc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* desc_free_entry:
+   Free a descriptor snapshot, and drop its reference on the device.
+ */
+static void
+desc_free_entry (
+		struct desc_cache_entry *e)
+{
+	libusb_unref_device(e->dev);
+	free(e->desc.endpoints);
+	free(e);
+}
+
+/* desc_fill_endpoint:
+   Fill in the information about one endpoint. On USB 3.0, the packet size is the max packet size
+   times the burst size, and also times the mult value for isochronous endpoints. Below that,
+   high bandwidth isochronous and interrupt endpoints carry up to three packets per microframe.
+ */
+static void
+desc_fill_endpoint (
+		struct cyusb_ep_desc *ep,
+		const struct libusb_interface_descriptor *ifd,
+		const struct libusb_endpoint_descriptor *epd,
+		unsigned short bcdUSB)
+{
+	struct libusb_ss_endpoint_companion_descriptor *compd = NULL;
+
+	ep->address    = epd->bEndpointAddress;
+	ep->type       = epd->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	ep->interface  = ifd->bInterfaceNumber;
+	ep->altsetting = ifd->bAlternateSetting;
+	ep->interval   = epd->bInterval;
+	ep->burst      = 1;
+	ep->mult       = 1;
+
+	if ( (bcdUSB >= 0x0300) && (libusb_get_ss_endpoint_companion_descriptor(NULL, epd, &compd) == 0) ) {
+		ep->maxpacket = epd->wMaxPacketSize;
+		ep->burst     = compd->bMaxBurst + 1;
+		if ( ep->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+			ep->mult = (compd->bmAttributes & 0x03) + 1;
+		libusb_free_ss_endpoint_companion_descriptor(compd);
+	}
+	else {
+		ep->maxpacket = epd->wMaxPacketSize & 0x07FF;
+		if ( (ep->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) || (ep->type == LIBUSB_TRANSFER_TYPE_INTERRUPT) )
+			ep->mult = ((epd->wMaxPacketSize >> 11) & 0x03) + 1;
+	}
+
+	ep->pktsize = (unsigned int)ep->maxpacket * ep->burst * ep->mult;
+}
+
+/* desc_build:
+   Take a snapshot of the descriptors of a device.
+ */
+static int
+desc_build (
+		libusb_device *dev,
+		struct desc_cache_entry *e)
+{
+	struct cyusb_desc *d = &e->desc;
+	struct libusb_device_descriptor devd;
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *ifd;
+	unsigned int count = 0;
+	int i, j, k, r;
+
+	r = libusb_get_device_descriptor(dev, &devd);
+	if ( r )
+		return r;
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if ( r )
+		return r;
+
+	d->vid            = devd.idVendor;
+	d->pid            = devd.idProduct;
+	d->bcdUSB         = devd.bcdUSB;
+	d->config         = config->bConfigurationValue;
+	d->num_interfaces = config->bNumInterfaces;
+
+	for ( i = 0; i < config->bNumInterfaces; ++i ) {
+		for ( j = 0; j < config->interface[i].num_altsetting; ++j )
+			count += config->interface[i].altsetting[j].bNumEndpoints;
+	}
+
+	d->endpoints = (struct cyusb_ep_desc *)calloc((count != 0) ? count : 1, sizeof(struct cyusb_ep_desc));
+	if ( d->endpoints == NULL ) {
+		libusb_free_config_descriptor(config);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* The lookup table points at the first alternate setting that declares each endpoint. */
+	memset(d->index, 0xFF, sizeof(d->index));
+	for ( i = 0; i < config->bNumInterfaces; ++i ) {
+		for ( j = 0; j < config->interface[i].num_altsetting; ++j ) {
+			ifd = &config->interface[i].altsetting[j];
+			for ( k = 0; k < ifd->bNumEndpoints; ++k ) {
+				desc_fill_endpoint(&d->endpoints[d->count], ifd, &ifd->endpoint[k], devd.bcdUSB);
+				if ( d->index[DESC_INDEX(ifd->endpoint[k].bEndpointAddress)] < 0 )
+					d->index[DESC_INDEX(ifd->endpoint[k].bEndpointAddress)] = d->count;
+				d->count++;
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return 0;
+}
+
+/* desc_cache_insert:
+   Add a new snapshot to the cache, replacing the least recently used one that is not in use.
+   Must be called with desc_cache_lock held.
+ */
+static void
+desc_cache_insert (
+		struct desc_cache_entry *e)
+{
+	int i, slot = -1;
+
+	for ( i = 0; i < DESC_CACHE_SIZE; ++i ) {
+		if ( desc_cache[i] == NULL ) {
+			slot = i;
+			break;
+		}
+		if ( (desc_cache[i]->refcount == 1) &&
+				((slot < 0) || (desc_cache[i]->last_used < desc_cache[slot]->last_used)) )
+			slot = i;
+	}
+
+	/* Every cached snapshot is in use; this one is freed when it is released. */
+	if ( slot < 0 )
+		return;
+
+	if ( desc_cache[slot] != NULL )
+		desc_free_entry(desc_cache[slot]);
+
+	e->refcount++;
+	desc_cache[slot] = e;
+}
+
+/* cyusb_desc_get:
+   Get the descriptor snapshot of a device, from the cache if it has been taken already.
+ */
+int
+cyusb_desc_get (
+		libusb_device *dev,
+		const struct cyusb_desc **desc)
+{
+	struct desc_cache_entry *e;
+	int i, r;
+
+	if ( (dev == NULL) || (desc == NULL) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*desc = NULL;
+
+	pthread_mutex_lock(&desc_cache_lock);
+	for ( i = 0; i < DESC_CACHE_SIZE; ++i ) {
+		e = desc_cache[i];
+		if ( (e != NULL) && (e->dev == dev) ) {
+			e->refcount++;
+			e->last_used = ++desc_cache_clock;
+			pthread_mutex_unlock(&desc_cache_lock);
+			*desc = &e->desc;
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&desc_cache_lock);
+
+	e = (struct desc_cache_entry *)calloc(1, sizeof(struct desc_cache_entry));
+	if ( e == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	r = desc_build(dev, e);
+	if ( r != 0 ) {
+		free(e->desc.endpoints);
+		free(e);
+		return r;
+	}
+	e->dev      = libusb_ref_device(dev);
+	e->refcount = 1;
+
+	/* Another thread may have taken a snapshot of the same device in the meantime. */
+	pthread_mutex_lock(&desc_cache_lock);
+	for ( i = 0; i < DESC_CACHE_SIZE; ++i ) {
+		if ( (desc_cache[i] != NULL) && (desc_cache[i]->dev == dev) ) {
+			desc_free_entry(e);
+			e = desc_cache[i];
+			e->refcount++;
+			break;
+		}
+	}
+	e->last_used = ++desc_cache_clock;
+	if ( i == DESC_CACHE_SIZE )
+		desc_cache_insert(e);
+	pthread_mutex_unlock(&desc_cache_lock);
+
+	*desc = &e->desc;
+	return 0;
+}
+
+/* cyusb_desc_release:
+   Drop a reference to a snapshot obtained from cyusb_desc_get().
+ */
+void
+cyusb_desc_release (
+		const struct cyusb_desc *desc)
+{
+	struct desc_cache_entry *e = (struct desc_cache_entry *)desc;
+
+	if ( desc == NULL )
+		return;
+
+	pthread_mutex_lock(&desc_cache_lock);
+	if ( --e->refcount == 0 )
+		desc_free_entry(e);
+	pthread_mutex_unlock(&desc_cache_lock);
+}
+
+/* cyusb_desc_endpoint:
+   Look up an endpoint of a snapshot by its address.
+ */
+const struct cyusb_ep_desc *
+cyusb_desc_endpoint (
+		const struct cyusb_desc *desc,
+		unsigned char address)
+{
+	int i = desc->index[DESC_INDEX(address)];
+
+	if ( (i < 0) || (desc->endpoints[i].address != address) )
+		return NULL;
+
+	return &desc->endpoints[i];
+}
+
+/* cyusb_desc_forget:
+   Drop the cached snapshot of a device, or of all devices, so that it is taken again next time.
+   Snapshots still in use are freed when they are released.
+ */
+void
+cyusb_desc_forget (
+		libusb_device *dev)
+{
+	struct desc_cache_entry *e;
+	int i;
+
+	pthread_mutex_lock(&desc_cache_lock);
+	for ( i = 0; i < DESC_CACHE_SIZE; ++i ) {
+		e = desc_cache[i];
+		if ( (e == NULL) || ((dev != NULL) && (e->dev != dev)) )
+			continue;
+
+		desc_cache[i] = NULL;
+		if ( --e->refcount == 0 )
+			desc_free_entry(e);
+	}
+	pthread_mutex_unlock(&desc_cache_lock);
+}
+
+/*[]*/
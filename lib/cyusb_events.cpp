@@ -0,0 +1,239 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_events.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Library owned event handling threads. One thread can be run per libusb	*
+ * context, so that applications using asynchronous transfers or streams do	*
+ * not have to drive libusb_handle_events() themselves. The threads can be	*
+ * pinned to a CPU and run at a real-time priority.				*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Maximum number of libusb contexts for which event threads can be run at the same time. */
+#define MAX_EVENT_THREADS			(8)
+
+/* Timeout (in milliseconds) for each event handling call made by the event thread. When
+   libusb can interrupt the event handler, this only bounds the time spent in one call. Older
+   versions of libusb cannot be woken up, and a stop request has to wait for this timeout.
+ */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define EVENT_THREAD_POLL_INTERVAL		(1000)
+#else
+#define EVENT_THREAD_POLL_INTERVAL		(100)
+#endif
+
+/*
+   struct cyusb_event_thread
+   State of the event handling thread for one libusb context.
+ */
+struct cyusb_event_thread {
+	libusb_context		*ctx;			/* libusb context handled by this thread. */
+	pthread_t		thread;			/* Event handling thread. */
+	int			refcount;		/* Number of users of this thread; 0 if unused. */
+	int			stop;			/* Request to stop the thread. */
+};
+
+static struct cyusb_event_thread evthreads[MAX_EVENT_THREADS];
+static pthread_mutex_t evlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* find_event_thread:
+   Look up the event thread entry for a libusb context. Must be called with evlock held.
+ */
+static struct cyusb_event_thread *
+find_event_thread (
+		libusb_context *ctx)
+{
+	int i;
+
+	for ( i = 0; i < MAX_EVENT_THREADS; ++i ) {
+		if ( (evthreads[i].refcount != 0) && (evthreads[i].ctx == ctx) )
+			return &evthreads[i];
+	}
+
+	return NULL;
+}
+
+/* event_thread_func:
+   Body of the event handling thread. All transfer callbacks for the context are run from here.
+ */
+static void *
+event_thread_func (
+		void *arg)
+{
+	struct cyusb_event_thread *et = (struct cyusb_event_thread *)arg;
+	struct timeval tv;
+	int r;
+
+	while ( !__atomic_load_n(&et->stop, __ATOMIC_ACQUIRE) ) {
+		tv.tv_sec  = EVENT_THREAD_POLL_INTERVAL / 1000;
+		tv.tv_usec = (EVENT_THREAD_POLL_INTERVAL % 1000) * 1000;
+
+		r = libusb_handle_events_timeout_completed(et->ctx, &tv, &et->stop);
+		if ( (r != 0) && (r != LIBUSB_ERROR_INTERRUPTED) ) {
+			printf("Library: Event handling failed, stopping event thread\n");
+			cyusb_error(r);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* cyusb_event_thread_start:
+   Start the event handling thread for a libusb context, or take one more reference on it
+   if it is already running.
+ */
+int
+cyusb_event_thread_start (
+		libusb_context *ctx)
+{
+	struct cyusb_event_thread *et;
+	int i;
+
+	pthread_mutex_lock(&evlock);
+
+	et = find_event_thread(ctx);
+	if ( et != NULL ) {
+		et->refcount++;
+		pthread_mutex_unlock(&evlock);
+		return 0;
+	}
+
+	for ( i = 0; i < MAX_EVENT_THREADS; ++i ) {
+		if ( evthreads[i].refcount == 0 ) {
+			et = &evthreads[i];
+			break;
+		}
+	}
+	if ( et == NULL ) {
+		pthread_mutex_unlock(&evlock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	et->ctx  = ctx;
+	et->stop = 0;
+	if ( pthread_create(&et->thread, NULL, event_thread_func, et) != 0 ) {
+		pthread_mutex_unlock(&evlock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	et->refcount = 1;
+
+	pthread_mutex_unlock(&evlock);
+	return 0;
+}
+
+/* cyusb_event_thread_stop:
+   Drop a reference on the event handling thread for a libusb context. The thread is woken up
+   and joined when the last reference goes away.
+ */
+void
+cyusb_event_thread_stop (
+		libusb_context *ctx)
+{
+	struct cyusb_event_thread *et;
+
+	pthread_mutex_lock(&evlock);
+
+	et = find_event_thread(ctx);
+	if ( et == NULL ) {
+		pthread_mutex_unlock(&evlock);
+		return;
+	}
+
+	if ( --et->refcount == 0 ) {
+		__atomic_store_n(&et->stop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		libusb_interrupt_event_handler(ctx);
+#endif
+		pthread_join(et->thread, NULL);
+		et->ctx = NULL;
+	}
+
+	pthread_mutex_unlock(&evlock);
+}
+
+/* cyusb_event_thread_running:
+   Check whether an event handling thread is running for a libusb context.
+ */
+int
+cyusb_event_thread_running (
+		libusb_context *ctx)
+{
+	int running;
+
+	pthread_mutex_lock(&evlock);
+	running = (find_event_thread(ctx) != NULL);
+	pthread_mutex_unlock(&evlock);
+
+	return running;
+}
+
+/* cyusb_event_thread_set_sched:
+   Pin the event handling thread for a libusb context to a CPU, and set its scheduling policy.
+ */
+int
+cyusb_event_thread_set_sched (
+		libusb_context *ctx,
+		int cpu,
+		int priority)
+{
+	struct cyusb_event_thread *et;
+	struct sched_param param;
+	cpu_set_t cpus;
+	int policy = ( priority != 0 ) ? SCHED_FIFO : SCHED_OTHER;
+	int r;
+
+	if ( (cpu < -1) || (cpu >= CPU_SETSIZE) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if ( (priority != 0) &&
+			((priority < sched_get_priority_min(SCHED_FIFO)) || (priority > sched_get_priority_max(SCHED_FIFO))) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&evlock);
+
+	et = find_event_thread(ctx);
+	if ( et == NULL ) {
+		pthread_mutex_unlock(&evlock);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	CPU_ZERO(&cpus);
+	if ( cpu >= 0 )
+		CPU_SET(cpu, &cpus);
+	else {
+		/* Any CPU the process may run on. */
+		sched_getaffinity(0, sizeof(cpus), &cpus);
+	}
+	r = pthread_setaffinity_np(et->thread, sizeof(cpus), &cpus);
+	if ( r != 0 ) {
+		pthread_mutex_unlock(&evlock);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	r = pthread_setschedparam(et->thread, policy, &param);
+
+	pthread_mutex_unlock(&evlock);
+
+	if ( r == EPERM )
+		return LIBUSB_ERROR_ACCESS;
+	if ( r != 0 )
+		return LIBUSB_ERROR_INVALID_PARAM;
+	return 0;
+}
+
+/*[]*/
@@ -0,0 +1,1245 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_fanout.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Fan-out of one IN stream to several processes through shared memory. The	*
+ * process owning the device (cyusbd) points every transfer of the stream at	*
+ * a slot of a ring held in a memfd, so the data only lands in memory once.	*
+ * Consumers connect over a unix socket, and receive the ring and the control	*
+ * area read-only, along with a page of their own which is the only memory	*
+ * they can write: it holds their read cursor. They are woken up through an	*
+ * eventfd. A consumer that falls behind either loses the oldest data, or	*
+ * holds the stream back until it catches up.					*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Layout identification of the control area. The version changes with any layout change. */
+#define FANOUT_MAGIC			0x4f464e43	/* "CNFO" */
+#define FANOUT_VERSION			2
+
+/* Size that the ring is rounded up to when it is backed by huge pages. */
+#define FANOUT_HUGEPAGE_SIZE		(2 * 1024 * 1024)
+
+/* Time (in milliseconds) a new consumer has to send its request after connecting. */
+#define FANOUT_HELLO_TIMEOUT		(1000)
+
+/* States of a consumer entry in the control area. */
+#define FANOUT_CONSUMER_FREE		0
+#define FANOUT_CONSUMER_ACTIVE		1
+
+/*
+   struct fanout_consumer_state
+   Entry of one consumer in the control area, written by the producer only.
+ */
+struct fanout_consumer_state {
+	unsigned int		state;			/* One of the FANOUT_CONSUMER_ states. */
+	int			policy;			/* CYUSB_FANOUT_DROP or CYUSB_FANOUT_BLOCK. */
+	unsigned int		pid;			/* Process ID of the consumer. */
+};
+
+/*
+   struct fanout_cursor
+   Page of one consumer, the only shared memory the consumer can write. Nothing in it is
+   trusted by the producer beyond the consumer's own position in the ring.
+ */
+struct fanout_cursor {
+	unsigned long long	cursor;			/* Sequence number of the next slot to be read. */
+	unsigned long long	dropped;		/* Slots lost because the consumer fell behind. */
+	unsigned int		waiting;		/* Set by the consumer before it sleeps on its eventfd. */
+};
+
+/*
+   struct fanout_slot
+   Published state of one ring slot.
+ */
+struct fanout_slot {
+	unsigned long long	seq;			/* Sequence number of the data in the slot. */
+	unsigned int		length;			/* Bytes of data in the slot. */
+	int			status;			/* Transfer status the slot was filled with. */
+};
+
+/*
+   struct fanout_control
+   Control area shared with all consumers, followed by nslots struct fanout_slot entries. Only
+   the producer writes it; consumers map it read-only.
+ */
+struct fanout_control {
+	unsigned int		magic;			/* FANOUT_MAGIC. */
+	unsigned int		version;		/* FANOUT_VERSION. */
+	unsigned int		nslots;			/* Number of slots in the ring. */
+	unsigned int		slotsize;		/* Size of each slot in bytes. */
+	unsigned int		queuedepth;		/* Number of transfers kept queued. */
+	unsigned int		endpoint;		/* Endpoint that is streamed. */
+
+	unsigned long long	write_seq __attribute__((aligned(CYUSB_CACHE_LINE)));
+							/* Sequence number of the next slot to be published. */
+	unsigned long long	assigned_seq;		/* Sequence number of the next slot handed to a transfer. */
+
+	unsigned int		producer_waiting __attribute__((aligned(CYUSB_CACHE_LINE)));
+							/* Set while transfers are held for a blocking consumer. */
+
+	struct fanout_consumer_state consumers[CYUSB_FANOUT_CONSUMERS] __attribute__((aligned(CYUSB_CACHE_LINE)));
+} __attribute__((aligned(CYUSB_CACHE_LINE)));
+
+/* Request sent by a consumer after connecting. */
+struct fanout_hello {
+	unsigned int		version;		/* FANOUT_VERSION. */
+	int			policy;			/* CYUSB_FANOUT_DROP or CYUSB_FANOUT_BLOCK. */
+};
+
+/* Descriptors sent along with an accepted reply, in this order. */
+#define FANOUT_FD_RING			0		/* Ring, read-only. */
+#define FANOUT_FD_CONTROL		1		/* Control area, read-only. */
+#define FANOUT_FD_CURSOR		2		/* Page of the consumer, read-write. */
+#define FANOUT_FD_WAKEUP		3		/* eventfd the consumer is woken up with. */
+#define FANOUT_FD_PRODUCER		4		/* eventfd the consumer wakes the producer with. */
+#define FANOUT_NFDS			5
+
+/* Reply sent by the producer, along with the FANOUT_NFDS descriptors if status is 0. */
+struct fanout_reply {
+	int			status;			/* 0, or a LIBUSB_ERROR. */
+	unsigned int		index;			/* Entry of the consumer in the control area. */
+	unsigned long long	ring_size;		/* Size of the ring mapping. */
+	unsigned long long	ctl_size;		/* Size of the control mapping. */
+	unsigned long long	cursor_size;		/* Size of the consumer page mapping. */
+};
+
+/*
+   struct cyusb_fanout
+   State of the producer side of a fan-out.
+ */
+struct cyusb_fanout {
+	libusb_device_handle	*handle;		/* Device handle. */
+	libusb_context		*ctx;			/* libusb context the handle belongs to. */
+	unsigned char		endpoint;		/* Endpoint address. */
+	int			interface;		/* Interface claimed for the endpoint, or -1. */
+	cyusb_stream		*strm;			/* Stream on the endpoint. */
+	int			event_thread;		/* Whether the library event thread was started. */
+
+	char			path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+							/* Socket that consumers connect to. */
+	int			listen_fd;		/* Listening socket. */
+	int			wake_fd;		/* eventfd written by consumers that unblock the stream. */
+	int			ring_fd;		/* memfd holding the ring. */
+	int			ring_ro_fd;		/* Read-only descriptor of the ring, for consumers. */
+	int			ctl_fd;			/* memfd holding the control area. */
+	int			ctl_ro_fd;		/* Read-only descriptor of the control area, for consumers. */
+
+	unsigned char		*ring;			/* Ring, mapped read-write. */
+	size_t			ring_size;		/* Size of the ring mapping. */
+	struct fanout_control	*ctl;			/* Control area. */
+	struct fanout_slot	*slots;			/* Slot table following the control area. */
+	size_t			ctl_size;		/* Size of the control mapping. */
+	size_t			cursor_size;		/* Size of each consumer page. */
+	unsigned int		nslots;			/* Number of slots in the ring. */
+	unsigned int		slotsize;		/* Size of each slot in bytes. */
+	unsigned int		queuedepth;		/* Number of transfers in the stream. */
+
+	pthread_mutex_t		lock;			/* Serializes slot assignment and consumer changes. */
+	unsigned long long	*seqs;			/* Sequence number each slot was assigned for. */
+	unsigned char		*done;			/* Whether each slot has completed, but not been published. */
+	struct libusb_transfer	**held;			/* Transfers waiting for a blocking consumer, in order. */
+	unsigned int		nheld;			/* Number of entries in held. */
+
+	int			clients[CYUSB_FANOUT_CONSUMERS];/* Connection of each consumer, or -1. */
+	int			evfds[CYUSB_FANOUT_CONSUMERS];	/* Wakeup eventfd of each consumer, or -1. */
+	struct fanout_cursor	*cursors[CYUSB_FANOUT_CONSUMERS];/* Page of each consumer, or NULL. */
+};
+
+/*
+   struct cyusb_fanout_consumer
+   State of a process reading from a fan-out.
+ */
+struct cyusb_fanout_consumer {
+	int			sock;			/* Connection to the producer. */
+	int			evfd;			/* eventfd the producer wakes this consumer with. */
+	int			wake_fd;		/* eventfd this consumer wakes the producer with. */
+	const unsigned char	*ring;			/* Ring, mapped read-only. */
+	size_t			ring_size;		/* Size of the ring mapping. */
+	const struct fanout_control *ctl;		/* Control area, mapped read-only. */
+	const struct fanout_slot *slots;		/* Slot table. */
+	size_t			ctl_size;		/* Size of the control mapping. */
+	struct fanout_cursor	*me;			/* Page of this consumer, mapped read-write. */
+	size_t			cursor_size;		/* Size of the page mapping. */
+	int			policy;			/* CYUSB_FANOUT_DROP or CYUSB_FANOUT_BLOCK. */
+	bool			gone;			/* Whether the producer has gone away. */
+};
+
+/* fanout_socket_path:
+   Build the path of the socket of a named fan-out.
+ */
+static int
+fanout_socket_path (
+		const char *name,
+		struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if ( snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s", CYUSB_FANOUT_SOCKET, name) >=
+			(int)sizeof(addr->sun_path) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return 0;
+}
+
+/* fanout_memfd:
+   Create and map a shared memory file of (at least) the given size.
+ */
+static int
+fanout_memfd (
+		const char *name,
+		size_t *size,
+		bool hugepage,
+		void **map)
+{
+	size_t len = *size;
+	int fd = -1;
+
+	/* Huge pages are only used if they are available; the ring works the same without them. */
+	if ( hugepage ) {
+		len = (len + FANOUT_HUGEPAGE_SIZE - 1) & ~((size_t)FANOUT_HUGEPAGE_SIZE - 1);
+		fd  = memfd_create(name, MFD_CLOEXEC | MFD_HUGETLB);
+		if ( (fd >= 0) && (ftruncate(fd, len) != 0) ) {
+			close(fd);
+			fd = -1;
+		}
+		if ( fd >= 0 ) {
+			*map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if ( *map != MAP_FAILED ) {
+				*size = len;
+				return fd;
+			}
+			close(fd);
+		}
+		len = *size;
+	}
+
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if ( fd < 0 )
+		return -1;
+
+	if ( ftruncate(fd, len) != 0 ) {
+		close(fd);
+		return -1;
+	}
+
+	*map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( *map == MAP_FAILED ) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* fanout_readonly_fd:
+   Open a read-only descriptor of a memfd, for consumers, so that they cannot map it writable.
+   The memfd itself is made read-only to its owner too, so that the read-only descriptor cannot
+   be opened again for writing through /proc.
+ */
+static int
+fanout_readonly_fd (
+		int fd)
+{
+	char tbuf[32];
+	int ro;
+
+	snprintf(tbuf, sizeof(tbuf), "/proc/self/fd/%d", fd);
+	ro = open(tbuf, O_RDONLY | O_CLOEXEC);
+	if ( ro >= 0 )
+		fchmod(fd, S_IRUSR);
+
+	return ro;
+}
+
+/* fanout_claim:
+   Claim the interface holding the endpoint, with the first alternate setting that has it.
+ */
+static int
+fanout_claim (
+		struct cyusb_fanout *fan)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *ifd;
+	int alt = 0;
+	int r;
+	int i, j, k;
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(fan->handle), &config);
+	if ( r )
+		return r;
+
+	fan->interface = -1;
+	for ( i = 0; (i < config->bNumInterfaces) && (fan->interface < 0); ++i ) {
+		for ( j = 0; (j < config->interface[i].num_altsetting) && (fan->interface < 0); ++j ) {
+			ifd = &config->interface[i].altsetting[j];
+			for ( k = 0; k < ifd->bNumEndpoints; ++k ) {
+				if ( ifd->endpoint[k].bEndpointAddress == fan->endpoint ) {
+					fan->interface = ifd->bInterfaceNumber;
+					alt = ifd->bAlternateSetting;
+					break;
+				}
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+
+	if ( fan->interface < 0 )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	if ( libusb_kernel_driver_active(fan->handle, fan->interface) == 1 )
+		libusb_detach_kernel_driver(fan->handle, fan->interface);
+	r = libusb_claim_interface(fan->handle, fan->interface);
+	if ( r ) {
+		fan->interface = -1;
+		return r;
+	}
+
+	if ( alt != 0 ) {
+		r = libusb_set_interface_alt_setting(fan->handle, fan->interface, alt);
+		if ( r ) {
+			libusb_release_interface(fan->handle, fan->interface);
+			fan->interface = -1;
+		}
+	}
+
+	return r;
+}
+
+/* fanout_has_room:
+   Check whether the next slot can be handed to a transfer, without overwriting data that a
+   blocking consumer has not read yet. The caller holds the fan-out lock.
+ */
+static bool
+fanout_has_room (
+		struct cyusb_fanout *fan)
+{
+	unsigned long long seq = fan->ctl->assigned_seq;
+	struct fanout_consumer_state *cs;
+	int i;
+
+	for ( i = 0; i < CYUSB_FANOUT_CONSUMERS; ++i ) {
+		cs = &fan->ctl->consumers[i];
+		if ( (fan->clients[i] < 0) || (cs->policy != CYUSB_FANOUT_BLOCK) )
+			continue;
+		if ( seq >= __atomic_load_n(&fan->cursors[i]->cursor, __ATOMIC_SEQ_CST) + fan->nslots )
+			return false;
+	}
+
+	return true;
+}
+
+/* fanout_assign:
+   Point a transfer at the next slot of the ring. The caller holds the fan-out lock.
+ */
+static void
+fanout_assign (
+		struct cyusb_fanout *fan,
+		struct libusb_transfer *transfer)
+{
+	unsigned long long seq = fan->ctl->assigned_seq;
+	unsigned int slot = seq % fan->nslots;
+
+	fan->seqs[slot]  = seq;
+	fan->done[slot]  = 0;
+	transfer->buffer = fan->ring + (size_t)slot * fan->slotsize;
+
+	/* Consumers that do not block the stream check this to find out whether the slot they
+	   are reading has been handed out again. */
+	__atomic_store_n(&fan->ctl->assigned_seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* fanout_wake_consumers:
+   Wake up the consumers that are waiting for data. The caller holds the fan-out lock.
+ */
+static void
+fanout_wake_consumers (
+		struct cyusb_fanout *fan)
+{
+	unsigned long long one = 1;
+	int i;
+
+	for ( i = 0; i < CYUSB_FANOUT_CONSUMERS; ++i ) {
+		if ( (fan->evfds[i] >= 0) &&
+				(__atomic_exchange_n(&fan->cursors[i]->waiting, 0, __ATOMIC_SEQ_CST)) )
+			write(fan->evfds[i], &one, sizeof(one));
+	}
+}
+
+/* fanout_fill:
+   Assign the transfers queued when the stream starts to the first slots of the ring. Later
+   submissions already have their slot assigned by fanout_stream_cb().
+ */
+static void
+fanout_fill (
+		cyusb_stream *strm,
+		struct libusb_transfer *transfer,
+		void *arg)
+{
+	struct cyusb_fanout *fan = (struct cyusb_fanout *)arg;
+
+	if ( (transfer->buffer >= fan->ring) && (transfer->buffer < fan->ring + fan->ring_size) )
+		return;
+
+	pthread_mutex_lock(&fan->lock);
+	fanout_assign(fan, transfer);
+	pthread_mutex_unlock(&fan->lock);
+}
+
+/* fanout_stream_cb:
+   Publish the slot of a completed transfer, and hand the transfer the next slot.
+ */
+static int
+fanout_stream_cb (
+		cyusb_stream *strm,
+		struct libusb_transfer *transfer,
+		unsigned int length,
+		void *arg)
+{
+	struct cyusb_fanout *fan = (struct cyusb_fanout *)arg;
+	unsigned int slot = (transfer->buffer - fan->ring) / fan->slotsize;
+	unsigned long long seq;
+	unsigned int n;
+	int i;
+
+	/* Keep whatever data arrived, even if the transfer failed (e.g. timed out). The good
+	   packets of an isochronous transfer are moved together, so that a slot always holds
+	   contiguous data. */
+	if ( transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ) {
+		length = 0;
+		for ( i = 0; i < transfer->num_iso_packets; ++i ) {
+			if ( transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED )
+				continue;
+			n = transfer->iso_packet_desc[i].actual_length;
+			memmove(transfer->buffer + length, libusb_get_iso_packet_buffer_simple(transfer, i), n);
+			length += n;
+		}
+	}
+	else
+		length = transfer->actual_length;
+
+	pthread_mutex_lock(&fan->lock);
+
+	fan->slots[slot].length = length;
+	fan->slots[slot].status = transfer->status;
+	fan->done[slot] = 1;
+
+	/* Transfers normally complete in the order they were queued, but held transfers can be
+	   queued by another thread; slots are only ever published in order. */
+	seq = fan->ctl->write_seq;
+	while ( (fan->done[seq % fan->nslots]) && (fan->seqs[seq % fan->nslots] == seq) ) {
+		fan->done[seq % fan->nslots] = 0;
+		__atomic_store_n(&fan->slots[seq % fan->nslots].seq, seq, __ATOMIC_RELEASE);
+		seq++;
+	}
+	if ( seq != fan->ctl->write_seq ) {
+		__atomic_store_n(&fan->ctl->write_seq, seq, __ATOMIC_SEQ_CST);
+		fanout_wake_consumers(fan);
+	}
+
+	/* The flag is raised before looking for room, so that a consumer making room at the same
+	   time is sure to wake up the producer. */
+	if ( fan->nheld == 0 ) {
+		__atomic_store_n(&fan->ctl->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		if ( fanout_has_room(fan) ) {
+			__atomic_store_n(&fan->ctl->producer_waiting, 0, __ATOMIC_RELAXED);
+			fanout_assign(fan, transfer);
+			pthread_mutex_unlock(&fan->lock);
+			return CYUSB_STREAM_RESUBMIT;
+		}
+	}
+
+	fan->held[fan->nheld++] = transfer;
+	pthread_mutex_unlock(&fan->lock);
+	return CYUSB_STREAM_HOLD;
+}
+
+/* fanout_resume:
+   Queue the transfers that were held for a blocking consumer, as far as there is room.
+ */
+static void
+fanout_resume (
+		struct cyusb_fanout *fan)
+{
+	struct libusb_transfer *transfer;
+	int r;
+
+	pthread_mutex_lock(&fan->lock);
+	while ( fan->nheld != 0 ) {
+		__atomic_store_n(&fan->ctl->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		if ( !fanout_has_room(fan) )
+			break;
+
+		transfer = fan->held[0];
+		memmove(&fan->held[0], &fan->held[1], (fan->nheld - 1) * sizeof(struct libusb_transfer *));
+		fan->nheld--;
+
+		fanout_assign(fan, transfer);
+		r = cyusb_stream_submit(fan->strm, transfer);
+		if ( (r != 0) && (r != LIBUSB_ERROR_INTERRUPTED) )
+			printf("Library: Failed to queue fan-out transfer %d\n", r);
+	}
+	if ( fan->nheld == 0 )
+		__atomic_store_n(&fan->ctl->producer_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&fan->lock);
+}
+
+/* fanout_send:
+   Send the reply to a consumer request, with descriptors if the request was accepted.
+ */
+static int
+fanout_send (
+		int sock,
+		const struct fanout_reply *reply,
+		const int *fds,
+		int nfds)
+{
+	char cbuf[CMSG_SPACE(FANOUT_NFDS * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base   = (void *)reply;
+	iov.iov_len    = sizeof(struct fanout_reply);
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if ( nfds != 0 ) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control    = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	return ( sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(struct fanout_reply) ) ? 0 : -1;
+}
+
+/* fanout_accept:
+   Accept a new consumer, and hand it the ring starting at the newest data.
+ */
+static void
+fanout_accept (
+		struct cyusb_fanout *fan)
+{
+	struct fanout_consumer_state *cs;
+	struct fanout_cursor *cur;
+	struct fanout_hello hello;
+	struct fanout_reply reply;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct pollfd pfd;
+	size_t cursor_size = fan->cursor_size;
+	void *map;
+	int fds[FANOUT_NFDS];
+	int sock, evfd, curfd;
+	int i;
+
+	sock = accept4(fan->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if ( sock < 0 )
+		return;
+
+	memset(&reply, 0, sizeof(reply));
+	pfd.fd     = sock;
+	pfd.events = POLLIN;
+	if ( (poll(&pfd, 1, FANOUT_HELLO_TIMEOUT) != 1) ||
+			(recv(sock, &hello, sizeof(hello), 0) != (ssize_t)sizeof(hello)) ) {
+		close(sock);
+		return;
+	}
+
+	if ( (hello.version != FANOUT_VERSION) ||
+			((hello.policy != CYUSB_FANOUT_DROP) && (hello.policy != CYUSB_FANOUT_BLOCK)) ) {
+		reply.status = LIBUSB_ERROR_INVALID_PARAM;
+		fanout_send(sock, &reply, NULL, 0);
+		close(sock);
+		return;
+	}
+
+	evfd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	curfd = fanout_memfd("cyusb_fanout_cursor", &cursor_size, false, &map);
+	cur   = ( curfd >= 0 ) ? (struct fanout_cursor *)map : NULL;
+	if ( getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 )
+		cred.pid = 0;
+
+	pthread_mutex_lock(&fan->lock);
+	for ( i = 0; i < CYUSB_FANOUT_CONSUMERS; ++i ) {
+		if ( fan->clients[i] < 0 )
+			break;
+	}
+	if ( (i == CYUSB_FANOUT_CONSUMERS) || (evfd < 0) || (curfd < 0) ) {
+		pthread_mutex_unlock(&fan->lock);
+		reply.status = ( (evfd < 0) || (curfd < 0) ) ? LIBUSB_ERROR_NO_MEM : LIBUSB_ERROR_BUSY;
+		fanout_send(sock, &reply, NULL, 0);
+		if ( evfd >= 0 )
+			close(evfd);
+		if ( curfd >= 0 ) {
+			munmap(cur, cursor_size);
+			close(curfd);
+		}
+		close(sock);
+		return;
+	}
+
+	/* A blocking consumer holds the stream back from the moment it is set up, so its
+	   cursor is in place before the producer can see it. */
+	cs = &fan->ctl->consumers[i];
+	cs->policy = hello.policy;
+	cs->pid    = cred.pid;
+	__atomic_store_n(&cur->cursor, __atomic_load_n(&fan->ctl->write_seq, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	__atomic_store_n(&cs->state, FANOUT_CONSUMER_ACTIVE, __ATOMIC_RELEASE);
+	fan->cursors[i] = cur;
+	fan->clients[i] = sock;
+	fan->evfds[i]   = evfd;
+	pthread_mutex_unlock(&fan->lock);
+
+	reply.index       = i;
+	reply.ring_size   = fan->ring_size;
+	reply.ctl_size    = fan->ctl_size;
+	reply.cursor_size = cursor_size;
+	fds[FANOUT_FD_RING]     = fan->ring_ro_fd;
+	fds[FANOUT_FD_CONTROL]  = fan->ctl_ro_fd;
+	fds[FANOUT_FD_CURSOR]   = curfd;
+	fds[FANOUT_FD_WAKEUP]   = evfd;
+	fds[FANOUT_FD_PRODUCER] = fan->wake_fd;
+	if ( fanout_send(sock, &reply, fds, FANOUT_NFDS) != 0 )
+		cyusb_fanout_drop(fan, i);
+	close(curfd);
+}
+
+/* cyusb_fanout_create:
+   Open a stream on an IN endpoint whose data is published to consumers through a ring.
+ */
+int
+cyusb_fanout_create (
+		libusb_device_handle *h,
+		unsigned char endpoint,
+		const char *name,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		size_t ringsize,
+		int flags,
+		cyusb_fanout **fanout)
+{
+	struct cyusb_fanout *fan;
+	struct cyusb_stream_stats stats;
+	struct sockaddr_un addr;
+	char tbuf[64];
+	void *map;
+	int r;
+	int i;
+
+	if ( (h == NULL) || (name == NULL) || (fanout == NULL) ||
+			((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*fanout = NULL;
+	r = fanout_socket_path(name, &addr);
+	if ( r )
+		return r;
+
+	fan = (struct cyusb_fanout *)calloc(1, sizeof(struct cyusb_fanout));
+	if ( fan == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	fan->handle     = h;
+	fan->ctx        = cyusb_handle_context(h);
+	fan->endpoint   = endpoint;
+	fan->interface  = -1;
+	fan->listen_fd  = -1;
+	fan->wake_fd    = -1;
+	fan->ring_fd    = -1;
+	fan->ring_ro_fd = -1;
+	fan->ctl_fd     = -1;
+	fan->ctl_ro_fd  = -1;
+	fan->queuedepth = queuedepth;
+	pthread_mutex_init(&fan->lock, NULL);
+	for ( i = 0; i < CYUSB_FANOUT_CONSUMERS; ++i ) {
+		fan->clients[i] = -1;
+		fan->evfds[i]   = -1;
+	}
+
+	r = fanout_claim(fan);
+	if ( r == 0 )
+		r = cyusb_stream_open(h, endpoint, 0, reqsize, queuedepth, &fan->strm);
+	if ( r ) {
+		cyusb_fanout_close(fan);
+		return r;
+	}
+
+	/* The ring must hold more than the transfers in flight, so that there is always data
+	   that consumers can read while the next transfers are being filled. */
+	cyusb_stream_get_stats(fan->strm, &stats);
+	fan->slotsize = reqsize * stats.pktsize;
+	if ( ringsize / fan->slotsize < 2 * queuedepth ) {
+		cyusb_fanout_close(fan);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	snprintf(tbuf, sizeof(tbuf), "cyusb_fanout.%s", name);
+	fan->ring_size = ringsize;
+	fan->ring_fd = fanout_memfd(tbuf, &fan->ring_size, (flags & CYUSB_FANOUT_HUGEPAGE) != 0, &map);
+	if ( fan->ring_fd < 0 ) {
+		cyusb_fanout_close(fan);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	fan->ring   = (unsigned char *)map;
+	fan->nslots = fan->ring_size / fan->slotsize;
+
+	/* Consumers get descriptors opened read-only, so that they cannot map the ring or the
+	   control area writable. */
+	fan->ring_ro_fd = fanout_readonly_fd(fan->ring_fd);
+
+	fan->ctl_size    = sizeof(struct fanout_control) + fan->nslots * sizeof(struct fanout_slot);
+	fan->ctl_fd      = fanout_memfd("cyusb_fanout_control", &fan->ctl_size, false, &map);
+	fan->ctl_ro_fd   = ( fan->ctl_fd >= 0 ) ? fanout_readonly_fd(fan->ctl_fd) : -1;
+	fan->cursor_size = sysconf(_SC_PAGESIZE);
+	fan->seqs     = (unsigned long long *)calloc(fan->nslots, sizeof(unsigned long long));
+	fan->done     = (unsigned char *)calloc(fan->nslots, 1);
+	fan->held     = (struct libusb_transfer **)calloc(queuedepth, sizeof(struct libusb_transfer *));
+	fan->wake_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ( (fan->ring_ro_fd < 0) || (fan->ctl_fd < 0) || (fan->ctl_ro_fd < 0) || (fan->seqs == NULL) || (fan->done == NULL) ||
+			(fan->held == NULL) || (fan->wake_fd < 0) ) {
+		cyusb_fanout_close(fan);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	fan->ctl        = (struct fanout_control *)map;
+	fan->slots      = (struct fanout_slot *)(fan->ctl + 1);
+	fan->ctl->version    = FANOUT_VERSION;
+	fan->ctl->nslots     = fan->nslots;
+	fan->ctl->slotsize   = fan->slotsize;
+	fan->ctl->queuedepth = queuedepth;
+	fan->ctl->endpoint   = endpoint;
+	fan->ctl->magic      = FANOUT_MAGIC;
+
+	/* A socket left behind by an earlier run is replaced. */
+	fan->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if ( fan->listen_fd < 0 ) {
+		r = LIBUSB_ERROR_OTHER;
+		cyusb_fanout_close(fan);
+		return r;
+	}
+	unlink(addr.sun_path);
+	if ( (bind(fan->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+			(listen(fan->listen_fd, CYUSB_FANOUT_CONSUMERS) != 0) ) {
+		r = ( errno == EACCES ) ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_OTHER;
+		cyusb_fanout_close(fan);
+		return r;
+	}
+	strcpy(fan->path, addr.sun_path);
+	chmod(fan->path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+	cyusb_stream_set_callback(fan->strm, fanout_stream_cb, fan);
+	cyusb_stream_set_fill(fan->strm, fanout_fill, fan);
+
+	*fanout = fan;
+	return 0;
+}
+
+/* cyusb_fanout_start:
+   Start streaming into the ring.
+ */
+int
+cyusb_fanout_start (
+		cyusb_fanout *fan)
+{
+	int r;
+
+	if ( !fan->event_thread ) {
+		r = cyusb_event_thread_start(fan->ctx);
+		if ( r )
+			return r;
+		fan->event_thread = 1;
+	}
+
+	return cyusb_stream_start(fan->strm);
+}
+
+/* cyusb_fanout_pollfds:
+   Get the descriptors that the owner of a fan-out has to wait on.
+ */
+int
+cyusb_fanout_pollfds (
+		cyusb_fanout *fan,
+		struct pollfd *fds,
+		int max)
+{
+	int n = 0;
+	int i;
+
+	if ( max < CYUSB_FANOUT_POLLFDS )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	fds[n].fd     = fan->listen_fd;
+	fds[n++].events = POLLIN;
+	fds[n].fd     = fan->wake_fd;
+	fds[n++].events = POLLIN;
+
+	pthread_mutex_lock(&fan->lock);
+	for ( i = 0; i < CYUSB_FANOUT_CONSUMERS; ++i ) {
+		if ( fan->clients[i] >= 0 ) {
+			fds[n].fd       = fan->clients[i];
+			fds[n++].events = POLLIN;
+		}
+	}
+	pthread_mutex_unlock(&fan->lock);
+
+	for ( i = 0; i < n; ++i )
+		fds[i].revents = 0;
+
+	return n;
+}
+
+/* cyusb_fanout_handle:
+   Handle new consumers, consumers that have gone away, and consumers that unblocked the stream.
+ */
+void
+cyusb_fanout_handle (
+		cyusb_fanout *fan,
+		const struct pollfd *fds,
+		int nfds)
+{
+	unsigned long long count;
+	char c;
+	int i, j;
+
+	for ( i = 0; i < nfds; ++i ) {
+		if ( fds[i].revents == 0 )
+			continue;
+
+		if ( fds[i].fd == fan->listen_fd )
+			fanout_accept(fan);
+		else if ( fds[i].fd == fan->wake_fd )
+			read(fan->wake_fd, &count, sizeof(count));
+		else {
+			/* Consumers never send anything after their request; anything readable on the
+			   connection means the consumer has closed it. */
+			for ( j = 0; j < CYUSB_FANOUT_CONSUMERS; ++j ) {
+				if ( (fan->clients[j] == fds[i].fd) && (recv(fds[i].fd, &c, 1, MSG_DONTWAIT) <= 0) )
+					cyusb_fanout_drop(fan, j);
+			}
+		}
+	}
+
+	/* This is also done when nothing happened, so that a lost wakeup only delays the stream. */
+	fanout_resume(fan);
+}
+
+/* cyusb_fanout_drop:
+   Disconnect a consumer.
+ */
+void
+cyusb_fanout_drop (
+		cyusb_fanout *fan,
+		int index)
+{
+	if ( (index < 0) || (index >= CYUSB_FANOUT_CONSUMERS) )
+		return;
+
+	pthread_mutex_lock(&fan->lock);
+	if ( fan->clients[index] >= 0 ) {
+		__atomic_store_n(&fan->ctl->consumers[index].state, FANOUT_CONSUMER_FREE, __ATOMIC_RELEASE);
+		close(fan->clients[index]);
+		close(fan->evfds[index]);
+		munmap(fan->cursors[index], fan->cursor_size);
+		fan->clients[index] = -1;
+		fan->evfds[index]   = -1;
+		fan->cursors[index] = NULL;
+	}
+	pthread_mutex_unlock(&fan->lock);
+
+	/* A blocking consumer that went away no longer holds the stream back. */
+	fanout_resume(fan);
+}
+
+/* cyusb_fanout_get_consumer:
+   Get the state of one of the consumers of a fan-out.
+ */
+int
+cyusb_fanout_get_consumer (
+		cyusb_fanout *fan,
+		int index,
+		struct cyusb_fanout_info *info)
+{
+	struct fanout_consumer_state *cs;
+	unsigned long long seq;
+
+	if ( (index < 0) || (index >= CYUSB_FANOUT_CONSUMERS) || (fan->clients[index] < 0) )
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	cs  = &fan->ctl->consumers[index];
+	seq = __atomic_load_n(&fan->ctl->write_seq, __ATOMIC_ACQUIRE);
+	info->pid     = cs->pid;
+	info->policy  = cs->policy;
+	info->lag     = seq - __atomic_load_n(&fan->cursors[index]->cursor, __ATOMIC_ACQUIRE);
+	info->dropped = __atomic_load_n(&fan->cursors[index]->dropped, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* cyusb_fanout_close:
+   Stop the stream, disconnect all consumers and release everything held by a fan-out.
+ */
+void
+cyusb_fanout_close (
+		cyusb_fanout *fan)
+{
+	int i;
+
+	if ( fan == NULL )
+		return;
+
+	/* Held transfers are owned by the stream again once it is stopped. */
+	if ( fan->strm != NULL )
+		cyusb_stream_close(fan->strm);
+	if ( fan->event_thread )
+		cyusb_event_thread_stop(fan->ctx);
+	if ( fan->interface >= 0 )
+		libusb_release_interface(fan->handle, fan->interface);
+
+	for ( i = 0; i < CYUSB_FANOUT_CONSUMERS; ++i ) {
+		if ( fan->clients[i] >= 0 )
+			close(fan->clients[i]);
+		if ( fan->evfds[i] >= 0 )
+			close(fan->evfds[i]);
+		if ( fan->cursors[i] != NULL )
+			munmap(fan->cursors[i], fan->cursor_size);
+	}
+
+	if ( fan->listen_fd >= 0 ) {
+		if ( fan->path[0] )
+			unlink(fan->path);
+		close(fan->listen_fd);
+	}
+	if ( fan->wake_fd >= 0 )
+		close(fan->wake_fd);
+	if ( fan->ctl != NULL )
+		munmap(fan->ctl, fan->ctl_size);
+	if ( fan->ctl_ro_fd >= 0 )
+		close(fan->ctl_ro_fd);
+	if ( fan->ctl_fd >= 0 )
+		close(fan->ctl_fd);
+	if ( fan->ring != NULL )
+		munmap(fan->ring, fan->ring_size);
+	if ( fan->ring_ro_fd >= 0 )
+		close(fan->ring_ro_fd);
+	if ( fan->ring_fd >= 0 )
+		close(fan->ring_fd);
+
+	free(fan->seqs);
+	free(fan->done);
+	free(fan->held);
+	pthread_mutex_destroy(&fan->lock);
+	free(fan);
+}
+
+/* fanout_recv:
+   Receive the reply of the producer, and the descriptors that come with it.
+ */
+static int
+fanout_recv (
+		int sock,
+		struct fanout_reply *reply,
+		int *fds,
+		int nfds)
+{
+	char cbuf[CMSG_SPACE(FANOUT_NFDS * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int n = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base       = reply;
+	iov.iov_len        = sizeof(struct fanout_reply);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if ( recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(struct fanout_reply) )
+		return LIBUSB_ERROR_IO;
+
+	for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+		if ( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) ) {
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), ((n < nfds) ? n : nfds) * sizeof(int));
+		}
+	}
+
+	if ( reply->status != 0 )
+		return reply->status;
+
+	return ( n == nfds ) ? 0 : LIBUSB_ERROR_IO;
+}
+
+/* cyusb_fanout_attach:
+   Connect to a named fan-out as a consumer.
+ */
+int
+cyusb_fanout_attach (
+		const char *name,
+		int policy,
+		cyusb_fanout_consumer **consumer)
+{
+	struct cyusb_fanout_consumer *cons;
+	struct fanout_hello hello;
+	struct fanout_reply reply;
+	struct sockaddr_un addr;
+	void *map;
+	int fds[FANOUT_NFDS] = { -1, -1, -1, -1, -1 };
+	int i, r;
+
+	if ( consumer == NULL )
+		return LIBUSB_ERROR_INVALID_PARAM;
+	*consumer = NULL;
+
+	r = fanout_socket_path(name, &addr);
+	if ( r )
+		return r;
+
+	cons = (struct cyusb_fanout_consumer *)calloc(1, sizeof(struct cyusb_fanout_consumer));
+	if ( cons == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	cons->policy = policy;
+	cons->evfd   = -1;
+	cons->wake_fd = -1;
+	cons->sock   = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ( cons->sock < 0 ) {
+		free(cons);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	if ( connect(cons->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+		r = ( errno == EACCES ) ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_NOT_FOUND;
+		cyusb_fanout_detach(cons);
+		return r;
+	}
+
+	hello.version = FANOUT_VERSION;
+	hello.policy  = policy;
+	if ( send(cons->sock, &hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello) ) {
+		cyusb_fanout_detach(cons);
+		return LIBUSB_ERROR_IO;
+	}
+
+	r = fanout_recv(cons->sock, &reply, fds, FANOUT_NFDS);
+	cons->evfd    = fds[FANOUT_FD_WAKEUP];
+	cons->wake_fd = fds[FANOUT_FD_PRODUCER];
+	if ( r ) {
+		for ( i = FANOUT_FD_RING; i <= FANOUT_FD_CURSOR; ++i ) {
+			if ( fds[i] >= 0 )
+				close(fds[i]);
+		}
+		cyusb_fanout_detach(cons);
+		return r;
+	}
+
+	/* The mappings stay valid after the descriptors are closed, and after the producer exits.
+	   Only the page of the consumer is writable; everything the producer relies on is not. */
+	cons->ring_size = reply.ring_size;
+	map = mmap(NULL, cons->ring_size, PROT_READ, MAP_SHARED, fds[FANOUT_FD_RING], 0);
+	cons->ring = ( map == MAP_FAILED ) ? NULL : (const unsigned char *)map;
+	cons->ctl_size = reply.ctl_size;
+	map = mmap(NULL, cons->ctl_size, PROT_READ, MAP_SHARED, fds[FANOUT_FD_CONTROL], 0);
+	cons->ctl = ( map == MAP_FAILED ) ? NULL : (const struct fanout_control *)map;
+	cons->cursor_size = reply.cursor_size;
+	map = mmap(NULL, cons->cursor_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[FANOUT_FD_CURSOR], 0);
+	cons->me = ( map == MAP_FAILED ) ? NULL : (struct fanout_cursor *)map;
+	for ( i = FANOUT_FD_RING; i <= FANOUT_FD_CURSOR; ++i )
+		close(fds[i]);
+
+	if ( (cons->ring == NULL) || (cons->ctl == NULL) || (cons->me == NULL) ||
+			(cons->ctl->magic != FANOUT_MAGIC) || (cons->ctl->version != FANOUT_VERSION) ||
+			(reply.index >= CYUSB_FANOUT_CONSUMERS) ) {
+		cyusb_fanout_detach(cons);
+		return LIBUSB_ERROR_IO;
+	}
+
+	cons->slots = (const struct fanout_slot *)(cons->ctl + 1);
+
+	*consumer = cons;
+	return 0;
+}
+
+/* fanout_wait:
+   Wait until data is published past the cursor of a consumer, or the producer goes away.
+ */
+static int
+fanout_wait (
+		struct cyusb_fanout_consumer *cons,
+		unsigned long long cursor,
+		unsigned int timeout)
+{
+	unsigned long long count;
+	struct pollfd fds[2];
+	int r;
+
+	for ( ; ; ) {
+		if ( __atomic_load_n(&cons->ctl->write_seq, __ATOMIC_ACQUIRE) > cursor )
+			return 0;
+
+		/* Checked again once the flag is up, so that data published in between is not
+		   waited for. */
+		__atomic_store_n(&cons->me->waiting, 1, __ATOMIC_SEQ_CST);
+		if ( __atomic_load_n(&cons->ctl->write_seq, __ATOMIC_SEQ_CST) > cursor ) {
+			__atomic_store_n(&cons->me->waiting, 0, __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		fds[0].fd     = cons->evfd;
+		fds[0].events = POLLIN;
+		fds[1].fd     = cons->sock;
+		fds[1].events = POLLIN;
+		r = poll(fds, 2, ( timeout == 0 ) ? -1 : (int)timeout);
+		if ( (r < 0) && (errno == EINTR) )
+			continue;
+		if ( r < 0 )
+			return LIBUSB_ERROR_OTHER;
+		if ( r == 0 )
+			return LIBUSB_ERROR_TIMEOUT;
+
+		if ( fds[1].revents != 0 ) {
+			cons->gone = true;
+			return LIBUSB_ERROR_NO_DEVICE;
+		}
+		read(cons->evfd, &count, sizeof(count));
+	}
+}
+
+/* cyusb_fanout_next:
+   Get the next block of data for a consumer, in place in the ring.
+ */
+int
+cyusb_fanout_next (
+		cyusb_fanout_consumer *cons,
+		const unsigned char **data,
+		unsigned int *length,
+		unsigned int timeout)
+{
+	const struct fanout_control *ctl = cons->ctl;
+	unsigned long long cursor = __atomic_load_n(&cons->me->cursor, __ATOMIC_RELAXED);
+	unsigned long long assigned, skip;
+	const struct fanout_slot *s;
+	int r;
+
+	for ( ; ; ) {
+		if ( cons->gone )
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		r = fanout_wait(cons, cursor, timeout);
+		if ( r )
+			return r;
+
+		/* A consumer that does not block the stream may have been overtaken. It skips to
+		   data that is not about to be handed out again. */
+		assigned = __atomic_load_n(&ctl->assigned_seq, __ATOMIC_ACQUIRE);
+		if ( assigned >= cursor + ctl->nslots ) {
+			skip = assigned - ctl->nslots + ctl->queuedepth;
+			__atomic_store_n(&cons->me->dropped, cons->me->dropped + (skip - cursor), __ATOMIC_RELAXED);
+			cursor = skip;
+			__atomic_store_n(&cons->me->cursor, cursor, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		s = &cons->slots[cursor % ctl->nslots];
+		if ( (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != cursor) || (s->length == 0) ) {
+			/* Slots that received no data are skipped. */
+			cursor++;
+			__atomic_store_n(&cons->me->cursor, cursor, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		*data   = cons->ring + (size_t)(cursor % ctl->nslots) * ctl->slotsize;
+		*length = s->length;
+		return 0;
+	}
+}
+
+/* cyusb_fanout_release:
+   Hand the block returned by cyusb_fanout_next() back to the ring.
+ */
+int
+cyusb_fanout_release (
+		cyusb_fanout_consumer *cons)
+{
+	unsigned long long cursor = __atomic_load_n(&cons->me->cursor, __ATOMIC_RELAXED);
+	unsigned long long one = 1;
+	int r = 0;
+
+	/* Make sure all reads of the data are done before the check. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if ( __atomic_load_n(&cons->ctl->assigned_seq, __ATOMIC_ACQUIRE) >= cursor + cons->ctl->nslots ) {
+		__atomic_store_n(&cons->me->dropped, cons->me->dropped + 1, __ATOMIC_RELAXED);
+		r = LIBUSB_ERROR_OVERFLOW;
+	}
+
+	/* The producer lowers its flag itself once it has room again. */
+	__atomic_store_n(&cons->me->cursor, cursor + 1, __ATOMIC_SEQ_CST);
+	if ( (cons->policy == CYUSB_FANOUT_BLOCK) &&
+			(__atomic_load_n(&cons->ctl->producer_waiting, __ATOMIC_SEQ_CST)) )
+		write(cons->wake_fd, &one, sizeof(one));
+
+	return r;
+}
+
+/* cyusb_fanout_dropped:
+   Get the number of blocks a consumer has lost.
+ */
+unsigned long long
+cyusb_fanout_dropped (
+		cyusb_fanout_consumer *cons)
+{
+	return __atomic_load_n(&cons->me->dropped, __ATOMIC_RELAXED);
+}
+
+/* cyusb_fanout_detach:
+   Disconnect a consumer from its fan-out, and release its mappings.
+ */
+void
+cyusb_fanout_detach (
+		cyusb_fanout_consumer *cons)
+{
+	if ( cons == NULL )
+		return;
+
+	if ( cons->ring != NULL )
+		munmap((void *)cons->ring, cons->ring_size);
+	if ( cons->ctl != NULL )
+		munmap((void *)cons->ctl, cons->ctl_size);
+	if ( cons->me != NULL )
+		munmap(cons->me, cons->cursor_size);
+	if ( cons->evfd >= 0 )
+		close(cons->evfd);
+	if ( cons->wake_fd >= 0 )
+		close(cons->wake_fd);
+	if ( cons->sock >= 0 )
+		close(cons->sock);
+	free(cons);
+}
+
+/*[]*/
+
@@ -0,0 +1,511 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_fx2image.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Parsed FX2/FX2LP firmware images. An Intel hex, C2 load or binary file is	*
+ * parsed once into contiguous segments, which can then be written to the	*
+ * device with as few vendor requests as possible. Parsed images are cached,	*
+ * keyed by the file path, modification time and a hash of the contents, so	*
+ * that downloading the same file again does not parse it again.		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Number of parsed images kept in the cache. */
+#define FX2_CACHE_SIZE				(8)
+
+/* Largest firmware file that will be parsed. A hex file for a full 64 KB image is ~180 KB. */
+#define FX2_MAX_FILE_SIZE			(1024 * 1024)
+
+/* Address of the CPUCS register, and the loader footer in C2 load files. */
+#define FX2_CPUCS_ADDR				(0xE600)
+
+/* Timeout (in milliseconds) for each vendor request used to write the firmware. */
+#define FX2_WRITE_TIMEOUT			(1000)
+
+#define HEX_NIBBLE(c)	((((c) >= '0') && ((c) <= '9')) ? ((c) - '0') : ((((c) | 0x20) - 'a') + 10))
+
+/*
+   struct fx2_cache_entry
+   A parsed image, with the information used to find it in the cache.
+ */
+struct fx2_cache_entry {
+	struct cyusb_fx2_image	image;			/* Parsed image; must be the first member. */
+	char			*path;			/* Path the image was loaded from. */
+	struct timespec		mtime;			/* Modification time of the file. */
+	off_t			size;			/* Size of the file. */
+	unsigned long long	hash;			/* FNV-1a hash of the file contents. */
+	int			refcount;		/* References held by the cache and by callers. */
+	unsigned long long	last_used;		/* For least recently used replacement. */
+};
+
+static struct fx2_cache_entry *fx2_cache[FX2_CACHE_SIZE];
+static unsigned long long fx2_cache_clock;
+static pthread_mutex_t fx2_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* fx2_hash:
+   Get the 64 bit FNV-1a hash of a block of data.
+ */
+static unsigned long long
+fx2_hash (
+		const unsigned char *data,
+		size_t length)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for ( i = 0; i < length; ++i ) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* hex_byte:
+   Convert two hex digits into a byte. Returns -1 if either is not a hex digit.
+ */
+static inline int
+hex_byte (
+		const char *p)
+{
+	if ( !isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]) )
+		return -1;
+
+	return (HEX_NIBBLE(p[0]) << 4) | HEX_NIBBLE(p[1]);
+}
+
+/* fx2_parse_hex:
+   Parse an Intel hex file into the image memory, marking the bytes that are present.
+ */
+static int
+fx2_parse_hex (
+		const char *text,
+		size_t length,
+		unsigned char *mem,
+		unsigned char *present)
+{
+	const char *p = text, *end = text + length;
+	const char *eol;
+	int count, address, type, sum, b;
+	int i;
+
+	while ( p < end ) {
+		eol = (const char *)memchr(p, '\n', end - p);
+		if ( eol == NULL )
+			eol = end;
+
+		/* Skip blank lines, and anything before the start code. */
+		while ( (p < eol) && (*p != ':') )
+			++p;
+		if ( p == eol ) {
+			p = eol + 1;
+			continue;
+		}
+
+		if ( eol - p < 11 )
+			return -EINVAL;
+
+		count   = hex_byte(p + 1);
+		address = (hex_byte(p + 3) << 8) | hex_byte(p + 5);
+		type    = hex_byte(p + 7);
+		if ( (count < 0) || (address < 0) || (type < 0) || (eol - p < 11 + count * 2) )
+			return -EINVAL;
+
+		sum = count + (address >> 8) + (address & 0xFF) + type;
+		for ( i = 0; i <= count; ++i ) {
+			b = hex_byte(p + 9 + i * 2);
+			if ( b < 0 )
+				return -EINVAL;
+			sum += b;
+			if ( (type == 0) && (i < count) )
+				mem[(address + i) & 0xFFFF] = b;
+		}
+		if ( (sum & 0xFF) != 0 ) {
+			printf("Checksum error in hex record\n");
+			return -EINVAL;
+		}
+
+		if ( type == 1 )
+			return 0;
+		if ( type == 0 ) {
+			if ( address + count > CYUSB_FX2_MAX_SIZE )
+				return -EINVAL;
+			memset(present + address, 1, count);
+		}
+
+		p = eol + 1;
+	}
+
+	/* A file without an end record is accepted, as long as it had some data. */
+	return 0;
+}
+
+/* fx2_parse_c2load:
+   Parse a C2 load (IIC) file into the image memory, marking the bytes that are present.
+ */
+static int
+fx2_parse_c2load (
+		const unsigned char *data,
+		size_t length,
+		unsigned char *mem,
+		unsigned char *present)
+{
+	size_t offset = 8;
+	unsigned int count, address;
+
+	while ( length - offset >= 4 ) {
+		count   = (data[offset] << 8) | data[offset + 1];
+		address = (data[offset + 2] << 8) | data[offset + 3];
+		offset += 4;
+
+		/* The footer is a write to CPUCS, which releases the CPU from reset. */
+		if ( (address == FX2_CPUCS_ADDR) && (count == 0x8001) )
+			return 0;
+
+		count &= 0x3FF;
+		if ( (address + count > CYUSB_FX2_MAX_SIZE) || (length - offset < count) )
+			return -EINVAL;
+
+		memcpy(mem + address, data + offset, count);
+		memset(present + address, 1, count);
+		offset += count;
+	}
+
+	return -EINVAL;
+}
+
+/* fx2_build_segments:
+   Collect the bytes that are present into a list of contiguous segments.
+ */
+static int
+fx2_build_segments (
+		struct cyusb_fx2_image *img,
+		const unsigned char *present)
+{
+	unsigned int i, start, n = 0;
+
+	for ( i = 0; i < CYUSB_FX2_MAX_SIZE; ++i ) {
+		if ( present[i] && ((i == 0) || !present[i - 1]) )
+			++n;
+	}
+
+	img->segments = (struct cyusb_fx2_segment *)calloc((n) ? n : 1, sizeof(struct cyusb_fx2_segment));
+	if ( img->segments == NULL )
+		return -ENOMEM;
+
+	img->count    = 0;
+	img->max_addr = 0;
+	for ( i = 0; i < CYUSB_FX2_MAX_SIZE; ) {
+		if ( !present[i] ) {
+			++i;
+			continue;
+		}
+
+		start = i;
+		while ( (i < CYUSB_FX2_MAX_SIZE) && present[i] )
+			++i;
+
+		img->segments[img->count].address = start;
+		img->segments[img->count].length  = i - start;
+		img->segments[img->count].data    = img->mem + start;
+		img->count++;
+		img->max_addr = i;
+	}
+
+	return (img->count) ? 0 : -EINVAL;
+}
+
+/* fx2_parse_image:
+   Parse the contents of a firmware file into a new image.
+ */
+static int
+fx2_parse_image (
+		const unsigned char *data,
+		size_t length,
+		struct fx2_cache_entry *e)
+{
+	struct cyusb_fx2_image *img = &e->image;
+	unsigned char *present;
+	int r;
+
+	img->mem = (unsigned char *)calloc(1, CYUSB_FX2_MAX_SIZE);
+	present  = (unsigned char *)calloc(1, CYUSB_FX2_MAX_SIZE);
+	if ( (img->mem == NULL) || (present == NULL) ) {
+		free(present);
+		return -ENOMEM;
+	}
+
+	if ( (length > 0) && (data[0] == ':') ) {
+		img->format = CYUSB_FX2_FORMAT_HEX;
+		r = fx2_parse_hex((const char *)data, length, img->mem, present);
+	}
+	else if ( (length >= 8) && (data[0] == 0xC2) ) {
+		img->format = CYUSB_FX2_FORMAT_C2LOAD;
+		r = fx2_parse_c2load(data, length, img->mem, present);
+	}
+	else if ( (length > 0) && (data[0] != 0xC0) && (length <= CYUSB_FX2_MAX_SIZE) ) {
+		img->format = CYUSB_FX2_FORMAT_BIN;
+		memcpy(img->mem, data, length);
+		memset(present, 1, length);
+		r = 0;
+	}
+	else
+		r = -EINVAL;
+
+	if ( r == 0 )
+		r = fx2_build_segments(img, present);
+
+	free(present);
+	return r;
+}
+
+/* fx2_free_entry:
+   Free a parsed image.
+ */
+static void
+fx2_free_entry (
+		struct fx2_cache_entry *e)
+{
+	free(e->image.segments);
+	free(e->image.mem);
+	free(e->path);
+	free(e);
+}
+
+/* fx2_cache_insert:
+   Add a newly parsed image to the cache, replacing the least recently used one that is not in use.
+   Must be called with fx2_cache_lock held.
+ */
+static void
+fx2_cache_insert (
+		struct fx2_cache_entry *e)
+{
+	int i, slot = -1;
+
+	for ( i = 0; i < FX2_CACHE_SIZE; ++i ) {
+		if ( fx2_cache[i] == NULL ) {
+			slot = i;
+			break;
+		}
+		if ( (fx2_cache[i]->refcount == 1) &&
+				((slot < 0) || (fx2_cache[i]->last_used < fx2_cache[slot]->last_used)) )
+			slot = i;
+	}
+
+	/* Every cached image is in use; this one is freed when it is released. */
+	if ( slot < 0 )
+		return;
+
+	if ( fx2_cache[slot] != NULL )
+		fx2_free_entry(fx2_cache[slot]);
+
+	e->refcount++;
+	fx2_cache[slot] = e;
+}
+
+/* cyusb_fx2_image_load:
+   Get the parsed image for a firmware file, from the cache if the file has not changed.
+ */
+int
+cyusb_fx2_image_load (
+		const char *filename,
+		struct cyusb_fx2_image **image)
+{
+	struct fx2_cache_entry *e = NULL;
+	struct stat filestat;
+	unsigned char *data;
+	unsigned long long hash;
+	ssize_t nbr;
+	int fd, i, r;
+
+	if ( (filename == NULL) || (image == NULL) )
+		return -EINVAL;
+
+	*image = NULL;
+	if ( stat(filename, &filestat) != 0 )
+		return -ENOENT;
+	if ( (filestat.st_size == 0) || (filestat.st_size > FX2_MAX_FILE_SIZE) )
+		return -EINVAL;
+
+	/* A file that has not been touched since it was parsed does not have to be read at all. */
+	pthread_mutex_lock(&fx2_cache_lock);
+	for ( i = 0; i < FX2_CACHE_SIZE; ++i ) {
+		e = fx2_cache[i];
+		if ( (e != NULL) && (e->size == filestat.st_size) &&
+				(e->mtime.tv_sec == filestat.st_mtim.tv_sec) &&
+				(e->mtime.tv_nsec == filestat.st_mtim.tv_nsec) &&
+				(strcmp(e->path, filename) == 0) ) {
+			e->refcount++;
+			e->last_used = ++fx2_cache_clock;
+			pthread_mutex_unlock(&fx2_cache_lock);
+			*image = &e->image;
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&fx2_cache_lock);
+
+	fd = open(filename, O_RDONLY);
+	if ( fd < 0 )
+		return -ENOENT;
+
+	data = (unsigned char *)malloc(filestat.st_size);
+	if ( data == NULL ) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	nbr = read(fd, data, filestat.st_size);
+	close(fd);
+	if ( nbr != filestat.st_size ) {
+		free(data);
+		return -EIO;
+	}
+
+	/* The same contents may have been parsed already, from a copy or an older timestamp. */
+	hash = fx2_hash(data, nbr);
+	pthread_mutex_lock(&fx2_cache_lock);
+	for ( i = 0; i < FX2_CACHE_SIZE; ++i ) {
+		e = fx2_cache[i];
+		if ( (e != NULL) && (e->size == filestat.st_size) && (e->hash == hash) ) {
+			e->refcount++;
+			e->last_used = ++fx2_cache_clock;
+			pthread_mutex_unlock(&fx2_cache_lock);
+			free(data);
+			*image = &e->image;
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&fx2_cache_lock);
+
+	e = (struct fx2_cache_entry *)calloc(1, sizeof(struct fx2_cache_entry));
+	if ( e == NULL ) {
+		free(data);
+		return -ENOMEM;
+	}
+
+	r = fx2_parse_image(data, nbr, e);
+	free(data);
+	e->path = strdup(filename);
+	if ( (r == 0) && (e->path == NULL) )
+		r = -ENOMEM;
+	if ( r != 0 ) {
+		fx2_free_entry(e);
+		return r;
+	}
+
+	e->mtime    = filestat.st_mtim;
+	e->size     = filestat.st_size;
+	e->hash     = hash;
+	e->refcount = 1;
+
+	pthread_mutex_lock(&fx2_cache_lock);
+	e->last_used = ++fx2_cache_clock;
+	fx2_cache_insert(e);
+	pthread_mutex_unlock(&fx2_cache_lock);
+
+	*image = &e->image;
+	return 0;
+}
+
+/* cyusb_fx2_image_release:
+   Drop a reference to an image obtained from cyusb_fx2_image_load().
+ */
+void
+cyusb_fx2_image_release (
+		struct cyusb_fx2_image *image)
+{
+	struct fx2_cache_entry *e = (struct fx2_cache_entry *)image;
+
+	if ( image == NULL )
+		return;
+
+	pthread_mutex_lock(&fx2_cache_lock);
+	if ( --e->refcount == 0 )
+		fx2_free_entry(e);
+	pthread_mutex_unlock(&fx2_cache_lock);
+}
+
+/* cyusb_fx2_image_write:
+   Write the parts of an image that fall in the address range [start, end) to the device, using
+   the specified vendor request. The requests are queued several at a time.
+ */
+int
+cyusb_fx2_image_write (
+		libusb_device_handle *h,
+		const struct cyusb_fx2_image *image,
+		unsigned char vendor_command,
+		unsigned int start,
+		unsigned int end)
+{
+	const struct cyusb_fx2_segment *seg;
+	struct cyusb_control_req *reqs;
+	unsigned int address, last, len;
+	unsigned int n = 0, pass;
+	int count = 0;
+	unsigned int i;
+	int r;
+
+	/* The first pass counts the requests, and the second one fills them in. */
+	reqs = NULL;
+	for ( pass = 0; pass < 2; ++pass ) {
+		for ( i = 0; i < image->count; ++i ) {
+			seg     = &image->segments[i];
+			address = (seg->address > start) ? seg->address : start;
+			last    = seg->address + seg->length;
+			if ( last > end )
+				last = end;
+
+			for ( ; address < last; address += len ) {
+				len = last - address;
+				if ( len > CYUSB_FX2_MAX_WRITE )
+					len = CYUSB_FX2_MAX_WRITE;
+
+				if ( reqs != NULL ) {
+					reqs[n].bmRequestType = 0x40;
+					reqs[n].bRequest      = vendor_command;
+					reqs[n].wValue        = address;
+					reqs[n].wLength       = len;
+					reqs[n].data          = image->mem + address;
+					reqs[n].timeout       = FX2_WRITE_TIMEOUT;
+					count += len;
+				}
+				n++;
+			}
+		}
+
+		if ( (pass == 0) && (n != 0) ) {
+			reqs = (struct cyusb_control_req *)calloc(n, sizeof(struct cyusb_control_req));
+			if ( reqs == NULL )
+				return LIBUSB_ERROR_NO_MEM;
+			n = 0;
+		}
+	}
+
+	if ( reqs == NULL )
+		return 0;
+
+	r = cyusb_control_batch(h, reqs, n, 0, 0);
+	free(reqs);
+	if ( r ) {
+		printf("Error in control_transfer\n");
+		return r;
+	}
+
+	return count;
+}
+
+/*[]*/
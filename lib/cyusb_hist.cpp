@@ -0,0 +1,211 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_hist.cpp					*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Log-linear histograms for latency measurements. Each power of two range	*
+ * of values is split into 2^CYUSB_HIST_SUB_BITS equal buckets, which keeps	*
+ * the relative error of any reported value under 1 / 2^CYUSB_HIST_SUB_BITS	*
+ * while recording stays a handful of instructions.				*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+#define HIST_SUB_COUNT			(1ULL << CYUSB_HIST_SUB_BITS)
+#define HIST_SUB_MASK			(HIST_SUB_COUNT - 1)
+
+/* hist_index:
+   Get the bucket index for a value.
+ */
+static inline unsigned int
+hist_index (
+		unsigned long long value)
+{
+	unsigned int msb;
+
+	if ( value < HIST_SUB_COUNT )
+		return (unsigned int)value;
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - CYUSB_HIST_SUB_BITS + 1) << CYUSB_HIST_SUB_BITS) +
+		(unsigned int)((value >> (msb - CYUSB_HIST_SUB_BITS)) & HIST_SUB_MASK);
+}
+
+/* hist_lowest:
+   Get the lowest value that is counted in a bucket.
+ */
+static inline unsigned long long
+hist_lowest (
+		unsigned int index)
+{
+	unsigned int row = index >> CYUSB_HIST_SUB_BITS;
+
+	if ( row == 0 )
+		return index;
+
+	return (HIST_SUB_COUNT + (index & HIST_SUB_MASK)) << (row - 1);
+}
+
+/* hist_highest:
+   Get the highest value that is counted in a bucket.
+ */
+static inline unsigned long long
+hist_highest (
+		unsigned int index)
+{
+	unsigned int row = index >> CYUSB_HIST_SUB_BITS;
+
+	if ( row == 0 )
+		return index;
+
+	return hist_lowest(index) + (1ULL << (row - 1)) - 1;
+}
+
+/* cyusb_hist_reset:
+   Clear all the values recorded in a histogram.
+ */
+void
+cyusb_hist_reset (
+		struct cyusb_hist *hist)
+{
+	memset(hist, 0, sizeof(struct cyusb_hist));
+	hist->min = ~0ULL;
+}
+
+/* cyusb_hist_record:
+   Record one value in a histogram.
+ */
+void
+cyusb_hist_record (
+		struct cyusb_hist *hist,
+		unsigned long long value)
+{
+	hist->buckets[hist_index(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if ( value < hist->min )
+		hist->min = value;
+	if ( value > hist->max )
+		hist->max = value;
+}
+
+/* cyusb_hist_diff:
+   Get the values recorded in a histogram after an earlier snapshot of it was taken. The
+   minimum and maximum are only accurate to the bucket resolution.
+ */
+void
+cyusb_hist_diff (
+		struct cyusb_hist *result,
+		const struct cyusb_hist *now,
+		const struct cyusb_hist *before)
+{
+	unsigned int i, last = 0;
+
+	cyusb_hist_reset(result);
+	for ( i = 0; i < CYUSB_HIST_BUCKETS; ++i ) {
+		result->buckets[i] = now->buckets[i] - before->buckets[i];
+		if ( result->buckets[i] != 0 ) {
+			if ( result->count == 0 )
+				result->min = hist_lowest(i);
+			result->count += result->buckets[i];
+			last = i;
+		}
+	}
+	result->sum = now->sum - before->sum;
+
+	if ( result->count == 0 )
+		return;
+
+	/* Use the exact maximum if it was recorded in the same bucket. */
+	result->max = hist_highest(last);
+	if ( (now->max >= hist_lowest(last)) && (now->max <= result->max) )
+		result->max = now->max;
+}
+
+/* cyusb_hist_add:
+   Add the values recorded in one histogram to another, for example to combine the histograms
+   of several streams.
+ */
+void
+cyusb_hist_add (
+		struct cyusb_hist *total,
+		const struct cyusb_hist *hist)
+{
+	unsigned int i;
+
+	if ( hist->count == 0 )
+		return;
+
+	for ( i = 0; i < CYUSB_HIST_BUCKETS; ++i )
+		total->buckets[i] += hist->buckets[i];
+	total->count += hist->count;
+	total->sum   += hist->sum;
+	if ( hist->min < total->min )
+		total->min = hist->min;
+	if ( hist->max > total->max )
+		total->max = hist->max;
+}
+
+/* cyusb_hist_percentile:
+   Get the value below which the given percentage of recorded values fall.
+ */
+unsigned long long
+cyusb_hist_percentile (
+		const struct cyusb_hist *hist,
+		double percentile)
+{
+	unsigned long long target;
+	unsigned long long seen = 0;
+	unsigned int i;
+
+	if ( hist->count == 0 )
+		return 0;
+
+	if ( percentile >= 100.0 )
+		return hist->max;
+
+	target = (unsigned long long)((percentile / 100.0) * hist->count + 0.5);
+	if ( target == 0 )
+		target = 1;
+
+	for ( i = 0; i < CYUSB_HIST_BUCKETS; ++i ) {
+		seen += hist->buckets[i];
+		if ( seen >= target ) {
+			if ( hist_highest(i) > hist->max )
+				return hist->max;
+			return hist_highest(i);
+		}
+	}
+
+	return hist->max;
+}
+
+/* cyusb_hist_count_below:
+   Get the number of recorded values that are below the given value, to the resolution of the
+   histogram: values in the same bucket as it are not counted.
+ */
+unsigned long long
+cyusb_hist_count_below (
+		const struct cyusb_hist *hist,
+		unsigned long long value)
+{
+	unsigned long long count = 0;
+	unsigned int last = hist_index(value);
+	unsigned int i;
+
+	if ( last > CYUSB_HIST_BUCKETS )
+		last = CYUSB_HIST_BUCKETS;
+
+	for ( i = 0; i < last; ++i )
+		count += hist->buckets[i];
+
+	return count;
+}
+
+/*[]*/
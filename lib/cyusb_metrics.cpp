@@ -0,0 +1,415 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_metrics.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Per-device, per-endpoint counters kept in a POSIX shared memory segment.	*
+ * The segment is created by cyusbd, which tracks device arrivals; every	*
+ * process that streams with the library attaches to it and updates the	*
+ * counters of its endpoints in place. Readers map the segment read-only, so	*
+ * reading the counters never involves the streaming processes. The segment	*
+ * is writable by its group, which can be set with MetricsGroup in		*
+ * /etc/cyusb.conf, so that streams of other users than cyusbd can attach.	*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <time.h>
+#include <grp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Permissions of the segment: streams of the group update it, anybody may read it. */
+#define METRICS_MODE		(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)
+
+/* Group allowed to update the segment, from /etc/cyusb.conf (in libcyusb.cpp). */
+extern char metricsgroup[];
+
+/* Segment mapped read-write by this process, if any. */
+static struct cyusb_metrics *metrics = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether a failure to attach to the segment has been reported already. */
+static bool metrics_reported = false;
+
+/* metrics_set_owner:
+   Make the segment writable by its group, and give it to the configured group if there is one.
+   The mode is set explicitly, as the one given to shm_open() is reduced by the umask.
+ */
+static void
+metrics_set_owner (
+		int fd)
+{
+	struct group *gr;
+
+	if ( fchmod(fd, METRICS_MODE) != 0 )
+		printf("Library: Cannot set the permissions of %s: %s\n", CYUSB_METRICS_NAME, strerror(errno));
+
+	if ( metricsgroup[0] == '\0' )
+		return;
+
+	gr = getgrnam(metricsgroup);
+	if ( gr == NULL )
+		printf("Library: Unknown MetricsGroup %s in /etc/cyusb.conf\n", metricsgroup);
+	else if ( fchown(fd, (uid_t)-1, gr->gr_gid) != 0 )
+		printf("Library: Cannot give %s to group %s: %s\n", CYUSB_METRICS_NAME, metricsgroup, strerror(errno));
+}
+
+/* metrics_valid:
+   Check whether a mapped segment has the layout this library was built with.
+ */
+static bool
+metrics_valid (
+		const struct cyusb_metrics *m,
+		size_t size)
+{
+	return ( (size >= sizeof(struct cyusb_metrics)) &&
+		 (m->magic == CYUSB_METRICS_MAGIC) && (m->version == CYUSB_METRICS_VERSION) &&
+		 (m->size == sizeof(struct cyusb_metrics)) &&
+		 (m->ndevices == CYUSB_METRICS_DEVICES) && (m->nendpoints == CYUSB_METRICS_ENDPOINTS) );
+}
+
+/* metrics_open:
+   Open and map the segment. The caller holds metrics_lock.
+ */
+static int
+metrics_open (
+		bool create)
+{
+	struct cyusb_metrics *m;
+	struct stat st;
+	int fd;
+	int r = 0;
+
+	if ( metrics != NULL )
+		return 0;
+
+	fd = shm_open(CYUSB_METRICS_NAME, (create) ? (O_RDWR | O_CREAT) : O_RDWR, METRICS_MODE);
+	if ( fd < 0 )
+		return -errno;
+
+	if ( create )
+		metrics_set_owner(fd);
+
+	if ( fstat(fd, &st) != 0 ) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+
+	/* Only the daemon sizes the segment; a segment that is still being set up is not used. */
+	if ( ((size_t)st.st_size != sizeof(struct cyusb_metrics)) ) {
+		if ( (!create) || (ftruncate(fd, sizeof(struct cyusb_metrics)) != 0) ) {
+			r = (create) ? -errno : -ENODEV;
+			close(fd);
+			return r;
+		}
+	}
+
+	m = (struct cyusb_metrics *)mmap(NULL, sizeof(struct cyusb_metrics), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	r = ( m == MAP_FAILED ) ? -errno : 0;
+	close(fd);
+	if ( r )
+		return r;
+
+	if ( !metrics_valid(m, sizeof(struct cyusb_metrics)) ) {
+		if ( !create ) {
+			munmap(m, sizeof(struct cyusb_metrics));
+			return -ENODEV;
+		}
+
+		/* A new segment, or one from a library with a different layout. The magic number is
+		   written last, so that nobody else uses the segment before it is complete. */
+		memset(m, 0, sizeof(struct cyusb_metrics));
+		m->version    = CYUSB_METRICS_VERSION;
+		m->size       = sizeof(struct cyusb_metrics);
+		m->ndevices   = CYUSB_METRICS_DEVICES;
+		m->nendpoints = CYUSB_METRICS_ENDPOINTS;
+		m->created    = time(NULL);
+		__atomic_store_n(&m->magic, CYUSB_METRICS_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	if ( create )
+		m->publisher = getpid();
+
+	metrics = m;
+	return 0;
+}
+
+/* metrics_find:
+   Find the slot of a device by its bus and port path, claiming a free slot for it if it has
+   none and claim is set. The caller holds metrics_lock.
+ */
+static struct cyusb_dev_metrics *
+metrics_find (
+		libusb_device *dev,
+		bool claim,
+		bool *added)
+{
+	struct libusb_device_descriptor desc;
+	struct cyusb_dev_metrics *d;
+	unsigned char ports[7];
+	unsigned char busnum = libusb_get_bus_number(dev);
+	unsigned int state;
+	int n;
+	int i;
+
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	if ( n < 0 )
+		n = 0;
+
+	*added = false;
+	for ( i = 0; i < CYUSB_METRICS_DEVICES; ++i ) {
+		d = &metrics->dev[i];
+		state = __atomic_load_n(&d->state, __ATOMIC_ACQUIRE);
+		if ( (state == CYUSB_METRICS_PRESENT) || (state == CYUSB_METRICS_GONE) ) {
+			if ( (d->busnum == busnum) && (d->nports == n) && (memcmp(d->ports, ports, n) == 0) )
+				return d;
+		}
+	}
+	if ( !claim )
+		return NULL;
+
+	/* Other processes may be claiming slots at the same time. */
+	for ( i = 0; i < CYUSB_METRICS_DEVICES; ++i ) {
+		d = &metrics->dev[i];
+		state = CYUSB_METRICS_FREE;
+		if ( !__atomic_compare_exchange_n(&d->state, &state, CYUSB_METRICS_CLAIMED, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
+			continue;
+
+		memset(&d->vid, 0, offsetof(struct cyusb_dev_metrics, ep) - offsetof(struct cyusb_dev_metrics, vid));
+		memset(d->ep, 0, sizeof(d->ep));
+		libusb_get_device_descriptor(dev, &desc);
+		d->vid     = desc.idVendor;
+		d->pid     = desc.idProduct;
+		d->busnum  = busnum;
+		d->devaddr = libusb_get_device_address(dev);
+		d->nports  = n;
+		memcpy(d->ports, ports, n);
+		d->arrived = time(NULL);
+		__atomic_store_n(&d->state, CYUSB_METRICS_PRESENT, __ATOMIC_RELEASE);
+
+		*added = true;
+		return d;
+	}
+
+	return NULL;
+}
+
+/* cyusb_metrics_create:
+   Create the metrics segment, or attach to the existing one, on behalf of the daemon.
+ */
+int
+cyusb_metrics_create (
+		void)
+{
+	int r;
+
+	pthread_mutex_lock(&metrics_lock);
+	r = metrics_open(true);
+	pthread_mutex_unlock(&metrics_lock);
+
+	return r;
+}
+
+/* cyusb_metrics_release:
+   Unmap the metrics segment from this process.
+ */
+void
+cyusb_metrics_release (
+		void)
+{
+	pthread_mutex_lock(&metrics_lock);
+	if ( metrics != NULL )
+		munmap(metrics, sizeof(struct cyusb_metrics));
+	metrics = NULL;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/* cyusb_metrics_map:
+   Map an existing metrics segment read-only.
+ */
+const struct cyusb_metrics *
+cyusb_metrics_map (
+		void)
+{
+	struct cyusb_metrics *m;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(CYUSB_METRICS_NAME, O_RDONLY, 0);
+	if ( fd < 0 )
+		return NULL;
+
+	if ( (fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct cyusb_metrics)) ) {
+		close(fd);
+		return NULL;
+	}
+
+	m = (struct cyusb_metrics *)mmap(NULL, sizeof(struct cyusb_metrics), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( m == MAP_FAILED )
+		return NULL;
+
+	if ( !metrics_valid(m, st.st_size) ) {
+		munmap(m, sizeof(struct cyusb_metrics));
+		return NULL;
+	}
+
+	return m;
+}
+
+/* cyusb_metrics_unmap:
+   Unmap a segment mapped by cyusb_metrics_map().
+ */
+void
+cyusb_metrics_unmap (
+		const struct cyusb_metrics *m)
+{
+	if ( m != NULL )
+		munmap((void *)m, sizeof(struct cyusb_metrics));
+}
+
+/* cyusb_metrics_arrived:
+   Record the arrival of a device, keeping its slot across re-enumerations.
+ */
+int
+cyusb_metrics_arrived (
+		libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+	struct cyusb_dev_metrics *d;
+	bool added;
+	int r;
+
+	pthread_mutex_lock(&metrics_lock);
+	if ( metrics == NULL ) {
+		pthread_mutex_unlock(&metrics_lock);
+		return -ENODEV;
+	}
+
+	d = metrics_find(dev, true, &added);
+	if ( d == NULL ) {
+		pthread_mutex_unlock(&metrics_lock);
+		return -ENOSPC;
+	}
+
+	if ( !added ) {
+		libusb_get_device_descriptor(dev, &desc);
+		d->vid     = desc.idVendor;
+		d->pid     = desc.idProduct;
+		d->devaddr = libusb_get_device_address(dev);
+		d->arrived = time(NULL);
+		__atomic_store_n(&d->state, CYUSB_METRICS_PRESENT, __ATOMIC_RELEASE);
+	}
+	__atomic_add_fetch(&d->enumerations, 1, __ATOMIC_RELAXED);
+
+	r = d - metrics->dev;
+	pthread_mutex_unlock(&metrics_lock);
+	return r;
+}
+
+/* cyusb_metrics_left:
+   Record that a device has left.
+ */
+void
+cyusb_metrics_left (
+		libusb_device *dev)
+{
+	struct cyusb_dev_metrics *d;
+	bool added;
+
+	pthread_mutex_lock(&metrics_lock);
+	if ( metrics != NULL ) {
+		d = metrics_find(dev, false, &added);
+		if ( d != NULL )
+			__atomic_store_n(&d->state, CYUSB_METRICS_GONE, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+/* cyusb_metrics_endpoint:
+   Get the counters of an endpoint, attaching to the segment if needed.
+ */
+struct cyusb_ep_metrics *
+cyusb_metrics_endpoint (
+		libusb_device *dev,
+		unsigned char endpoint)
+{
+	struct cyusb_dev_metrics *d = NULL;
+	bool added;
+	int r;
+
+	pthread_mutex_lock(&metrics_lock);
+	r = metrics_open(false);
+	if ( r == 0 )
+		d = metrics_find(dev, true, &added);
+	else if ( (r != -ENOENT) && (!metrics_reported) ) {
+		/* No segment just means that cyusbd is not running; anything else is worth knowing. */
+		printf("Library: Cannot attach to the metrics segment %s: %s\n", CYUSB_METRICS_NAME, strerror(-r));
+		metrics_reported = true;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	return ( d != NULL ) ? &d->ep[CYUSB_METRICS_EP_SLOT(endpoint)] : NULL;
+}
+
+/* cyusb_metrics_add:
+   Account for a completed transfer.
+ */
+void
+cyusb_metrics_add (
+		struct cyusb_ep_metrics *m,
+		enum libusb_transfer_status status,
+		unsigned int length)
+{
+	if ( m == NULL )
+		return;
+
+	if ( status == LIBUSB_TRANSFER_COMPLETED ) {
+		__atomic_add_fetch(&m->transfers, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&m->bytes, length, __ATOMIC_RELAXED);
+	}
+	else if ( status != LIBUSB_TRANSFER_CANCELLED ) {
+		__atomic_add_fetch(&m->failures, 1, __ATOMIC_RELAXED);
+		if ( status == LIBUSB_TRANSFER_TIMED_OUT )
+			__atomic_add_fetch(&m->timeouts, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* cyusb_metrics_resubmit:
+   Account for the time a completed transfer took to be queued again.
+ */
+void
+cyusb_metrics_resubmit (
+		struct cyusb_ep_metrics *m,
+		unsigned long long ns)
+{
+	unsigned long long max;
+
+	if ( m == NULL )
+		return;
+
+	__atomic_add_fetch(&m->resubmits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->resubmit_ns, ns, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&m->resubmit_max_ns, __ATOMIC_RELAXED);
+	while ( (ns > max) && (!__atomic_compare_exchange_n(&m->resubmit_max_ns, &max, ns, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) )
+		;
+}
+
+/*[]*/
+
@@ -0,0 +1,557 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_pattern.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Data pattern generation and verification for the cyusb library. The	*
+ * patterns match the ones produced by the source/sink firmware examples:	*
+ * a constant byte, incrementing 8/16/32-bit counters, and a 32-bit LFSR.	*
+ * Verification compares 32 bytes at a time using vector types, and only	*
+ * drops to a per-element compare for blocks that contain a mismatch.		*
+ * Generation stores 32 bytes at a time in the same way. Payloads for OUT	*
+ * streams come from a pattern, or from a file mapped into memory.		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Feedback taps of the 32-bit Galois LFSR (x^32 + x^22 + x^2 + x + 1). */
+#define PATTERN_LFSR_TAPS		(0x80200003U)
+
+/* Size in bytes of the vectors used for verification. */
+#define PATTERN_VEC_SIZE		(32)
+
+/* Number of vectors compared before the results are tested. */
+#define PATTERN_VEC_GROUP		(4)
+
+typedef unsigned char  pattern_v8  __attribute__ ((vector_size (PATTERN_VEC_SIZE)));
+typedef unsigned short pattern_v16 __attribute__ ((vector_size (PATTERN_VEC_SIZE)));
+typedef unsigned int   pattern_v32 __attribute__ ((vector_size (PATTERN_VEC_SIZE)));
+
+/* Prefix of a payload specification naming a file instead of a pattern. */
+#define PAYLOAD_FILE_PREFIX		"file:"
+
+/* Source of the data sent by an OUT stream. */
+struct cyusb_payload {
+	struct cyusb_pattern	pattern;		/* Pattern generator, if there is no file. */
+	const unsigned char	*map;			/* File, mapped read-only; NULL for a pattern. */
+	size_t			size;			/* Size of the file. */
+	size_t			pos;			/* Offset in the file of the next byte sent. */
+};
+
+/* Names of the patterns, indexed by pattern type. */
+static const char *pattern_names[] = { "const", "inc8", "inc16", "inc32", "lfsr" };
+
+/* pattern_width:
+   Get the size in bytes of one element of a pattern.
+ */
+static inline unsigned int
+pattern_width (
+		int type)
+{
+	switch ( type ) {
+		case CYUSB_PATTERN_INC16:
+			return 2;
+		case CYUSB_PATTERN_INC32:
+		case CYUSB_PATTERN_LFSR:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+/* pattern_load:
+   Read the element at an index from a buffer. Elements are stored little endian.
+ */
+static inline unsigned int
+pattern_load (
+		const unsigned char *buf,
+		unsigned int width,
+		size_t index)
+{
+	const unsigned char *ptr = buf + index * width;
+
+	switch ( width ) {
+		case 2:
+			return ptr[0] | (ptr[1] << 8);
+		case 4:
+			return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int)ptr[3] << 24);
+		default:
+			return ptr[0];
+	}
+}
+
+/* pattern_step:
+   Get the element that follows a value in a pattern.
+ */
+static inline unsigned int
+pattern_step (
+		int type,
+		unsigned int value)
+{
+	switch ( type ) {
+		case CYUSB_PATTERN_INC8:
+			return (value + 1) & 0xFF;
+		case CYUSB_PATTERN_INC16:
+			return (value + 1) & 0xFFFF;
+		case CYUSB_PATTERN_INC32:
+			return value + 1;
+		case CYUSB_PATTERN_LFSR:
+			return (value >> 1) ^ ((0U - (value & 1)) & PATTERN_LFSR_TAPS);
+		default:
+			return value;
+	}
+}
+
+/* vec_any:
+   Check whether any bit is set in a vector of XORed data and expected values.
+ */
+static inline bool
+vec_any (
+		const void *mask)
+{
+	unsigned long long q[PATTERN_VEC_SIZE / 8];
+	unsigned long long r = 0;
+	unsigned int i;
+
+	memcpy(q, mask, PATTERN_VEC_SIZE);
+	for ( i = 0; i < PATTERN_VEC_SIZE / 8; ++i )
+		r |= q[i];
+
+	return (r != 0);
+}
+
+/* scan_counter:
+   Skip over the vector sized blocks that match a constant or counter pattern, starting at element
+   index. Returns the index of the first block that has a mismatch (or of the partial block at the
+   end of the buffer), and updates *next to the value expected there.
+ */
+template <typename V, typename T>
+static size_t
+scan_counter (
+		const unsigned char *buf,
+		size_t count,
+		size_t index,
+		unsigned int *next,
+		T increment)
+{
+	const size_t lanes = PATTERN_VEC_SIZE / sizeof(T);
+	V expected, advance, data, mask, zero = {};
+	T value = (T)*next;
+	size_t i;
+
+	/* expected holds the next block of the pattern, and advance moves it on by one block. */
+	for ( i = 0; i < lanes; ++i ) {
+		expected[i] = (T)(value + i * increment);
+		advance[i]  = (T)(lanes * increment);
+	}
+
+	/* Test the compare results once for every PATTERN_VEC_GROUP blocks. */
+	for ( ; index + lanes * PATTERN_VEC_GROUP <= count; index += lanes * PATTERN_VEC_GROUP ) {
+		mask = zero;
+		for ( i = 0; i < PATTERN_VEC_GROUP; ++i ) {
+			memcpy(&data, buf + (index + i * lanes) * sizeof(T), PATTERN_VEC_SIZE);
+			mask |= expected ^ data;
+			expected += advance;
+		}
+		if ( vec_any(&mask) ) {
+			expected -= advance * PATTERN_VEC_GROUP;
+			break;
+		}
+	}
+
+	for ( ; index + lanes <= count; index += lanes ) {
+		memcpy(&data, buf + index * sizeof(T), PATTERN_VEC_SIZE);
+		mask = expected ^ data;
+		if ( vec_any(&mask) )
+			break;
+		expected += advance;
+	}
+
+	*next = expected[0];
+	return index;
+}
+
+/* scan_lfsr:
+   Skip over the vector sized blocks in which every word is the LFSR successor of the word before
+   it. Element index must be at least 1. *next is only updated if any block was skipped.
+ */
+static size_t
+scan_lfsr (
+		const unsigned char *buf,
+		size_t count,
+		size_t index,
+		unsigned int *next)
+{
+	const size_t lanes = PATTERN_VEC_SIZE / sizeof(unsigned int);
+	pattern_v32 prev, data, expected, mask, zero = {};
+	size_t start = index;
+	size_t i;
+
+	for ( ; index + lanes * PATTERN_VEC_GROUP <= count; index += lanes * PATTERN_VEC_GROUP ) {
+		mask = zero;
+		for ( i = 0; i < PATTERN_VEC_GROUP; ++i ) {
+			memcpy(&prev, buf + (index + i * lanes - 1) * 4, PATTERN_VEC_SIZE);
+			memcpy(&data, buf + (index + i * lanes) * 4, PATTERN_VEC_SIZE);
+			expected = (prev >> 1) ^ ((0U - (prev & 1)) & PATTERN_LFSR_TAPS);
+			mask |= expected ^ data;
+		}
+		if ( vec_any(&mask) )
+			break;
+	}
+
+	for ( ; index + lanes <= count; index += lanes ) {
+		memcpy(&prev, buf + (index - 1) * 4, PATTERN_VEC_SIZE);
+		memcpy(&data, buf + index * 4, PATTERN_VEC_SIZE);
+		expected = (prev >> 1) ^ ((0U - (prev & 1)) & PATTERN_LFSR_TAPS);
+		mask = expected ^ data;
+		if ( vec_any(&mask) )
+			break;
+	}
+
+	/* The words that were skipped all follow on from each other, so the last one is good. */
+	if ( index != start )
+		*next = pattern_step(CYUSB_PATTERN_LFSR, pattern_load(buf, 4, index - 1));
+	return index;
+}
+
+/* fill_counter:
+   Store vector sized blocks of a constant or counter pattern, starting with *next, for as long
+   as whole blocks fit in count elements. Returns the number of elements stored, and updates
+   *next to the element that follows them.
+ */
+template <typename V, typename T>
+static size_t
+fill_counter (
+		unsigned char *buf,
+		size_t count,
+		unsigned int *next,
+		T increment)
+{
+	const size_t lanes = PATTERN_VEC_SIZE / sizeof(T);
+	V value, advance;
+	size_t index = 0;
+	size_t i;
+
+	for ( i = 0; i < lanes; ++i ) {
+		value[i]   = (T)(*next + i * increment);
+		advance[i] = (T)(lanes * increment);
+	}
+
+	for ( ; index + lanes <= count; index += lanes ) {
+		memcpy(buf + index * sizeof(T), &value, PATTERN_VEC_SIZE);
+		value += advance;
+	}
+
+	*next = (T)(*next + index * increment);
+	return index;
+}
+
+/* cyusb_pattern_parse:
+   Parse a pattern specification of the form name[:seed].
+ */
+int
+cyusb_pattern_parse (
+		const char *spec,
+		int *type,
+		unsigned int *seed)
+{
+	const char *sep = strchr(spec, ':');
+	size_t len = (sep != NULL) ? (size_t)(sep - spec) : strlen(spec);
+	char *end;
+	int i;
+
+	for ( i = 0; i < (int)(sizeof(pattern_names) / sizeof(pattern_names[0])); ++i ) {
+		if ( (strlen(pattern_names[i]) == len) && (strncasecmp(spec, pattern_names[i], len) == 0) )
+			break;
+	}
+	if ( i == (int)(sizeof(pattern_names) / sizeof(pattern_names[0])) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*type = i;
+	*seed = (i == CYUSB_PATTERN_LFSR) ? 1 : 0;
+	if ( sep != NULL ) {
+		*seed = strtoul(sep + 1, &end, 0);
+		if ( (end == sep + 1) || (*end != '\0') )
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	return 0;
+}
+
+/* cyusb_pattern_name:
+   Get the name of a pattern type.
+ */
+const char *
+cyusb_pattern_name (
+		int type)
+{
+	if ( (type < 0) || (type >= (int)(sizeof(pattern_names) / sizeof(pattern_names[0]))) )
+		return "unknown";
+
+	return pattern_names[type];
+}
+
+/* cyusb_pattern_init:
+   Set up a pattern generator/checker that starts with the seed value.
+ */
+void
+cyusb_pattern_init (
+		struct cyusb_pattern *pat,
+		int type,
+		unsigned int seed)
+{
+	memset(pat, 0, sizeof(struct cyusb_pattern));
+	pat->type        = type;
+	pat->width       = pattern_width(type);
+	pat->next        = seed & ((pat->width == 4) ? 0xFFFFFFFFU : ((1U << (pat->width * 8)) - 1));
+	pat->synced      = 1;
+	pat->first_error = CYUSB_PATTERN_NO_ERROR;
+
+	/* An LFSR stuck at zero never moves on. */
+	if ( (type == CYUSB_PATTERN_LFSR) && (pat->next == 0) )
+		pat->next = 1;
+}
+
+/* cyusb_pattern_resync:
+   Take the next element that is checked as the new start of the sequence.
+ */
+void
+cyusb_pattern_resync (
+		struct cyusb_pattern *pat)
+{
+	if ( pat->type != CYUSB_PATTERN_CONST )
+		pat->synced = 0;
+}
+
+/* cyusb_pattern_fill:
+   Fill a buffer with the next part of the pattern. Any bytes after the last complete element
+   are set to zero.
+ */
+void
+cyusb_pattern_fill (
+		struct cyusb_pattern *pat,
+		unsigned char *buf,
+		unsigned int length)
+{
+	unsigned int count = length / pat->width;
+	unsigned int i = 0, b;
+	unsigned int value;
+
+	/* Whole blocks first; an LFSR word depends on the one before it, so it stays serial. */
+	switch ( pat->type ) {
+		case CYUSB_PATTERN_CONST:
+			memset(buf, pat->next, count);
+			i = count;
+			break;
+		case CYUSB_PATTERN_INC8:
+			i = fill_counter<pattern_v8, unsigned char>(buf, count, &pat->next, 1);
+			break;
+		case CYUSB_PATTERN_INC16:
+			i = fill_counter<pattern_v16, unsigned short>(buf, count, &pat->next, 1);
+			break;
+		case CYUSB_PATTERN_INC32:
+			i = fill_counter<pattern_v32, unsigned int>(buf, count, &pat->next, 1);
+			break;
+	}
+
+	value = pat->next;
+	for ( ; i < count; ++i ) {
+		for ( b = 0; b < pat->width; ++b )
+			buf[i * pat->width + b] = (unsigned char)(value >> (b * 8));
+		value = pattern_step(pat->type, value);
+	}
+	memset(buf + count * pat->width, 0, length - count * pat->width);
+
+	pat->next    = value;
+	pat->offset += length;
+}
+
+/* cyusb_pattern_verify:
+   Check a buffer against the pattern, continuing from where the previous buffer ended. Returns
+   the number of elements that did not match.
+ */
+unsigned long long
+cyusb_pattern_verify (
+		struct cyusb_pattern *pat,
+		const unsigned char *buf,
+		unsigned int length)
+{
+	const size_t lanes = PATTERN_VEC_SIZE / pat->width;
+	size_t count = length / pat->width;
+	size_t i = 0, end;
+	unsigned long long errors = 0;
+	unsigned int value;
+
+	while ( i < count ) {
+		/* Skip the blocks that match, as long as we know what to expect. */
+		if ( pat->synced ) {
+			switch ( pat->type ) {
+				case CYUSB_PATTERN_CONST:
+					i = scan_counter<pattern_v8, unsigned char>(buf, count, i, &pat->next, 0);
+					break;
+				case CYUSB_PATTERN_INC8:
+					i = scan_counter<pattern_v8, unsigned char>(buf, count, i, &pat->next, 1);
+					break;
+				case CYUSB_PATTERN_INC16:
+					i = scan_counter<pattern_v16, unsigned short>(buf, count, i, &pat->next, 1);
+					break;
+				case CYUSB_PATTERN_INC32:
+					i = scan_counter<pattern_v32, unsigned int>(buf, count, i, &pat->next, 1);
+					break;
+				case CYUSB_PATTERN_LFSR:
+					if ( i != 0 )
+						i = scan_lfsr(buf, count, i, &pat->next);
+					break;
+			}
+		}
+
+		/* Check the next block one element at a time. */
+		end = (i + lanes < count) ? (i + lanes) : count;
+		for ( ; i < end; ++i ) {
+			value = pattern_load(buf, pat->width, i);
+			if ( !pat->synced ) {
+				pat->synced = 1;
+			}
+			else if ( value != pat->next ) {
+				if ( pat->first_error == CYUSB_PATTERN_NO_ERROR )
+					pat->first_error = pat->offset + i * pat->width;
+				errors++;
+
+				/* If the element after this one follows on from the expected value, only this
+				   element is corrupt. Otherwise data was lost or inserted, and the sequence
+				   restarts from this element. */
+				if ( (i + 1 < count) &&
+						(pattern_load(buf, pat->width, i + 1) == pattern_step(pat->type, pat->next)) )
+					value = pat->next;
+			}
+			pat->next = pattern_step(pat->type, value);
+		}
+	}
+
+	pat->errors += errors;
+	pat->offset += length;
+	return errors;
+}
+
+/* cyusb_payload_create:
+   Set up a payload source from a pattern or file specification.
+ */
+int
+cyusb_payload_create (
+		const char *spec,
+		cyusb_payload **pl_p)
+{
+	struct cyusb_payload *pl;
+	struct stat st;
+	unsigned int seed;
+	void *map;
+	int type;
+	int fd;
+	int r;
+
+	*pl_p = NULL;
+
+	pl = (struct cyusb_payload *)calloc(1, sizeof(struct cyusb_payload));
+	if ( pl == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	if ( strncmp(spec, PAYLOAD_FILE_PREFIX, strlen(PAYLOAD_FILE_PREFIX)) != 0 ) {
+		r = cyusb_pattern_parse(spec, &type, &seed);
+		if ( r ) {
+			free(pl);
+			return r;
+		}
+		cyusb_pattern_init(&pl->pattern, type, seed);
+		*pl_p = pl;
+		return 0;
+	}
+
+	fd = open(spec + strlen(PAYLOAD_FILE_PREFIX), O_RDONLY);
+	if ( fd < 0 ) {
+		free(pl);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if ( (fstat(fd, &st) != 0) || (st.st_size == 0) ) {
+		close(fd);
+		free(pl);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		free(pl);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	pl->map  = (const unsigned char *)map;
+	pl->size = st.st_size;
+	*pl_p = pl;
+	return 0;
+}
+
+/* cyusb_payload_fill:
+   Fill a buffer with the next part of the payload. A file starts over once it has all been sent.
+ */
+void
+cyusb_payload_fill (
+		cyusb_payload *pl,
+		unsigned char *buf,
+		unsigned int length)
+{
+	size_t n;
+
+	if ( pl->map == NULL ) {
+		cyusb_pattern_fill(&pl->pattern, buf, length);
+		return;
+	}
+
+	while ( length != 0 ) {
+		n = pl->size - pl->pos;
+		if ( n > length )
+			n = length;
+		memcpy(buf, pl->map + pl->pos, n);
+		buf     += n;
+		length  -= n;
+		pl->pos += n;
+		if ( pl->pos == pl->size )
+			pl->pos = 0;
+	}
+}
+
+/* cyusb_payload_name:
+   Get a printable description of a payload source.
+ */
+const char *
+cyusb_payload_name (
+		cyusb_payload *pl)
+{
+	return ( pl->map != NULL ) ? "file" : cyusb_pattern_name(pl->pattern.type);
+}
+
+/* cyusb_payload_destroy:
+   Release a payload source.
+ */
+void
+cyusb_payload_destroy (
+		cyusb_payload *pl)
+{
+	if ( pl->map != NULL )
+		munmap((void *)pl->map, pl->size);
+	free(pl);
+}
+
+/*[]*/
@@ -0,0 +1,1172 @@
+/*******************************************************************************\
+ * Program Name		:	cyusb_stream.cpp				*
+ * License		:	LGPL Ver 2.1				        *
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS		*
+ * Modification Notes	:							*
+ * 										*
+ * Asynchronous streaming engine for the cyusb library. A stream keeps a fixed	*
+ * ring of pre-allocated transfers queued on one endpoint, and re-submits each	*
+ * transfer from its completion callback without any further allocation.	*
+ * Completed transfers are either handed to a data callback, or passed to the	*
+ * application thread through a lock-free single producer/consumer queue.	*
+ * Every stream also updates the shared endpoint counters (cyusb_metrics_*).	*
+ * In adaptive mode, the number of transfers in flight and their size are	*
+ * tuned while the stream runs, within the limits it was opened with.		*
+ \*******************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/* Timeout (in milliseconds) used for each data transfer queued by a stream. */
+#define STREAM_XFER_TIMEOUT			(5000)
+
+/* Interval (in milliseconds) at which events are polled while a stream is being drained. */
+#define STREAM_DRAIN_POLL_INTERVAL		(100)
+
+/* Streams whose buffers take up at least this many bytes ask for huge page backed buffers,
+   in case zero-copy buffers cannot be allocated. */
+#define STREAM_HUGEPAGE_THRESHOLD		(2 * 1024 * 1024)
+
+/* Default length (in milliseconds) of the window over which an adaptive stream is measured
+   before its settings are reconsidered. */
+#define STREAM_ADAPT_INTERVAL			(100)
+
+/* Fewest completions in a window for its measurements to be acted upon. */
+#define STREAM_ADAPT_MIN_COMPLETIONS		(8)
+
+/* Number of consecutive windows above the throughput target (by more than a tenth) after
+   which an adaptive stream gives up a transfer to cut its latency. */
+#define STREAM_ADAPT_CALM_WINDOWS		(10)
+
+struct cyusb_stream;
+
+/*
+   struct cyusb_stream_xfer
+   Book-keeping for one of the transfers owned by a stream.
+ */
+struct cyusb_stream_xfer {
+	struct cyusb_stream	*strm;			/* Stream that owns this transfer. */
+	struct libusb_transfer	*transfer;		/* libusb transfer structure. */
+	unsigned char		*buffer;		/* Data buffer attached to the transfer (from the pool). */
+	unsigned int		length;			/* Bytes transferred, when on the completion queue. */
+	unsigned long long	submit_ns;		/* Time at which the transfer was last submitted. */
+	unsigned long long	complete_ns;		/* Time at which it last completed, 0 if it has not. */
+	bool			busy;			/* Whether the transfer is queued with libusb. */
+};
+
+/*
+   struct cyusb_stream
+   State of a streaming operation on a single endpoint.
+ */
+struct cyusb_stream {
+	libusb_device_handle	*handle;		/* Device handle. */
+	libusb_context		*ctx;			/* libusb context the handle belongs to. */
+	unsigned char		endpoint;		/* Endpoint address. */
+	unsigned char		eptype;			/* Transfer type of the endpoint. */
+	unsigned int		pktsize;		/* Packet (or burst) size for the endpoint. */
+	unsigned int		reqsize;		/* Request size in packets. */
+	unsigned int		queuedepth;		/* Number of transfers kept in flight. */
+	unsigned int		xfersize;		/* Size of each transfer in bytes. */
+
+	cyusb_stream_cb		callback;		/* Data callback registered by the application. */
+	void			*cb_arg;		/* Argument passed to the data callback. */
+	cyusb_stream_fill_cb	fill;			/* Called to fill each transfer before it is queued. */
+	void			*fill_arg;		/* Argument passed to the fill callback. */
+
+	struct cyusb_stream_xfer *xfers;		/* Array of queuedepth transfers. */
+	cyusb_bufpool		*pool;			/* Data buffers for all the transfers. */
+
+	bool			queued;			/* Whether completions go to the completion queue. */
+	struct cyusb_stream_xfer **ring;		/* Completion queue entries. */
+	unsigned int		qmask;			/* Completion queue size - 1 (size is a power of 2). */
+	unsigned int		qhead;			/* Queue write index, only updated by the event thread. */
+	unsigned int		qtail;			/* Queue read index, only updated by the application. */
+	sem_t			qsem;			/* Count of entries on the completion queue. */
+
+	volatile bool		running;		/* Whether the stream has been started. */
+	volatile bool		stop_requested;		/* Request to stop re-submitting transfers. */
+	int			in_flight;		/* Number of transfers queued with libusb. */
+
+	unsigned long long	success_count;		/* Number of successful transfers. */
+	unsigned long long	failure_count;		/* Number of failed transfers. */
+	unsigned long long	bytes;			/* Number of bytes transferred. */
+	unsigned long long	iso_errors;		/* Number of isochronous packets that failed. */
+	unsigned long long	short_packets;		/* Number of short packets or transfers. */
+
+	unsigned long long	last_complete_ns;	/* Time at which the last transfer completed. */
+	struct cyusb_hist	latency;		/* Submit to completion time of each transfer. */
+	struct cyusb_hist	interval;		/* Time between consecutive completions. */
+	struct cyusb_ep_metrics	*metrics;		/* Shared counters of the endpoint, or NULL. */
+
+	bool			verify;			/* Whether received data is checked. */
+	int			vtype;			/* Pattern that data is checked against. */
+	unsigned int		vseed;			/* Seed for the pattern. */
+	struct cyusb_pattern	pattern;		/* Pattern checker state. */
+
+	cyusb_capture		*capture;		/* Capture file all transfers are written to. */
+
+	cyusb_payload		*payload;		/* Source of the data sent on an OUT endpoint. */
+	int			pmode;			/* CYUSB_PAYLOAD_ONCE or CYUSB_PAYLOAD_EACH. */
+	bool			plock_init;		/* Whether plock has been initialised. */
+	pthread_mutex_t		plock;			/* Keeps the payload in order, as transfers can be
+							   filled from both the event and application threads. */
+
+	bool			adaptive;		/* Whether the depth and size are tuned. */
+	struct cyusb_stream_adapt adapt;		/* Limits and targets of the tuning. */
+	unsigned int		cur_depth;		/* Number of transfers currently kept in flight. */
+	unsigned int		cur_reqsize;		/* Request size (in packets) currently used. */
+	pthread_mutex_t		alock;			/* Protects parked, as transfers can be re-queued
+							   from both the event and application threads. */
+	struct cyusb_stream_xfer **parked;		/* Transfers not needed at the current depth. */
+	unsigned int		nparked;		/* Number of entries in parked. */
+
+	unsigned long long	w_start_ns;		/* Start of the current measurement window. */
+	unsigned int		w_count;		/* Completions in the window. */
+	unsigned int		w_failures;		/* Failed transfers in the window. */
+	unsigned int		w_shorts;		/* Short bulk or interrupt transfers in the window. */
+	unsigned int		w_iso_errors;		/* Failed isochronous packets in the window. */
+	unsigned int		w_starved;		/* Re-queues in the window that found nothing queued. */
+	unsigned long long	w_bytes;		/* Bytes transferred in the window. */
+	unsigned long long	w_latency;		/* Sum of the transfer latencies in the window. */
+	unsigned int		calm;			/* Consecutive windows above the throughput target. */
+	bool			settle;			/* Skip the next window, after a change. */
+
+	unsigned long long	adapt_windows;		/* Number of windows evaluated. */
+	unsigned long long	adapt_grows;		/* Number of increases of the depth or size. */
+	unsigned long long	adapt_shrinks;		/* Number of decreases of the depth or size. */
+	unsigned int		adapt_reason;		/* CYUSB_STREAM_ADAPT_ reasons for the last change. */
+};
+
+/* find_endpoint:
+   Get the transfer type and packet size of an endpoint from the descriptor snapshot of the
+   device. The first alternate setting that declares the endpoint is used.
+ */
+static int
+find_endpoint (
+		libusb_device_handle *h,
+		unsigned char endpoint,
+		unsigned char *eptype,
+		unsigned int *pktsize)
+{
+	const struct cyusb_desc *desc;
+	const struct cyusb_ep_desc *ep;
+	int r;
+
+	r = cyusb_desc_get(libusb_get_device(h), &desc);
+	if ( r )
+		return r;
+
+	ep = cyusb_desc_endpoint(desc, endpoint);
+	if ( ep != NULL ) {
+		*eptype  = ep->type;
+		*pktsize = ep->pktsize;
+	}
+
+	cyusb_desc_release(desc);
+	return ( ep != NULL ) ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* stream_now:
+   Get the current time from CYUSB_CLOCK, in nanoseconds.
+ */
+static inline unsigned long long
+stream_now (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime(CYUSB_CLOCK, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* stream_submit:
+   Prepare a transfer owned by the stream and queue it with libusb. No memory is allocated here.
+ */
+static int
+stream_submit (
+		struct cyusb_stream_xfer *x)
+{
+	struct cyusb_stream *strm = x->strm;
+	int r;
+
+	/* The data buffers are large enough for the request size the stream was opened with, so
+	   an adaptive stream only changes how much of them is used. */
+	if ( strm->adaptive ) {
+		x->transfer->length = __atomic_load_n(&strm->cur_reqsize, __ATOMIC_RELAXED) * strm->pktsize;
+		if ( strm->eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+			x->transfer->num_iso_packets = x->transfer->length / strm->pktsize;
+	}
+
+	if ( strm->eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+		libusb_set_iso_packet_lengths(x->transfer, strm->pktsize);
+
+	if ( (strm->payload != NULL) && (strm->pmode == CYUSB_PAYLOAD_EACH) ) {
+		pthread_mutex_lock(&strm->plock);
+		cyusb_payload_fill(strm->payload, x->transfer->buffer, x->transfer->length);
+		pthread_mutex_unlock(&strm->plock);
+	}
+
+	if ( strm->fill != NULL )
+		strm->fill(strm, x->transfer, strm->fill_arg);
+
+	__atomic_store_n(&x->busy, true, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&strm->in_flight, 1, __ATOMIC_RELAXED);
+	x->submit_ns = stream_now();
+	r = libusb_submit_transfer(x->transfer);
+	if ( r ) {
+		__atomic_store_n(&x->busy, false, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&strm->in_flight, 1, __ATOMIC_RELEASE);
+	}
+	else if ( x->complete_ns != 0 )
+		cyusb_metrics_resubmit(strm->metrics, x->submit_ns - x->complete_ns);
+
+	return r;
+}
+
+/* stream_requeue:
+   Queue a transfer again after it completed. An adaptive stream only keeps its current depth
+   of transfers in flight; the others are parked until the depth grows again. self is 1 when
+   the transfer is still counted as in flight, i.e. when called from its completion callback.
+ */
+static int
+stream_requeue (
+		struct cyusb_stream_xfer *x,
+		int self)
+{
+	struct cyusb_stream *strm = x->strm;
+	struct cyusb_stream_xfer *y;
+	int queued;
+	int r;
+
+	if ( !strm->adaptive )
+		return stream_submit(x);
+
+	pthread_mutex_lock(&strm->alock);
+	queued = __atomic_load_n(&strm->in_flight, __ATOMIC_RELAXED) - self;
+	if ( queued >= (int)__atomic_load_n(&strm->cur_depth, __ATOMIC_RELAXED) ) {
+		strm->parked[strm->nparked++] = x;
+		pthread_mutex_unlock(&strm->alock);
+		return 0;
+	}
+
+	/* Nothing left on the endpoint means it has been idle since the last completion. */
+	if ( (queued == 0) && (x->complete_ns != 0) )
+		__atomic_add_fetch(&strm->w_starved, 1, __ATOMIC_RELAXED);
+
+	r = stream_submit(x);
+	while ( (r == 0) && (strm->nparked != 0) && (__atomic_load_n(&strm->in_flight, __ATOMIC_RELAXED) - self <
+				(int)__atomic_load_n(&strm->cur_depth, __ATOMIC_RELAXED)) ) {
+		y = strm->parked[--strm->nparked];
+		if ( stream_submit(y) != 0 ) {
+			strm->parked[strm->nparked++] = y;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&strm->alock);
+
+	return r;
+}
+
+/* stream_adapt:
+   Account for a completed transfer in the measurement window of an adaptive stream, and
+   reconsider the depth and request size at the end of the window. Called from the event
+   thread only.
+ */
+static void
+stream_adapt (
+		struct cyusb_stream *strm,
+		struct libusb_transfer *transfer,
+		unsigned int length,
+		unsigned long long errors,
+		unsigned long long shorts,
+		unsigned long long latency)
+{
+	const struct cyusb_stream_adapt *a = &strm->adapt;
+	unsigned long long now = strm->last_complete_ns;
+	unsigned int depth = strm->cur_depth;
+	unsigned int size  = strm->cur_reqsize;
+	unsigned int reason = 0;
+	unsigned int starved;
+	unsigned long long avg, kbps;
+	bool over_latency, over_rate;
+
+	strm->w_count++;
+	strm->w_bytes   += length;
+	strm->w_latency += latency;
+	if ( transfer->status != LIBUSB_TRANSFER_COMPLETED )
+		strm->w_failures++;
+	if ( strm->eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS )
+		strm->w_iso_errors += errors;
+	else
+		strm->w_shorts += shorts;
+
+	if ( (now - strm->w_start_ns < a->interval * 1000000ULL) || (strm->w_count < STREAM_ADAPT_MIN_COMPLETIONS) )
+		return;
+
+	starved = __atomic_exchange_n(&strm->w_starved, 0, __ATOMIC_RELAXED);
+	avg     = strm->w_latency / strm->w_count;
+	kbps    = strm->w_bytes * 1000000000ULL / 1024 / (now - strm->w_start_ns);
+	over_latency = (a->latency_target != 0) && (avg > a->latency_target * 1000ULL);
+	over_rate    = (a->rate_target != 0) && (kbps * 10 > a->rate_target * 11ULL);
+
+	/* The first window after a change still has transfers of the old size in it. */
+	if ( strm->settle ) {
+		strm->settle = false;
+	}
+	else if ( (strm->w_failures != 0) || (2 * strm->w_shorts > strm->w_count) ) {
+		/* The device does not have as much data as is asked for. Smaller requests return it
+		   sooner, without costing any throughput. */
+		reason = ( strm->w_failures != 0 ) ? CYUSB_STREAM_ADAPT_FAILED : CYUSB_STREAM_ADAPT_SHORT;
+		size = ( size / 2 > a->min_reqsize ) ? size / 2 : a->min_reqsize;
+	}
+	else if ( (starved != 0) || (strm->w_iso_errors != 0) ) {
+		/* The endpoint ran dry, or missed service intervals: queue more, unless that would
+		   break the latency target. */
+		reason = ( starved != 0 ) ? CYUSB_STREAM_ADAPT_UNDERRUN : CYUSB_STREAM_ADAPT_ISO_ERRORS;
+		if ( !over_latency ) {
+			if ( depth < a->max_queuedepth )
+				depth += ( depth / 4 > 1 ) ? depth / 4 : 1;
+			else
+				size *= 2;
+		}
+	}
+	else if ( over_latency ) {
+		reason = CYUSB_STREAM_ADAPT_LATENCY;
+		if ( depth > a->min_queuedepth )
+			depth--;
+		else
+			size /= 2;
+	}
+	else if ( (a->rate_target != 0) && (!over_rate) && (kbps < a->rate_target) ) {
+		reason = CYUSB_STREAM_ADAPT_RATE;
+		if ( depth < a->max_queuedepth )
+			depth++;
+		else
+			size *= 2;
+	}
+	else if ( (over_rate) && (++strm->calm >= STREAM_ADAPT_CALM_WINDOWS) ) {
+		/* Comfortably above the throughput target: buffer less. */
+		reason = CYUSB_STREAM_ADAPT_RATE;
+		strm->calm = 0;
+		if ( depth > a->min_queuedepth )
+			depth--;
+	}
+
+	if ( !over_rate )
+		strm->calm = 0;
+	if ( depth > a->max_queuedepth )
+		depth = a->max_queuedepth;
+	if ( size > a->max_reqsize )
+		size = a->max_reqsize;
+	if ( size < a->min_reqsize )
+		size = a->min_reqsize;
+
+	if ( (depth != strm->cur_depth) || (size != strm->cur_reqsize) ) {
+		if ( (depth > strm->cur_depth) || (size > strm->cur_reqsize) )
+			__atomic_store_n(&strm->adapt_grows, strm->adapt_grows + 1, __ATOMIC_RELAXED);
+		else
+			__atomic_store_n(&strm->adapt_shrinks, strm->adapt_shrinks + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&strm->adapt_reason, reason, __ATOMIC_RELAXED);
+		__atomic_store_n(&strm->cur_depth, depth, __ATOMIC_RELAXED);
+		__atomic_store_n(&strm->cur_reqsize, size, __ATOMIC_RELAXED);
+		strm->settle = true;
+	}
+	__atomic_store_n(&strm->adapt_windows, strm->adapt_windows + 1, __ATOMIC_RELAXED);
+
+	strm->w_start_ns   = now;
+	strm->w_count      = 0;
+	strm->w_failures   = 0;
+	strm->w_shorts     = 0;
+	strm->w_iso_errors = 0;
+	strm->w_bytes      = 0;
+	strm->w_latency    = 0;
+}
+
+/* stream_verify:
+   Check the data received in a transfer against the stream pattern.
+ */
+static void
+stream_verify (
+		struct cyusb_stream *strm,
+		struct libusb_transfer *transfer)
+{
+	struct cyusb_pattern pat = strm->pattern;
+	int i;
+
+	if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+		cyusb_pattern_resync(&strm->pattern);
+		return;
+	}
+
+	if ( strm->eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ) {
+		for ( i = 0; i < transfer->num_iso_packets; ++i ) {
+			if ( transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED ) {
+				cyusb_pattern_resync(&pat);
+				continue;
+			}
+			cyusb_pattern_verify(&pat, libusb_get_iso_packet_buffer_simple(transfer, i),
+					transfer->iso_packet_desc[i].actual_length);
+		}
+	}
+	else
+		cyusb_pattern_verify(&pat, transfer->buffer, transfer->actual_length);
+
+	/* The checker works on a local copy, so that cyusb_stream_get_stats() only ever sees
+	   complete values for the counters. */
+	strm->pattern.next   = pat.next;
+	strm->pattern.synced = pat.synced;
+	__atomic_store_n(&strm->pattern.errors, pat.errors, __ATOMIC_RELAXED);
+	__atomic_store_n(&strm->pattern.first_error, pat.first_error, __ATOMIC_RELAXED);
+	__atomic_store_n(&strm->pattern.offset, pat.offset, __ATOMIC_RELAXED);
+}
+
+/* stream_enqueue:
+   Pass a completed transfer to the application through the completion queue. There can never be
+   more than queuedepth entries on the queue, so it cannot overflow.
+ */
+static void
+stream_enqueue (
+		struct cyusb_stream_xfer *x)
+{
+	struct cyusb_stream *strm = x->strm;
+	unsigned int head = strm->qhead;
+
+	strm->ring[head & strm->qmask] = x;
+	__atomic_store_n(&strm->qhead, head + 1, __ATOMIC_RELEASE);
+	sem_post(&strm->qsem);
+}
+
+/* stream_callback:
+   Completion callback for all transfers queued by a stream.
+ */
+static void
+stream_callback (
+		struct libusb_transfer *transfer)
+{
+	struct cyusb_stream_xfer *x = (struct cyusb_stream_xfer *)transfer->user_data;
+	struct cyusb_stream *strm = x->strm;
+	unsigned long long now = stream_now();
+	unsigned long long errors = 0, shorts = 0;
+	unsigned int length = 0;
+	int hold = 0;
+	int i;
+
+	if ( transfer->status != LIBUSB_TRANSFER_CANCELLED ) {
+		cyusb_hist_record(&strm->latency, now - x->submit_ns);
+		if ( strm->last_complete_ns != 0 )
+			cyusb_hist_record(&strm->interval, now - strm->last_complete_ns);
+		strm->last_complete_ns = now;
+		x->complete_ns = now;
+	}
+
+	if ( transfer->status == LIBUSB_TRANSFER_COMPLETED ) {
+		if ( strm->eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ) {
+			/* Only count the data from the packets that were received without error. */
+			for ( i = 0; i < transfer->num_iso_packets; ++i ) {
+				if ( transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED ) {
+					length += transfer->iso_packet_desc[i].actual_length;
+					if ( transfer->iso_packet_desc[i].actual_length < strm->pktsize )
+						shorts++;
+				}
+				else
+					errors++;
+			}
+		}
+		else {
+			length = transfer->actual_length;
+			if ( length < ((strm->adaptive) ? (unsigned int)transfer->length : strm->xfersize) )
+				shorts++;
+		}
+
+		if ( errors != 0 )
+			__atomic_store_n(&strm->iso_errors, strm->iso_errors + errors, __ATOMIC_RELAXED);
+		if ( shorts != 0 )
+			__atomic_store_n(&strm->short_packets, strm->short_packets + shorts, __ATOMIC_RELAXED);
+
+		__atomic_store_n(&strm->success_count, strm->success_count + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&strm->bytes, strm->bytes + length, __ATOMIC_RELAXED);
+	}
+	else if ( transfer->status != LIBUSB_TRANSFER_CANCELLED )
+		__atomic_store_n(&strm->failure_count, strm->failure_count + 1, __ATOMIC_RELAXED);
+	cyusb_metrics_add(strm->metrics, transfer->status, length);
+
+	if ( (strm->capture != NULL) && (transfer->status != LIBUSB_TRANSFER_CANCELLED) )
+		cyusb_capture_transfer(strm->capture, transfer, now);
+
+	if ( (strm->adaptive) && (transfer->status != LIBUSB_TRANSFER_CANCELLED) )
+		stream_adapt(strm, transfer, length, errors, shorts, now - x->submit_ns);
+
+	if ( (strm->verify) && (transfer->status != LIBUSB_TRANSFER_CANCELLED) )
+		stream_verify(strm, transfer);
+
+	/* The transfer stays counted as in flight until the stream is done with it here, so that
+	   cyusb_stream_stop() cannot return while it is still being looked at. */
+	__atomic_store_n(&x->busy, false, __ATOMIC_RELAXED);
+
+	if ( transfer->status == LIBUSB_TRANSFER_CANCELLED ) {
+		__atomic_sub_fetch(&strm->in_flight, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if ( strm->queued ) {
+		if ( !strm->stop_requested ) {
+			x->length = length;
+			stream_enqueue(x);
+		}
+		__atomic_sub_fetch(&strm->in_flight, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if ( strm->callback != NULL )
+		hold = strm->callback(strm, transfer, length, strm->cb_arg);
+
+	/* Re-submit the transfer unless the application has asked us to hold on to it. A failure
+	   to re-queue is not expected in the general case, and is only reflected in the count of
+	   transfers in flight. */
+	if ( (!strm->stop_requested) && (hold == CYUSB_STREAM_RESUBMIT) )
+		stream_requeue(x, 1);
+	__atomic_sub_fetch(&strm->in_flight, 1, __ATOMIC_RELEASE);
+}
+
+/* free_stream:
+   Release all transfers and buffers held by a stream.
+ */
+static void
+free_stream (
+		struct cyusb_stream *strm)
+{
+	unsigned int i;
+
+	if ( strm->xfers != NULL ) {
+		for ( i = 0; i < strm->queuedepth; ++i ) {
+			if ( strm->xfers[i].transfer != NULL )
+				libusb_free_transfer(strm->xfers[i].transfer);
+		}
+		free(strm->xfers);
+	}
+
+	cyusb_bufpool_destroy(strm->pool);
+
+	if ( strm->ring != NULL ) {
+		sem_destroy(&strm->qsem);
+		free(strm->ring);
+	}
+
+	if ( strm->parked != NULL ) {
+		pthread_mutex_destroy(&strm->alock);
+		free(strm->parked);
+	}
+
+	if ( strm->plock_init )
+		pthread_mutex_destroy(&strm->plock);
+
+	free(strm);
+}
+
+/* cyusb_stream_open:
+   Allocate a stream with all of its transfers and data buffers on the specified endpoint.
+ */
+int
+cyusb_stream_open (
+		libusb_device_handle *h,
+		unsigned char endpoint,
+		unsigned int pktsize,
+		unsigned int reqsize,
+		unsigned int queuedepth,
+		cyusb_stream **stream)
+{
+	struct cyusb_stream *strm;
+	unsigned char eptype;
+	unsigned int  maxpkt;
+	unsigned int  i;
+	int r;
+
+	if ( (h == NULL) || (stream == NULL) || (reqsize == 0) || (queuedepth == 0) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*stream = NULL;
+
+	r = find_endpoint(h, endpoint, &eptype, &maxpkt);
+	if ( r )
+		return r;
+
+	if ( eptype == LIBUSB_TRANSFER_TYPE_CONTROL )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if ( pktsize == 0 )
+		pktsize = maxpkt;
+
+	strm = (struct cyusb_stream *)calloc(1, sizeof(struct cyusb_stream));
+	if ( strm == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	strm->handle     = h;
+	strm->ctx        = cyusb_handle_context(h);
+	strm->endpoint   = endpoint;
+	strm->eptype     = eptype;
+	strm->pktsize    = pktsize;
+	strm->reqsize    = reqsize;
+	strm->queuedepth = queuedepth;
+	strm->xfersize   = reqsize * pktsize;
+	strm->metrics    = cyusb_metrics_endpoint(libusb_get_device(h), endpoint);
+
+	strm->xfers = (struct cyusb_stream_xfer *)calloc(queuedepth, sizeof(struct cyusb_stream_xfer));
+	if ( strm->xfers == NULL ) {
+		free_stream(strm);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* Use zero-copy buffers where possible; the pool falls back to ordinary memory. */
+	r = cyusb_bufpool_create(h, strm->xfersize, queuedepth,
+			((unsigned long long)strm->xfersize * queuedepth >= STREAM_HUGEPAGE_THRESHOLD) ?
+			CYUSB_BUFPOOL_HUGEPAGE : 0, &strm->pool);
+	if ( r ) {
+		free_stream(strm);
+		return r;
+	}
+
+	for ( i = 0; i < queuedepth; ++i ) {
+		struct cyusb_stream_xfer *x = &strm->xfers[i];
+
+		x->strm     = strm;
+		x->buffer   = cyusb_bufpool_get(strm->pool, i);
+		x->transfer = libusb_alloc_transfer((eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? reqsize : 0);
+		if ( (x->buffer == NULL) || (x->transfer == NULL) ) {
+			free_stream(strm);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+
+		switch ( eptype ) {
+			case LIBUSB_TRANSFER_TYPE_BULK:
+				libusb_fill_bulk_transfer(x->transfer, h, endpoint, x->buffer, strm->xfersize,
+						stream_callback, x, STREAM_XFER_TIMEOUT);
+				break;
+
+			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+				libusb_fill_interrupt_transfer(x->transfer, h, endpoint, x->buffer, strm->xfersize,
+						stream_callback, x, STREAM_XFER_TIMEOUT);
+				break;
+
+			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+				libusb_fill_iso_transfer(x->transfer, h, endpoint, x->buffer, strm->xfersize,
+						reqsize, stream_callback, x, STREAM_XFER_TIMEOUT);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	*stream = strm;
+	return 0;
+}
+
+/* cyusb_stream_set_callback:
+   Register the function to be called on completion of each transfer in the stream.
+ */
+void
+cyusb_stream_set_callback (
+		cyusb_stream *strm,
+		cyusb_stream_cb callback,
+		void *arg)
+{
+	strm->callback = callback;
+	strm->cb_arg   = arg;
+}
+
+/* cyusb_stream_set_fill:
+   Register the function to be called to fill each transfer just before it is queued.
+ */
+void
+cyusb_stream_set_fill (
+		cyusb_stream *strm,
+		cyusb_stream_fill_cb fill,
+		void *arg)
+{
+	strm->fill     = fill;
+	strm->fill_arg = arg;
+}
+
+/* cyusb_stream_set_capture:
+   Select the capture file that all completed transfers are written to.
+ */
+void
+cyusb_stream_set_capture (
+		cyusb_stream *strm,
+		cyusb_capture *cap)
+{
+	strm->capture = cap;
+}
+
+/* cyusb_stream_set_verify:
+   Select the pattern that data received by the stream is checked against.
+ */
+int
+cyusb_stream_set_verify (
+		cyusb_stream *strm,
+		int type,
+		unsigned int seed)
+{
+	if ( strm->running )
+		return LIBUSB_ERROR_BUSY;
+
+	if ( type < 0 ) {
+		strm->verify = false;
+		return 0;
+	}
+
+	if ( ((strm->endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN) ||
+			(type > CYUSB_PATTERN_LFSR) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	strm->verify = true;
+	strm->vtype  = type;
+	strm->vseed  = seed;
+	return 0;
+}
+
+/* cyusb_stream_set_payload:
+   Select the payload that data sent by the stream comes from.
+ */
+int
+cyusb_stream_set_payload (
+		cyusb_stream *strm,
+		cyusb_payload *pl,
+		int mode)
+{
+	unsigned int i;
+
+	if ( strm->running )
+		return LIBUSB_ERROR_BUSY;
+
+	if ( pl == NULL ) {
+		strm->payload = NULL;
+		return 0;
+	}
+
+	if ( ((strm->endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_OUT) ||
+			((mode != CYUSB_PAYLOAD_ONCE) && (mode != CYUSB_PAYLOAD_EACH)) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if ( !strm->plock_init ) {
+		pthread_mutex_init(&strm->plock, NULL);
+		strm->plock_init = true;
+	}
+
+	/* The buffers stay attached to the same transfers, so data placed in them now is sent
+	   every time they are queued, whatever request size an adaptive stream uses. */
+	if ( mode == CYUSB_PAYLOAD_ONCE ) {
+		for ( i = 0; i < strm->queuedepth; ++i )
+			cyusb_payload_fill(pl, strm->xfers[i].buffer, strm->xfersize);
+	}
+
+	strm->payload = pl;
+	strm->pmode   = mode;
+	return 0;
+}
+
+/* cyusb_stream_lock_buffers:
+   Lock the data buffers of the stream into memory.
+ */
+int
+cyusb_stream_lock_buffers (
+		cyusb_stream *strm)
+{
+	return cyusb_bufpool_lock(strm->pool);
+}
+
+/* cyusb_stream_set_adaptive:
+   Let the stream tune its depth and request size while it runs.
+ */
+int
+cyusb_stream_set_adaptive (
+		cyusb_stream *strm,
+		const struct cyusb_stream_adapt *adapt)
+{
+	struct cyusb_stream_adapt a;
+
+	if ( strm->running )
+		return LIBUSB_ERROR_BUSY;
+
+	if ( adapt == NULL ) {
+		strm->adaptive = false;
+		return 0;
+	}
+
+	/* Zero limits stand for the widest range the stream was opened with. */
+	a = *adapt;
+	if ( a.min_reqsize == 0 )
+		a.min_reqsize = 1;
+	if ( a.max_reqsize == 0 )
+		a.max_reqsize = strm->reqsize;
+	if ( a.min_queuedepth == 0 )
+		a.min_queuedepth = 1;
+	if ( a.max_queuedepth == 0 )
+		a.max_queuedepth = strm->queuedepth;
+	if ( a.interval == 0 )
+		a.interval = STREAM_ADAPT_INTERVAL;
+
+	if ( (a.max_reqsize > strm->reqsize) || (a.max_queuedepth > strm->queuedepth) ||
+			(a.min_reqsize > a.max_reqsize) || (a.min_queuedepth > a.max_queuedepth) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	/* Unless a starting point is given, a stream with a latency target starts with as little
+	   queued as allowed, and any other stream with as much. */
+	if ( a.reqsize == 0 )
+		a.reqsize = ( a.latency_target != 0 ) ? a.min_reqsize : a.max_reqsize;
+	if ( a.queuedepth == 0 )
+		a.queuedepth = ( a.latency_target != 0 ) ? a.min_queuedepth : a.max_queuedepth;
+	if ( (a.reqsize < a.min_reqsize) || (a.reqsize > a.max_reqsize) ||
+			(a.queuedepth < a.min_queuedepth) || (a.queuedepth > a.max_queuedepth) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if ( strm->parked == NULL ) {
+		strm->parked = (struct cyusb_stream_xfer **)calloc(strm->queuedepth, sizeof(struct cyusb_stream_xfer *));
+		if ( strm->parked == NULL )
+			return LIBUSB_ERROR_NO_MEM;
+		pthread_mutex_init(&strm->alock, NULL);
+	}
+
+	strm->adapt       = a;
+	strm->adaptive    = true;
+	strm->cur_depth   = a.queuedepth;
+	strm->cur_reqsize = a.reqsize;
+	return 0;
+}
+
+/* stream_reset:
+   Clear the statistics and completion queue of a stream that is about to be started.
+ */
+static void
+stream_reset (
+		struct cyusb_stream *strm)
+{
+	strm->success_count  = 0;
+	strm->failure_count  = 0;
+	strm->bytes          = 0;
+	strm->iso_errors     = 0;
+	strm->short_packets  = 0;
+	strm->last_complete_ns = 0;
+	cyusb_hist_reset(&strm->latency);
+	cyusb_hist_reset(&strm->interval);
+
+	/* The position of the device in the pattern sequence is not known yet. */
+	if ( strm->verify ) {
+		cyusb_pattern_init(&strm->pattern, strm->vtype, strm->vseed);
+		cyusb_pattern_resync(&strm->pattern);
+	}
+	/* An adaptive stream starts out at the depth and size given as its starting point. */
+	if ( strm->adaptive ) {
+		strm->cur_depth     = strm->adapt.queuedepth;
+		strm->cur_reqsize   = strm->adapt.reqsize;
+		strm->nparked       = 0;
+		strm->w_start_ns    = stream_now();
+		strm->w_count       = 0;
+		strm->w_failures    = 0;
+		strm->w_shorts      = 0;
+		strm->w_iso_errors  = 0;
+		strm->w_starved     = 0;
+		strm->w_bytes       = 0;
+		strm->w_latency     = 0;
+		strm->calm          = 0;
+		strm->settle        = false;
+		strm->adapt_windows = 0;
+		strm->adapt_grows   = 0;
+		strm->adapt_shrinks = 0;
+		strm->adapt_reason  = 0;
+	}
+
+	strm->stop_requested = false;
+	strm->running        = true;
+
+	/* Throw away anything left on the completion queue from an earlier run. */
+	if ( strm->queued ) {
+		while ( sem_trywait(&strm->qsem) == 0 )
+			;
+		strm->qhead = 0;
+		strm->qtail = 0;
+	}
+}
+
+/* cyusb_stream_start:
+   Clear the stream statistics and queue all transfers on the endpoint.
+ */
+int
+cyusb_stream_start (
+		cyusb_stream *strm)
+{
+	unsigned int i;
+	int r;
+
+	if ( strm->running )
+		return LIBUSB_ERROR_BUSY;
+
+	stream_reset(strm);
+
+	for ( i = 0; i < strm->queuedepth; ++i ) {
+		strm->xfers[i].complete_ns = 0;
+		if ( (strm->adaptive) && (i >= strm->cur_depth) ) {
+			strm->parked[strm->nparked++] = &strm->xfers[i];
+			continue;
+		}
+		r = stream_submit(&strm->xfers[i]);
+		if ( r ) {
+			printf("Library: Failed to queue stream transfer %d\n", r);
+			cyusb_stream_stop(strm);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+/* cyusb_stream_start_held:
+   Start the stream with all of its transfers waiting on the completion queue, so that the
+   application can fill each one before it is queued.
+ */
+int
+cyusb_stream_start_held (
+		cyusb_stream *strm)
+{
+	unsigned int i;
+
+	if ( strm->running )
+		return LIBUSB_ERROR_BUSY;
+	if ( !strm->queued )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	stream_reset(strm);
+
+	/* Nothing is in flight yet, so this thread can stand in for the event thread as the
+	   producer on the completion queue. */
+	for ( i = 0; i < strm->queuedepth; ++i ) {
+		strm->xfers[i].length      = 0;
+		strm->xfers[i].complete_ns = 0;
+		stream_enqueue(&strm->xfers[i]);
+	}
+
+	return 0;
+}
+
+/* cyusb_stream_submit:
+   Queue a transfer that was held back by the data callback.
+ */
+int
+cyusb_stream_submit (
+		cyusb_stream *strm,
+		struct libusb_transfer *transfer)
+{
+	struct cyusb_stream_xfer *x = (struct cyusb_stream_xfer *)transfer->user_data;
+
+	if ( (x == NULL) || (x->strm != strm) || (__atomic_load_n(&x->busy, __ATOMIC_RELAXED)) )
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if ( strm->stop_requested )
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	return stream_requeue(x, 0);
+}
+
+/* cyusb_stream_stop:
+   Stop re-submitting transfers, cancel the ones still queued, and wait until all are returned.
+ */
+int
+cyusb_stream_stop (
+		cyusb_stream *strm)
+{
+	struct timeval tv;
+	unsigned int i;
+	int r = 0;
+
+	if ( !strm->running )
+		return 0;
+
+	strm->stop_requested = true;
+
+	/* Wake up an application thread waiting on the completion queue. */
+	if ( strm->queued )
+		sem_post(&strm->qsem);
+
+	/* A callback that was already running when the stop was requested may still re-submit its
+	   transfer, so the cancellation is repeated until nothing is left in flight. Events are
+	   handled here even if an event thread is running for the context; libusb makes sure only
+	   one thread handles them at a time. */
+	tv.tv_sec  = 0;
+	tv.tv_usec = STREAM_DRAIN_POLL_INTERVAL * 1000;
+	while ( __atomic_load_n(&strm->in_flight, __ATOMIC_ACQUIRE) > 0 ) {
+		for ( i = 0; i < strm->queuedepth; ++i ) {
+			if ( __atomic_load_n(&strm->xfers[i].busy, __ATOMIC_RELAXED) )
+				libusb_cancel_transfer(strm->xfers[i].transfer);
+		}
+
+		r = libusb_handle_events_timeout_completed(strm->ctx, &tv, NULL);
+		if ( (r != 0) && (r != LIBUSB_ERROR_INTERRUPTED) )
+			break;
+		r = 0;
+	}
+
+	strm->running = false;
+	return r;
+}
+
+/* cyusb_stream_enable_queue:
+   Pass completed transfers to the application through the completion queue, instead of calling
+   the data callback from the event handling thread.
+ */
+int
+cyusb_stream_enable_queue (
+		cyusb_stream *strm)
+{
+	unsigned int size = 1;
+
+	if ( strm->running )
+		return LIBUSB_ERROR_BUSY;
+	if ( strm->queued )
+		return 0;
+
+	while ( size < strm->queuedepth )
+		size <<= 1;
+
+	strm->ring = (struct cyusb_stream_xfer **)calloc(size, sizeof(struct cyusb_stream_xfer *));
+	if ( strm->ring == NULL )
+		return LIBUSB_ERROR_NO_MEM;
+
+	if ( sem_init(&strm->qsem, 0, 0) != 0 ) {
+		free(strm->ring);
+		strm->ring = NULL;
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	strm->qmask  = size - 1;
+	strm->queued = true;
+	return 0;
+}
+
+/* cyusb_stream_next:
+   Wait for the next completed transfer on the completion queue. The transfer belongs to the
+   application until it is handed back with cyusb_stream_submit().
+ */
+int
+cyusb_stream_next (
+		cyusb_stream *strm,
+		struct libusb_transfer **transfer,
+		unsigned int *length,
+		unsigned int timeout)
+{
+	struct cyusb_stream_xfer *x;
+	struct timespec ts;
+	unsigned int tail;
+	int r;
+
+	if ( !strm->queued )
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if ( timeout == 0 ) {
+		do {
+			r = sem_wait(&strm->qsem);
+		} while ( (r != 0) && (errno == EINTR) );
+	}
+	else {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec  += timeout / 1000;
+		ts.tv_nsec += (timeout % 1000) * 1000000;
+		if ( ts.tv_nsec >= 1000000000 ) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		do {
+			r = sem_timedwait(&strm->qsem, &ts);
+		} while ( (r != 0) && (errno == EINTR) );
+		if ( (r != 0) && (errno == ETIMEDOUT) )
+			return LIBUSB_ERROR_TIMEOUT;
+	}
+	if ( r != 0 )
+		return LIBUSB_ERROR_OTHER;
+
+	tail = strm->qtail;
+	if ( (strm->stop_requested) || (tail == __atomic_load_n(&strm->qhead, __ATOMIC_ACQUIRE)) )
+		return LIBUSB_ERROR_INTERRUPTED;
+
+	x = strm->ring[tail & strm->qmask];
+	__atomic_store_n(&strm->qtail, tail + 1, __ATOMIC_RELEASE);
+
+	*transfer = x->transfer;
+	*length   = x->length;
+	return 0;
+}
+
+/* cyusb_stream_get_stats:
+   Get the transfer statistics collected since the stream was started.
+ */
+void
+cyusb_stream_get_stats (
+		cyusb_stream *strm,
+		struct cyusb_stream_stats *stats)
+{
+	stats->success_count = __atomic_load_n(&strm->success_count, __ATOMIC_RELAXED);
+	stats->failure_count = __atomic_load_n(&strm->failure_count, __ATOMIC_RELAXED);
+	stats->bytes         = __atomic_load_n(&strm->bytes, __ATOMIC_RELAXED);
+	stats->in_flight     = __atomic_load_n(&strm->in_flight, __ATOMIC_RELAXED);
+	stats->eptype        = strm->eptype;
+	stats->pktsize       = strm->pktsize;
+	stats->zerocopy      = cyusb_bufpool_is_zerocopy(strm->pool);
+	stats->locked        = cyusb_bufpool_is_locked(strm->pool);
+	stats->iso_errors    = __atomic_load_n(&strm->iso_errors, __ATOMIC_RELAXED);
+	stats->short_packets = __atomic_load_n(&strm->short_packets, __ATOMIC_RELAXED);
+
+	stats->verify_errors      = __atomic_load_n(&strm->pattern.errors, __ATOMIC_RELAXED);
+	stats->verify_first_error = (strm->verify) ?
+		__atomic_load_n(&strm->pattern.first_error, __ATOMIC_RELAXED) : CYUSB_PATTERN_NO_ERROR;
+	stats->verify_bytes       = __atomic_load_n(&strm->pattern.offset, __ATOMIC_RELAXED);
+
+	stats->adaptive      = strm->adaptive;
+	stats->reqsize       = ( strm->adaptive ) ? __atomic_load_n(&strm->cur_reqsize, __ATOMIC_RELAXED) : strm->reqsize;
+	stats->queuedepth    = ( strm->adaptive ) ? __atomic_load_n(&strm->cur_depth, __ATOMIC_RELAXED) : strm->queuedepth;
+	stats->adapt_windows = __atomic_load_n(&strm->adapt_windows, __ATOMIC_RELAXED);
+	stats->adapt_grows   = __atomic_load_n(&strm->adapt_grows, __ATOMIC_RELAXED);
+	stats->adapt_shrinks = __atomic_load_n(&strm->adapt_shrinks, __ATOMIC_RELAXED);
+	stats->adapt_reason  = __atomic_load_n(&strm->adapt_reason, __ATOMIC_RELAXED);
+}
+
+/* cyusb_stream_get_latency:
+   Get a copy of the latency and completion interval histograms of a stream.
+ */
+void
+cyusb_stream_get_latency (
+		cyusb_stream *strm,
+		struct cyusb_hist *latency,
+		struct cyusb_hist *interval)
+{
+	/* The histograms are updated from the event handling thread without any locking, so the
+	   copy may be off by the few transfers that complete while it is being taken. */
+	if ( latency != NULL )
+		memcpy(latency, &strm->latency, sizeof(struct cyusb_hist));
+	if ( interval != NULL )
+		memcpy(interval, &strm->interval, sizeof(struct cyusb_hist));
+}
+
+/* cyusb_stream_close:
+   Stop the stream if it is running, and free all resources associated with it.
+ */
+void
+cyusb_stream_close (
+		cyusb_stream *strm)
+{
+	if ( strm == NULL )
+		return;
+
+	cyusb_stream_stop(strm);
+	free_stream(strm);
+}
+
+/*[]*/
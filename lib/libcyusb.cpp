@@ -16,6 +16,9 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <libusb-1.0/libusb.h>
 #include "../include/cyusb.h"
@@ -29,9 +32,47 @@
 /* Maximum size of EZ-USB FX3 firmware binary. Limited by amount of RAM available. */
 #define FX3_MAX_FW_SIZE				(524288)
 
-static struct cydev 	cydev[MAXDEVICES];		/* List of devices of interest that are connected. */
-static int          	nid;				/* Number of Interesting Devices. */
-static libusb_device	**list;				/* libusb device list used by the cyusb library. */
+/*
+   struct cyusb_context
+   A table of devices of interest, with the libusb context they were opened with. All the state the
+   library keeps about devices lives here, so that independent contexts can be used from different
+   threads. The table is updated in place when devices arrive or leave: slots of devices that have
+   left are kept empty (dev = NULL) and reused, so the index of every other device stays the same.
+   Devices are only opened (is_open = 1) when their handle is first asked for.
+ */
+struct cyusb_context {
+	libusb_context		*ctx;			/* libusb context, NULL for the default context. */
+	struct cydev		*devs;			/* List of devices of interest that are connected. */
+	int			count;			/* Number of slots used in devs. */
+	int			size;			/* Number of slots allocated in devs. */
+	libusb_device		**list;			/* libusb device list from the last enumeration. */
+	pthread_mutex_t		lock;			/* Serializes updates of devs. Recursive, as hotplug
+							   notifications run with it held and may call
+							   cyusb_gethandle_ctx(). */
+	libusb_hotplug_callback_handle hotplug_handle;	/* libusb hotplug registration. */
+	int			hotplug_active;		/* Whether hotplug events are handled. */
+	cyusb_hotplug_cb	hotplug_notify;		/* Application notification callback. */
+	void			*hotplug_arg;		/* Argument for hotplug_notify. */
+};
+
+/* Context used by the functions that do not take a context. */
+static struct cyusb_context default_context = {
+	NULL, NULL, 0, 0, NULL, PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, 0, 0, NULL, NULL
+};
+
+/*
+   struct handle_ctx
+   libusb context of a device handle opened through a cyusb_context.
+ */
+struct handle_ctx {
+	libusb_device_handle	*handle;		/* Device handle. */
+	libusb_context		*ctx;			/* libusb context the handle belongs to. */
+};
+
+static struct handle_ctx	*handle_map;		/* Handles opened on contexts other than the default. */
+static int			handle_count;		/* Number of entries used in handle_map. */
+static int			handle_size;		/* Number of entries allocated in handle_map. */
+static pthread_mutex_t		handle_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
    struct VPD
@@ -43,13 +84,14 @@ struct VPD {
 	char		desc[MAX_STR_LEN];		/* Device description. */
 };
 
-static struct VPD	vpd[MAX_ID_PAIRS];		/* Known device database. */
+static struct VPD	vpd[MAX_ID_PAIRS];		/* Known device database, sorted by VID/PID. */
 static int 		maxdevices;			/* Number of devices in the vpd database. */
-static unsigned int 	checksum = 0;			/* Checksum calculated on the Cypress firmware binary. */
+static int		config_parsed;			/* The config file is only parsed once per process. */
 
 /* The following variables are used by the cyusb_linux application. */
        char		pidfile[MAX_FILEPATH_LENGTH];	/* Full path to the PID file specified in /etc/cyusb.conf */
        char		logfile[MAX_FILEPATH_LENGTH];	/* Full path to the LOG file specified in /etc/cyusb.conf */
+       char		metricsgroup[MAX_STR_LEN];	/* Group allowed to update the metrics segment, or empty */
        int		logfd;				/* File descriptor for the LOG file. */
        int		pidfd;				/* File descriptor for the PID file. */
 
@@ -74,21 +116,40 @@ isempty (
 	return flag;
 }
 
+/* vpd_compare:
+   Order VPD entries by VID and then PID, for bsearch().
+ */
+static int
+vpd_compare (
+		const void *a,
+		const void *b)
+{
+	const struct VPD *va = (const struct VPD *)a;
+	const struct VPD *vb = (const struct VPD *)b;
+	unsigned int ka = (va->vid << 16) | va->pid;
+	unsigned int kb = (vb->vid << 16) | vb->pid;
+
+	return (ka > kb) - (ka < kb);
+}
+
 /* parse_configfile:
-   Parse the /etc/cyusb.conf file and get the list of USB devices of interest.
+   Parse the /etc/cyusb.conf file and get the list of USB devices of interest. The results are
+   kept for the life of the process, so the file is only read by the first cyusb_open() call.
  */
-static void
+static int
 parse_configfile (
 		void)
 {
 	FILE *inp;
 	char buf[MAX_CFG_LINE_LENGTH];
 	char *cp1, *cp2, *cp3;
-	int i;
+
+	if ( config_parsed )
+		return 0;
 
 	inp = fopen("/etc/cyusb.conf", "r");
 	if (inp == NULL)
-		return;
+		return -ENOENT;
 
 	memset(buf,'\0',MAX_CFG_LINE_LENGTH);
 	while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
@@ -108,6 +169,13 @@ parse_configfile (
 			cp2 = strtok(NULL," \t\n");
 			strcpy(pidfile,cp2);
 		}
+		else if ( !strcmp(cp1,"MetricsGroup") ) {
+			cp2 = strtok(NULL," \t\n");
+			if ( cp2 != NULL ) {
+				strncpy(metricsgroup,cp2,MAX_STR_LEN);
+				metricsgroup[MAX_STR_LEN - 1] = '\0';
+			}
+		}
 		else if ( !strcmp(cp1,"<VPD>") ) {
 			while ( fgets(buf,MAX_CFG_LINE_LENGTH,inp) ) {
 				if ( buf[0] == '#' ) 		/* Any line starting with a # is a comment 	*/
@@ -139,6 +207,10 @@ parse_configfile (
 	}
 
 	fclose(inp);
+
+	qsort(vpd, maxdevices, sizeof(struct VPD), vpd_compare);
+	config_parsed = 1;
+	return 0;
 }
 
 /* device_is_of_interest:
@@ -148,19 +220,16 @@ static int
 device_is_of_interest (
 		libusb_device *d)
 {
-	int i;
 	struct libusb_device_descriptor desc;
-	int vid, pid;
+	struct VPD key;
 
 	libusb_get_device_descriptor(d, &desc);
-	vid = desc.idVendor;
-	pid = desc.idProduct;
+	key.vid = desc.idVendor;
+	key.pid = desc.idProduct;
 
-	for ( i = 0; i < maxdevices; ++i ) {
-		if ( (vpd[i].vid == vid) && (vpd[i].pid == pid) ) {
-			printf("Found device %04x %04x \n", vid, pid);
-			return 1;
-		}
+	if ( bsearch(&key, vpd, maxdevices, sizeof(struct VPD), vpd_compare) != NULL ) {
+		printf("Found device %04x %04x \n", key.vid, key.pid);
+		return 1;
 	}
 	return 0;
 }
@@ -178,69 +247,308 @@ cyusb_getvendor (
 	return d.idVendor;
 }
 
+/* handle_map_add:
+   Remember the context a device handle was opened with. Only handles of contexts with their own
+   libusb context are kept.
+ */
+static void
+handle_map_add (
+		struct cyusb_context *c,
+		libusb_device_handle *h)
+{
+	struct handle_ctx *map;
+
+	if ( c->ctx == NULL )
+		return;
+
+	pthread_mutex_lock(&handle_lock);
+	if ( handle_count == handle_size ) {
+		map = (struct handle_ctx *)realloc(handle_map, (handle_size + MAXDEVICES) * sizeof(struct handle_ctx));
+		if ( map == NULL ) {
+			pthread_mutex_unlock(&handle_lock);
+			return;
+		}
+		handle_map   = map;
+		handle_size += MAXDEVICES;
+	}
+	handle_map[handle_count].handle = h;
+	handle_map[handle_count].ctx    = c->ctx;
+	++handle_count;
+	pthread_mutex_unlock(&handle_lock);
+}
+
+/* handle_map_remove:
+   Forget the context of a device handle that is being closed.
+ */
+static void
+handle_map_remove (
+		libusb_device_handle *h)
+{
+	int i;
+
+	pthread_mutex_lock(&handle_lock);
+	for ( i = 0; i < handle_count; ++i ) {
+		if ( handle_map[i].handle == h ) {
+			handle_map[i] = handle_map[--handle_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&handle_lock);
+}
+
+/* cyusb_handle_context:
+   Get the libusb context that a device handle was opened with, so that the library can handle events
+   for requests it makes on the handle. Handles opened outside of a cyusb_context belong to the default
+   context.
+ */
+libusb_context *
+cyusb_handle_context (
+		libusb_device_handle *h)
+{
+	libusb_context *ctx = NULL;
+	int i;
+
+	pthread_mutex_lock(&handle_lock);
+	for ( i = 0; i < handle_count; ++i ) {
+		if ( handle_map[i].handle == h ) {
+			ctx = handle_map[i].ctx;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&handle_lock);
+
+	return ctx;
+}
+
+/* cydev_find:
+   Get the index of a device in the device table, or -1 if it is not there.
+ */
+static int
+cydev_find (
+		struct cyusb_context *c,
+		libusb_device *d)
+{
+	int i;
+
+	for ( i = 0; i < c->count; ++i ) {
+		if ( c->devs[i].dev == d )
+			return i;
+	}
+	return -1;
+}
+
+/* cydev_add:
+   Store a device of interest in the first free slot of the device table, growing the table if it is
+   full. The device is opened later, by cyusb_gethandle_ctx(). Returns the index used for the device,
+   or a negative error code.
+ */
+static int
+cydev_add (
+		struct cyusb_context *c,
+		libusb_device *d)
+{
+	struct libusb_device_descriptor desc;
+	struct cydev *devs;
+	int size;
+	int i;
+
+	for ( i = 0; i < c->count; ++i ) {
+		if ( c->devs[i].dev == NULL )
+			break;
+	}
+	if ( i == c->size ) {
+		size = (c->size == 0) ? MAXDEVICES : 2 * c->size;
+		devs = (struct cydev *)realloc(c->devs, size * sizeof(struct cydev));
+		if ( devs == NULL )
+			return -ENOMEM;
+		memset(devs + c->size, 0, (size - c->size) * sizeof(struct cydev));
+		c->devs = devs;
+		c->size = size;
+	}
+
+	libusb_get_device_descriptor(d, &desc);
+	c->devs[i].dev     = libusb_ref_device(d);
+	c->devs[i].handle  = NULL;
+	c->devs[i].vid     = desc.idVendor;
+	c->devs[i].pid     = desc.idProduct;
+	c->devs[i].is_open = 0;
+	c->devs[i].busnum  = libusb_get_bus_number(d);
+	c->devs[i].devaddr = libusb_get_device_address(d);
+	if ( i == c->count )
+		++c->count;
+
+	return i;
+}
+
+/* cydev_remove:
+   Close a device and free its slot in the device table. Trailing free slots are dropped.
+ */
+static void
+cydev_remove (
+		struct cyusb_context *c,
+		int index)
+{
+	if ( c->devs[index].is_open ) {
+		handle_map_remove(c->devs[index].handle);
+		libusb_close(c->devs[index].handle);
+	}
+	cyusb_desc_forget(c->devs[index].dev);
+	libusb_unref_device(c->devs[index].dev);
+	memset(&c->devs[index], 0, sizeof(struct cydev));
+
+	while ( (c->count > 0) && (c->devs[c->count - 1].dev == NULL) )
+		--c->count;
+}
+
 /* renumerate:
-   Get handles to and store information about all USB devices of interest.
+   Store information about all USB devices of interest.
  */
 static int
 renumerate (
-		void)
+		struct cyusb_context *c)
 {
-	libusb_device *dev = NULL;
-	libusb_device_handle *handle = NULL;
-	struct libusb_device_descriptor desc;
 	int           numdev;
 	int           i;
 	int           r;
 
-	numdev = libusb_get_device_list(NULL, &list);
+	numdev = libusb_get_device_list(c->ctx, &c->list);
 	if ( numdev < 0 ) {
 		printf("Library: Error in enumerating devices...\n");
 		return -ENODEV;
 	}
 
-	nid = 0;
+	c->count = 0;
 	for ( i = 0; i < numdev; ++i ) {
-		libusb_device *tdev = list[i];
+		libusb_device *tdev = c->list[i];
 		if ( device_is_of_interest(tdev) ) {
-			cydev[nid].dev = tdev;
-			r = libusb_open(tdev, &cydev[nid].handle);
-			if ( r ) {
-				printf("Error in opening device %d\n", r);
-				return -EACCES;
-			}
-			else
-				handle = cydev[nid].handle;
-
-			libusb_get_device_descriptor(tdev, &desc);
-			cydev[nid].vid     = desc.idVendor;
-			cydev[nid].pid     = desc.idProduct;
-			cydev[nid].is_open = 1;
-			cydev[nid].busnum  = libusb_get_bus_number(tdev);
-			cydev[nid].devaddr = libusb_get_device_address(tdev);
-			++nid;
+			r = cydev_add(c, tdev);
+			if ( r < 0 )
+				break;
 		}
 	}
 
-	return nid;
+	return c->count;
+}
+
+/* context_create:
+   Allocate a context with its own libusb context.
+ */
+static int
+context_create (
+		cyusb_context **ctx)
+{
+	struct cyusb_context *c;
+	pthread_mutexattr_t attr;
+	int r;
+
+	c = (struct cyusb_context *)calloc(1, sizeof(struct cyusb_context));
+	if ( c == NULL )
+		return -ENOMEM;
+
+	r = libusb_init(&c->ctx);
+	if (r) {
+		printf("Error in initializing libusb library...\n");
+		free(c);
+		return -EACCES;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&c->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	*ctx = c;
+	return 0;
+}
+
+/* cyusb_open_ctx:
+   Creates a context and stores all USB devices of interest in it. Returns their count.
+ */
+int
+cyusb_open_ctx (
+		cyusb_context **ctx)
+{
+	int r;
+
+	*ctx = NULL;
+
+	/* Parse the file and store information inside exported data structures */
+	r = parse_configfile();
+	if ( r ) {
+		printf("/etc/cyusb.conf file not found. Exiting\n");
+		return r;
+	}
+
+	r = context_create(ctx);
+	if ( r )
+		return r;
+
+	/* Get list of USB devices of interest. */
+	return renumerate(*ctx);
+}
+
+/* open_vid_pid:
+   Open the USB device with specified vid/pid, and store it as the only device in a context.
+ */
+static int
+open_vid_pid (
+		struct cyusb_context *c,
+		unsigned short vid,
+		unsigned short pid)
+{
+	libusb_device_handle *h = NULL;
+	int r;
+
+	h = libusb_open_device_with_vid_pid(c->ctx, vid, pid);
+	if ( !h ) {
+		printf("Device not found\n");
+		return -ENODEV;
+	}
+
+	c->count = 0;
+	r = cydev_add(c, libusb_get_device(h));
+	if ( r < 0 ) {
+		libusb_close(h);
+		return r;
+	}
+	c->devs[0].handle  = h;
+	c->devs[0].is_open = 1;
+	handle_map_add(c, h);
+
+	return 1;
+}
+
+/* cyusb_open_ctx:
+   Creates a context holding just the USB device with specified vid/pid.
+ */
+int
+cyusb_open_ctx (
+		cyusb_context **ctx,
+		unsigned short vid,
+		unsigned short pid)
+{
+	int r;
+
+	r = context_create(ctx);
+	if ( r )
+		return r;
+
+	return open_vid_pid(*ctx, vid, pid);
 }
 
 /* cyusb_open:
-   Opens handles to all USB devices of interest, and returns their count.
+   Opens the library on the default context, and returns the number of USB devices of interest.
  */
 int cyusb_open (
 		void)
 {
-	int fd1;
 	int r;
 
-	fd1 = open("/etc/cyusb.conf", O_RDONLY);
-	if ( fd1 < 0 ) {
+	/* Parse the file and store information inside exported data structures */
+	r = parse_configfile();
+	if ( r ) {
 		printf("/etc/cyusb.conf file not found. Exiting\n");
-		return -ENOENT;
-	}
-	else {
-		close(fd1);
-		parse_configfile();	/* Parse the file and store information inside exported data structures */
+		return r;
 	}
 
 	r = libusb_init(NULL);
@@ -250,7 +558,7 @@ int cyusb_open (
 	}
 
 	/* Get list of USB devices of interest. */
-	r = renumerate();
+	r = renumerate(&default_context);
 	return r;
 }
 
@@ -262,9 +570,6 @@ int cyusb_open (
 		unsigned short pid)
 {
 	int r;
-	libusb_device *dev = NULL;
-	libusb_device_handle *h = NULL;
-	struct libusb_device_descriptor desc;
 
 	r = libusb_init(NULL);
 	if (r) {
@@ -272,25 +577,7 @@ int cyusb_open (
 		return -EACCES;
 	}
 
-	h = libusb_open_device_with_vid_pid(NULL, vid, pid);
-	if ( !h ) {
-		printf("Device not found\n");
-		return -ENODEV;
-	}
-
-	dev = libusb_get_device(h);
-	cydev[0].dev     = dev;
-	cydev[0].handle  = h;
-
-	libusb_get_device_descriptor(dev, &desc);
-	cydev[0].vid     = desc.idVendor;
-	cydev[0].pid     = desc.idProduct;
-	cydev[0].is_open = 1;
-	cydev[0].busnum  = libusb_get_bus_number(dev);
-	cydev[0].devaddr = libusb_get_device_address(dev);
-	nid = 1;
-
-	return 1;
+	return open_vid_pid(&default_context, vid, pid);
 }
 
 /* cyusb_error:
@@ -345,6 +632,38 @@ cyusb_error (
 	}
 }
 
+/* cyusb_gethandle_ctx:
+   Get a handle to the USB device with specified index in a context.
+ */
+libusb_device_handle *
+cyusb_gethandle_ctx (
+		cyusb_context *ctx,
+		int index)
+{
+	libusb_device_handle *h = NULL;
+	int r;
+
+	/* Devices are opened the first time their handle is asked for. */
+	pthread_mutex_lock(&ctx->lock);
+	if ( (index >= 0) && (index < ctx->count) ) {
+		if ( (ctx->devs[index].dev != NULL) && (!ctx->devs[index].is_open) ) {
+			r = libusb_open(ctx->devs[index].dev, &ctx->devs[index].handle);
+			if ( r ) {
+				printf("Error in opening device %d\n", r);
+				ctx->devs[index].handle = NULL;
+			}
+			else {
+				ctx->devs[index].is_open = 1;
+				handle_map_add(ctx, ctx->devs[index].handle);
+			}
+		}
+		h = ctx->devs[index].handle;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return h;
+}
+
 /* cyusb_gethandle:
    Get a handle to the USB device with specified index.
  */
@@ -352,7 +671,55 @@ libusb_device_handle *
 cyusb_gethandle (
 		int index)
 {
-	return cydev[index].handle;
+	return cyusb_gethandle_ctx(&default_context, index);
+}
+
+/* context_release:
+   Close all device handles of a context, and free its device table.
+ */
+static void
+context_release (
+		struct cyusb_context *c)
+{
+	int i;
+
+	if ( c->hotplug_active )
+		cyusb_hotplug_stop_ctx(c);
+
+	for ( i = 0; i < c->count; ++i ) {
+		if ( c->devs[i].is_open ) {
+			handle_map_remove(c->devs[i].handle);
+			libusb_close(c->devs[i].handle);
+		}
+		if ( c->devs[i].dev != NULL ) {
+			cyusb_desc_forget(c->devs[i].dev);
+			libusb_unref_device(c->devs[i].dev);
+		}
+	}
+	free(c->devs);
+	c->devs  = NULL;
+	c->count = 0;
+	c->size  = 0;
+
+	if ( c->list != NULL )
+		libusb_free_device_list(c->list, 1);
+	c->list = NULL;
+	libusb_exit(c->ctx);
+}
+
+/* cyusb_close_ctx:
+   Close all device handles of a context, and free the context.
+ */
+void
+cyusb_close_ctx (
+		cyusb_context *ctx)
+{
+	if ( ctx == NULL )
+		return;
+
+	context_release(ctx);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
 }
 
 /* cyusb_close:
@@ -362,16 +729,248 @@ void
 cyusb_close (
 		void)
 {
-	int i;
+	context_release(&default_context);
+}
+
+/* cyusb_getcount_ctx:
+   Get the number of slots in use in the device table of a context.
+ */
+int
+cyusb_getcount_ctx (
+		cyusb_context *ctx)
+{
+	return ctx->count;
+}
+
+/* cyusb_getcount:
+   Get the number of slots in use in the cydev[] table.
+ */
+int
+cyusb_getcount (
+		void)
+{
+	return cyusb_getcount_ctx(&default_context);
+}
+
+/* cyusb_getdev_ctx:
+   Get a copy of the device table entry with specified index in a context.
+ */
+int
+cyusb_getdev_ctx (
+		cyusb_context *ctx,
+		int index,
+		struct cydev *dev)
+{
+	int r = -ENODEV;
+
+	pthread_mutex_lock(&ctx->lock);
+	if ( (index >= 0) && (index < ctx->count) && (ctx->devs[index].dev != NULL) ) {
+		*dev = ctx->devs[index];
+		r = 0;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return r;
+}
+
+/* cyusb_getdev:
+   Get a copy of the cydev[] table entry with specified index.
+ */
+int
+cyusb_getdev (
+		int index,
+		struct cydev *dev)
+{
+	return cyusb_getdev_ctx(&default_context, index, dev);
+}
+
+/* cyusb_get_libusb_context:
+   Get the libusb context used by a context.
+ */
+libusb_context *
+cyusb_get_libusb_context (
+		cyusb_context *ctx)
+{
+	return (ctx == NULL) ? NULL : ctx->ctx;
+}
+
+/* hotplug_event:
+   libusb hotplug callback, run by the event thread of the context. Devices of interest that arrive are
+   added to the device table, and devices that leave are closed and removed. The application is
+   notified before a device is removed, so that it can stop using the handle.
+ */
+static int LIBUSB_CALL
+hotplug_event (
+		libusb_context *ctx,
+		libusb_device *d,
+		libusb_hotplug_event event,
+		void *user_data)
+{
+	struct cyusb_context *c = (struct cyusb_context *)user_data;
+	int index;
+
+	pthread_mutex_lock(&c->lock);
+	if ( event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ) {
+		if ( (cydev_find(c, d) < 0) && (device_is_of_interest(d)) ) {
+			index = cydev_add(c, d);
+			if ( index < 0 )
+				printf("Library: Failed to add new device %d\n", index);
+			else if ( c->hotplug_notify )
+				c->hotplug_notify(CYUSB_HOTPLUG_ARRIVED, index, &c->devs[index], c->hotplug_arg);
+		}
+	}
+	else {
+		index = cydev_find(c, d);
+		if ( index >= 0 ) {
+			if ( c->hotplug_notify )
+				c->hotplug_notify(CYUSB_HOTPLUG_LEFT, index, &c->devs[index], c->hotplug_arg);
+			cydev_remove(c, index);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+/* cyusb_hotplug_start_ctx:
+   Start updating the device table of a context from libusb hotplug events.
+ */
+int
+cyusb_hotplug_start_ctx (
+		cyusb_context *ctx,
+		cyusb_hotplug_cb cb,
+		void *arg)
+{
+	int r;
+
+	if ( ctx->hotplug_active )
+		return LIBUSB_ERROR_BUSY;
+	if ( !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) )
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctx->hotplug_notify = cb;
+	ctx->hotplug_arg    = arg;
+
+	/* ENUMERATE also reports devices that arrived since the context was opened; those already in
+	   the table are skipped by the callback. */
+	r = libusb_hotplug_register_callback(ctx->ctx,
+			(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+			LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_event, ctx, &ctx->hotplug_handle);
+	if ( r != LIBUSB_SUCCESS )
+		return r;
+
+	r = cyusb_event_thread_start(ctx->ctx);
+	if ( r != 0 ) {
+		libusb_hotplug_deregister_callback(ctx->ctx, ctx->hotplug_handle);
+		return r;
+	}
+
+	ctx->hotplug_active = 1;
+	return 0;
+}
+
+/* cyusb_hotplug_start:
+   Start updating the cydev[] table from libusb hotplug events.
+ */
+int
+cyusb_hotplug_start (
+		cyusb_hotplug_cb cb,
+		void *arg)
+{
+	return cyusb_hotplug_start_ctx(&default_context, cb, arg);
+}
+
+/* cyusb_hotplug_stop_ctx:
+   Stop handling hotplug events for a context. The device table is left as it is.
+ */
+void
+cyusb_hotplug_stop_ctx (
+		cyusb_context *ctx)
+{
+	if ( !ctx->hotplug_active )
+		return;
+
+	libusb_hotplug_deregister_callback(ctx->ctx, ctx->hotplug_handle);
+	cyusb_event_thread_stop(ctx->ctx);
+	ctx->hotplug_active = 0;
+	ctx->hotplug_notify = NULL;
+}
+
+/* cyusb_hotplug_stop:
+   Stop handling hotplug events. The cydev[] table is left as it is.
+ */
+void
+cyusb_hotplug_stop (
+		void)
+{
+	cyusb_hotplug_stop_ctx(&default_context);
+}
+
+/* cyusb_refresh_ctx:
+   Bring the device table of a context up to date with a new device list, for systems where libusb does
+   not support hotplug events. Only devices that have arrived or left are opened or closed.
+ */
+int
+cyusb_refresh_ctx (
+		cyusb_context *ctx,
+		cyusb_hotplug_cb cb,
+		void *arg)
+{
+	libusb_device **newlist;
+	int numdev;
+	int i, j;
+	int index;
+
+	numdev = libusb_get_device_list(ctx->ctx, &newlist);
+	if ( numdev < 0 ) {
+		printf("Library: Error in enumerating devices...\n");
+		return -ENODEV;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	for ( i = 0; i < ctx->count; ++i ) {
+		if ( ctx->devs[i].dev == NULL )
+			continue;
+		for ( j = 0; j < numdev; ++j ) {
+			if ( newlist[j] == ctx->devs[i].dev )
+				break;
+		}
+		if ( j == numdev ) {
+			if ( cb )
+				cb(CYUSB_HOTPLUG_LEFT, i, &ctx->devs[i], arg);
+			cydev_remove(ctx, i);
+		}
+	}
 
-	for ( i = 0; i < nid; ++i ) {
-		libusb_close(cydev[i].handle);
+	for ( j = 0; j < numdev; ++j ) {
+		if ( (cydev_find(ctx, newlist[j]) >= 0) || (!device_is_of_interest(newlist[j])) )
+			continue;
+		index = cydev_add(ctx, newlist[j]);
+		if ( index < 0 )
+			printf("Library: Failed to add new device %d\n", index);
+		else if ( cb )
+			cb(CYUSB_HOTPLUG_ARRIVED, index, &ctx->devs[index], arg);
 	}
 
-	libusb_free_device_list(list, 1);
-	libusb_exit(NULL);
+	for ( i = 0, index = 0; i < ctx->count; ++i )
+		index += (ctx->devs[i].dev != NULL);
+	pthread_mutex_unlock(&ctx->lock);
+
+	libusb_free_device_list(newlist, 1);
+	return index;
 }
 
+/* cyusb_refresh:
+   Bring the cydev[] table up to date with a new device list.
+ */
+int
+cyusb_refresh (
+		cyusb_hotplug_cb cb,
+		void *arg)
+{
+	return cyusb_refresh_ctx(&default_context, cb, arg);
+}
 
 /* cyusb_download_fx2:
    Download firmware to the Cypress FX2/FX2LP device using USB vendor commands.
@@ -379,109 +978,224 @@ cyusb_close (
 int
 cyusb_download_fx2 (
 		libusb_device_handle *h,
-		char *filename,
+		const char *filename,
 		unsigned char vendor_command)
 {
-	FILE *fp = NULL;
-	char buf[256];
-	char tbuf1[3];
-	char tbuf2[5];
-	char tbuf3[3];
+	struct cyusb_fx2_image *img = NULL;
 	unsigned char reset = 0;
 	int r;
-	int count = 0;
-	unsigned char num_bytes = 0;
-	unsigned short address = 0;
-	unsigned char *dbuf = NULL;
-	int i;
 
-	fp = fopen(filename, "r" );
-	tbuf1[2] ='\0';
-	tbuf2[4] = '\0';
-	tbuf3[2] = '\0';
+	/* The file is only parsed again if it has changed since the last download. */
+	r = cyusb_fx2_image_load(filename, &img);
+	if ( r ) {
+		printf("Failed to load firmware file %s\n", filename);
+		return r;
+	}
 
 	/* Place the FX2/FX2LP CPU in reset, so that the vendor commands can be handled by the device. */
 	reset = 1;
 	r = libusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
-	if ( !r ) {
+	if ( r != 1 ) {
 		printf("Error in control_transfer\n");
+		cyusb_fx2_image_release(img);
+		return (r < 0) ? r : LIBUSB_ERROR_IO;
+	}
+
+	r = cyusb_fx2_image_write(h, img, vendor_command, 0, CYUSB_FX2_MAX_SIZE);
+	cyusb_fx2_image_release(img);
+	if ( r < 0 )
 		return r;
+
+	printf("Total bytes downloaded = %d\n", r);
+
+	/* Bring the CPU out of reset to run the newly loaded firmware. */
+	reset = 0;
+	r = libusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
+	return 0;
+}
+
+/* Number of vendor requests kept in flight while firmware is downloaded to FX3 RAM. */
+#define FX3_DOWNLOAD_DEPTH			(8)
+
+/* Size of each vendor request used to download firmware to FX3 RAM. */
+#define FX3_DOWNLOAD_CHUNK			(4096)
+
+/* Timeout (in milliseconds) for each vendor request used to download firmware to FX3 RAM. */
+#define FX3_DOWNLOAD_TIMEOUT			(1000)
+
+typedef unsigned int fx3_v4u __attribute__ ((vector_size (16)));
+
+/* fx3_checksum:
+   Add up count 32 bit words of firmware data, four at a time.
+ */
+static unsigned int
+fx3_checksum (
+		const unsigned char *data,
+		unsigned int count)
+{
+	fx3_v4u acc = { 0, 0, 0, 0 };
+	fx3_v4u v;
+	unsigned int sum;
+	unsigned int i;
+
+	for ( i = 0; i + 4 <= count; i += 4 ) {
+		memcpy(&v, data + i * 4, sizeof(v));
+		acc += v;
+	}
+
+	sum = acc[0] + acc[1] + acc[2] + acc[3];
+	for ( ; i < count; ++i ) {
+		unsigned int w;
+
+		memcpy(&w, data + i * 4, 4);
+		sum += w;
 	}
-	sleep(1);
 
-	count = 0;
+	return sum;
+}
+
+/* fx3_parse_image:
+   Check the header, section list and checksum of a FX3 firmware image, and get its entry point.
+ */
+static int
+fx3_parse_image (
+		const unsigned char *image,
+		size_t length,
+		unsigned int *entry)
+{
+	unsigned int sum = 0;
+	unsigned int dlen, address, expected;
+	size_t offset = 4;
+
+	if ( (length < 4) || (strncmp((const char *)image, "CY", 2)) ) {
+		printf("Image does not have 'CY' at start. aborting\n");
+		return -EINVAL;
+	}
+	if ( image[2] & 0x01 ) {
+		printf("Image does not contain executable code\n");
+		return -EINVAL;
+	}
+	if ( !(image[3] == 0xB0) ) {
+		printf("Not a normal FW binary with checksum\n");
+		return -EINVAL;
+	}
 
-	while ( fgets(buf, 256, fp) != NULL ) {
-		if ( buf[8] == '1' )
+	while ( 1 ) {
+		if ( length - offset < 8 )
 			break;
-		strncpy(tbuf1,buf+1,2);
-		num_bytes = strtoul(tbuf1,NULL,16);
-		strncpy(tbuf2,buf+3,4);
-		address = strtoul(tbuf2,NULL,16);
-		dbuf = (unsigned char *)malloc(num_bytes);
-		for ( i = 0; i < num_bytes; ++i ) {
-			strncpy(tbuf3,&buf[9+i*2],2);
-			dbuf[i] = strtoul(tbuf3,NULL,16);
+		memcpy(&dlen, image + offset, 4);
+		memcpy(&address, image + offset + 4, 4);
+		offset += 8;
+
+		if ( dlen == 0 ) {
+			if ( length - offset < 4 )
+				break;
+			memcpy(&expected, image + offset, 4);
+			if ( expected != sum ) {
+				printf("Error in checksum\n");
+				return -EINVAL;
+			}
+			*entry = address;
+			return 0;
 		}
 
-		r = libusb_control_transfer(h, 0x40, vendor_command, address, 0x00, dbuf, num_bytes, 1000);
-		if ( !r ) {
-			printf("Error in control_transfer\n");
-			free(dbuf);
-			return r;
-		}
-		count += num_bytes;
-		free(dbuf);
+		if ( dlen > (length - offset) / 4 )
+			break;
+		sum    += fx3_checksum(image + offset, dlen);
+		offset += (size_t)dlen * 4;
 	}
 
-	printf("Total bytes downloaded = %d\n", count);
-	sleep(1);
+	printf("Firmware image is truncated\n");
+	return -EINVAL;
+}
 
-	/* Bring the CPU out of reset to run the newly loaded firmware. */
-	reset = 0;
-	r = libusb_control_transfer(h, 0x40, 0xA0, 0xE600, 0x00, &reset, 0x01, 1000);
-	fclose(fp);
-	return 0;
+/* cyusb_fx3_image_check:
+   Check a FX3 firmware image held in memory, without writing anything to a device.
+ */
+int
+cyusb_fx3_image_check (
+		const unsigned char *image,
+		size_t length,
+		unsigned int *entry)
+{
+	unsigned int program_entry = 0;
+	int r;
+
+	r = fx3_parse_image(image, length, &program_entry);
+	if ( (r == 0) && (entry != NULL) )
+		*entry = program_entry;
+	return r;
 }
 
-/* control_transfer:
-   Internal function that issues the vendor command that incrementally loads firmware segments to the
-   Cypress FX3 device RAM.
+/* cyusb_download_fx3_image:
+   Download a firmware image held in memory to the Cypress FX3 device RAM. Several vendor requests
+   are kept queued at the same time, so that the device does not sit idle between requests.
  */
-static void
-control_transfer (
+int
+cyusb_download_fx3_image (
 		libusb_device_handle *h,
-	       	unsigned int address,
-	       	unsigned char *dbuf,
-	       	int len)
+		const unsigned char *image,
+		size_t length)
 {
-	int j;
+	struct cyusb_control_req *reqs, *req;
+	unsigned int program_entry = 0;
+	unsigned int dlen, address, len;
+	unsigned int count = 1;
+	size_t offset;
 	int r;
-	int b;
-	unsigned int *pint;
-	int index;
 
-	int balance = len;
-	pint = (unsigned int *)dbuf;
-
-	index = 0;
-	while ( balance > 0 ) {
-		if ( balance > 4096 )
-			b = 4096;
-		else b = balance;
-		r = libusb_control_transfer (h, 0x40, 0xA0, ( address & 0x0000ffff ), address >> 16,
-			       	&dbuf[index], b, 1000);
-		if ( r != b ) {
-			printf("Error in control_transfer\n");
+	r = fx3_parse_image(image, length, &program_entry);
+	if ( r )
+		return r;
+
+	/* The image has been checked, so the section list can be walked without further checks. */
+	for ( offset = 4; ; offset += 8 + (size_t)dlen * 4 ) {
+		memcpy(&dlen, image + offset, 4);
+		if ( dlen == 0 )
+			break;
+		count += (dlen * 4 + FX3_DOWNLOAD_CHUNK - 1) / FX3_DOWNLOAD_CHUNK;
+	}
+
+	reqs = (struct cyusb_control_req *)calloc(count, sizeof(struct cyusb_control_req));
+	if ( reqs == NULL )
+		return -ENOMEM;
+
+	req = reqs;
+	for ( offset = 4; ; offset += 8 + (size_t)dlen * 4 ) {
+		memcpy(&dlen, image + offset, 4);
+		if ( dlen == 0 )
+			break;
+		memcpy(&address, image + offset + 4, 4);
+
+		for ( len = 0; len < dlen * 4; len += req->wLength, ++req ) {
+			req->bmRequestType = 0x40;
+			req->bRequest      = 0xA0;
+			req->wValue        = (address + len) & 0x0000ffff;
+			req->wIndex        = (address + len) >> 16;
+			req->wLength       = (dlen * 4 - len > FX3_DOWNLOAD_CHUNK) ? FX3_DOWNLOAD_CHUNK : dlen * 4 - len;
+			req->data          = (unsigned char *)image + offset + 8 + len;
+			req->timeout       = FX3_DOWNLOAD_TIMEOUT;
 		}
-		address += b ;
-		balance -= b;
-		index += b;
 	}
 
-	/* Update the firmware checksum as the download is being performed. */
-	for ( j = 0; j < len/4; ++j )
-		checksum += pint[j];
+	/* The jump to the entry point is only sent once all of the data is in. The device may not
+	   complete it, as it starts running the new firmware straight away. */
+	req->bmRequestType = 0x40;
+	req->bRequest      = 0xA0;
+	req->wValue        = program_entry & 0x0000ffff;
+	req->wIndex        = program_entry >> 16;
+	req->flags         = CYUSB_CONTROL_BARRIER | CYUSB_CONTROL_NO_FAIL;
+
+	r = cyusb_control_batch(h, reqs, count, FX3_DOWNLOAD_DEPTH, 0);
+	if ( r ) {
+		printf("Error in control_transfer\n");
+		r = -EIO;
+	}
+	else if ( req->status < 0 )
+		printf("Ignored error in control_transfer: %d\n", req->status);
+
+	free(reqs);
+	return r;
 }
 
 /* cyusb_download_fx3:
@@ -492,15 +1206,9 @@ cyusb_download_fx3 (
 		libusb_device_handle *h,
 	       	const char *filename)
 {
+	struct stat filestat;
+	void *image;
 	int fd;
-	unsigned char buf[FX3_MAX_FW_SIZE];
-	int nbr;
-	int dlen;
-	int count;
-	unsigned int *pdbuf = NULL;
-	unsigned int address;
-	unsigned int *pint;
-	unsigned int program_entry;
 	int r;
 
 	fd = open(filename, O_RDONLY);
@@ -511,56 +1219,23 @@ cyusb_download_fx3 (
 	else
 		printf("File successfully opened\n");
 
-	count = 0;
-	checksum = 0;
-	nbr = read(fd, buf, 2);		/* Read first 2 bytes, must be equal to 'CY'	*/
-	if ( strncmp((char *)buf,"CY",2) ) {
-		printf("Image does not have 'CY' at start. aborting\n");
-		return -EINVAL;
-	}
-	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageCTL	*/
-	if ( buf[0] & 0x01 ) {
-		printf("Image does not contain executable code\n");
-		return -EINVAL;
-	}
-	nbr = read(fd, buf, 1);		/* Read 1 byte. bImageType	*/
-	if ( !(buf[0] == 0xB0) ) {
-		printf("Not a normal FW binary with checksum\n");
-		return -EINVAL;
-	}
-
-	while (1) {
-		nbr = read(fd, buf, 4);	/* Read Length of section 1,2,3, ...	*/
-		pdbuf = (unsigned int *)buf;
-		dlen = *pdbuf;
-		nbr = read(fd,buf,4);	/* Read Address of section 1,2,3,...	*/
-		pint = (unsigned int *)buf;
-		address = *pint;
-		if ( dlen != 0 ) {
-			nbr = read(fd, buf, dlen*4);	/* Read data bytes	*/
-			control_transfer(h, address, buf, dlen*4);
-		}
-		else {
-			program_entry = address;
-			break;
-		}
-	}
-
-	nbr = read(fd, buf, 4);			/* Read checksum	*/
-	pdbuf = (unsigned int *)buf;
-	if ( *pdbuf != checksum ) {
-		printf("Error in checksum\n");
+	if ( (fstat(fd, &filestat) != 0) || (filestat.st_size < 4) || (filestat.st_size > FX3_MAX_FW_SIZE) ) {
+		printf("File is not a valid FX3 firmware binary\n");
+		close(fd);
 		return -EINVAL;
 	}
 
-	sleep(1);
-	r = libusb_control_transfer(h, 0x40, 0xA0, (program_entry & 0x0000ffff ) , program_entry >> 16, NULL, 0, 1000);
-	if ( r ) {
-		printf("Ignored error in control_transfer: %d\n", r);
+	/* The image is read straight from the page cache, without being copied into a buffer. */
+	image = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if ( image == MAP_FAILED ) {
+		printf("Failed to map firmware file\n");
+		return -ENOMEM;
 	}
 
-	close(fd);
-	return 0;
+	r = cyusb_download_fx3_image(h, (const unsigned char *)image, filestat.st_size);
+	munmap(image, filestat.st_size);
+	return r;
 }
 
 /*[]*/
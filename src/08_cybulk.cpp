@@ -5,6 +5,9 @@
  * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS				*
  * Date written		:	April 3, 2012							*
  * Modification Notes	:									*
+ *    1. Reworked into a streaming pipe: stdin is sent to the bulk OUT endpoint and data	*
+ *       from the bulk IN endpoint is written to stdout, through rings of asynchronous	*
+ *       transfers. The endpoints are taken from the device descriptors.			*
  * 												*
  * This program is a CLI program that does a bulk transfer using the bulkloop.hex file		*
  * downloaded to the FX2 device									*
@@ -15,6 +18,9 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
 #include <pthread.h>
 
 #include <libusb-1.0/libusb.h>
@@ -22,11 +28,15 @@
 
 /********** Cut and paste the following & modify as required  **********/
 static const char * program_name;
-static const char *const short_options = "hvt:";
+static const char *const short_options = "hvt:o:i:s:q:";
 static const struct option long_options[] = {
 		{ "help",	0,	NULL,	'h'	},
 		{ "version",	0,	NULL,	'v'	},
 		{ "timeout",    1,      NULL,   't',	},
+		{ "out",	1,	NULL,	'o'	},
+		{ "in",		1,	NULL,	'i'	},
+		{ "size",	1,	NULL,	's'	},
+		{ "queue",	1,	NULL,	'q'	},
 		{ NULL,		0,	NULL,	 0	}
 };
 
@@ -35,141 +45,383 @@ static int next_option;
 static void print_usage(FILE *stream, int exit_code)
 {
 	fprintf(stream, "Usage: %s options\n", program_name);
-	fprintf(stream, 
+	fprintf(stream,
 		"  -h  --help           Display this usage information.\n"
 		"  -v  --version        Print version.\n"
-		"  -t  --timeout	timeout in seconds, 0 for indefinite wait.\n");
+		"  -t  --timeout	seconds to wait for IN data after end of input, 0 for indefinite wait.\n"
+		"  -o  --out		bulk OUT endpoint (default: first bulk OUT endpoint).\n"
+		"  -i  --in		bulk IN endpoint (default: first bulk IN endpoint).\n"
+		"  -s  --size		transfer size in bytes (default: 65536).\n"
+		"  -q  --queue		number of transfers queued in each direction (default: 16).\n");
 
 	exit(exit_code);
 }
 /***********************************************************************/
 
-static FILE *fp = stdout;
+#define DEFAULT_XFER_SIZE	(65536)
+#define DEFAULT_QUEUE_DEPTH	(16)
+
+/* Interval (in milliseconds) at which the reader checks for the end of the run. */
+#define READER_POLL_INTERVAL	(250)
+
 static int timeout_provided;
 static int timeout = 0;
+static int out_ep = 0;
+static int in_ep = 0;
+static int xfer_size = DEFAULT_XFER_SIZE;
+static int queue_depth = DEFAULT_QUEUE_DEPTH;
 static libusb_device_handle *h1 = NULL;
 
+static cyusb_stream *out_strm = NULL;
+static cyusb_stream *in_strm = NULL;
+
+static volatile sig_atomic_t quit = 0;
+static volatile int writer_done = 0;
+static int writer_status = 0;
+static unsigned long long bytes_out = 0;
+static unsigned long long bytes_in = 0;
+
 static void validate_inputs(void)
 {
 	if ( (timeout_provided) && (timeout < 0) ) {
 	   fprintf(stderr,"Must provide a positive value for timeout in seconds\n");
 	   print_usage(stdout, 1);
-	}   
+	}
+	if ( (xfer_size <= 0) || (queue_depth <= 0) ) {
+	   fprintf(stderr,"Transfer size and queue depth must be positive\n");
+	   print_usage(stdout, 1);
+	}
+	if ( ((out_ep != 0) && ((out_ep & LIBUSB_ENDPOINT_IN) || (out_ep > 0xFF))) ||
+	     ((in_ep != 0) && (!(in_ep & LIBUSB_ENDPOINT_IN) || (in_ep > 0xFF))) ) {
+	   fprintf(stderr,"Endpoint address does not match the direction\n");
+	   print_usage(stdout, 1);
+	}
 }
 
-static void *reader(void *arg1)
+static unsigned long long now_ms(void)
 {
+	struct timespec ts;
+
+	clock_gettime(CYUSB_CLOCK, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void sig_handler(int signo)
+{
+	quit = 1;
+}
+
+/* Find the first interface setting with a bulk OUT and a bulk IN endpoint (or the requested
+   ones), and claim it. The endpoints come from the descriptor snapshot of the device, which
+   lists them by interface and alternate setting. The smaller of the two packet sizes (burst
+   included on USB 3.0) is returned. */
+static int find_endpoints(int *maxpkt)
+{
+	const struct cyusb_desc *desc;
+	const struct cyusb_ep_desc *ep, *out_found, *in_found;
+	unsigned int i, j;
 	int r;
-	unsigned char buf[64];
-	int transferred = 0;
-
-	memset(buf,'\0',64);
-	while (1) {
-		r = libusb_bulk_transfer(h1, 0x86, buf, 64, &transferred, timeout * 1000);
-		if ( r == 0 ) {
-		   printf("%s", buf);
-		   memset(buf,'\0',64);
+
+	r = cyusb_desc_get(libusb_get_device(h1), &desc);
+	if ( r != 0 )
+	   return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for ( i = 0; (i < desc->count) && (r == LIBUSB_ERROR_NOT_FOUND); i = j ) {
+		out_found = in_found = NULL;
+		for ( j = i; (j < desc->count) && (desc->endpoints[j].interface == desc->endpoints[i].interface) &&
+				(desc->endpoints[j].altsetting == desc->endpoints[i].altsetting); ++j ) {
+			ep = &desc->endpoints[j];
+			if ( ep->type != LIBUSB_TRANSFER_TYPE_BULK )
+			   continue;
+			if ( ep->address & LIBUSB_ENDPOINT_IN ) {
+			   if ( !in_found && ((in_ep == 0) || (in_ep == ep->address)) )
+			      in_found = ep;
+			}
+			else if ( !out_found && ((out_ep == 0) || (out_ep == ep->address)) )
+			   out_found = ep;
+		}
+		if ( !out_found || !in_found )
 		   continue;
+
+		ep = &desc->endpoints[i];
+		if ( libusb_kernel_driver_active(h1, ep->interface) != 0 ) {
+		   fprintf(stderr, "kernel driver active. Exitting\n");
+		   r = LIBUSB_ERROR_BUSY;
 		}
+		else if ( (r = libusb_claim_interface(h1, ep->interface)) != 0 )
+		   fprintf(stderr, "Error in claiming interface\n");
+		else if ( (ep->altsetting != 0) &&
+				((r = libusb_set_interface_alt_setting(h1, ep->interface, ep->altsetting)) != 0) )
+		   fprintf(stderr, "Error in selecting alternate setting\n");
 		else {
-			cyusb_error(r);
-			cyusb_close();
-			return NULL;
+		   out_ep  = out_found->address;
+		   in_ep   = in_found->address;
+		   *maxpkt = (out_found->pktsize < in_found->pktsize) ? out_found->pktsize : in_found->pktsize;
 		}
-	} 
+	}
 
+	cyusb_desc_release(desc);
+	return r;
 }
 
-static void * writer(void *arg2)
+/* Reads stdin into OUT transfers as they become free. Each read() is as large as the transfer,
+   and takes whatever stdin has ready, so interactive input is not held back. When the device
+   stops taking data, no transfers come back and stdin is not read any further. */
+static void *writer(void *arg2)
 {
-	int r, nbr;
-	unsigned char buf[64];
-	int transferred = 0;
-
-	memset(buf,'\0',64);
-	while ( nbr = read(0,buf,64) ) {
-		r = libusb_bulk_transfer(h1, 0x02, buf, nbr, &transferred, timeout * 1000);
-		if ( r == 0 ) {
-			memset(buf,'\0',64);
-			continue;
+	struct libusb_transfer *transfer;
+	unsigned int length;
+	unsigned int returned = 0;
+	unsigned long long submitted = 0;
+	ssize_t nbr;
+	int r;
+
+	while ( 1 ) {
+		r = cyusb_stream_next(out_strm, &transfer, &length, 0);
+		if ( r != 0 )
+		   break;
+
+		/* The first queue_depth entries are the idle transfers placed there at start. */
+		if ( returned++ >= (unsigned int)queue_depth ) {
+		   if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+		      fprintf(stderr, "OUT transfer failed with status %d\n", transfer->status);
+		      r = LIBUSB_ERROR_IO;
+		      break;
+		   }
+		   bytes_out += length;
 		}
-		else {
-			cyusb_error(r);
-			cyusb_close();
-			return NULL;
+
+		do {
+			nbr = read(0, transfer->buffer, xfer_size);
+		} while ( (nbr < 0) && (errno == EINTR) && !quit );
+		if ( nbr <= 0 ) {
+		   if ( nbr < 0 ) {
+		      perror("read");
+		      r = LIBUSB_ERROR_IO;
+		   }
+		   break;
 		}
-	} 
 
+		/* Wait as long as the device needs; data is never dropped on a slow consumer. */
+		transfer->length  = nbr;
+		transfer->timeout = 0;
+		r = cyusb_stream_submit(out_strm, transfer);
+		if ( r != 0 )
+		   break;
+		submitted++;
+	}
+
+	/* Wait for the data still in flight to reach the device. */
+	while ( (r == 0) && (returned < submitted + queue_depth) ) {
+		if ( cyusb_stream_next(out_strm, &transfer, &length, 0) != 0 )
+		   break;
+		if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+		   fprintf(stderr, "OUT transfer failed with status %d\n", transfer->status);
+		   r = LIBUSB_ERROR_IO;
+		}
+		bytes_out += length;
+		returned++;
+	}
+
+	writer_status = r;
+	writer_done = 1;
+	return NULL;
 }
 
+/* Writes data from IN transfers to stdout, and queues each transfer again only once its data
+   has been written out, so that a slow reader on stdout holds the device back. */
+static int reader(void)
+{
+	struct libusb_transfer *transfer;
+	unsigned int length, done;
+	unsigned long long idle_since = 0;
+	ssize_t nbw;
+	int r;
+
+	while ( !quit ) {
+		r = cyusb_stream_next(in_strm, &transfer, &length, READER_POLL_INTERVAL);
+		if ( r == LIBUSB_ERROR_TIMEOUT ) {
+		   if ( !writer_done )
+		      continue;
+		   if ( writer_status != 0 )
+		      return writer_status;
+		   if ( idle_since == 0 )
+		      idle_since = now_ms();
+		   else if ( (timeout != 0) && (now_ms() - idle_since >= (unsigned long long)timeout * 1000) )
+		      return 0;
+		   continue;
+		}
+		if ( r != 0 )
+		   return r;
+
+		/* The idle transfers placed on the queue at start have never failed. */
+		if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+		   fprintf(stderr, "IN transfer failed with status %d\n", transfer->status);
+		   return LIBUSB_ERROR_IO;
+		}
+
+		for ( done = 0; done < length; done += nbw ) {
+			nbw = write(1, transfer->buffer + done, length - done);
+			if ( nbw < 0 ) {
+			   if ( errno == EINTR )
+			      continue;
+			   perror("write");
+			   return LIBUSB_ERROR_IO;
+			}
+		}
+		if ( length != 0 ) {
+		   bytes_in += length;
+		   idle_since = 0;
+		}
+
+		transfer->timeout = 0;
+		r = cyusb_stream_submit(in_strm, transfer);
+		if ( r != 0 )
+		   return r;
+	}
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
 	int r;
-	char user_input = 'n';
-	pthread_t tid1, tid2;
+	int maxpkt = 0;
+	pthread_t tid2;
+	unsigned long long start, elapsed;
 
 	program_name = argv[0];
-	
-	while ( (next_option = getopt_long(argc, argv, short_options, 
+
+	while ( (next_option = getopt_long(argc, argv, short_options,
 					   long_options, NULL) ) != -1 ) {
 		switch ( next_option ) {
 			case 'h': /* -h or --help  */
 				  print_usage(stdout, 0);
 			case 'v': /* -v or --version */
-				  printf("%s (Ver 1.0)\n",program_name);
+				  printf("%s (Ver 1.1)\n",program_name);
 				  printf("Copyright (C) 2012 Cypress Semiconductors Inc. / ATR-LABS\n");
 				  exit(0);
 			case 't': /* -t or --timeout  */
 				  timeout_provided = 1;
 				  timeout = atoi(optarg);
 				  break;
+			case 'o': /* -o or --out */
+				  out_ep = strtoul(optarg, NULL, 0);
+				  break;
+			case 'i': /* -i or --in */
+				  in_ep = strtoul(optarg, NULL, 0);
+				  break;
+			case 's': /* -s or --size */
+				  xfer_size = atoi(optarg);
+				  break;
+			case 'q': /* -q or --queue */
+				  queue_depth = atoi(optarg);
+				  break;
 			case '?': /* Invalid option */
 				  print_usage(stdout, 1);
 			default : /* Something else, unexpected */
 				  abort();
 		}
-	} 
+	}
 
 	validate_inputs();
 
+	/* stdout carries the data from the device, so all messages go to stderr. */
 	r = cyusb_open();
 	if ( r < 0 ) {
-	   printf("Error opening library\n");
+	   fprintf(stderr, "Error opening library\n");
 	   return -1;
 	}
 	else if ( r == 0 ) {
-		printf("No device found\n");
+		fprintf(stderr, "No device found\n");
 		return 0;
 	}
 	if ( r > 1 ) {
-		printf("More than 1 devices of interest found. Disconnect unwanted devices\n");
+		fprintf(stderr, "More than 1 devices of interest found. Disconnect unwanted devices\n");
+		cyusb_close();
 		return 0;
 	}
 	h1 = cyusb_gethandle(0);
 	if ( cyusb_getvendor(h1) != 0x04b4 ) {
-	  	printf("Cypress chipset not detected\n");
+	  	fprintf(stderr, "Cypress chipset not detected\n");
 		cyusb_close();
 	  	return 0;
 	}
-	r = libusb_kernel_driver_active(h1, 0);
+	r = find_endpoints(&maxpkt);
 	if ( r != 0 ) {
-	   printf("kernel driver active. Exitting\n");
+	   if ( r == LIBUSB_ERROR_NOT_FOUND )
+	      fprintf(stderr, "No bulk OUT and IN endpoint pair found\n");
 	   cyusb_close();
 	   return 0;
 	}
-	r = libusb_claim_interface(h1, 0);
+
+	/* The transfer size is kept to a whole number of packets. */
+	if ( xfer_size < maxpkt )
+	   xfer_size = maxpkt;
+	xfer_size -= xfer_size % maxpkt;
+
+	r = cyusb_stream_open(h1, out_ep, maxpkt, xfer_size / maxpkt, queue_depth, &out_strm);
+	if ( r == 0 )
+	   r = cyusb_stream_open(h1, in_ep, maxpkt, xfer_size / maxpkt, queue_depth, &in_strm);
+	if ( r == 0 )
+	   r = cyusb_stream_enable_queue(out_strm);
+	if ( r == 0 )
+	   r = cyusb_stream_enable_queue(in_strm);
 	if ( r != 0 ) {
-	   printf("Error in claiming interface\n");
-	   cyusb_close();
-	   return 0;
+	   fprintf(stderr, "Error in allocating transfers\n");
+	   cyusb_error(r);
+	   goto out;
 	}
-	else printf("Successfully claimed interface\n");
-	r = pthread_create(&tid1, NULL, reader, NULL);
+	fprintf(stderr, "Piping through endpoints 0x%02x/0x%02x, %d x %d byte transfers\n",
+			out_ep, in_ep, queue_depth, xfer_size);
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	/* Both streams start with all transfers handed to this program. The IN transfers are
+	   queued here with no timeout, the OUT transfers as stdin data arrives. */
+	r = cyusb_stream_start_held(in_strm);
+	if ( r == 0 )
+	   r = cyusb_stream_start_held(out_strm);
+	if ( r == 0 )
+	   r = cyusb_event_thread_start(NULL);
+	if ( r != 0 ) {
+	   fprintf(stderr, "Error in starting transfers\n");
+	   cyusb_error(r);
+	   goto out;
+	}
+
+	start = now_ms();
 	r = pthread_create(&tid2, NULL, writer, NULL);
-	while ( 1) {
-		pause();
+	if ( r != 0 ) {
+	   fprintf(stderr, "Error in creating writer thread\n");
+	   cyusb_event_thread_stop(NULL);
+	   goto out;
 	}
+
+	r = reader();
+	if ( r != 0 )
+	   cyusb_error(r);
+
+	/* The writer may still be blocked on stdin or on the device. */
+	if ( !writer_done )
+	   pthread_cancel(tid2);
+	pthread_join(tid2, NULL);
+
+	cyusb_stream_stop(out_strm);
+	cyusb_stream_stop(in_strm);
+	cyusb_event_thread_stop(NULL);
+
+	elapsed = now_ms() - start;
+	if ( elapsed == 0 )
+	   elapsed = 1;
+	fprintf(stderr, "Sent %llu bytes, received %llu bytes in %llu ms (%llu / %llu KBps)\n",
+			bytes_out, bytes_in, elapsed, bytes_out / elapsed, bytes_in / elapsed);
+
+out:
+	cyusb_stream_close(in_strm);
+	cyusb_stream_close(out_strm);
 	cyusb_close();
 	return 0;
 }
@@ -3,7 +3,16 @@
  * Description		:	This is a CLI program which can be used to measure the		*
  *				data transfer rate for data (IN or OUT endpoint) transfers	*
  *				from a Cypress USB device. Endpoints of type Bulk, Interrupt 	*
- *				and Isochronous are supported.					*
+ *				and Isochronous are supported. Completion latency and jitter	*
+ *				are reported as percentiles at the end of the test. A sweep	*
+ *				mode finds the best request size and queue depth, and an	*
+ *				adaptive mode tunes both while the test runs. OUT endpoints	*
+ *				are sent a selected pattern or the contents of a file. The	*
+ *				event thread can be pinned to a CPU and run at a real-time	*
+ *				priority, and the buffers locked, to see how host scheduling	*
+ *				shows in the completion interval distribution. A multi-stream	*
+ *				mode runs several endpoints, of one or more devices, at once	*
+ *				and reports the aggregate throughput and its fairness.		*
  * Author		:	Karthik Sivaramakrishnan					*
  * License		:	LGPL Ver 2.1							*
  * Copyright		:	Cypress Semiconductors Inc.					*
@@ -16,7 +25,9 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 #include <libusb-1.0/libusb.h>
 #include "../include/cyusb.h"
@@ -26,130 +37,789 @@ unsigned int endpoint   = 0;	// Endpoint to be tested
 unsigned int reqsize    = 16;	// Request size in number of packets
 unsigned int queuedepth = 16;	// Number of requests to queue
 unsigned int duration   = 100;	// Duration of the test in seconds
+unsigned int interval   = 0;	// Interval in seconds between latency reports, 0 for end of test only
+int          vtype      = -1;	// Pattern that received data is checked against, -1 for no check
+unsigned int vseed      = 0;	// Seed for the data pattern
+const char  *payload_spec = NULL;	// Pattern or file sent on an OUT endpoint, NULL for zeros
+bool         payload_each = false;	// Fill each OUT transfer before it is queued, not just once
+bool         verify_data  = false;	// Whether received data is being checked
+const char  *capture_file = NULL;	// File that all transfers are captured to, NULL for none
+
+// Variables storing the host scheduling configuration.
+int          event_cpu      = -1;	// CPU the event thread is pinned to, -1 for any CPU
+int          event_priority = 0;	// SCHED_FIFO priority of the event thread, 0 for normal scheduling
+bool         lock_buffers   = false;	// Whether the stream buffers are locked into memory
+
+// Variables storing the adaptive mode configuration.
+bool         adaptive       = false;	// Whether the request size and queue depth are tuned
+unsigned int latency_target = 0;	// Average transfer latency wanted in us, 0 for none
+unsigned int rate_target    = 0;	// Throughput wanted in KBps, 0 for none
+
+// Variables storing the sweep mode configuration.
+bool         sweep_mode   = false;	// Whether a sweep over request sizes and queue depths is done
+unsigned int sweep_window = 2;		// Measurement window for each sweep point, in seconds
+const char  *sweep_file   = NULL;	// File to write the sweep results to, NULL for stdout
+bool         sweep_json   = false;	// Write the sweep results as JSON instead of CSV
+
+// Variables storing the multi-stream mode configuration.
+const char  *multi_list   = NULL;	// Streams to run at the same time, NULL for a single stream
+
+// Time (in milliseconds) for which each sweep point is run before it is measured.
+#define SWEEP_WARMUP_TIME	(200)
+
+// Largest request size and queue depth tried by a sweep, unless given on the command line.
+#define SWEEP_DEFAULT_MAX	(64)
+
+// Results for one point of a parameter sweep.
+struct sweep_point {
+	unsigned int		reqsize;	// Request size in packets
+	unsigned int		queuedepth;	// Number of requests queued
+	int			status;		// 0 if the point could be run, error code otherwise
+	unsigned long long	bytes;		// Bytes transferred in the measurement window
+	unsigned long long	failures;	// Failed transfers in the measurement window
+	double			kbps;		// Throughput in KBps
+	double			cpu_ms;		// Process CPU time (user + system) used, in ms
+	double			cpu_pct;	// CPU time as a percentage of the window
+};
 
 libusb_device_handle		*dev_handle = NULL;	// Handle to the USB device
 unsigned char		eptype;			// Type of endpoint (transfer type)
 unsigned int		pktsize;		// Maximum packet size for the endpoint
 
-unsigned int            success_count = 0;	// Number of successful transfers
-unsigned int            failure_count = 0;	// Number of failed transfers
-unsigned int 		transfer_size = 0;	// Size of data transfers performed so far
+unsigned long long	transfer_size = 0;	// Size of data transfers performed so far
 unsigned int		transfer_index = 0;	// Write index into the transfer_size array
-volatile bool		stop_transfers = false;	// Request to stop data transfers
-volatile int		rqts_in_flight = 0;	// Number of transfers that are in progress
 
-struct timeval		start_ts;		// Data transfer start time stamp.
-struct timeval		end_ts;			// Data transfer stop time stamp.
+struct timespec		start_ts;		// Data transfer start time stamp.
+struct timespec		end_ts;			// Data transfer stop time stamp.
 
 // Function: xfer_callback
-// This is the call back function called by libusb upon completion of a queued data transfer.
-static void
+// This is the call back function called by the stream upon completion of a queued data transfer.
+static int
 xfer_callback (
-		struct libusb_transfer *transfer)
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		unsigned int            length,
+		void                   *arg)
 {
+	struct cyusb_stream_stats stats;
 	unsigned int elapsed_time;
-	int size = 0;
 
-	// Reduce the number of requests in flight.
-	rqts_in_flight--;
+	// Update the actual transfer size for this request.
+	transfer_size += length;
 
-	// Check if the transfer has succeeded.
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	// Print the transfer statistics when queuedepth transfers are completed.
+	transfer_index++;
+	if (transfer_index == queuedepth) {
 
-		failure_count++;
+		clock_gettime (CYUSB_CLOCK, &end_ts);
+		elapsed_time = ((end_ts.tv_sec - start_ts.tv_sec) * 1000000 +
+			(end_ts.tv_nsec - start_ts.tv_nsec) / 1000);
 
-	} else {
+		cyusb_stream_get_stats (strm, &stats);
+		printf ("Transfer Counts: %llu pass %llu fail\n", stats.success_count, stats.failure_count);
+		printf ("Data rate: %f KBps\n\n", (((double)transfer_size / 1024) / ((double)elapsed_time / 1000000)));
 
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		transfer_index = 0;
+		transfer_size  = 0;
+		start_ts = end_ts;
+	}
 
-			// Loop through all the packets and check the status of each packet transfer
-			for (int i = 0; i < reqsize; ++i) {
+	return CYUSB_STREAM_RESUBMIT;
+}
 
-				// Calculate the actual size of data transferred in each micro-frame.
-				if (transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED) {
-					size += transfer->iso_packet_desc[i].actual_length;
-				}
-			}
+// Function: print_histogram
+// Prints the percentiles of a latency histogram, in microseconds.
+static void
+print_histogram (
+		const char        *name,
+		struct cyusb_hist *hist)
+{
+	if (hist->count == 0) {
+		printf ("\t%-18s: no samples\n", name);
+		return;
+	}
+
+	printf ("\t%-18s: n=%llu mean=%.1f p50=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n", name, hist->count,
+			((double)hist->sum / hist->count) / 1000,
+			(double)cyusb_hist_percentile (hist, 50.0) / 1000,
+			(double)cyusb_hist_percentile (hist, 99.0) / 1000,
+			(double)cyusb_hist_percentile (hist, 99.9) / 1000,
+			(double)hist->max / 1000);
+}
+
+// Function: print_distribution
+// Prints how the values of a latency histogram are spread over power of two ranges of
+// microseconds, from the smallest value to the largest.
+static void
+print_distribution (
+		const char        *name,
+		struct cyusb_hist *hist)
+{
+	unsigned long long lo = 0, hi, below, prev = 0;
+
+	if (hist->count == 0)
+		return;
+
+	printf ("%s distribution:\n", name);
+	for (hi = 1000; prev < hist->count; hi <<= 1) {
+		below = (hi > hist->max) ? hist->count : cyusb_hist_count_below (hist, hi);
+		if (below != prev)
+			printf ("\t%8llu - %8llu us : %llu (%.2f%%)\n", lo / 1000, hi / 1000, below - prev,
+					((double)(below - prev) * 100) / hist->count);
+		prev = below;
+		lo   = hi;
+	}
+	printf ("\n");
+}
+
+// Function: apply_sched
+// Pins the event thread to the selected CPU and sets its priority, if either was given.
+static int
+apply_sched (
+		const char *progname)
+{
+	int r;
+
+	if ((event_cpu < 0) && (event_priority == 0))
+		return 0;
+
+	r = cyusb_event_thread_set_sched (NULL, event_cpu, event_priority);
+	if (r != 0) {
+		printf ("%s: Failed to set event thread CPU %d, priority %d\n", progname, event_cpu, event_priority);
+		cyusb_error (r);
+	}
+	return r;
+}
+
+// Function: adapt_reason_name
+// Gets a printable name for the reason of a change made by an adaptive stream.
+static const char *
+adapt_reason_name (
+		unsigned int reason)
+{
+	switch (reason) {
+		case CYUSB_STREAM_ADAPT_UNDERRUN:   return "underrun";
+		case CYUSB_STREAM_ADAPT_ISO_ERRORS: return "iso packet errors";
+		case CYUSB_STREAM_ADAPT_SHORT:      return "short transfers";
+		case CYUSB_STREAM_ADAPT_FAILED:     return "failed transfers";
+		case CYUSB_STREAM_ADAPT_LATENCY:    return "latency target";
+		case CYUSB_STREAM_ADAPT_RATE:       return "throughput target";
+		default:                            return "unknown";
+	}
+}
 
-		} else {
-			size = reqsize * pktsize;
+// Function: print_report
+// Prints the transfer latency, completion interval and error counts for a stretch of the test.
+static void
+print_report (
+		const char                *title,
+		struct cyusb_hist         *latency,
+		struct cyusb_hist         *jitter,
+		struct cyusb_stream_stats *stats)
+{
+	printf ("%s\n", title);
+	print_histogram ("Transfer latency", latency);
+	print_histogram ("Completion interval", jitter);
+	printf ("\t%-18s: %llu pass %llu fail\n", "Transfer counts", stats->success_count, stats->failure_count);
+	if (stats->eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		printf ("\t%-18s: %llu\n", "Iso packet errors", stats->iso_errors);
+	printf ("\t%-18s: %llu\n", "Short packets", stats->short_packets);
+	if (verify_data) {
+		printf ("\t%-18s: %llu errors in %llu bytes", "Data verification", stats->verify_errors,
+				stats->verify_bytes);
+		if (stats->verify_first_error != CYUSB_PATTERN_NO_ERROR)
+			printf (", first at offset %llu", stats->verify_first_error);
+		printf ("\n");
+	}
+	if (stats->adaptive) {
+		printf ("\t%-18s: reqsize %u queuedepth %u, %llu increases %llu decreases in %llu windows",
+				"Adaptive setting", stats->reqsize, stats->queuedepth, stats->adapt_grows,
+				stats->adapt_shrinks, stats->adapt_windows);
+		if (stats->adapt_reason != 0)
+			printf (", last for %s", adapt_reason_name (stats->adapt_reason));
+		printf ("\n");
+	}
+	printf ("\n");
+}
+
+// Function: timeval_ms
+// Converts a struct timeval to milliseconds.
+static double
+timeval_ms (
+		struct timeval *tv)
+{
+	return ((double)tv->tv_sec * 1000 + (double)tv->tv_usec / 1000);
+}
+
+// Function: run_sweep_point
+// Runs the stream with one request size and queue depth for the sweep window, and measures the
+// throughput and CPU usage. The device handle and claimed interface are reused across points.
+static void
+run_sweep_point (
+		struct sweep_point *pt)
+{
+	cyusb_stream             *strm = NULL;
+	struct cyusb_stream_stats s0, s1;
+	struct rusage             ru0, ru1;
+	struct timespec           t0, t1;
+	unsigned int              remaining;
+	double                    elapsed;
+
+	pt->status = cyusb_stream_open (dev_handle, endpoint, pktsize, pt->reqsize, pt->queuedepth, &strm);
+	if (pt->status != 0)
+		return;
+
+	if (lock_buffers) {
+		pt->status = cyusb_stream_lock_buffers (strm);
+		if (pt->status != 0) {
+			cyusb_stream_close (strm);
+			return;
 		}
+	}
 
-		success_count++;
+	pt->status = cyusb_stream_start (strm);
+	if (pt->status != 0) {
+		cyusb_stream_close (strm);
+		return;
 	}
 
-	// Update the actual transfer size for this request.
-	transfer_size += size;
+	// Let the queue fill up before the measurement is started.
+	usleep (SWEEP_WARMUP_TIME * 1000);
 
-	// Print the transfer statistics when queuedepth transfers are completed.
-	transfer_index++;
-	if (transfer_index == queuedepth) {
+	cyusb_stream_get_stats (strm, &s0);
+	getrusage (RUSAGE_SELF, &ru0);
+	clock_gettime (CYUSB_CLOCK, &t0);
 
-		gettimeofday (&end_ts, NULL);
-		elapsed_time = ((end_ts.tv_sec - start_ts.tv_sec) * 1000000 +
-			(end_ts.tv_usec - start_ts.tv_usec));
+	remaining = sweep_window;
+	while (remaining != 0)
+		remaining = sleep (remaining);
 
-		printf ("Transfer Counts: %d pass %d fail\n", success_count, failure_count);
-		printf ("Data rate: %f KBps\n\n", (((double)transfer_size / 1024) / ((double)elapsed_time / 1000000)));
+	cyusb_stream_get_stats (strm, &s1);
+	getrusage (RUSAGE_SELF, &ru1);
+	clock_gettime (CYUSB_CLOCK, &t1);
 
-		transfer_index = 0;
-		transfer_size  = 0;
-		start_ts = end_ts;
+	cyusb_stream_stop (strm);
+	cyusb_stream_close (strm);
+
+	elapsed      = (double)(t1.tv_sec - t0.tv_sec) * 1000 + (double)(t1.tv_nsec - t0.tv_nsec) / 1000000;
+	pt->bytes    = s1.bytes - s0.bytes;
+	pt->failures = s1.failure_count - s0.failure_count;
+	pt->kbps     = ((double)pt->bytes / 1024) / (elapsed / 1000);
+	pt->cpu_ms   = (timeval_ms (&ru1.ru_utime) - timeval_ms (&ru0.ru_utime)) +
+		(timeval_ms (&ru1.ru_stime) - timeval_ms (&ru0.ru_stime));
+	pt->cpu_pct  = (pt->cpu_ms * 100) / elapsed;
+}
+
+// Function: write_sweep_results
+// Writes the table of sweep results in CSV or JSON format.
+static void
+write_sweep_results (
+		FILE               *fp,
+		struct sweep_point *points,
+		unsigned int        count)
+{
+	unsigned int i;
+
+	if (sweep_json) {
+		fprintf (fp, "[\n");
+		for (i = 0; i < count; i++) {
+			fprintf (fp, "  { \"reqsize\": %u, \"queuedepth\": %u, \"status\": %d, \"bytes\": %llu, "
+					"\"kbps\": %.1f, \"cpu_ms\": %.1f, \"cpu_pct\": %.1f, \"failures\": %llu }%s\n",
+					points[i].reqsize, points[i].queuedepth, points[i].status, points[i].bytes,
+					points[i].kbps, points[i].cpu_ms, points[i].cpu_pct, points[i].failures,
+					(i + 1 < count) ? "," : "");
+		}
+		fprintf (fp, "]\n");
+	} else {
+		fprintf (fp, "reqsize,queuedepth,status,bytes,kbps,cpu_ms,cpu_pct,failures\n");
+		for (i = 0; i < count; i++) {
+			fprintf (fp, "%u,%u,%d,%llu,%.1f,%.1f,%.1f,%llu\n",
+					points[i].reqsize, points[i].queuedepth, points[i].status, points[i].bytes,
+					points[i].kbps, points[i].cpu_ms, points[i].cpu_pct, points[i].failures);
+		}
 	}
+}
 
-	// Prepare and re-submit the read request.
-	if (!stop_transfers) {
+// Function: run_sweep
+// Walks a grid of power of two request sizes and queue depths, up to the given maximum values,
+// and reports the throughput, CPU time and failures for each point along with the best setting.
+static int
+run_sweep (
+		const char  *progname,
+		unsigned int max_reqsize,
+		unsigned int max_depth)
+{
+	struct sweep_point *points, *best = NULL;
+	unsigned int        count = 0, n_reqsize = 0, n_depth = 0;
+	unsigned int        rs, qd, i;
+	FILE               *fp = stdout;
+
+	for (rs = 1; rs <= max_reqsize; rs <<= 1)
+		n_reqsize++;
+	for (qd = 1; qd <= max_depth; qd <<= 1)
+		n_depth++;
+
+	points = (struct sweep_point *)calloc (n_reqsize * n_depth, sizeof (struct sweep_point));
+	if (points == NULL)
+		return -ENOMEM;
+
+	printf ("%s: Sweeping %d request sizes and %d queue depths, %d seconds per point\n",
+			progname, n_reqsize, n_depth, sweep_window);
+
+	for (rs = 1; rs <= max_reqsize; rs <<= 1) {
+		for (qd = 1; qd <= max_depth; qd <<= 1) {
+			points[count].reqsize    = rs;
+			points[count].queuedepth = qd;
+			run_sweep_point (&points[count]);
+
+			if (points[count].status != 0)
+				printf ("\treqsize %4d queuedepth %4d : failed (%d)\n", rs, qd, points[count].status);
+			else
+				printf ("\treqsize %4d queuedepth %4d : %10.1f KBps, %5.1f%% CPU, %llu failures\n",
+						rs, qd, points[count].kbps, points[count].cpu_pct, points[count].failures);
+			count++;
+		}
+	}
 
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
+	// The best setting is the highest throughput without failures. Ties within 1% go to the
+	// setting that uses less CPU time.
+	for (i = 0; i < count; i++) {
+		if ((points[i].status != 0) || (points[i].failures != 0))
+			continue;
+		if ((best == NULL) || (points[i].kbps > best->kbps * 1.01) ||
+				((points[i].kbps > best->kbps * 0.99) && (points[i].cpu_ms < best->cpu_ms)))
+			best = &points[i];
+	}
 
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
+	if (sweep_file != NULL) {
+		fp = fopen (sweep_file, "w");
+		if (fp == NULL) {
+			printf ("%s: Failed to open %s, writing results to stdout\n", progname, sweep_file);
+			fp = stdout;
+		}
+	}
 
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_set_iso_packet_lengths (transfer, pktsize);
-				if (libusb_submit_transfer (transfer) == 0)
-					rqts_in_flight++;
-				break;
+	write_sweep_results (fp, points, count);
+	if (fp != stdout)
+		fclose (fp);
 
-			default:
-				break;
+	if (best != NULL)
+		printf ("%s: Best setting: -s %d -q %d (%.1f KBps, %.1f%% CPU)\n", progname,
+				best->reqsize, best->queuedepth, best->kbps, best->cpu_pct);
+	else
+		printf ("%s: No setting completed without failures\n", progname);
+
+	free (points);
+	return 0;
+}
+
+// Largest number of streams, and of claimed interfaces, in multi-stream mode.
+#define MULTI_MAX_STREAMS	(64)
+#define MULTI_MAX_IFACES	(64)
+
+// One of the streams run at the same time in multi-stream mode.
+struct multi_stream {
+	unsigned int		  dev;		// Index of the device in the device table
+	unsigned int		  ep;		// Endpoint address
+	unsigned char		  type;		// Transfer type of the endpoint
+	cyusb_stream		 *strm;		// Stream on the endpoint
+	struct cyusb_stream_stats stats;	// Statistics at the end of the test
+	struct cyusb_hist	  latency;	// Transfer latency over the test
+	struct cyusb_hist	  jitter;	// Completion intervals over the test
+	unsigned long long	  prev_bytes;	// Bytes transferred at the last report
+	double			  kbps;		// Throughput over the test, in KBps
+};
+
+// An interface claimed in multi-stream mode, with the alternate setting selected on it.
+struct multi_iface {
+	unsigned int		dev;		// Index of the device in the device table
+	int			iface;		// Interface number
+	int			alt;		// Alternate setting selected
+};
+
+static struct multi_stream multi_streams[MULTI_MAX_STREAMS];
+static struct multi_iface  multi_ifaces[MULTI_MAX_IFACES];
+static unsigned int        multi_nstreams = 0;
+static unsigned int        multi_nifaces  = 0;
+
+// Function: eptype_name
+// Gets a printable name for an endpoint transfer type.
+static const char *
+eptype_name (
+		unsigned char type)
+{
+	switch (type & LIBUSB_TRANSFER_TYPE_MASK) {
+		case LIBUSB_TRANSFER_TYPE_BULK:        return "bulk";
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:   return "int";
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS: return "iso";
+		default:                               return "ctrl";
+	}
+}
+
+// Function: multi_claim
+// Claims the interface of a device that an endpoint is on, and selects the first alternate
+// setting that has it. An interface that is already claimed is only used again if the endpoint
+// is in the alternate setting that was selected on it.
+static int
+multi_claim (
+		const char   *progname,
+		unsigned int  dev,
+		unsigned int  ep,
+		unsigned char *type)
+{
+	libusb_device_handle *h = cyusb_gethandle (dev);
+	const struct cyusb_desc *desc;
+	const struct cyusb_ep_desc *epd;
+	unsigned int n;
+	int r;
+
+	if (h == NULL) {
+		printf ("%s: No device %u\n", progname, dev);
+		return -ENODEV;
+	}
+
+	r = cyusb_desc_get (libusb_get_device (h), &desc);
+	if (r != 0) {
+		printf ("%s: Failed to get USB Configuration descriptor of device %u\n", progname, dev);
+		return r;
+	}
+
+	epd = cyusb_desc_endpoint (desc, ep);
+	if (epd == NULL) {
+		printf ("%s: Failed to find endpoint 0x%x on device %u\n", progname, ep, dev);
+		cyusb_desc_release (desc);
+		return -ENOENT;
+	}
+
+	*type = epd->type;
+	for (n = 0; n < multi_nifaces; n++) {
+		if ((multi_ifaces[n].dev == dev) && (multi_ifaces[n].iface == epd->interface))
+			break;
+	}
+
+	if (n < multi_nifaces) {
+		r = 0;
+		if (multi_ifaces[n].alt != epd->altsetting) {
+			printf ("%s: Endpoint 0x%x of device %u needs setting %d of interface %d, "
+					"but setting %d is in use\n", progname, ep, dev,
+					epd->altsetting, epd->interface, multi_ifaces[n].alt);
+			r = -EBUSY;
 		}
+	} else if (multi_nifaces == MULTI_MAX_IFACES) {
+		r = -ENOSPC;
+	} else {
+		r = libusb_claim_interface (h, epd->interface);
+		if (r == 0) {
+			if (epd->altsetting != 0)
+				libusb_set_interface_alt_setting (h, epd->interface, epd->altsetting);
+
+			multi_ifaces[multi_nifaces].dev   = dev;
+			multi_ifaces[multi_nifaces].iface = epd->interface;
+			multi_ifaces[multi_nifaces].alt   = epd->altsetting;
+			multi_nifaces++;
+		} else
+			printf ("%s: Failed to claim interface %d of device %u\n", progname,
+					epd->interface, dev);
+	}
+
+	cyusb_desc_release (desc);
+	return r;
+}
+
+// Function: multi_add
+// Adds a stream on an endpoint of a device to the list of streams to be run.
+static int
+multi_add (
+		const char  *progname,
+		unsigned int dev,
+		unsigned int ep)
+{
+	struct multi_stream *ms;
+	unsigned char type;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < multi_nstreams; i++) {
+		if ((multi_streams[i].dev == dev) && (multi_streams[i].ep == ep))
+			return 0;
+	}
+	if (multi_nstreams == MULTI_MAX_STREAMS) {
+		printf ("%s: Too many streams, at most %d can be run\n", progname, MULTI_MAX_STREAMS);
+		return -ENOSPC;
 	}
+
+	r = multi_claim (progname, dev, ep, &type);
+	if (r != 0)
+		return r;
+
+	ms = &multi_streams[multi_nstreams];
+	memset (ms, 0, sizeof (*ms));
+	ms->dev  = dev;
+	ms->ep   = ep;
+	ms->type = type;
+	multi_nstreams++;
+	return 0;
 }
 
-// Function to free data buffers and transfer structures
+// Function: multi_add_all
+// Adds a stream for every IN endpoint of every device in the device table. On each interface,
+// the endpoints of the first alternate setting that has IN endpoints are used.
+static int
+multi_add_all (
+		const char  *progname,
+		unsigned int ndevices)
+{
+	libusb_device_handle *h;
+	const struct cyusb_desc *desc;
+	const struct cyusb_ep_desc *epd;
+	unsigned int dev, i;
+	int iface, alt, r = 0;
+
+	for (dev = 0; (dev < ndevices) && (r == 0); dev++) {
+		h = cyusb_gethandle (dev);
+		if ((h == NULL) || (cyusb_desc_get (libusb_get_device (h), &desc) != 0))
+			continue;
+
+		// The snapshot lists the endpoints by interface and then by alternate setting.
+		iface = -1;
+		alt   = -1;
+		for (i = 0; (i < desc->count) && (r == 0); i++) {
+			epd = &desc->endpoints[i];
+			if ((epd->address & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN)
+				continue;
+			if ((epd->interface == iface) && (epd->altsetting != alt))
+				continue;
+
+			iface = epd->interface;
+			alt   = epd->altsetting;
+			r = multi_add (progname, dev, epd->address);
+		}
+
+		cyusb_desc_release (desc);
+	}
+
+	if ((r == 0) && (multi_nstreams == 0)) {
+		printf ("%s: No IN endpoints found\n", progname);
+		r = -ENOENT;
+	}
+	return r;
+}
+
+// Function: multi_parse
+// Adds the streams listed as <dev>:<ep> pairs, separated by commas, or all IN endpoints for the
+// list "all".
+static int
+multi_parse (
+		const char  *progname,
+		const char  *list,
+		unsigned int ndevices)
+{
+	unsigned long dev, ep;
+	const char *p = list;
+	char *end;
+	int r;
+
+	if (strcmp (list, "all") == 0)
+		return multi_add_all (progname, ndevices);
+
+	while (*p != '\0') {
+		dev = strtoul (p, &end, 0);
+		if ((end == p) || (*end != ':'))
+			break;
+		p  = end + 1;
+		ep = strtoul (p, &end, 0);
+		if ((end == p) || ((*end != ',') && (*end != '\0')) || ((ep & 0x70) != 0) || ((ep & 0x0F) == 0) ||
+				(ep > 0xFF))
+			break;
+		if (dev >= ndevices) {
+			printf ("%s: No device %lu, %u devices found\n", progname, dev, ndevices);
+			return -ENODEV;
+		}
+
+		r = multi_add (progname, dev, ep);
+		if (r != 0)
+			return r;
+
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	if ((*p != '\0') || (multi_nstreams == 0)) {
+		printf ("%s: Failed to parse stream list %s\n", progname, list);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// Function: multi_report
+// Prints the throughput, share of the total, errors and latency of each stream, then the
+// aggregate throughput, CPU usage and latency of all streams along with the fairness index.
 static void
-free_transfer_buffers (
-		unsigned char          **databuffers,
-		struct libusb_transfer **transfers)
+multi_report (
+		double elapsed,
+		double cpu_ms)
 {
-	// Free up any allocated data buffers
-	if (databuffers != NULL) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (databuffers[i] != NULL) {
-				free (databuffers[i]);
-			}
-			databuffers[i] = NULL;
+	struct multi_stream *ms;
+	struct cyusb_hist latency, jitter;
+	double total = 0, sumsq = 0, lo = 0, hi = 0, jain;
+	unsigned long long failures = 0;
+	unsigned int i;
+
+	cyusb_hist_reset (&latency);
+	cyusb_hist_reset (&jitter);
+	for (i = 0; i < multi_nstreams; i++) {
+		ms = &multi_streams[i];
+		ms->kbps = ((double)ms->stats.bytes / 1024) / (elapsed / 1000);
+		total   += ms->kbps;
+		sumsq   += ms->kbps * ms->kbps;
+		if ((i == 0) || (ms->kbps < lo))
+			lo = ms->kbps;
+		if ((i == 0) || (ms->kbps > hi))
+			hi = ms->kbps;
+		failures += ms->stats.failure_count;
+		cyusb_hist_add (&latency, &ms->latency);
+		cyusb_hist_add (&jitter, &ms->jitter);
+	}
+
+	printf ("Per stream statistics:\n");
+	printf ("\t%4s %5s %5s %12s %7s %8s %8s %12s %12s %12s\n", "dev", "ep", "type", "KBps", "share",
+			"fail", "iso err", "lat p50 us", "lat p99 us", "ivl p99 us");
+	for (i = 0; i < multi_nstreams; i++) {
+		ms = &multi_streams[i];
+		printf ("\t%4u  0x%02x %5s %12.1f %6.1f%% %8llu %8llu %12.1f %12.1f %12.1f\n", ms->dev, ms->ep,
+				eptype_name (ms->type), ms->kbps, (total != 0) ? (ms->kbps * 100) / total : 0.0,
+				ms->stats.failure_count, ms->stats.iso_errors,
+				(double)cyusb_hist_percentile (&ms->latency, 50.0) / 1000,
+				(double)cyusb_hist_percentile (&ms->latency, 99.0) / 1000,
+				(double)cyusb_hist_percentile (&ms->jitter, 99.0) / 1000);
+	}
+	printf ("\n");
+
+	// Jain's fairness index: 1 when all streams get the same throughput, 1/n when one gets it all.
+	jain = (sumsq != 0) ? (total * total) / (multi_nstreams * sumsq) : 0;
+
+	printf ("Aggregate statistics:\n");
+	printf ("\t%-18s: %u\n", "Streams", multi_nstreams);
+	printf ("\t%-18s: %.1f KBps\n", "Throughput", total);
+	printf ("\t%-18s: %.1f ms (%.1f%%)\n", "CPU time", cpu_ms, (cpu_ms * 100) / elapsed);
+	printf ("\t%-18s: %llu\n", "Failed transfers", failures);
+	print_histogram ("Transfer latency", &latency);
+	print_histogram ("Completion interval", &jitter);
+	printf ("\t%-18s: %.3f Jain index, slowest/fastest %.3f\n", "Fairness", jain, (hi != 0) ? lo / hi : 0.0);
+	printf ("\n");
+}
+
+// Function: run_multi
+// Runs streams on several endpoints, of one or more devices, at the same time for the test
+// duration, and reports the throughput and latency of each along with the aggregate.
+static int
+run_multi (
+		const char  *progname,
+		const char  *list,
+		unsigned int ndevices)
+{
+	struct multi_stream      *ms;
+	struct cyusb_stream_stats stats;
+	struct rusage             ru0, ru1;
+	struct timespec           t0, t1, now;
+	unsigned int              remaining, period, i;
+	double                    elapsed, total;
+	int                       r;
+
+	r = multi_parse (progname, list, ndevices);
+	if (r != 0)
+		goto release;
+
+	for (i = 0; i < multi_nstreams; i++) {
+		ms = &multi_streams[i];
+		r  = cyusb_stream_open (cyusb_gethandle (ms->dev), ms->ep, 0, reqsize, queuedepth, &ms->strm);
+		if ((r == 0) && (lock_buffers))
+			r = cyusb_stream_lock_buffers (ms->strm);
+		if (r != 0) {
+			printf ("%s: Failed to set up stream on endpoint 0x%x of device %u\n", progname, ms->ep, ms->dev);
+			cyusb_error (r);
+			goto close;
 		}
-		free (databuffers);
 	}
 
-	// Free up any allocated transfer structures
-	if (transfers != NULL) {
-		for (unsigned int i = 0; i < queuedepth; i++) {
-			if (transfers[i] != NULL) {
-				libusb_free_transfer (transfers[i]);
+	r = cyusb_event_thread_start (NULL);
+	if (r != 0) {
+		printf ("%s: Failed to start event handling thread\n", progname);
+		goto close;
+	}
+	r = apply_sched (progname);
+	if (r != 0)
+		goto stop;
+
+	printf ("%s: Starting %u streams, request size %u, queue depth %u, for %u seconds\n\n", progname,
+			multi_nstreams, reqsize, queuedepth, duration);
+
+	getrusage (RUSAGE_SELF, &ru0);
+	clock_gettime (CYUSB_CLOCK, &t0);
+	for (i = 0; i < multi_nstreams; i++) {
+		r = cyusb_stream_start (multi_streams[i].strm);
+		if (r != 0) {
+			printf ("%s: Failed to queue transfers on endpoint 0x%x of device %u\n", progname,
+					multi_streams[i].ep, multi_streams[i].dev);
+			cyusb_error (r);
+			goto stop_streams;
+		}
+	}
+
+	// Print the aggregate throughput for each interval if requested.
+	now = t0;
+	remaining = duration;
+	while (remaining != 0) {
+		period = ((interval != 0) && (interval < remaining)) ? interval : remaining;
+		remaining -= period;
+		while (period != 0)
+			period = sleep (period);
+
+		if ((interval != 0) && (remaining != 0)) {
+			t1 = now;
+			clock_gettime (CYUSB_CLOCK, &now);
+			elapsed = (now.tv_sec - t1.tv_sec) * 1000.0 + (now.tv_nsec - t1.tv_nsec) / 1000000.0;
+
+			total = 0;
+			for (i = 0; i < multi_nstreams; i++) {
+				ms = &multi_streams[i];
+				cyusb_stream_get_stats (ms->strm, &stats);
+				total += (double)(stats.bytes - ms->prev_bytes);
+				ms->prev_bytes = stats.bytes;
 			}
-			transfers[i] = NULL;
+			printf ("Aggregate data rate: %.1f KBps\n", (total / 1024) / (elapsed / 1000));
+		}
+	}
+
+stop_streams:
+	for (i = 0; i < multi_nstreams; i++)
+		cyusb_stream_stop (multi_streams[i].strm);
+	clock_gettime (CYUSB_CLOCK, &t1);
+	getrusage (RUSAGE_SELF, &ru1);
+
+	if (r == 0) {
+		for (i = 0; i < multi_nstreams; i++) {
+			ms = &multi_streams[i];
+			cyusb_stream_get_stats (ms->strm, &ms->stats);
+			cyusb_stream_get_latency (ms->strm, &ms->latency, &ms->jitter);
 		}
-		free (transfers);
+
+		printf ("\n%s: Test duration is complete\n\n", progname);
+		elapsed = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+		multi_report (elapsed, (timeval_ms (&ru1.ru_utime) - timeval_ms (&ru0.ru_utime)) +
+				(timeval_ms (&ru1.ru_stime) - timeval_ms (&ru0.ru_stime)));
 	}
+
+stop:
+	cyusb_event_thread_stop (NULL);
+close:
+	for (i = 0; i < multi_nstreams; i++) {
+		if (multi_streams[i].strm != NULL)
+			cyusb_stream_close (multi_streams[i].strm);
+	}
+release:
+	for (i = 0; i < multi_nifaces; i++)
+		libusb_release_interface (cyusb_gethandle (multi_ifaces[i].dev), multi_ifaces[i].iface);
+	return r;
 }
 
 // Prints application usage information.
@@ -159,12 +829,47 @@ print_usage (
 {
 	printf ("%s: USB data transfer performance test\n", progname);
 	printf ("\n");
-	printf ("Usage: %s -e <epnum> -s <reqsize> -q <queuedepth> -d <duration>\n", progname);
+	printf ("Usage: %s -e <epnum> -s <reqsize> -q <queuedepth> -d <duration> [-i <interval>] [-v <pattern>]\n"
+			"\t\t[-f] [-c <capture>] [-p <cpu>] [-P <priority>] [-m]\n", progname);
 	printf ("\twhere\n");
 	printf ("\t\tepnum is the endpoint to be tested\n");
 	printf ("\t\treqsize is the size of individual data transfer requests in packets or bursts\n");
 	printf ("\t\tqueuedepth is the number of requests to be queued at a time\n");
 	printf ("\t\tduration is the duration in seconds for which the test is to be run\n");
+	printf ("\t\tinterval is the time in seconds between latency reports (default: end of test only)\n");
+	printf ("\t\tpattern is the data pattern to check IN data against: const[:value], inc8, inc16,\n");
+	printf ("\t\t\tinc32 or lfsr (default: no check). On an OUT endpoint, it is the data\n");
+	printf ("\t\t\tsent, and may also be file:<path> (default: zeros)\n");
+	printf ("\t\t-f fills each OUT transfer before it is queued, so that the pattern continues\n");
+	printf ("\t\t\tacross transfers (default: all buffers are filled once)\n");
+	printf ("\t\tcapture is a file that all transfers are recorded to, for cyusbreplay (default: none)\n");
+	printf ("\t\tcpu is the CPU that the event thread is pinned to (default: any CPU)\n");
+	printf ("\t\tpriority is the SCHED_FIFO priority of the event thread (default: normal scheduling)\n");
+	printf ("\t\t-m locks the transfer buffers into memory\n");
+	printf ("\t\tThe CPU, priority and -m options also apply to the other modes.\n");
+	printf ("\n");
+	printf ("Adaptive mode: %s -e <epnum> -a [-l <latency>] [-r <rate>] [-s <reqsize>] [-q <queuedepth>] ...\n",
+			progname);
+	printf ("\twhere\n");
+	printf ("\t\treqsize and queuedepth are the largest values used\n");
+	printf ("\t\tlatency is the average transfer latency wanted in us (default: none)\n");
+	printf ("\t\trate is the throughput wanted in KBps (default: none)\n");
+	printf ("\n");
+	printf ("Sweep mode: %s -e <epnum> -S [-s <reqsize>] [-q <queuedepth>] [-w <window>] [-o <file>] [-j]\n",
+			progname);
+	printf ("\twhere\n");
+	printf ("\t\treqsize and queuedepth are the largest values tried (default: %d)\n", SWEEP_DEFAULT_MAX);
+	printf ("\t\twindow is the measurement time for each setting in seconds (default: 2)\n");
+	printf ("\t\tfile is where the results table is written (default: stdout)\n");
+	printf ("\t\t-j writes the results as JSON instead of CSV\n");
+	printf ("\n");
+	printf ("Multi-stream mode: %s -M <streams> [-s <reqsize>] [-q <queuedepth>] [-d <duration>] [-i <interval>]\n",
+			progname);
+	printf ("\twhere\n");
+	printf ("\t\tstreams is a comma separated list of <device>:<endpoint> pairs, with devices numbered\n");
+	printf ("\t\t\tfrom 0 in the order they are found, or all for every IN endpoint of every device\n");
+	printf ("\t\tinterval is the time in seconds between aggregate data rate reports (default: none)\n");
+	printf ("\t\tAll the streams are run at the same time, with the same request size and queue depth.\n");
 	printf ("\n");
 }
 
@@ -177,23 +882,30 @@ int main (
 	char         c;
 
 	libusb_device		*dev = NULL;	// The USB device
-	libusb_device_descriptor deviceDesc;
-	libusb_config_descriptor *configDesc;
-	libusb_interface_descriptor *interfaceDesc;
-	libusb_endpoint_descriptor *endpointDesc;
-	libusb_ss_endpoint_companion_descriptor *companionDesc;
+	const struct cyusb_desc *desc;		// Descriptor snapshot of the device
+	const struct cyusb_ep_desc *epDesc;	// The endpoint to be tested
 
 	int  rStatus;
-	int  if_numsettings;
-	bool found_ep = false;
 
-	struct libusb_transfer **transfers = NULL;		// List of transfer structures.
-	unsigned char **databuffers = NULL;			// List of data buffers.
+	cyusb_stream *strm = NULL;				// Data stream on the endpoint.
+	cyusb_payload *payload = NULL;				// Data sent on an OUT endpoint.
+	cyusb_capture *cap = NULL;				// Capture file for the stream.
+	struct cyusb_capture_stats cap_stats;			// Statistics for the capture file.
+	struct cyusb_stream_stats stats;			// Statistics for the stream.
 
-	struct timeval t1, t2;					// Timestamps used for test duration control
+	unsigned int remaining;					// Time left in the test duration, in seconds
+	unsigned int period;					// Time to wait for the next report, in seconds
+
+	static struct cyusb_hist latency, jitter;		// Latency histograms since start of test
+	static struct cyusb_hist prev_latency, prev_jitter;	// Histograms at the last report
+	static struct cyusb_hist ivl_latency, ivl_jitter;	// Histograms for the last interval
+	struct cyusb_stream_stats prev_stats;			// Statistics at the last report
+	struct cyusb_stream_stats ivl_stats;			// Statistics for the last interval
+
+	bool reqsize_set = false, queuedepth_set = false;	// Whether -s and -q were given
 
 	// Parse command line parameters
-	while ((c = getopt (argc, argv, "e:s:q:d:h")) != -1) {
+	while ((c = getopt (argc, argv, "e:s:q:d:i:v:fc:p:P:mal:r:Sw:o:jM:h")) != -1) {
 		switch (c) {
 			case 'e':
 				// Get the endpoint number.
@@ -218,6 +930,7 @@ int main (
 					print_usage (argv[0]);
 					return (-EINVAL);
 				}
+				reqsize_set = true;
 				break;
 
 			case 'q':
@@ -227,6 +940,7 @@ int main (
 					print_usage (argv[0]);
 					return (-EINVAL);
 				}
+				queuedepth_set = true;
 				break;
 
 			case 'd':
@@ -238,6 +952,112 @@ int main (
 				}
 				break;
 
+			case 'i':
+				// Get the latency report interval.
+				if (sscanf ((const char *)optarg, "%d", &interval) != 1) {
+					printf ("%s: Failed to parse report interval\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'v':
+				// Get the pattern for data verification, or the payload for an OUT endpoint.
+				payload_spec = optarg;
+				if (strncmp (optarg, "file:", 5) == 0)
+					break;
+				if (cyusb_pattern_parse (optarg, &vtype, &vseed) != 0) {
+					printf ("%s: Unknown data pattern %s\n", argv[0], optarg);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'f':
+				// Fill each OUT transfer with the next part of the payload.
+				payload_each = true;
+				break;
+
+			case 'c':
+				// Get the file to capture the transfers to.
+				capture_file = optarg;
+				break;
+
+			case 'p':
+				// Get the CPU to pin the event thread to.
+				if ((sscanf ((const char *)optarg, "%d", &event_cpu) != 1) || (event_cpu < 0)) {
+					printf ("%s: Failed to parse event thread CPU\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'P':
+				// Get the real-time priority of the event thread.
+				if ((sscanf ((const char *)optarg, "%d", &event_priority) != 1) || (event_priority <= 0)) {
+					printf ("%s: Failed to parse event thread priority\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'm':
+				// Lock the transfer buffers into memory.
+				lock_buffers = true;
+				break;
+
+			case 'a':
+				// Tune the request size and queue depth while the test runs.
+				adaptive = true;
+				break;
+
+			case 'l':
+				// Get the latency target for the adaptive mode.
+				if (sscanf ((const char *)optarg, "%u", &latency_target) != 1) {
+					printf ("%s: Failed to parse latency target\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'r':
+				// Get the throughput target for the adaptive mode.
+				if (sscanf ((const char *)optarg, "%u", &rate_target) != 1) {
+					printf ("%s: Failed to parse throughput target\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'S':
+				// Sweep over request sizes and queue depths.
+				sweep_mode = true;
+				break;
+
+			case 'w':
+				// Get the measurement window for each sweep point.
+				if ((sscanf ((const char *)optarg, "%d", &sweep_window) != 1) || (sweep_window == 0)) {
+					printf ("%s: Failed to parse sweep window\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'o':
+				// Get the file to write the sweep results to.
+				sweep_file = optarg;
+				break;
+
+			case 'j':
+				// Write the sweep results as JSON.
+				sweep_json = true;
+				break;
+
+			case 'M':
+				// Get the list of streams to run at the same time.
+				multi_list = optarg;
+				break;
+
 			case 'h':
 				// Print the usage information and quit.
 				print_usage (argv[0]);
@@ -268,6 +1088,13 @@ int main (
 		}
 	}
 
+	// In multi-stream mode, run streams on all the listed devices and endpoints, and quit.
+	if (multi_list != NULL) {
+		rStatus = run_multi (argv[0], multi_list, rStatus);
+		cyusb_close ();
+		return rStatus;
+	}
+
 	// Step 2: Get a handle to the first CyUSB device.
 	dev_handle = cyusb_gethandle (0);
 	if (dev_handle == NULL) {
@@ -276,95 +1103,56 @@ int main (
 	}
 	dev = libusb_get_device(dev_handle);
 
-	// Step 3: Read the configuration descriptor.
-	rStatus = libusb_get_config_descriptor (dev, 0, &configDesc);
+	// Step 3: Get the descriptor snapshot of the device.
+	rStatus = cyusb_desc_get (dev, &desc);
 	if (rStatus != 0) {
 		printf ("%s: Failed to get USB Configuration descriptor\n", argv[0]);
 		cyusb_close ();
 		return -EACCES;
 	}
 
-	// Step 4: Check each of the interfaces one by one and check if we can find the desired endpoint there.
-	for (int i = 0; i < configDesc->bNumInterfaces; i++) {
-
-		// Step 4.a: Claim the interface
-		rStatus = libusb_claim_interface (dev_handle, i);
-		if (rStatus != 0) {
-			printf ("%s: Failed to claim interface %d\n", argv[0], i);
-			libusb_free_config_descriptor (configDesc);
-			cyusb_close ();
-			return -EACCES;
-		}
-
-		// Step 4.b: Get each of the interface descriptors and check if the endpoint is present.
-		if_numsettings = configDesc->interface[i].num_altsetting;
-		for (int j = 0; j < if_numsettings; j++) {
-
-			interfaceDesc = (libusb_interface_descriptor *)&(configDesc->interface[i].altsetting[j]);
-
-			// Step 4.b.1: Check if the desired endpoint is present.
-			for (int k = 0; k < interfaceDesc->bNumEndpoints; k++) {
-
-				endpointDesc = (libusb_endpoint_descriptor *)&(interfaceDesc->endpoint[k]);
-				if (endpointDesc->bEndpointAddress == endpoint) {
-					printf ("%s: Found endpoint 0x%x in interface %d, setting %d\n",
-							argv[0], endpoint, i, j);
-
-					// If the alt setting is not 0, select it
-					libusb_set_interface_alt_setting (dev_handle, i, j);
-					found_ep = true;
-					break;
-				}
-			}
-
-			if (found_ep)
-				break;
-		}
-
-		if (found_ep)
-			break;
-
-		// Step 4.c: Release the interface as the endpoint was not found.
-		libusb_release_interface (dev_handle, i);
-	}
-
-	if (!found_ep) {
+	// Step 4: Look up the endpoint, and claim the interface and select the alternate setting it is in.
+	epDesc = cyusb_desc_endpoint (desc, endpoint);
+	if (epDesc == NULL) {
 		printf ("%s: Failed to find endpoint 0x%x on device\n", argv[0], endpoint);
-		libusb_free_config_descriptor (configDesc);
+		cyusb_desc_release (desc);
 		cyusb_close ();
 		return (-ENOENT);
 	}
 
-	// Store the endpoint type and maximum packet size
-	eptype  = endpointDesc->bmAttributes;
-
-	libusb_get_device_descriptor (dev, &deviceDesc);
-	if (deviceDesc.bcdUSB >= 0x0300) {
-
-		// If this is a USB 3.0 connection, get the endpoint companion descriptor
-		// The packet size for the endpoint is calculated as the product of the max
-		// packet size and the burst size. For Isochronous endpoints, this value is
-		// multiplied by the mult value as well.
-
-		libusb_get_ss_endpoint_companion_descriptor (NULL, endpointDesc, &companionDesc);
-
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			pktsize = endpointDesc->wMaxPacketSize * (companionDesc->bMaxBurst + 1) *
-				(companionDesc->bmAttributes + 1);
-		else
-			pktsize = endpointDesc->wMaxPacketSize * (companionDesc->bMaxBurst + 1);
-
-		libusb_free_ss_endpoint_companion_descriptor (companionDesc);
+	rStatus = libusb_claim_interface (dev_handle, epDesc->interface);
+	if (rStatus != 0) {
+		printf ("%s: Failed to claim interface %d\n", argv[0], epDesc->interface);
+		cyusb_desc_release (desc);
+		cyusb_close ();
+		return -EACCES;
+	}
 
-	} else {
+	printf ("%s: Found endpoint 0x%x in interface %d, setting %d\n",
+			argv[0], endpoint, epDesc->interface, epDesc->altsetting);
+	if (epDesc->altsetting != 0)
+		libusb_set_interface_alt_setting (dev_handle, epDesc->interface, epDesc->altsetting);
 
-		// Not USB 3.0. For Isochronous endpoints, get the packet size as computed by
-		// the library. For other endpoints, use the max packet size as it is.
-		if (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			pktsize = libusb_get_max_iso_packet_size (dev, endpoint);
-		else
-			pktsize = endpointDesc->wMaxPacketSize;
+	// Store the endpoint type and packet size. The snapshot has the packet size worked out
+	// from the burst and mult values of the endpoint already.
+	eptype  = epDesc->type;
+	pktsize = epDesc->pktsize;
 
+	// In sweep mode, run every setting on the same handle and claimed interface, and quit.
+	if (sweep_mode) {
+		rStatus = cyusb_event_thread_start (NULL);
+		if (rStatus == 0) {
+			rStatus = apply_sched (argv[0]);
+			if (rStatus == 0)
+				rStatus = run_sweep (argv[0], (reqsize_set) ? reqsize : SWEEP_DEFAULT_MAX,
+						(queuedepth_set) ? queuedepth : SWEEP_DEFAULT_MAX);
+			cyusb_event_thread_stop (NULL);
+		} else
+			printf ("%s: Failed to start event handling thread\n", argv[0]);
+
+		cyusb_desc_release (desc);
+		cyusb_close ();
+		return rStatus;
 	}
 
 	// Print the test parameters.
@@ -377,96 +1165,217 @@ int main (
 	printf ("\tEndpoint type    : 0x%x\n", eptype);
 	printf ("\tMax packet size  : 0x%x\n", pktsize);
 
-	// Allocate buffers and transfer structures
-	bool allocfail = false;
-
-	databuffers = (unsigned char **)calloc (queuedepth, sizeof (unsigned char *));
-	transfers   = (struct libusb_transfer **)calloc (queuedepth, sizeof (struct libusb_transfer *));
+	// Allocate the stream along with all its buffers and transfer structures
+	rStatus = cyusb_stream_open (dev_handle, endpoint, pktsize, reqsize, queuedepth, &strm);
+	if (rStatus != 0) {
+		printf ("%s: Failed to allocate buffers and transfer structures\n", argv[0]);
+		cyusb_desc_release (desc);
+		cyusb_close ();
+		return (-ENOMEM);
+	}
 
-	if ((databuffers != NULL) && (transfers != NULL)) {
+	// Keep the buffers resident, so that no completion waits for a page fault.
+	if (lock_buffers) {
+		rStatus = cyusb_stream_lock_buffers (strm);
+		if (rStatus != 0) {
+			printf ("%s: Failed to lock the transfer buffers into memory\n", argv[0]);
+			cyusb_error (rStatus);
+			cyusb_stream_close (strm);
+			cyusb_desc_release (desc);
+			cyusb_close ();
+			return rStatus;
+		}
+	}
 
-		for (unsigned int i = 0; i < queuedepth; i++) {
+	// Report whether the transfers complete straight into the stream buffers.
+	cyusb_stream_get_stats (strm, &stats);
+	printf ("\tBuffer memory    : %s%s\n", (stats.zerocopy) ? "zero-copy (usbfs mapped)" : "user space",
+			(stats.locked) ? ", locked" : "");
+
+	// Let the library handle all USB events, and run the transfer callbacks, on its own thread.
+	rStatus = cyusb_event_thread_start (NULL);
+	if (rStatus == 0) {
+		rStatus = apply_sched (argv[0]);
+		if (rStatus != 0)
+			cyusb_event_thread_stop (NULL);
+	} else
+		printf ("%s: Failed to start event handling thread\n", argv[0]);
+	if (rStatus != 0) {
+		cyusb_stream_close (strm);
+		cyusb_desc_release (desc);
+		cyusb_close ();
+		return rStatus;
+	}
+	if (event_cpu >= 0)
+		printf ("\tEvent thread     : CPU %d, ", event_cpu);
+	else
+		printf ("\tEvent thread     : any CPU, ");
+	if (event_priority != 0)
+		printf ("SCHED_FIFO priority %d\n\n", event_priority);
+	else
+		printf ("normal scheduling\n\n");
+	cyusb_stream_set_callback (strm, xfer_callback, NULL);
+
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+
+		// Send the selected payload, or zeros if there is none, so that the data is known.
+		rStatus = cyusb_payload_create ((payload_spec != NULL) ? payload_spec : "const:0", &payload);
+		if (rStatus == 0)
+			rStatus = cyusb_stream_set_payload (strm, payload,
+					(payload_each) ? CYUSB_PAYLOAD_EACH : CYUSB_PAYLOAD_ONCE);
+		if (rStatus != 0) {
+			printf ("%s: Failed to set up payload %s\n", argv[0], (payload_spec != NULL) ? payload_spec : "const:0");
+			cyusb_error (rStatus);
+			if (payload != NULL)
+				cyusb_payload_destroy (payload);
+			cyusb_stream_close (strm);
+			cyusb_event_thread_stop (NULL);
+			cyusb_desc_release (desc);
+			cyusb_close ();
+			return rStatus;
+		}
+		printf ("\tPayload          : %s, %s\n\n", (payload_spec != NULL) ? payload_spec : "const:0",
+				(payload_each) ? "filled for each transfer" : "filled once");
 
-			databuffers[i] = (unsigned char *)malloc (reqsize * pktsize);
-			transfers[i]   = libusb_alloc_transfer (
-					(eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? reqsize : 0);
+	} else if (payload_spec != NULL) {
 
-			if ((databuffers[i] == NULL) || (transfers[i] == NULL)) {
-				allocfail = true;
-				break;
-			}
+		// Check the received data against the selected pattern.
+		if (vtype < 0) {
+			printf ("%s: Data from a file can only be sent on OUT endpoints\n", argv[0]);
+			rStatus = -EINVAL;
+		} else
+			rStatus = cyusb_stream_set_verify (strm, vtype, vseed);
+		if (rStatus != 0) {
+			cyusb_stream_close (strm);
+			cyusb_event_thread_stop (NULL);
+			cyusb_desc_release (desc);
+			cyusb_close ();
+			return rStatus;
 		}
-
-	} else {
-		allocfail = true;
+		verify_data = true;
+		printf ("\tData pattern     : %s\n\n", cyusb_pattern_name (vtype));
 	}
 
-	// Check if all memory allocations have succeeded
-	if (allocfail) {
-		printf ("%s: Failed to allocate buffers and transfer structures\n", argv[0]);
-		free_transfer_buffers (databuffers, transfers);
+	// In adaptive mode, the request size and queue depth given are the largest ones used.
+	if (adaptive) {
+		struct cyusb_stream_adapt adapt;
 
-		libusb_free_config_descriptor (configDesc);
-		cyusb_close ();
-		return (-ENOMEM);
+		memset (&adapt, 0, sizeof (adapt));
+		adapt.latency_target = latency_target;
+		adapt.rate_target    = rate_target;
+		rStatus = cyusb_stream_set_adaptive (strm, &adapt);
+		if (rStatus != 0) {
+			printf ("%s: Failed to set up adaptive mode\n", argv[0]);
+			cyusb_error (rStatus);
+			cyusb_stream_close (strm);
+			if (payload != NULL)
+				cyusb_payload_destroy (payload);
+			cyusb_event_thread_stop (NULL);
+			cyusb_desc_release (desc);
+			cyusb_close ();
+			return rStatus;
+		}
+		printf ("\tAdaptive mode    : latency target %u us, throughput target %u KBps\n\n",
+				latency_target, rate_target);
+	}
+
+	// Record all transfers to the capture file, if any.
+	if (capture_file != NULL) {
+		rStatus = cyusb_capture_create (capture_file, 0, 0, &cap);
+		if (rStatus != 0) {
+			printf ("%s: Failed to create capture file %s: %s\n", argv[0], capture_file, strerror (-rStatus));
+			cyusb_stream_close (strm);
+			if (payload != NULL)
+				cyusb_payload_destroy (payload);
+			cyusb_event_thread_stop (NULL);
+			cyusb_desc_release (desc);
+			cyusb_close ();
+			return rStatus;
+		}
+		cyusb_stream_set_capture (strm, cap);
+		cyusb_capture_get_stats (cap, &cap_stats);
+		printf ("\tCapture file     : %s%s\n\n", capture_file, (cap_stats.direct) ? " (O_DIRECT)" : "");
 	}
 
 	// Take the transfer start timestamp
-	gettimeofday (&start_ts, NULL);
+	clock_gettime (CYUSB_CLOCK, &start_ts);
 
 	// Launch all the transfers till queue depth is complete
-	for (unsigned int i = 0; i < queuedepth; i++) {
-		switch (eptype) {
-			case LIBUSB_TRANSFER_TYPE_BULK:
-				libusb_fill_bulk_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, NULL, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-				libusb_fill_interrupt_transfer (transfers[i], dev_handle, endpoint,
-						databuffers[i], reqsize * pktsize, xfer_callback, NULL, 5000);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
-
-			case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-				libusb_fill_iso_transfer (transfers[i], dev_handle, endpoint, databuffers[i],
-						reqsize * pktsize, reqsize, xfer_callback, NULL, 5000);
-				libusb_set_iso_packet_lengths (transfers[i], pktsize);
-				rStatus = libusb_submit_transfer (transfers[i]);
-				if (rStatus == 0)
-					rqts_in_flight++;
-				break;
+	rStatus = cyusb_stream_start (strm);
+	if (rStatus != 0) {
+		printf ("%s: Failed to queue transfers\n", argv[0]);
+		cyusb_error (rStatus);
+		if (cap != NULL)
+			cyusb_capture_close (cap);
+		cyusb_stream_close (strm);
+		if (payload != NULL)
+			cyusb_payload_destroy (payload);
+		cyusb_event_thread_stop (NULL);
+		cyusb_desc_release (desc);
+		cyusb_close ();
+		return rStatus;
+	}
 
-			default:
-				break;
+	// The transfers are serviced by the event thread. Just wait for the test duration to elapse,
+	// printing the statistics for each interval if requested.
+	cyusb_hist_reset (&prev_latency);
+	cyusb_hist_reset (&prev_jitter);
+	memset (&prev_stats, 0, sizeof (prev_stats));
+
+	remaining = duration;
+	while (remaining != 0) {
+		period = ((interval != 0) && (interval < remaining)) ? interval : remaining;
+		remaining -= period;
+		while (period != 0)
+			period = sleep (period);
+
+		if ((interval != 0) && (remaining != 0)) {
+			cyusb_stream_get_latency (strm, &latency, &jitter);
+			cyusb_stream_get_stats (strm, &stats);
+
+			cyusb_hist_diff (&ivl_latency, &latency, &prev_latency);
+			cyusb_hist_diff (&ivl_jitter, &jitter, &prev_jitter);
+			prev_latency = latency;
+			prev_jitter  = jitter;
+
+			ivl_stats = stats;
+			ivl_stats.success_count -= prev_stats.success_count;
+			ivl_stats.failure_count -= prev_stats.failure_count;
+			ivl_stats.iso_errors    -= prev_stats.iso_errors;
+			ivl_stats.short_packets -= prev_stats.short_packets;
+			ivl_stats.verify_errors -= prev_stats.verify_errors;
+			ivl_stats.verify_bytes  -= prev_stats.verify_bytes;
+			prev_stats = stats;
+
+			print_report ("Interval statistics:", &ivl_latency, &ivl_jitter, &ivl_stats);
 		}
 	}
 
-	gettimeofday (&t1, NULL);
-	do {
-		libusb_handle_events (NULL);
-		gettimeofday (&t2, NULL);
-	} while (t2.tv_sec < (t1.tv_sec + duration));
-
-	// Test duration elapsed. Set the stop_transfers flag and wait until all transfers are complete.
+	// Test duration elapsed. Stop the stream and wait until all transfers are complete.
 	printf ("%s: Test duration is complete. Stopping transfers\n", argv[0]);
-	stop_transfers = true;
-	while (rqts_in_flight != 0) {
-		printf ("%d requests are pending\n", rqts_in_flight);
-		libusb_handle_events (NULL);
-		sleep (1);
-	}
+	cyusb_stream_stop (strm);
 
 	// All transfers are complete. We can now free up all structures.
 	printf ("%s: Transfers completed\n", argv[0]);
 
-	free_transfer_buffers (databuffers, transfers);
-	libusb_free_config_descriptor (configDesc);
+	cyusb_stream_get_latency (strm, &latency, &jitter);
+	cyusb_stream_get_stats (strm, &stats);
+	print_report ("Test statistics:", &latency, &jitter, &stats);
+	print_distribution ("Completion interval", &jitter);
+
+	// The stream is stopped, so the capture file can be completed.
+	if (cap != NULL) {
+		cyusb_capture_get_stats (cap, &cap_stats);
+		rStatus = cyusb_capture_close (cap);
+		printf ("%s: Captured %llu transfers (%llu bytes), %llu dropped%s\n", argv[0], cap_stats.records,
+				cap_stats.bytes, cap_stats.dropped, (rStatus != 0) ? ", file incomplete" : "");
+	}
+
+	cyusb_stream_close (strm);
+	if (payload != NULL)
+		cyusb_payload_destroy (payload);
+	cyusb_event_thread_stop (NULL);
+	cyusb_desc_release (desc);
 	cyusb_close();
 
 	printf ("%s: Test completed\n", argv[0]);
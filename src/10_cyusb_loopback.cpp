@@ -0,0 +1,405 @@
+/************************************************************************************************
+ * Program Name		:	10_cyusb_loopback.cpp						*
+ * Description		:	This is a CLI program which measures full duplex throughput	*
+ *				and round trip latency through a device running a bulk loop	*
+ *				firmware (such as cyfxbulklpautoenum.img or bulkloop.hex).	*
+ *				Sequence numbered records are streamed to the OUT endpoint	*
+ *				and checked as they come back on the IN endpoint.		*
+ * License		:	LGPL Ver 2.1							*
+ * Copyright		:	Cypress Semiconductors Inc.					*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+// Size of the header at the start of each record: a 64-bit sequence number and a 64-bit
+// transmit time stamp.
+#define RECORD_HEADER_SIZE	(16)
+
+// Variables storing the user provided application configuration.
+unsigned int out_ep     = 0;	// OUT endpoint, 0 to use the first bulk OUT endpoint found
+unsigned int in_ep      = 0;	// IN endpoint, 0 to use the first bulk IN endpoint found
+unsigned int reqsize    = 16;	// Request size in number of packets
+unsigned int queuedepth = 16;	// Number of requests to queue in each direction
+unsigned int duration   = 10;	// Duration of the test in seconds
+
+libusb_device_handle	*dev_handle = NULL;	// Handle to the USB device
+unsigned int		recsize;		// Size of each record (the max packet size)
+
+unsigned long long	tx_seq = 0;		// Sequence number of the next record to send
+unsigned long long	rx_seq = 0;		// Sequence number of the next record expected
+unsigned long long	rx_records = 0;		// Number of records received
+unsigned long long	seq_errors = 0;		// Records received out of sequence
+unsigned long long	data_errors = 0;	// Words in record bodies that did not match
+unsigned long long	framing_errors = 0;	// IN transfers that did not hold whole records
+struct cyusb_hist	rtt_hist;		// Round trip time of each record, in ns
+
+// Function: now_ns
+// Gets the current time from CYUSB_CLOCK in nanoseconds.
+static unsigned long long
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CYUSB_CLOCK, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// Function: put_u64
+// Stores a 64-bit value in little endian byte order.
+static void
+put_u64 (
+		unsigned char     *ptr,
+		unsigned long long value)
+{
+	for (int i = 0; i < 8; i++)
+		ptr[i] = (unsigned char)(value >> (i * 8));
+}
+
+// Function: get_u64
+// Reads a 64-bit value stored in little endian byte order.
+static unsigned long long
+get_u64 (
+		const unsigned char *ptr)
+{
+	unsigned long long value = 0;
+
+	for (int i = 7; i >= 0; i--)
+		value = (value << 8) | ptr[i];
+	return value;
+}
+
+// Function: out_fill
+// Fills an OUT transfer with records just before it is queued. Each record carries its sequence
+// number, the time at which it was queued, and a body of 32-bit words counting up from the
+// sequence number.
+static void
+out_fill (
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		void                   *arg)
+{
+	struct cyusb_pattern body;
+	unsigned int         records = transfer->length / recsize;
+	unsigned long long   seq, ts = now_ns ();
+
+	seq = __atomic_fetch_add (&tx_seq, records, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < records; i++, seq++) {
+		unsigned char *rec = transfer->buffer + i * recsize;
+
+		put_u64 (rec, seq);
+		put_u64 (rec + 8, ts);
+		cyusb_pattern_init (&body, CYUSB_PATTERN_INC32, (unsigned int)seq);
+		cyusb_pattern_fill (&body, rec + RECORD_HEADER_SIZE, recsize - RECORD_HEADER_SIZE);
+	}
+}
+
+// Function: in_callback
+// Checks the records in a completed IN transfer, and records their round trip time.
+static int
+in_callback (
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		unsigned int            length,
+		void                   *arg)
+{
+	struct cyusb_pattern body;
+	unsigned long long   seq, ts = now_ns ();
+	unsigned int         records = length / recsize;
+
+	if ((length % recsize) != 0)
+		framing_errors++;
+
+	for (unsigned int i = 0; i < records; i++) {
+		const unsigned char *rec = transfer->buffer + i * recsize;
+
+		// A record that is not the next one expected means that data was lost or reordered.
+		// Carry on from the record that was received.
+		seq = get_u64 (rec);
+		if (seq != rx_seq)
+			seq_errors++;
+		rx_seq = seq + 1;
+
+		cyusb_hist_record (&rtt_hist, ts - get_u64 (rec + 8));
+
+		cyusb_pattern_init (&body, CYUSB_PATTERN_INC32, (unsigned int)seq);
+		data_errors += cyusb_pattern_verify (&body, rec + RECORD_HEADER_SIZE, recsize - RECORD_HEADER_SIZE);
+	}
+	rx_records += records;
+
+	return CYUSB_STREAM_RESUBMIT;
+}
+
+// Function: find_loopback_endpoints
+// Looks for an interface setting which has both the OUT and IN endpoints, in the descriptor
+// snapshot of the device. Endpoints which are not specified are taken as the first bulk
+// endpoint of the right direction. The interface is claimed and the alternate setting selected.
+// Records are one packet each, so the smaller max packet size of the two is returned.
+static int
+find_loopback_endpoints (
+		const struct cyusb_desc *desc,
+		unsigned int            *maxpkt)
+{
+	const struct cyusb_ep_desc *ep, *out_found, *in_found;
+	unsigned int i, j;
+
+	for (i = 0; i < desc->count; i = j) {
+		out_found = NULL;
+		in_found  = NULL;
+
+		// The snapshot lists the endpoints by interface and then by alternate setting.
+		for (j = i; (j < desc->count) && (desc->endpoints[j].interface == desc->endpoints[i].interface) &&
+				(desc->endpoints[j].altsetting == desc->endpoints[i].altsetting); j++) {
+			ep = &desc->endpoints[j];
+			if (ep->type != LIBUSB_TRANSFER_TYPE_BULK)
+				continue;
+
+			if ((ep->address & LIBUSB_ENDPOINT_IN) != 0) {
+				if ((in_found == NULL) && ((in_ep == 0) || (in_ep == ep->address)))
+					in_found = ep;
+			} else {
+				if ((out_found == NULL) && ((out_ep == 0) || (out_ep == ep->address)))
+					out_found = ep;
+			}
+		}
+
+		if ((out_found != NULL) && (in_found != NULL)) {
+			ep = &desc->endpoints[i];
+			if (libusb_claim_interface (dev_handle, ep->interface) != 0)
+				return -EACCES;
+			if (ep->altsetting != 0)
+				libusb_set_interface_alt_setting (dev_handle, ep->interface, ep->altsetting);
+
+			out_ep  = out_found->address;
+			in_ep   = in_found->address;
+			*maxpkt = (out_found->maxpacket < in_found->maxpacket) ? out_found->maxpacket : in_found->maxpacket;
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+// Prints application usage information.
+static void
+print_usage (
+		const char *progname)
+{
+	printf ("%s: USB full duplex loopback test\n", progname);
+	printf ("\n");
+	printf ("Usage: %s [-o <out_ep>] [-i <in_ep>] -s <reqsize> -q <queuedepth> -d <duration>\n", progname);
+	printf ("\twhere\n");
+	printf ("\t\tout_ep and in_ep are the endpoints to use (default: first bulk OUT and IN pair)\n");
+	printf ("\t\treqsize is the size of individual data transfer requests in packets or bursts\n");
+	printf ("\t\tqueuedepth is the number of requests to be queued in each direction\n");
+	printf ("\t\tduration is the duration in seconds for which the test is to be run\n");
+	printf ("\n");
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	extern char *optarg;
+	int          c;
+
+	const struct cyusb_desc *desc;		// Descriptor snapshot of the device
+	cyusb_stream *out_strm = NULL, *in_strm = NULL;
+	struct cyusb_stream_stats out_stats, in_stats;
+	unsigned long long start_ts, end_ts;
+	unsigned char *flushbuf;
+	unsigned int remaining;
+	double elapsed, out_kbps, in_kbps;
+	int  rStatus, actual;
+
+	// Parse command line parameters
+	while ((c = getopt (argc, argv, "o:i:s:q:d:h")) != -1) {
+		switch (c) {
+			case 'o':
+			case 'i':
+				// Get the endpoint address.
+				if (sscanf ((const char *)optarg, "%i", (c == 'o') ? &out_ep : &in_ep) != 1) {
+					printf ("%s: Failed to parse endpoint address\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 's':
+				// Get the request size value.
+				if (sscanf ((const char *)optarg, "%d", &reqsize) != 1) {
+					printf ("%s: Failed to parse request size\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'q':
+				// Get the queue depth value.
+				if (sscanf ((const char *)optarg, "%d", &queuedepth) != 1) {
+					printf ("%s: Failed to parse queue depth\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'd':
+				// Get the test duration.
+				if (sscanf ((const char *)optarg, "%d", &duration) != 1) {
+					printf ("%s: Failed to parse test duration\n", argv[0]);
+					print_usage (argv[0]);
+					return (-EINVAL);
+				}
+				break;
+
+			case 'h':
+				// Print the usage information and quit.
+				print_usage (argv[0]);
+				return (0);
+
+			default:
+				// Unknown option.
+				print_usage (argv[0]);
+				return (-EINVAL);
+		}
+	}
+
+	// Step 1: Initialize the cyusb library and get a handle to the first device.
+	rStatus = cyusb_open ();
+	if (rStatus <= 0) {
+		printf ("%s: No USB device found\n", argv[0]);
+		return -ENODEV;
+	}
+
+	dev_handle = cyusb_gethandle (0);
+	if (dev_handle == NULL) {
+		printf ("%s: Failed to get CyUSB device handle\n", argv[0]);
+		cyusb_close ();
+		return -EACCES;
+	}
+
+	// Step 2: Find the endpoint pair to loop data through, and claim its interface.
+	rStatus = cyusb_desc_get (libusb_get_device (dev_handle), &desc);
+	if (rStatus != 0) {
+		printf ("%s: Failed to get USB Configuration descriptor\n", argv[0]);
+		cyusb_close ();
+		return -EACCES;
+	}
+
+	rStatus = find_loopback_endpoints (desc, &recsize);
+	cyusb_desc_release (desc);
+	if (rStatus != 0) {
+		printf ("%s: Failed to find a bulk OUT and IN endpoint pair\n", argv[0]);
+		cyusb_close ();
+		return rStatus;
+	}
+
+	if (recsize < RECORD_HEADER_SIZE) {
+		printf ("%s: Packet size %d is too small for the test records\n", argv[0], recsize);
+		cyusb_close ();
+		return -EINVAL;
+	}
+
+	// Step 3: Allocate both streams. pktsize is taken from the descriptor snapshot, and
+	// includes the burst size on USB 3.0.
+	rStatus = cyusb_stream_open (dev_handle, out_ep, 0, reqsize, queuedepth, &out_strm);
+	if (rStatus == 0)
+		rStatus = cyusb_stream_open (dev_handle, in_ep, 0, reqsize, queuedepth, &in_strm);
+	if (rStatus != 0) {
+		printf ("%s: Failed to allocate buffers and transfer structures\n", argv[0]);
+		cyusb_stream_close (out_strm);
+		cyusb_close ();
+		return (-ENOMEM);
+	}
+
+	cyusb_stream_get_stats (out_strm, &out_stats);
+	printf ("%s: Starting loopback test with the following parameters\n", argv[0]);
+	printf ("\tOUT endpoint     : 0x%x\n", out_ep);
+	printf ("\tIN endpoint      : 0x%x\n", in_ep);
+	printf ("\tRecord size      : 0x%x\n", recsize);
+	printf ("\tRequest size     : 0x%x\n", reqsize * out_stats.pktsize);
+	printf ("\tQueue depth      : 0x%x\n", queuedepth);
+	printf ("\tTest duration    : 0x%x\n", duration);
+	printf ("\n");
+
+	// Step 4: Throw away any data left in the device from an earlier run.
+	flushbuf = (unsigned char *)malloc (reqsize * out_stats.pktsize);
+	if (flushbuf != NULL) {
+		while ((libusb_bulk_transfer (dev_handle, in_ep, flushbuf, reqsize * out_stats.pktsize,
+						&actual, 100) == 0) && (actual != 0))
+			;
+		free (flushbuf);
+	}
+
+	cyusb_hist_reset (&rtt_hist);
+	cyusb_stream_set_fill (out_strm, out_fill, NULL);
+	cyusb_stream_set_callback (in_strm, in_callback, NULL);
+
+	// Step 5: Queue all transfers in both directions. This is done before the event thread is
+	// started, so that the first round of OUT records is queued strictly in sequence order.
+	rStatus = cyusb_stream_start (in_strm);
+	if (rStatus == 0)
+		rStatus = cyusb_stream_start (out_strm);
+	if (rStatus == 0)
+		rStatus = cyusb_event_thread_start (NULL);
+	if (rStatus != 0) {
+		printf ("%s: Failed to start transfers\n", argv[0]);
+		cyusb_error (rStatus);
+		cyusb_stream_close (out_strm);
+		cyusb_stream_close (in_strm);
+		cyusb_close ();
+		return rStatus;
+	}
+
+	start_ts  = now_ns ();
+	remaining = duration;
+	while (remaining != 0)
+		remaining = sleep (remaining);
+
+	// Step 6: Stop sending first, so that the records already sent can still come back.
+	cyusb_stream_stop (out_strm);
+	usleep (100000);
+	end_ts = now_ns ();
+	cyusb_stream_stop (in_strm);
+	cyusb_event_thread_stop (NULL);
+
+	cyusb_stream_get_stats (out_strm, &out_stats);
+	cyusb_stream_get_stats (in_strm, &in_stats);
+
+	elapsed  = (double)(end_ts - start_ts) / 1000000000;
+	out_kbps = ((double)out_stats.bytes / 1024) / elapsed;
+	in_kbps  = ((double)in_stats.bytes / 1024) / elapsed;
+
+	printf ("%s: Test completed\n", argv[0]);
+	printf ("\t%-18s: %.1f KBps (%llu transfers, %llu failed)\n", "OUT throughput", out_kbps,
+			out_stats.success_count, out_stats.failure_count);
+	printf ("\t%-18s: %.1f KBps (%llu transfers, %llu failed)\n", "IN throughput", in_kbps,
+			in_stats.success_count, in_stats.failure_count);
+	printf ("\t%-18s: %.1f KBps\n", "Aggregate", out_kbps + in_kbps);
+	printf ("\t%-18s: %llu sent, %llu received\n", "Records", tx_seq, rx_records);
+	if (rtt_hist.count != 0)
+		printf ("\t%-18s: p50=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n", "Round trip time",
+				(double)cyusb_hist_percentile (&rtt_hist, 50.0) / 1000,
+				(double)cyusb_hist_percentile (&rtt_hist, 99.0) / 1000,
+				(double)cyusb_hist_percentile (&rtt_hist, 99.9) / 1000,
+				(double)rtt_hist.max / 1000);
+	printf ("\t%-18s: %llu sequence, %llu data, %llu framing\n", "Errors", seq_errors, data_errors,
+			framing_errors);
+
+	cyusb_stream_close (out_strm);
+	cyusb_stream_close (in_strm);
+	cyusb_close ();
+
+	return ((seq_errors != 0) || (data_errors != 0) || (framing_errors != 0)) ? -EIO : 0;
+}
+
+/*[]*/
@@ -7,11 +7,18 @@
  * Modification Notes	:									*
  * 												*
  * This program may be run as a deamon process. It obtains all device details for relevant	*
- * Cypress devices ( as listed in /etc/cyusb.conf ) and waits for two kinds of signals		*
- * ( SIGUSR1 and SIGUSR2 ). SIGUSR1 signal is handled when a notification arrives from the	*
- * kernel whenever a usb device gets added/deleted in which case the device list is refreshed.	*
- * SIGUSR1 would be generated by a script from a persistent udev rule.				*
+ * Cypress devices ( as listed in /etc/cyusb.conf ) and keeps the device list up to date from	*
+ * libusb hotplug events, logging every device that arrives or leaves. Only the devices that	*
+ * changed are opened or closed. Where libusb has no hotplug support, the SIGUSR1 signal	*
+ * generated by a script from a persistent udev rule triggers the same incremental refresh.	*
  * SIGUSR2 signal is a request to free all resources and exit. 					*
+ * The signal handlers only set flags; all the work is done from the main loop.		*
+ * The daemon also creates the shared memory segment holding the per-endpoint metrics	*
+ * (see cyusb_metrics_create()). It keeps the device slots in it up to date, counting	*
+ * re-enumerations, while the processes streaming with the library update the counters.	*
+ * With the -s option, the daemon also owns one IN endpoint of a device and streams it	*
+ * into a shared memory ring (see cyusb_fanout_create()), so that any number of		*
+ * processes can read the same data at the same time without claiming the device.	*
 \***********************************************************************************************/
 
 #include <stdio.h>
@@ -23,6 +30,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -30,21 +41,35 @@
 
 /********** Cut and paste the following & modify as required  **********/
 static const char * program_name;
-static const char *const short_options = "hv";
+static const char *const short_options = "hvs:n:r:H";
 static const struct option long_options[] = {
 		{ "help",	0,	NULL,	'h'	},
 		{ "version",	0,	NULL,	'v'	},
+		{ "stream",	1,	NULL,	's'	},
+		{ "name",	1,	NULL,	'n'	},
+		{ "ring",	1,	NULL,	'r'	},
+		{ "hugepages",	0,	NULL,	'H'	},
 		{ NULL,		0,	NULL,	 0	}
 };
 
 static int next_option;
 
+/* Transfer size (in packets), queue depth and default ring size (in MB) for the fan-out stream. */
+#define FANOUT_REQSIZE		(32)
+#define FANOUT_QUEUEDEPTH	(16)
+#define FANOUT_RING_SIZE	(64)
+
 static void print_usage(FILE *stream, int exit_code)
 {
 	fprintf(stream, "Usage: %s options\n", program_name);
 	fprintf(stream, 
 		"  -h  --help           Display this usage information.\n"
-		"  -v  --version        Print version.\n");
+		"  -v  --version        Print version.\n"
+		"  -s  --stream <d>:<e> Stream IN endpoint <e> of device <d> to consumer processes.\n"
+		"  -n  --name <name>    Name consumers attach to the stream with (default <d>.<e>).\n"
+		"  -r  --ring <MB>      Size of the shared memory ring in MB (default %d).\n"
+		"  -H  --hugepages      Back the ring with huge pages if they are available.\n",
+		FANOUT_RING_SIZE);
 
 	exit(exit_code);
 }
@@ -68,35 +93,155 @@ extern libusb_device **list;
 
 extern struct cydev cydev[MAXDEVICES];
 
+static volatile sig_atomic_t refresh_requested = 0;
+static volatile sig_atomic_t exit_requested    = 0;
+
+/* Stream fan-out configuration and state. The fan-out has a handle of its own on the device,
+   so that it is not affected by the device table closing its handle when the device leaves. */
+static int			fan_index = -1;		/* Device streamed, -1 if none */
+static unsigned int		fan_endpoint = 0;	/* IN endpoint streamed */
+static char			fan_name[64];		/* Name consumers attach with */
+static unsigned int		fan_ring = FANOUT_RING_SIZE;
+static int			fan_flags = 0;
+static cyusb_fanout		*fanout = NULL;
+static libusb_device_handle	*fan_handle = NULL;
+static int			fan_lost_fd = -1;	/* Written when the streamed device leaves */
+static pthread_mutex_t		fan_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void handle_sigusr1(int signo)
 {
-	int N;
+	refresh_requested = 1;
+}
 
-	printf("Signal SIGUSR1 received !\n");
-	cyusb_close();
-	N = cyusb_open();
-	if ( N < 0 ) {
-	   printf("Error in opening library\n");
-	   exit(-1);
+static void handle_sigusr2(int signo)
+{
+	exit_requested = 1;
+}
+
+/* Called by the library for every device of interest that arrives or leaves. */
+static void hotplug_notify(int event, int index, struct cydev *dev, void *arg)
+{
+	char tbuf[120];
+	time_t now = time(NULL);
+	int len;
+
+	len = strftime(tbuf, sizeof(tbuf), "%F %T ", localtime(&now));
+	len += snprintf(tbuf + len, sizeof(tbuf) - len, "%s device %04x:%04x bus %d addr %d (index %d)\n",
+			(event == CYUSB_HOTPLUG_ARRIVED) ? "Added" : "Removed",
+			dev->vid, dev->pid, dev->busnum, dev->devaddr, index);
+	printf("%s", tbuf);
+	if ( logfd >= 0 )
+		write(logfd, tbuf, len);
+
+	if ( event == CYUSB_HOTPLUG_ARRIVED )
+		cyusb_metrics_arrived(dev->dev);
+	else
+		cyusb_metrics_left(dev->dev);
+
+	/* This runs on the event thread, which cannot wait for the stream to drain; the fan-out
+	   is closed from the main loop instead. */
+	if ( event == CYUSB_HOTPLUG_LEFT ) {
+		unsigned long long one = 1;
+
+		pthread_mutex_lock(&fan_lock);
+		if ( (fan_handle != NULL) && (libusb_get_device(fan_handle) == dev->dev) )
+			write(fan_lost_fd, &one, sizeof(one));
+		pthread_mutex_unlock(&fan_lock);
+	}
+}
+
+static void log_message(const char *msg)
+{
+	char tbuf[160];
+	time_t now = time(NULL);
+	int len;
+
+	len = strftime(tbuf, sizeof(tbuf), "%F %T ", localtime(&now));
+	len += snprintf(tbuf + len, sizeof(tbuf) - len, "%s\n", msg);
+	printf("%s", tbuf);
+	if ( logfd >= 0 )
+		write(logfd, tbuf, len);
+}
+
+static int start_fanout(void)
+{
+	libusb_device_handle *h = NULL;
+	struct cydev d;
+	char tbuf[120];
+	int r;
+
+	r = cyusb_getdev(fan_index, &d);
+	if ( (r != 0) || (d.dev == NULL) ) {
+		printf("No device %d to stream from\n", fan_index);
+		return -ENODEV;
 	}
-	else if ( N == 0 ) {
-		printf("No device of interest found\n");
-		 exit(0);
+
+	r = libusb_open(d.dev, &h);
+	if ( r == 0 ) {
+		r = cyusb_fanout_create(h, fan_endpoint, fan_name, FANOUT_REQSIZE, FANOUT_QUEUEDEPTH,
+				(size_t)fan_ring * 1024 * 1024, fan_flags, &fanout);
+		if ( r == 0 )
+			r = cyusb_fanout_start(fanout);
 	}
-	else printf("No of devices of interest found = %d\n",N);
+	if ( r != 0 ) {
+		printf("Error %d in starting stream of endpoint 0x%02x\n", r, fan_endpoint);
+		cyusb_error(r);
+		cyusb_fanout_close(fanout);
+		fanout = NULL;
+		if ( h != NULL )
+			libusb_close(h);
+		return r;
+	}
+
+	pthread_mutex_lock(&fan_lock);
+	fan_handle = h;
+	pthread_mutex_unlock(&fan_lock);
+
+	snprintf(tbuf, sizeof(tbuf), "Streaming endpoint 0x%02x of device %04x:%04x to %s%s",
+			fan_endpoint, d.vid, d.pid, CYUSB_FANOUT_SOCKET, fan_name);
+	log_message(tbuf);
+	return 0;
 }
 
-static void handle_sigusr2(int signo)
+static void stop_fanout(const char *reason)
 {
-	unlink(pidfile);
-	close(logfd);
-	cyusb_close();
-	exit(0);
+	libusb_device_handle *h = fan_handle;
+	char tbuf[120];
+
+	if ( fanout == NULL )
+		return;
+
+	/* The lock is not held while the stream drains, as that needs the event thread, which
+	   may be waiting for the lock in hotplug_notify(). */
+	pthread_mutex_lock(&fan_lock);
+	fan_handle = NULL;
+	pthread_mutex_unlock(&fan_lock);
+
+	cyusb_fanout_close(fanout);
+	libusb_close(h);
+	fanout = NULL;
+
+	snprintf(tbuf, sizeof(tbuf), "Stopped streaming endpoint 0x%02x (%s)", fan_endpoint, reason);
+	log_message(tbuf);
 }
 
 static void validate_inputs(void)
 {
+	if ( fan_index < 0 )
+		return;
 
+	if ( (fan_endpoint & LIBUSB_ENDPOINT_IN) == 0 ) {
+		printf("Only IN endpoints can be streamed\n");
+		cyusb_close();
+		exit(1);
+	}
+	if ( fan_ring == 0 ) {
+		printf("Invalid ring size\n");
+		cyusb_close();
+		exit(1);
+	}
+	if ( fan_name[0] == '\0' )
+		snprintf(fan_name, sizeof(fan_name), "%d.%02x", fan_index, fan_endpoint);
 }
 
 int main(int argc, char **argv)
@@ -104,6 +249,12 @@ int main(int argc, char **argv)
 	int N;
 	int pid;
 	char tbuf[50];
+	struct sigaction sa;
+	sigset_t mask, oldmask;
+	struct pollfd fds[CYUSB_FANOUT_POLLFDS + 1];
+	struct timespec tick;
+	unsigned long long count;
+	int nfds;
 	int r;
 
 	N = cyusb_open();
@@ -111,10 +262,6 @@ int main(int argc, char **argv)
 	   printf("Error in opening library\n");
 	   return -1;
 	}
-	else if ( N == 0 ) {
-		printf("No device of interest found\n");
-		return 0;
-	}
 	else printf("No of devices of interest found = %d\n",N);
 
 	logfd = open(logfile, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR );
@@ -133,6 +280,19 @@ int main(int argc, char **argv)
 				  printf("cyusbd (Ver 1.0)\n");
 				  printf("Copyright (C) 2012 Cypress Semiconductors / ATR-LABS\n");
 				  exit(0);
+			case 's': /* -s or --stream */
+				  if ( sscanf(optarg, "%d:%i", &fan_index, &fan_endpoint) != 2 )
+					  print_usage(stdout, 1);
+				  break;
+			case 'n': /* -n or --name */
+				  snprintf(fan_name, sizeof(fan_name), "%s", optarg);
+				  break;
+			case 'r': /* -r or --ring */
+				  fan_ring = atoi(optarg);
+				  break;
+			case 'H': /* -H or --hugepages */
+				  fan_flags |= CYUSB_FANOUT_HUGEPAGE;
+				  break;
 			case '?': /* Invalid option */
 				  print_usage(stdout, 1);
 			default : /* Something else, unexpected */
@@ -156,12 +316,85 @@ int main(int argc, char **argv)
 		close(pidfd);
 	}
 
-	signal(SIGUSR1,handle_sigusr1);  /* Signal to handle events received from the kernel			*/
-	signal(SIGUSR2,handle_sigusr2);  /* Signal to stop this daemon and exit gracefully			*/
-	signal(SIGINT, handle_sigusr2);  /* Ctrl_C will also stop this daemon and exit gracefully		*/
+	/* The signals are only delivered inside sigsuspend(), so that a flag set by a handler is
+	   never missed between checking the flags and waiting. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_sigusr1;	/* Signal to handle events received from the kernel			*/
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = handle_sigusr2;	/* Signal to stop this daemon and exit gracefully			*/
+	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGINT,  &sa, NULL);	/* Ctrl_C will also stop this daemon and exit gracefully		*/
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* Publish the metrics of the devices already found; later arrivals come from hotplug_notify(). */
+	r = cyusb_metrics_create();
+	if ( r != 0 )
+		printf("Metrics segment %s not available (%s)\n", CYUSB_METRICS_NAME, strerror(-r));
+	else {
+		struct cydev d;
+		int i;
 
-	while (1) {
-		pause();
+		for ( i = 0; i < cyusb_getcount(); ++i ) {
+			if ( (cyusb_getdev(i, &d) == 0) && (d.dev != NULL) )
+				cyusb_metrics_arrived(d.dev);
+		}
+	}
+
+	r = cyusb_hotplug_start(hotplug_notify, NULL);
+	if ( r != 0 )
+		printf("Hotplug events not available (%d), waiting for SIGUSR1 to refresh device list\n", r);
+
+	if ( fan_index >= 0 ) {
+		fan_lost_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if ( fan_lost_fd >= 0 )
+			start_fanout();
 	}
+
+	/* ppoll() only lets the signals in while it waits, just as sigsuspend() would. While a
+	   stream is fanned out, the daemon also waits for consumers, and wakes up every second so
+	   that the fan-out can pick up a missed wakeup. */
+	tick.tv_sec  = 1;
+	tick.tv_nsec = 0;
+	while ( !exit_requested ) {
+		fds[0].fd      = fan_lost_fd;
+		fds[0].events  = POLLIN;
+		fds[0].revents = 0;
+		nfds = 1;
+		if ( fanout != NULL )
+			nfds += cyusb_fanout_pollfds(fanout, fds + 1, CYUSB_FANOUT_POLLFDS);
+
+		r = ppoll(fds, nfds, (fanout != NULL) ? &tick : NULL, &oldmask);
+		if ( (r > 0) && (fds[0].revents != 0) ) {
+			read(fan_lost_fd, &count, sizeof(count));
+			stop_fanout("device removed");
+		}
+		else if ( (r >= 0) && (fanout != NULL) )
+			cyusb_fanout_handle(fanout, fds + 1, nfds - 1);
+
+		if ( refresh_requested ) {
+			refresh_requested = 0;
+			N = cyusb_refresh(hotplug_notify, NULL);
+			if ( N < 0 )
+				printf("Error in refreshing device list\n");
+			else
+				printf("No of devices of interest found = %d\n",N);
+		}
+	}
+
+	stop_fanout("exiting");
+	if ( fan_lost_fd >= 0 )
+		close(fan_lost_fd);
+
+	unlink(pidfile);
+	close(logfd);
+	cyusb_metrics_release();
+	cyusb_close();
 	return 0;
 }
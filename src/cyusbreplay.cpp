@@ -0,0 +1,356 @@
+/************************************************************************************************
+ * Program Name		:	cyusbreplay.cpp							*
+ * Description		:	This is a CLI program which sends the data of a capture file	*
+ *				(see cyusb_capture_create) to an OUT endpoint of the first	*
+ *				device found, one transfer per record, so that a device sees	*
+ *				the same sequence of transfers again. Records are sent at the	*
+ *				times they were captured at, or as fast as possible.		*
+ * License		:	LGPL Ver 2.1							*
+ * Copyright		:	Cypress Semiconductors Inc.					*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/********** Cut and paste the following & modify as required  **********/
+static const char * program_name;
+static const char *const short_options = "hve:mq:s:r:";
+static const struct option long_options[] = {
+		{ "help",	0,	NULL,	'h'	},
+		{ "version",	0,	NULL,	'v'	},
+		{ "endpoint",	1,	NULL,	'e'	},
+		{ "max",	0,	NULL,	'm'	},
+		{ "queue",	1,	NULL,	'q'	},
+		{ "start",	1,	NULL,	's'	},
+		{ "recorded",	1,	NULL,	'r'	},
+		{ NULL,		0,	NULL,	 0	}
+};
+
+static int next_option;
+
+static void print_usage(FILE *stream, int exit_code)
+{
+	fprintf(stream, "Usage: %s options <capture file>\n", program_name);
+	fprintf(stream,
+		"  -h  --help               Display this usage information.\n"
+		"  -v  --version            Print version.\n"
+		"  -e  --endpoint <ep>      OUT endpoint to send the data to (hex).\n"
+		"  -m  --max                Send as fast as possible instead of at the recorded times.\n"
+		"  -q  --queue <n>          Number of transfers to keep queued (default 16).\n"
+		"  -s  --start <s>          Skip the first <s> seconds of the capture.\n"
+		"  -r  --recorded <ep>      Only send the records of endpoint <ep> (hex).\n");
+
+	exit(exit_code);
+}
+/***********************************************************************/
+
+// Time (in milliseconds) to wait for a transfer to come back before checking for a stop request.
+#define REPLAY_POLL_INTERVAL	(500)
+
+// Time (in nanoseconds) by which a record may be sent after its recorded time, without being
+// counted as late.
+#define REPLAY_LATE_NS		(1000000ULL)
+
+// Iso packets of the record being queued; used by the fill callback.
+struct replay_packets {
+	const struct cyusb_capture_packet	*packets;
+	unsigned int				 npackets;	// 0 to send the data in whole packets
+	unsigned int				 pktsize;	// Packet size of the endpoint
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// Function: handle_sigint
+// Requests the program to stop after the current record.
+static void
+handle_sigint (
+		int signo)
+{
+	stop_requested = 1;
+}
+
+// Function: now_ns
+// Gets the current time from the monotonic clock in nanoseconds.
+static unsigned long long
+now_ns (
+		void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// Function: sleep_until
+// Sleeps until the monotonic clock reaches the given time in nanoseconds.
+static void
+sleep_until (
+		unsigned long long t)
+{
+	struct timespec ts;
+
+	ts.tv_sec  = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+		if (stop_requested)
+			break;
+	}
+}
+
+// Function: replay_fill
+// Sets the iso packet lengths of a transfer to the ones of the record being sent, or splits the
+// data of a record without packets into whole packets. The stream calls this from
+// cyusb_stream_submit(), on this thread, after setting every packet to the full packet size.
+static void
+replay_fill (
+		cyusb_stream           *strm,
+		struct libusb_transfer *transfer,
+		void                   *arg)
+{
+	struct replay_packets *cur = (struct replay_packets *)arg;
+	unsigned int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		return;
+
+	if (cur->npackets == 0) {
+		transfer->num_iso_packets = (transfer->length + cur->pktsize - 1) / cur->pktsize;
+		if (transfer->num_iso_packets != 0)
+			transfer->iso_packet_desc[transfer->num_iso_packets - 1].length =
+				transfer->length - (transfer->num_iso_packets - 1) * cur->pktsize;
+		return;
+	}
+
+	transfer->num_iso_packets = cur->npackets;
+	for (i = 0; i < cur->npackets; i++)
+		transfer->iso_packet_desc[i].length = cur->packets[i].length;
+}
+
+// Function: find_endpoint
+// Claims the interface holding an endpoint, selecting its alternate setting, and gets the
+// transfer type and the packet size of the endpoint from the descriptor snapshot of the device.
+static int
+find_endpoint (
+		libusb_device_handle *h,
+		unsigned char         ep,
+		unsigned char        *eptype,
+		unsigned int         *pktsize)
+{
+	const struct cyusb_desc *desc;
+	const struct cyusb_ep_desc *epd;
+	int r;
+
+	r = cyusb_desc_get (libusb_get_device (h), &desc);
+	if (r)
+		return r;
+
+	epd = cyusb_desc_endpoint (desc, ep);
+	if (epd == NULL) {
+		cyusb_desc_release (desc);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	r = libusb_claim_interface (h, epd->interface);
+	if ((r == 0) && (epd->altsetting != 0))
+		r = libusb_set_interface_alt_setting (h, epd->interface, epd->altsetting);
+
+	*eptype  = epd->type;
+	*pktsize = epd->pktsize;
+
+	cyusb_desc_release (desc);
+	return r;
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	cyusb_capture_reader *rd;
+	const struct cyusb_capture_header *info;
+	const struct cyusb_capture_record *rec;
+	const struct cyusb_capture_packet *packets;
+	const unsigned char *data;
+	libusb_device_handle *h;
+	cyusb_stream *strm = NULL;
+	struct cyusb_stream_stats stats;
+	struct libusb_transfer *transfer;
+	struct replay_packets cur;
+	struct sigaction sa;
+	unsigned long long first_ts = 0, t0, t, skip = 0;
+	unsigned long long records = 0, bytes = 0, late = 0;
+	unsigned int ep = 0, filter = 0, queuedepth = 16;
+	unsigned int pktsize, reqsize, length;
+	unsigned char eptype;
+	bool max_rate = false;
+	double seconds;
+	int r;
+
+	program_name = argv[0];
+	while ( (next_option = getopt_long(argc, argv, short_options,
+					   long_options, NULL) ) != -1 ) {
+		switch ( next_option ) {
+			case 'h': /* -h or --help  */
+				  print_usage(stdout, 0);
+			case 'v': /* -v or --version */
+				  printf("cyusbreplay (Ver 1.0)\n");
+				  printf("Copyright (C) Cypress Semiconductors\n");
+				  exit(0);
+			case 'e': /* -e or --endpoint */
+				  ep = strtoul(optarg, NULL, 16);
+				  break;
+			case 'm': /* -m or --max */
+				  max_rate = true;
+				  break;
+			case 'q': /* -q or --queue */
+				  queuedepth = atoi(optarg);
+				  break;
+			case 's': /* -s or --start */
+				  skip = strtoull(optarg, NULL, 10) * 1000000000ULL;
+				  break;
+			case 'r': /* -r or --recorded */
+				  filter = strtoul(optarg, NULL, 16);
+				  break;
+			case '?': /* Invalid option */
+				  print_usage(stdout, 1);
+			default : /* Something else, unexpected */
+				  abort();
+		}
+	}
+	if ( (optind != argc - 1) || (ep == 0) || (ep & LIBUSB_ENDPOINT_IN) || (queuedepth == 0) )
+		print_usage(stdout, 1);
+
+	r = cyusb_capture_open(argv[optind], &rd);
+	if ( r != 0 ) {
+		printf("Error opening capture file %s: %s\n", argv[optind], strerror(-r));
+		return r;
+	}
+	info = cyusb_capture_info(rd);
+	printf("%s: %llu records, largest %u bytes\n", argv[optind], info->records, info->max_length);
+	if ( (info->records == 0) || (info->max_length == 0) ) {
+		cyusb_capture_close_reader(rd);
+		return 0;
+	}
+
+	r = cyusb_open();
+	if ( r <= 0 ) {
+		printf("No device found\n");
+		cyusb_capture_close_reader(rd);
+		return -ENODEV;
+	}
+	h = cyusb_gethandle(0);
+
+	r = find_endpoint(h, ep, &eptype, &pktsize);
+	if ( (r != 0) || (pktsize == 0) ) {
+		printf("Error using endpoint 0x%02x\n", ep);
+		cyusb_error(r);
+		cyusb_close();
+		cyusb_capture_close_reader(rd);
+		return r;
+	}
+
+	// Every transfer must hold the largest record, and for iso endpoints as many packets.
+	reqsize = (info->max_length + pktsize - 1) / pktsize;
+	if ( (eptype == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) && (reqsize < info->max_packets) )
+		reqsize = info->max_packets;
+
+	r = cyusb_stream_open(h, ep, pktsize, reqsize, queuedepth, &strm);
+	if ( r == 0 )
+		r = cyusb_stream_enable_queue(strm);
+	if ( r == 0 )
+		r = cyusb_event_thread_start(NULL);
+	if ( r != 0 ) {
+		printf("Error setting up the stream\n");
+		cyusb_error(r);
+		if ( strm != NULL )
+			cyusb_stream_close(strm);
+		cyusb_close();
+		cyusb_capture_close_reader(rd);
+		return r;
+	}
+	cyusb_stream_set_fill(strm, replay_fill, &cur);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_sigint;
+	sigaction(SIGINT,  &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// Skip to the start point through the index of the capture.
+	if ( skip != 0 ) {
+		if ( cyusb_capture_next(rd, &rec, NULL, NULL) == 0 )
+			cyusb_capture_seek(rd, rec->timestamp + skip);
+	}
+
+	// All transfers start out on the completion queue, waiting to be filled.
+	cyusb_stream_start_held(strm);
+	t0 = now_ns();
+
+	while ( !stop_requested ) {
+		r = cyusb_stream_next(strm, &transfer, &length, REPLAY_POLL_INTERVAL);
+		if ( r == LIBUSB_ERROR_TIMEOUT )
+			continue;
+		if ( r != 0 )
+			break;
+
+		// Failed transfers did not carry any data worth sending.
+		do {
+			r = cyusb_capture_next(rd, &rec, &packets, &data);
+		} while ( (r == 0) && ((rec->status != LIBUSB_TRANSFER_COMPLETED) ||
+				((filter != 0) && (rec->endpoint != filter))) );
+		if ( r != 0 )
+			break;
+
+		if ( records == 0 )
+			first_ts = rec->timestamp;
+		if ( !max_rate ) {
+			t = t0 + (rec->timestamp - first_ts);
+			if ( now_ns() > t + REPLAY_LATE_NS )
+				late++;
+			else
+				sleep_until(t);
+		}
+
+		memcpy(transfer->buffer, data, rec->length);
+		transfer->length = rec->length;
+		cur.packets  = packets;
+		cur.npackets = rec->npackets;
+		cur.pktsize  = pktsize;
+
+		r = cyusb_stream_submit(strm, transfer);
+		if ( r != 0 ) {
+			cyusb_error(r);
+			break;
+		}
+		records++;
+		bytes += rec->length;
+	}
+
+	// Let the transfers still queued complete before the stream is stopped.
+	cyusb_stream_get_stats(strm, &stats);
+	while ( (stats.in_flight != 0) && (!stop_requested) ) {
+		cyusb_stream_next(strm, &transfer, &length, REPLAY_POLL_INTERVAL);
+		cyusb_stream_get_stats(strm, &stats);
+	}
+	seconds = (now_ns() - t0) / 1e9;
+
+	cyusb_stream_stop(strm);
+	cyusb_stream_get_stats(strm, &stats);
+	printf("%llu records, %llu bytes in %.1f s, %.1f KBps, %llu failed transfers, %llu sent late\n",
+			records, bytes, seconds, (seconds > 0) ? bytes / 1024.0 / seconds : 0.0,
+			stats.failure_count, late);
+
+	cyusb_stream_close(strm);
+	cyusb_event_thread_stop(NULL);
+	cyusb_close();
+	cyusb_capture_close_reader(rd);
+	return 0;
+}
+
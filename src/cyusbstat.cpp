@@ -0,0 +1,300 @@
+/************************************************************************************************
+ * Program Name		:	cyusbstat.cpp							*
+ * Description		:	This is a CLI program which prints the per-device, per-endpoint	*
+ *				counters kept in the metrics segment created by cyusbd. The	*
+ *				segment is only mapped read-only, so the processes streaming	*
+ *				on the devices are not involved in any way. The counters can be	*
+ *				printed as a table, or in the Prometheus text format (e.g. for	*
+ *				the textfile collector of the node exporter).			*
+ * License		:	LGPL Ver 2.1							*
+ * Copyright		:	Cypress Semiconductors Inc.					*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/********** Cut and paste the following & modify as required  **********/
+static const char * program_name;
+static const char *const short_options = "hvpi:";
+static const struct option long_options[] = {
+		{ "help",	0,	NULL,	'h'	},
+		{ "version",	0,	NULL,	'v'	},
+		{ "prometheus",	0,	NULL,	'p'	},
+		{ "interval",	1,	NULL,	'i'	},
+		{ NULL,		0,	NULL,	 0	}
+};
+
+static int next_option;
+
+static void print_usage(FILE *stream, int exit_code)
+{
+	fprintf(stream, "Usage: %s options\n", program_name);
+	fprintf(stream,
+		"  -h  --help           Display this usage information.\n"
+		"  -v  --version        Print version.\n"
+		"  -p  --prometheus     Print the counters in the Prometheus text format.\n"
+		"  -i  --interval <s>   Print the counters again every <s> seconds.\n");
+
+	exit(exit_code);
+}
+/***********************************************************************/
+
+// Snapshot of the counters of one endpoint.
+struct ep_counters {
+	unsigned long long	bytes;
+	unsigned long long	transfers;
+	unsigned long long	failures;
+	unsigned long long	timeouts;
+	unsigned long long	resubmits;
+	unsigned long long	resubmit_ns;
+	unsigned long long	resubmit_max_ns;
+};
+
+// Description of one Prometheus metric.
+struct prom_metric {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+};
+
+static const struct prom_metric prom_metrics[] = {
+	{ "cyusb_endpoint_bytes_total",		  "counter", "Bytes transferred on the endpoint."			},
+	{ "cyusb_endpoint_transfers_total",	  "counter", "Transfers completed successfully on the endpoint."	},
+	{ "cyusb_endpoint_failures_total",	  "counter", "Transfers that failed on the endpoint, timeouts included."	},
+	{ "cyusb_endpoint_timeouts_total",	  "counter", "Transfers that timed out on the endpoint."		},
+	{ "cyusb_endpoint_resubmits_total",	  "counter", "Completed transfers that were queued again."		},
+	{ "cyusb_endpoint_resubmit_seconds_total", "counter", "Total time from completion to resubmission."		},
+	{ "cyusb_endpoint_resubmit_max_seconds",  "gauge",   "Longest time from completion to resubmission."		},
+};
+
+#define PROM_METRICS	(sizeof(prom_metrics) / sizeof(prom_metrics[0]))
+
+// Function: slot_endpoint
+// Gets the endpoint address of an endpoint slot; the inverse of CYUSB_METRICS_EP_SLOT().
+static unsigned char
+slot_endpoint (
+		int slot)
+{
+	return (slot & 0x0f) | ((slot & 0x10) << 3);
+}
+
+// Function: read_endpoint
+// Takes a snapshot of the counters of an endpoint. Returns false if the endpoint was never used.
+static bool
+read_endpoint (
+		const struct cyusb_ep_metrics *m,
+		struct ep_counters            *c)
+{
+	c->bytes           = __atomic_load_n (&m->bytes, __ATOMIC_RELAXED);
+	c->transfers       = __atomic_load_n (&m->transfers, __ATOMIC_RELAXED);
+	c->failures        = __atomic_load_n (&m->failures, __ATOMIC_RELAXED);
+	c->timeouts        = __atomic_load_n (&m->timeouts, __ATOMIC_RELAXED);
+	c->resubmits       = __atomic_load_n (&m->resubmits, __ATOMIC_RELAXED);
+	c->resubmit_ns     = __atomic_load_n (&m->resubmit_ns, __ATOMIC_RELAXED);
+	c->resubmit_max_ns = __atomic_load_n (&m->resubmit_max_ns, __ATOMIC_RELAXED);
+
+	return ((c->transfers != 0) || (c->failures != 0) || (c->resubmits != 0));
+}
+
+// Function: read_device
+// Checks whether a device slot is in use, and gets its state.
+static bool
+read_device (
+		const struct cyusb_dev_metrics *d,
+		unsigned int                   *state)
+{
+	*state = __atomic_load_n (&d->state, __ATOMIC_ACQUIRE);
+	return ((*state == CYUSB_METRICS_PRESENT) || (*state == CYUSB_METRICS_GONE));
+}
+
+// Function: port_path
+// Formats the port path of a device as "1.2.3".
+static void
+port_path (
+		const struct cyusb_dev_metrics *d,
+		char                           *buf)
+{
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; (i < d->nports) && (i < (int)sizeof(d->ports)); i++)
+		buf += sprintf (buf, (i == 0) ? "%d" : ".%d", d->ports[i]);
+}
+
+// Function: print_table
+// Prints the counters of all devices as a table.
+static void
+print_table (
+		const struct cyusb_metrics *m)
+{
+	const struct cyusb_dev_metrics *d;
+	struct ep_counters c;
+	unsigned int state, enumerations;
+	char ports[32];
+	int i, j;
+
+	printf ("Bus Port          VID:PID   Addr State   Reenum   EP          Bytes  Transfers   Failures   Timeouts"
+			"  Resub avg (us)  Resub max (us)\n");
+
+	for (i = 0; i < CYUSB_METRICS_DEVICES; i++) {
+		d = &m->dev[i];
+		if (!read_device (d, &state))
+			continue;
+
+		port_path (d, ports);
+		enumerations = __atomic_load_n (&d->enumerations, __ATOMIC_RELAXED);
+		printf ("%3d %-13s %04x:%04x %4d %-7s %6u\n", d->busnum, (ports[0]) ? ports : "-", d->vid, d->pid,
+				d->devaddr, (state == CYUSB_METRICS_PRESENT) ? "present" : "gone",
+				(enumerations) ? enumerations - 1 : 0);
+
+		for (j = 0; j < CYUSB_METRICS_ENDPOINTS; j++) {
+			if (!read_endpoint (&d->ep[j], &c))
+				continue;
+
+			printf ("%50s0x%02x %14llu %10llu %10llu %10llu  %14.1f  %14.1f\n", "", slot_endpoint (j),
+					c.bytes, c.transfers, c.failures, c.timeouts,
+					(c.resubmits) ? c.resubmit_ns / 1e3 / c.resubmits : 0.0, c.resubmit_max_ns / 1e3);
+		}
+	}
+}
+
+// Function: prom_value
+// Gets the value of one of the endpoint metrics from a snapshot.
+static double
+prom_value (
+		const struct ep_counters *c,
+		unsigned int              metric)
+{
+	switch (metric) {
+		case 0:  return c->bytes;
+		case 1:  return c->transfers;
+		case 2:  return c->failures;
+		case 3:  return c->timeouts;
+		case 4:  return c->resubmits;
+		case 5:  return c->resubmit_ns / 1e9;
+		default: return c->resubmit_max_ns / 1e9;
+	}
+}
+
+// Function: print_prometheus
+// Prints the counters of all devices in the Prometheus text exposition format.
+static void
+print_prometheus (
+		const struct cyusb_metrics *m)
+{
+	const struct cyusb_dev_metrics *d;
+	struct ep_counters c;
+	unsigned int state, enumerations;
+	unsigned int k;
+	char ports[32];
+	int i, j;
+
+	printf ("# HELP cyusb_device_present Whether the device is connected.\n");
+	printf ("# TYPE cyusb_device_present gauge\n");
+	for (i = 0; i < CYUSB_METRICS_DEVICES; i++) {
+		if (!read_device (&m->dev[i], &state))
+			continue;
+		d = &m->dev[i];
+		port_path (d, ports);
+		printf ("cyusb_device_present{bus=\"%d\",port=\"%s\",vid=\"%04x\",pid=\"%04x\"} %d\n",
+				d->busnum, ports, d->vid, d->pid, (state == CYUSB_METRICS_PRESENT));
+	}
+
+	printf ("# HELP cyusb_device_reenumerations_total Times the device has arrived again after leaving.\n");
+	printf ("# TYPE cyusb_device_reenumerations_total counter\n");
+	for (i = 0; i < CYUSB_METRICS_DEVICES; i++) {
+		if (!read_device (&m->dev[i], &state))
+			continue;
+		d = &m->dev[i];
+		port_path (d, ports);
+		enumerations = __atomic_load_n (&d->enumerations, __ATOMIC_RELAXED);
+		printf ("cyusb_device_reenumerations_total{bus=\"%d\",port=\"%s\",vid=\"%04x\",pid=\"%04x\"} %u\n",
+				d->busnum, ports, d->vid, d->pid, (enumerations) ? enumerations - 1 : 0);
+	}
+
+	// Each metric is printed for all endpoints before the next one, as the format requires.
+	for (k = 0; k < PROM_METRICS; k++) {
+		printf ("# HELP %s %s\n", prom_metrics[k].name, prom_metrics[k].help);
+		printf ("# TYPE %s %s\n", prom_metrics[k].name, prom_metrics[k].type);
+
+		for (i = 0; i < CYUSB_METRICS_DEVICES; i++) {
+			if (!read_device (&m->dev[i], &state))
+				continue;
+			d = &m->dev[i];
+			port_path (d, ports);
+
+			for (j = 0; j < CYUSB_METRICS_ENDPOINTS; j++) {
+				if (!read_endpoint (&d->ep[j], &c))
+					continue;
+				printf ("%s{bus=\"%d\",port=\"%s\",vid=\"%04x\",pid=\"%04x\",ep=\"0x%02x\"} %.9g\n",
+						prom_metrics[k].name, d->busnum, ports, d->vid, d->pid,
+						slot_endpoint (j), prom_value (&c, k));
+			}
+		}
+	}
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	const struct cyusb_metrics *m;
+	bool prometheus = false;
+	int interval = 0;
+
+	program_name = argv[0];
+	while ( (next_option = getopt_long(argc, argv, short_options,
+					   long_options, NULL) ) != -1 ) {
+		switch ( next_option ) {
+			case 'h': /* -h or --help  */
+				  print_usage(stdout, 0);
+			case 'v': /* -v or --version */
+				  printf("cyusbstat (Ver 1.0)\n");
+				  printf("Copyright (C) Cypress Semiconductors\n");
+				  exit(0);
+			case 'p': /* -p or --prometheus */
+				  prometheus = true;
+				  break;
+			case 'i': /* -i or --interval */
+				  interval = atoi(optarg);
+				  if ( interval <= 0 )
+					  print_usage(stdout, 1);
+				  break;
+			case '?': /* Invalid option */
+				  print_usage(stdout, 1);
+			default : /* Something else, unexpected */
+				  abort();
+		}
+	}
+
+	m = cyusb_metrics_map();
+	if ( m == NULL ) {
+		printf("Error: No metrics segment %s; is cyusbd running?\n", CYUSB_METRICS_NAME);
+		return -ENODEV;
+	}
+
+	for ( ; ; ) {
+		if ( prometheus )
+			print_prometheus(m);
+		else
+			print_table(m);
+		fflush(stdout);
+
+		if ( interval == 0 )
+			break;
+		sleep(interval);
+		if ( !prometheus )
+			printf("\n");
+	}
+
+	cyusb_metrics_unmap(m);
+	return 0;
+}
+
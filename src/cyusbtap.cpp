@@ -0,0 +1,194 @@
+/************************************************************************************************
+ * Program Name		:	cyusbtap.cpp							*
+ * Description		:	This is a CLI program which attaches to a stream fanned out by	*
+ *				cyusbd (cyusbd -s), and writes the data received to a file or	*
+ *				to stdout. Any number of these can read the same stream at the	*
+ *				same time, each at its own pace. A summary, including the data	*
+ *				lost by falling behind, is printed on stderr at the end.	*
+ * License		:	LGPL Ver 2.1							*
+ * Copyright		:	Cypress Semiconductors Inc.					*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/********** Cut and paste the following & modify as required  **********/
+static const char * program_name;
+static const char *const short_options = "hvbo:t:";
+static const struct option long_options[] = {
+		{ "help",	0,	NULL,	'h'	},
+		{ "version",	0,	NULL,	'v'	},
+		{ "block",	0,	NULL,	'b'	},
+		{ "output",	1,	NULL,	'o'	},
+		{ "time",	1,	NULL,	't'	},
+		{ NULL,		0,	NULL,	 0	}
+};
+
+static int next_option;
+
+static void print_usage(FILE *stream, int exit_code)
+{
+	fprintf(stream, "Usage: %s options <name>\n", program_name);
+	fprintf(stream,
+		"  -h  --help           Display this usage information.\n"
+		"  -v  --version        Print version.\n"
+		"  -b  --block          Hold the stream back instead of losing data when behind.\n"
+		"  -o  --output <file>  Write the data to <file> instead of stdout.\n"
+		"  -t  --time <s>       Stop after <s> seconds.\n");
+
+	exit(exit_code);
+}
+/***********************************************************************/
+
+// Interval (in milliseconds) at which a stop request is checked for while no data arrives.
+#define TAP_POLL_INTERVAL	(500)
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// Function: handle_sigint
+// Requests the program to stop after the current block.
+static void
+handle_sigint (
+		int signo)
+{
+	stop_requested = 1;
+}
+
+// Function: write_all
+// Writes a block of data to the output, looping over short writes.
+static int
+write_all (
+		int                  fd,
+		const unsigned char *buf,
+		unsigned int         len)
+{
+	ssize_t n;
+
+	while (len != 0) {
+		n = write (fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	cyusb_fanout_consumer *cons;
+	const unsigned char *data;
+	unsigned int length;
+	unsigned long long bytes = 0, blocks = 0, overwritten = 0;
+	struct timespec start, now;
+	struct sigaction sa;
+	int policy = CYUSB_FANOUT_DROP;
+	const char *outfile = NULL;
+	unsigned int duration = 0;
+	double seconds;
+	int fd = 1;
+	int r;
+
+	program_name = argv[0];
+	while ( (next_option = getopt_long(argc, argv, short_options,
+					   long_options, NULL) ) != -1 ) {
+		switch ( next_option ) {
+			case 'h': /* -h or --help  */
+				  print_usage(stdout, 0);
+			case 'v': /* -v or --version */
+				  printf("cyusbtap (Ver 1.0)\n");
+				  printf("Copyright (C) Cypress Semiconductors\n");
+				  exit(0);
+			case 'b': /* -b or --block */
+				  policy = CYUSB_FANOUT_BLOCK;
+				  break;
+			case 'o': /* -o or --output */
+				  outfile = optarg;
+				  break;
+			case 't': /* -t or --time */
+				  duration = atoi(optarg);
+				  break;
+			case '?': /* Invalid option */
+				  print_usage(stdout, 1);
+			default : /* Something else, unexpected */
+				  abort();
+		}
+	}
+	if ( optind != argc - 1 )
+		print_usage(stdout, 1);
+
+	if ( outfile != NULL ) {
+		fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if ( fd < 0 ) {
+			fprintf(stderr, "Error opening output file %s\n", outfile);
+			return -1;
+		}
+	}
+
+	r = cyusb_fanout_attach(argv[optind], policy, &cons);
+	if ( r != 0 ) {
+		fprintf(stderr, "Error %d in attaching to stream %s\n", r, argv[optind]);
+		cyusb_error(r);
+		return r;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_sigint;
+	sigaction(SIGINT,  &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	clock_gettime(CYUSB_CLOCK, &start);
+	while ( !stop_requested ) {
+		r = cyusb_fanout_next(cons, &data, &length, TAP_POLL_INTERVAL);
+		if ( r == 0 ) {
+			r = write_all(fd, data, length);
+			if ( cyusb_fanout_release(cons) != 0 )
+				overwritten++;
+			if ( r != 0 ) {
+				fprintf(stderr, "Error writing output: %s\n", strerror(-r));
+				break;
+			}
+			bytes  += length;
+			blocks += 1;
+		}
+		else if ( r != LIBUSB_ERROR_TIMEOUT ) {
+			if ( r == LIBUSB_ERROR_NO_DEVICE )
+				fprintf(stderr, "Stream has ended\n");
+			else
+				cyusb_error(r);
+			break;
+		}
+
+		clock_gettime(CYUSB_CLOCK, &now);
+		if ( (duration != 0) && (now.tv_sec - start.tv_sec >= (time_t)duration) )
+			break;
+	}
+
+	clock_gettime(CYUSB_CLOCK, &now);
+	seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%llu bytes in %llu blocks, %.1f KBps, %llu blocks dropped (%llu overwritten while read)\n",
+			bytes, blocks, (seconds > 0) ? bytes / 1024.0 / seconds : 0.0,
+			cyusb_fanout_dropped(cons), overwritten);
+
+	cyusb_fanout_detach(cons);
+	if ( fd != 1 )
+		close(fd);
+	return 0;
+}
+
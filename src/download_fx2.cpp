@@ -9,6 +9,8 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <libusb-1.0/libusb.h>
@@ -18,7 +20,6 @@
 #define FX2_INT_RAMSIZE		(0x4000)
 
 #define VENDORCMD_TIMEOUT	(5000)
-#define MAX_LINE_LENGTH		(512)
 #define MAX_BYTES_PER_LINE	(256)
 #define EEPROM_WRITE_SIZE	(1024)
 
@@ -29,6 +30,7 @@
 		((CHAR_TO_HEXVAL((char_p)[2])) << 4) | (CHAR_TO_HEXVAL((char_p)[3])))
 
 #define FX2_MAX_FW_SIZE		(0x10000)
+#define MAX_PORT_DEPTH		(7)
 
 /* List of supported programming targets */
 typedef enum {
@@ -38,15 +40,6 @@ typedef enum {
 	FW_TARGET_LR_I2C	// Program VID and PID to Large I2C EEPROM
 } fx2_fw_tgt_p;
 
-/* List of FX2LP firmware formats. */
-typedef enum {
-	FW_FORMAT_INVALID = 0,  // Invalid type, typically due to file access error.
-	FW_FORMAT_HEX = 0,      // Intel Hex Format, download to RAM only.
-	FW_FORMAT_BIN,          // Binary format, download to RAM only.
-	FW_FORMAT_C2LOAD,       // Firmware in C2 load format.
-	FW_FORMAT_C0LOAD	// USB IDs in C0 load format.
-} fx2_fw_fmt;
-
 static char fx2_vendax[][256] = {
 	":0a0d3e0000010202030304040505",
 	":10064d00E4F52CF52BF52AF529C203C200C202C2",
@@ -294,208 +287,10 @@ fx2_dnld_print_usage (
 	printf ("\t\t\t\"RAM \": Program to internal or external RAM\n");
 	printf ("\t\t\t\"SI2C\": Program to small I2C EEPROM, IIC file to be provided\n");
 	printf ("\t\t\t\"LI2C\": Program to large I2C EEPROM, IIC file to be provided\n");
+	printf ("\t%s -a ...: Program all attached devices in parallel\n", arg0);
 	printf ("\n");
 }
 
-static fx2_fw_fmt
-get_fw_format (
-		FILE *fw_fil_p)
-{
-	fx2_fw_fmt fmt = FW_FORMAT_HEX;
-	unsigned char hexdata[MAX_LINE_LENGTH], *fw_p;
-	unsigned char num_bytes;
-	size_t len;
-
-	if (fw_fil_p != 0) {
-		fseek (fw_fil_p, 0, SEEK_SET);
-
-		/* Check for valid HEX file first. Each line should begin with ':' and
-		 * have enough data to cover the byte count per line. */
-		while (fgets ((char *)hexdata, MAX_LINE_LENGTH, fw_fil_p) != NULL) {
-
-			if (hexdata[0] != ':')
-				fmt = FW_FORMAT_BIN;
-
-			fw_p      = &hexdata[1];
-			len       = strlen ((const char *)hexdata);
-			num_bytes = GET_HEX_BYTE(fw_p);
-
-			if (len < (num_bytes * 2 + 9))
-				fmt = FW_FORMAT_BIN;
-		}
-
-		if (fmt != FW_FORMAT_HEX) {
-			fseek (fw_fil_p, 0, SEEK_SET);
-			if (fgets ((char *)hexdata, MAX_LINE_LENGTH, fw_fil_p) == NULL) {
-				fmt = FW_FORMAT_INVALID;
-			} else {
-				switch (hexdata[0]) {
-					case 0xC0:
-						fmt = FW_FORMAT_C0LOAD;
-						printf ("Found C0 Load IIC format file\n");
-						break;
-					case 0xC2:
-						printf ("Found C2 Load IIC format file\n");
-						fmt = FW_FORMAT_C2LOAD;
-						break;
-					default:
-						printf ("Found binary format file\n");
-						fmt = FW_FORMAT_BIN;
-						break;
-				}
-			}
-		} else
-			printf ("Found Hex format file\n");
-	} else
-		fmt = FW_FORMAT_INVALID;
-
-	return fmt;
-}
-
-/* Function to read the FX2LP firmware from in_file into the fw_buf buffer.
-   max_addr is used to return the maximum valid address found in the input.
- */
-static fx2_fw_fmt
-read_fx2_firmware (
-		const char    *filename,
-		unsigned char *fw_buf,
-		unsigned int  *max_addr)
-{
-	FILE         *in_file = NULL;
-	fx2_fw_fmt    fmt;
-	int           ret, i;
-	struct stat   filbuf;
-	unsigned char scratch[MAX_LINE_LENGTH], *tmp;
-	unsigned int  address, length;
-
-
-	if ((filename == NULL) || (fw_buf == NULL) || (max_addr == NULL)) {
-		fprintf (stderr, "Invalid parameter\n");
-		return FW_FORMAT_INVALID;
-	}
-
-	ret = stat (filename, &filbuf);
-	if (ret != 0) {
-		fprintf (stderr, "Failed to stat file %s\n", filename);
-		return FW_FORMAT_INVALID;
-	}
-
-	in_file = fopen (filename, "rb");
-	if (in_file == NULL) {
-		fprintf (stderr, "Failed to open file %s\n", filename);
-		return FW_FORMAT_INVALID;
-	}
-
-	*max_addr = 0;
-	fmt = get_fw_format (in_file);
-	fseek (in_file, 0, SEEK_SET);
-	memset (fw_buf, 0, FX2_MAX_FW_SIZE);
-
-	switch (fmt)
-	{
-		case FW_FORMAT_HEX:
-			{
-				fmt    = FW_FORMAT_INVALID;
-				length = 0;
-
-				while (fgets ((char *)scratch, MAX_LINE_LENGTH, in_file) != NULL) {
-					/* If this is the end of file record, stop reading. */
-					if ((scratch[7] == '0') && (scratch[8] == '1')) {
-						fmt = FW_FORMAT_BIN;
-						break;
-					}
-
-					/* Ignore all except data records. */
-					if ((scratch[7] != '0') || (scratch[8] != '0'))
-						continue;
-
-					tmp = &scratch[1];
-					length  = GET_HEX_BYTE (tmp);
-					tmp += 2;
-					address = GET_HEX_WORD (tmp);
-
-					if ((address + length) > FX2_MAX_FW_SIZE) {
-						fprintf (stderr, "Firmware address out of range\n");
-						break;
-					}
-
-					if ((address + length) > *max_addr)
-						*max_addr = address + length;
-
-					tmp += 6;
-					for (i = 0; i < length; i++) {
-						fw_buf[address + i] = GET_HEX_BYTE (tmp);
-						tmp += 2;
-					}
-				}
-			}
-			break;
-
-		case FW_FORMAT_C2LOAD:
-			{
-				fmt = FW_FORMAT_INVALID;
-
-				/* Read and skip the 8 byte header. */
-				ret = fread (scratch, 1, 8, in_file);
-				if (ret == 8) {
-					ret = fread (scratch, 1, 4, in_file);
-					while (ret == 4) {
-						length  = (scratch[0] << 8) | scratch[1];
-						address = (scratch[2] << 8) | scratch[3];
-
-						/* We have received the footer. Stop reading file. */
-						if ((address == FX2_CPUCS_ADDR) && (length == 0x8001)) {
-							fmt = FW_FORMAT_BIN;
-							break;
-						}
-
-						if ((address + length) > FX2_MAX_FW_SIZE) {
-							fprintf (stderr, "Firmware address out of range\n");
-							break;
-						}
-
-						if ((address + length) > *max_addr)
-							*max_addr = address + length;
-						ret = fread (fw_buf + address, 1, length, in_file);
-						if (ret != length) {
-							fprintf (stderr, "Failed to read file\n");
-							break;
-						}
-
-						ret = fread (scratch, 1, 4, in_file);
-					}
-				}
-			}
-			break;
-
-		case FW_FORMAT_BIN:
-			{
-				/* Binary file, just read contents into memory as it is. */
-				if (filbuf.st_size <= FX2_MAX_FW_SIZE) {
-					ret = fread (fw_buf, 1, filbuf.st_size, in_file);
-					if (ret == filbuf.st_size) {
-						*max_addr = ret;
-						ret = 0;
-					} else {
-						fprintf (stderr, "File %s read failed\n", filename);
-						fmt = FW_FORMAT_INVALID;
-					}
-				} else {
-					fprintf (stderr, "File %s is too large. Not likely to be a FX2 firmware binary\n", filename);
-					fmt = FW_FORMAT_INVALID;
-				}
-			}
-			break;
-
-		default:
-			fmt = FW_FORMAT_INVALID;
-			break;
-	}
-
-	fclose (in_file);
-	return (fmt);
-}
-
 /* Function to force FX2 CPU into (cpu_enable = 0) or out (cpu_enable != 0) of reset. */
 static int
 fx2_reset (
@@ -519,15 +314,23 @@ static int
 fx2_load_vendax (
 		libusb_device_handle *h)
 {
+	struct cyusb_control_req reqs[FX2_VENDAX_SIZE + 1];
+	unsigned char (*databuf)[MAX_BYTES_PER_LINE];
+	unsigned char reset = 0;
 	int r, j;
         unsigned int i;
 	unsigned char *fw_p;
-	unsigned char  databuf[MAX_BYTES_PER_LINE];
 	unsigned char  num_bytes = 0;
 	unsigned short address = 0;
 
 	printf("Info: Downloading Vend_ax hex into FX2 RAM\n");
 
+	// Every line gets its own buffer, as all of them are queued at once.
+	databuf = (unsigned char (*)[MAX_BYTES_PER_LINE])malloc (FX2_VENDAX_SIZE * MAX_BYTES_PER_LINE);
+	if ( databuf == NULL )
+		return -2;
+
+	memset (reqs, 0, sizeof (reqs));
 	for ( i = 0; ((i < FX2_VENDAX_SIZE) && (fx2_vendax[i][8] == 0x30)); i++ ) {
 		fw_p = (unsigned char *)&fx2_vendax[i][1];
 		num_bytes = GET_HEX_BYTE(fw_p);
@@ -535,24 +338,38 @@ fx2_load_vendax (
 		address   = GET_HEX_WORD(fw_p);
 		fw_p += 6;
 		for ( j = 0; j < num_bytes; j++ ) {
-			databuf[j] = GET_HEX_BYTE(fw_p);
+			databuf[i][j] = GET_HEX_BYTE(fw_p);
 			fw_p += 2;
 		}
 
-		r = libusb_control_transfer(h, 0x40, 0xA0, address, 0x00, databuf, num_bytes, VENDORCMD_TIMEOUT);
-		if ( r != num_bytes ) {
-			printf("Error in control_transfer\n");
-			return -2;
-		}
+		reqs[i].bmRequestType = 0x40;
+		reqs[i].bRequest      = 0xA0;
+		reqs[i].wValue        = address;
+		reqs[i].wLength       = num_bytes;
+		reqs[i].data          = databuf[i];
+		reqs[i].timeout       = VENDORCMD_TIMEOUT;
 	}
 
-	printf("Info: Releasing FX2 CPU from reset\n");
-	r = fx2_reset (h, 1);
+	/* The CPU is only taken out of reset once all of the lines have been written. */
+	reqs[i].bmRequestType = 0x40;
+	reqs[i].bRequest      = 0xA0;
+	reqs[i].wValue        = FX2_CPUCS_ADDR;
+	reqs[i].wLength       = 1;
+	reqs[i].data          = &reset;
+	reqs[i].timeout       = VENDORCMD_TIMEOUT;
+	reqs[i].flags         = CYUSB_CONTROL_BARRIER;
+
+	r = cyusb_control_batch (h, reqs, i + 1, 0, 0);
+	free (databuf);
 	if ( r != 0 ) {
-		fprintf (stderr, "Error: Failed to get FX2 out of reset\n");
-		return -3;
+		if ( reqs[i].status == LIBUSB_ERROR_INTERRUPTED )
+			printf("Error in control_transfer\n");
+		else
+			fprintf (stderr, "Error: Failed to get FX2 out of reset\n");
+		return ( reqs[i].status == LIBUSB_ERROR_INTERRUPTED ) ? -2 : -3;
 	}
 
+	printf("Info: Released FX2 CPU from reset\n");
 	return 0;
 }
 
@@ -562,25 +379,27 @@ fx2_ram_download (
 		const char   *filename,
 		int           extended)
 {
-	unsigned char fw_buf[FX2_MAX_FW_SIZE];
-	fx2_fw_fmt    fmt;
-	unsigned int  address = 0, length = 0;
-	int           i, r;
+	struct cyusb_fx2_image *img;
+	unsigned int  address;
+	int           r;
 
-	fmt = read_fx2_firmware (filename, fw_buf, &address);
-	if (fmt != FW_FORMAT_BIN) {
+	/* The library parses the file only once, and caches the parsed segments. */
+	if (cyusb_fx2_image_load (filename, &img) != 0) {
 		fprintf (stderr, "Error: Invalid firmware file format\n");
 		return -1;
 	}
+	address = img->max_addr;
 
 	if ((address > FX2_INT_RAMSIZE) && (!extended)) {
 		fprintf (stderr, "Error: Firmware too big to fit in internal RAM\n");
+		cyusb_fx2_image_release (img);
 		return -2;
 	}
 
 	r = fx2_reset (h, 0);
 	if (r != 0) {
 		fprintf (stderr, "Error: Failed to force FX2 into reset\n");
+		cyusb_fx2_image_release (img);
 		return -3;
 	}
 
@@ -592,17 +411,16 @@ fx2_ram_download (
 		r = fx2_load_vendax(h);
 		if ( r != 0 ) {
 			fprintf (stderr, "Failed to download Vend_Ax firmware to aid programming\n");
+			cyusb_fx2_image_release (img);
 			return -4;
 		}
 
 		/* Load the external RAM part first. */
-		for (i = FX2_INT_RAMSIZE; i < address; i += EEPROM_WRITE_SIZE) {
-			length = ((address - i) > EEPROM_WRITE_SIZE) ? EEPROM_WRITE_SIZE : (address - i);
-			r = libusb_control_transfer (h, 0x40, 0xA3, i, 0x00, &fw_buf[i], length, VENDORCMD_TIMEOUT);
-			if (r != length) {
-				fprintf (stderr, "Vendor write to RAM failed\n");
-				return -5;
-			}
+		r = cyusb_fx2_image_write (h, img, 0xA3, FX2_INT_RAMSIZE, FX2_MAX_FW_SIZE);
+		if (r < 0) {
+			fprintf (stderr, "Vendor write to RAM failed\n");
+			cyusb_fx2_image_release (img);
+			return -5;
 		}
 
 		/* All data has been loaded on external RAM. Now halt the CPU and load the internal RAM. */
@@ -610,21 +428,17 @@ fx2_ram_download (
 		r = fx2_reset(h, 0);
 		if ( r != 0 ) {
 			fprintf (stderr, "Error: Failed to halt FX2 CPU\n");
+			cyusb_fx2_image_release (img);
 			return -6;
 		}
-
-		/* We can reduce the size to the internal RAM size now. */
-		address = FX2_INT_RAMSIZE;
 	}
 
-	/* Load the internal RAM part now. */
-	for (i = 0; i < address; i += EEPROM_WRITE_SIZE) {
-		length = ((address - i) > EEPROM_WRITE_SIZE) ? EEPROM_WRITE_SIZE : (address - i);
-		r = libusb_control_transfer (h, 0x40, 0xA0, i, 0x00, &fw_buf[i], length, VENDORCMD_TIMEOUT);
-		if (r != length) {
-			fprintf (stderr, "Vendor write to RAM failed\n");
-			return -7;
-		}
+	/* Load the internal RAM part now, skipping any gaps in the image. */
+	r = cyusb_fx2_image_write (h, img, 0xA0, 0, FX2_INT_RAMSIZE);
+	cyusb_fx2_image_release (img);
+	if (r < 0) {
+		fprintf (stderr, "Vendor write to RAM failed\n");
+		return -7;
 	}
 
 	/* Now release CPU from reset. */
@@ -645,11 +459,12 @@ fx2_eeprom_download (
 		const char   *filename,
 		int           large)
 {
+	struct cyusb_control_req *reqs;
 	int fd;
-	unsigned char buf[EEPROM_WRITE_SIZE];
+	unsigned char *buf;
 	int r;
 	unsigned short address = 0;
-	int nbr;
+	int nbr, nreqs, i;
 	int filsz;
 	struct stat filbuf;
 
@@ -683,25 +498,184 @@ fx2_eeprom_download (
 		return -4;
 	}
 
-	while ( (nbr = read(fd, buf, EEPROM_WRITE_SIZE)) ) {
+	/* Read the whole file, so that all of the EEPROM writes can be queued together. The last
+	   write is padded with zeroes up to a whole EEPROM page. */
+	nreqs = (filsz + EEPROM_WRITE_SIZE - 1) / EEPROM_WRITE_SIZE;
+	buf   = (unsigned char *)calloc (nreqs + 1, EEPROM_WRITE_SIZE);
+	reqs  = (struct cyusb_control_req *)calloc (nreqs + 1, sizeof (struct cyusb_control_req));
+	if ((buf == NULL) || (reqs == NULL) || (read (fd, buf, filsz) != filsz)) {
+		fprintf(stderr, "Error: Failed to read file %s\n", filename);
+		free (buf);
+		free (reqs);
+		close(fd);
+		return -5;
+	}
+	close(fd);
+
+	for ( i = 0; i < nreqs; i++ ) {
+		nbr = (filsz - i * EEPROM_WRITE_SIZE > EEPROM_WRITE_SIZE) ? EEPROM_WRITE_SIZE : filsz - i * EEPROM_WRITE_SIZE;
 		if (large)
 			nbr = ROUND_UP(nbr, 64);
 		else
 			nbr = ROUND_UP(nbr, 8);
-		r = libusb_control_transfer(h, 0x40, ((large) ? 0xA9 : 0xA2), address, 0x00, buf, nbr, VENDORCMD_TIMEOUT);
-		if ( r != nbr ) {
-			fprintf(stderr, "Error: Control transfer to write EEPROM failed\n");
-			close(fd);
-			return -5;
-		}
 
+		reqs[i].bmRequestType = 0x40;
+		reqs[i].bRequest      = (large) ? 0xA9 : 0xA2;
+		reqs[i].wValue        = address;
+		reqs[i].wLength       = nbr;
+		reqs[i].data          = buf + i * EEPROM_WRITE_SIZE;
+		reqs[i].timeout       = VENDORCMD_TIMEOUT;
 		address += nbr;
 	}
 
-	close(fd);
+	r = cyusb_control_batch (h, reqs, nreqs, 0, 0);
+	free (buf);
+	free (reqs);
+	if ( r != 0 ) {
+		fprintf(stderr, "Error: Control transfer to write EEPROM failed\n");
+		return -5;
+	}
+
 	return 0;
 }
 
+/* State of one device being programmed in the --all mode. */
+typedef struct {
+	libusb_device_handle *handle;		// Handle to the device.
+	char                  path[32];		// Bus number and port path of the device.
+	volatile int          finished;		// Programming thread is done with the device.
+	int                   status;		// Result of the programming.
+	double                seconds;		// Time taken to program the device.
+} fx2_flash_dev;
+
+static fx2_fw_tgt_p all_tgt      = FW_TARGET_NONE;
+static const char  *all_filename = NULL;
+
+/* Get the bus number and port path of a device, as in "2-1.4". */
+static void
+get_port_path (
+		libusb_device_handle *h,
+		char                 *path,
+		int                   len)
+{
+	libusb_device *dev = libusb_get_device (h);
+	unsigned char  ports[MAX_PORT_DEPTH];
+	int i, n, pos;
+
+	pos = snprintf (path, len, "%d", libusb_get_bus_number (dev));
+	n   = libusb_get_port_numbers (dev, ports, MAX_PORT_DEPTH);
+	for (i = 0; (i < n) && (pos < len); i++)
+		pos += snprintf (path + pos, len - pos, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+}
+
+/* Programming thread for one device in the --all mode. */
+static void *
+fx2_flash_thread (
+		void *arg)
+{
+	fx2_flash_dev  *dev = (fx2_flash_dev *)arg;
+	struct timespec t1, t2;
+	int r;
+
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	switch (all_tgt) {
+		case FW_TARGET_RAM:
+			r = fx2_ram_download (dev->handle, all_filename, 1);
+			break;
+		case FW_TARGET_SM_I2C:
+			r = fx2_eeprom_download (dev->handle, all_filename, 0);
+			break;
+		case FW_TARGET_LR_I2C:
+			r = fx2_eeprom_download (dev->handle, all_filename, 1);
+			break;
+		default:
+			r = -EINVAL;
+			break;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t2);
+
+	dev->seconds  = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	dev->status   = r;
+	dev->finished = 1;
+	return NULL;
+}
+
+/* Program the firmware on all the devices found by cyusb_open(), in parallel. FX2LP devices do
+   not re-enumerate while being programmed, so each one keeps its handle throughout. */
+static int
+fx2_download_all (
+		fx2_fw_tgt_p  tgt,
+		const char   *filename,
+		int           count)
+{
+	fx2_flash_dev *devs;
+	pthread_t     *tid;
+	int           *started;
+	int i, running, failed = 0;
+
+	all_tgt      = tgt;
+	all_filename = filename;
+
+	devs    = (fx2_flash_dev *)calloc (count, sizeof (fx2_flash_dev));
+	tid     = (pthread_t *)calloc (count, sizeof (pthread_t));
+	started = (int *)calloc (count, sizeof (int));
+	if ((devs == NULL) || (tid == NULL) || (started == NULL)) {
+		fprintf (stderr, "Error: Out of memory\n");
+		free (devs);
+		free (tid);
+		free (started);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		devs[i].handle = cyusb_gethandle (i);
+		if (devs[i].handle == NULL) {
+			fprintf (stderr, "Error: Failed to open device %d\n", i);
+			strcpy (devs[i].path, "-");
+			devs[i].status = -EACCES;
+			continue;
+		}
+		get_port_path (devs[i].handle, devs[i].path, sizeof (devs[i].path));
+		started[i] = (pthread_create (&tid[i], NULL, fx2_flash_thread, &devs[i]) == 0);
+		if (!started[i]) {
+			fprintf (stderr, "Error: Failed to start programming thread for device %s\n", devs[i].path);
+			devs[i].status = -ENOMEM;
+		}
+	}
+
+	do {
+		sleep (1);
+		running = 0;
+		printf ("Progress:");
+		for (i = 0; i < count; i++) {
+			if (!started[i])
+				continue;
+			if (!devs[i].finished)
+				running++;
+			printf ("  [%s] %s", devs[i].path, (!devs[i].finished) ? "busy" :
+					((devs[i].status == 0) ? "done" : "FAILED"));
+		}
+		printf ("\n");
+		fflush (stdout);
+	} while (running != 0);
+
+	printf ("\nSummary:\n");
+	for (i = 0; i < count; i++) {
+		if (started[i])
+			pthread_join (tid[i], NULL);
+		printf ("\tDevice %d at %-16s : %s (%d) in %.1f seconds\n", i, devs[i].path,
+				(devs[i].status == 0) ? "OK    " : "FAILED", devs[i].status, devs[i].seconds);
+		if (devs[i].status != 0)
+			failed++;
+	}
+	printf ("\t%d of %d device(s) programmed\n", count - failed, count);
+
+	free (devs);
+	free (tid);
+	free (started);
+	return (failed) ? -EIO : 0;
+}
+
 int main (
 		int    argc,
 		char **argv)
@@ -723,6 +697,7 @@ int main (
 	unsigned char num_bytes = 0;
 	unsigned short address = 0;
 	unsigned char *dbuf = NULL;
+	int all = 0;
 	int i;
 
 	/* Parse command line arguments. */
@@ -752,6 +727,8 @@ int main (
 					if (argc > (i + 1))
 						filename = argv[i + 1];
 					i++;
+				} else if ((strcmp (argv[i], "-a") == 0) || (strcmp (argv[i], "--all") == 0)) {
+					all = 1;
 				} else {
 					fprintf (stderr, "Error: Unknown parameter %s\n", argv[i]);
 					fx2_dnld_print_usage (argv[0]);
@@ -775,8 +752,13 @@ int main (
 	        fprintf (stderr, "Error: No FX2LP device found\n");
 		return -ENODEV;
 	}
+	else if (all) {
+		r = fx2_download_all (tgt, filename, r);
+		cyusb_close ();
+		return r;
+	}
 	else if (r > 1) {
-		fprintf (stderr, "Error: More than one Cypress device found\n");
+		fprintf (stderr, "Error: More than one Cypress device found, use -a to program all of them\n");
 		return -EINVAL;
 	}
 
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <libusb-1.0/libusb.h>
@@ -21,12 +23,18 @@
 
 #define I2C_PAGE_SIZE		(64)		// Page size for I2C EEPROM.
 #define I2C_SLAVE_SIZE		(64 * 1024)	// Max. size of data that can fit on one EEPROM address.
+#define I2C_PIPE_DEPTH		(4)		// Number of I2C vendor requests kept in flight.
+#define I2C_RETRY_COUNT		(3)		// Number of times a page that fails to verify is rewritten.
 
 #define SPI_PAGE_SIZE		(256)		// Page size for SPI flash memory.
 #define SPI_SECTOR_SIZE		(64 * 1024)	// Sector size for SPI flash memory.
+#define SPI_ERASE_TIMEOUT	(10000)		// Timeout (in milliseconds) for a SPI sector erase.
+#define SPI_POLL_MIN		(1)		// First status poll interval (in milliseconds) after an erase.
+#define SPI_POLL_MAX		(50)		// Longest status poll interval (in milliseconds).
 
 #define VENDORCMD_TIMEOUT	(5000)		// Timeout (in milliseconds) for each vendor command.
 #define GETHANDLE_TIMEOUT	(5)		// Timeout (in seconds) for getting a FX3 flash programmer handle.
+#define MAX_PORT_DEPTH		(7)		// Max. number of hub ports between a device and its root hub.
 
 /* Utility macros. */
 #define ROUND_UP(n,v)	((((n) + ((v) - 1)) / (v)) * (v))	// Round n upto a multiple of v.
@@ -54,32 +62,57 @@ const int i2c_eeprom_size[] =
 	131072		// bImageCtl[2:0] = 'b111
 };
 
-static int
-fx3_ram_write (
-		libusb_device_handle  *h,
-		unsigned char *buf,
-		unsigned int   ramAddress,
-		int            len)
+/* State of one device being programmed in the --all mode. */
+typedef struct {
+	libusb_device_handle *handle;		// Handle to the device, NULL if it was lost.
+	char                  path[32];		// Bus number and port path; stays the same across re-enumeration.
+	int                   needs_prog;	// Flash programmer has to be loaded before the target is written.
+	const char           *step;		// Operation in progress, for the progress report.
+	volatile unsigned int done;		// Bytes done in the current operation.
+	volatile unsigned int total;		// Total bytes in the current operation.
+	volatile int          finished;		// Programming thread is done with the device.
+	int                   status;		// Result of the programming.
+	double                seconds;		// Time taken to program the device.
+} fx3_flash_dev;
+
+/* Device being programmed by the current thread. NULL when only a single device is programmed. */
+static __thread fx3_flash_dev *cur_dev = NULL;
+
+/* Set while a step reports its own progress, so that the helpers it calls do not add to it. */
+static __thread int progress_held = 0;
+
+/* Only rewrite the SPI flash sectors that differ from the image (-d option). */
+static int spi_diff = 0;
+
+/* Record the start of a new programming step on the current device. */
+static void
+progress_start (
+		const char   *step,
+		unsigned int  total)
 {
-	int r;
-	int index = 0;
-	int size;
-
-	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = libusb_control_transfer (h, 0x40, 0xA0, GET_LSW(ramAddress), GET_MSW(ramAddress),
-				&buf[index], size, VENDORCMD_TIMEOUT);
-		if (r != size) {
-			fprintf (stderr, "Error: Vendor write to FX3 RAM failed\n");
-			return -1;
-		}
-
-		ramAddress += size;
-		index      += size;
-		len        -= size;
+	if (cur_dev != NULL) {
+		cur_dev->done  = 0;
+		cur_dev->total = total;
+		cur_dev->step  = step;
 	}
+}
 
-	return 0;
+/* Record progress on the current programming step. */
+static void
+progress_add (
+		unsigned int done)
+{
+	if ((cur_dev != NULL) && (!progress_held))
+		cur_dev->done += done;
+}
+
+/* Record the progress on the current programming step, as the amount of work done so far. */
+static void
+progress_set (
+		unsigned int done)
+{
+	if (cur_dev != NULL)
+		cur_dev->done = done;
 }
 
 /* Read the firmware image from the file into a buffer. */
@@ -144,10 +177,7 @@ fx3_usbboot_download (
 		const char   *filename)
 {
 	unsigned char *fwBuf;
-	unsigned int  *data_p;
-	unsigned int i, checksum;
-	unsigned int address, length;
-	int r, index, filesize;
+	int r, filesize;
 
 	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
 	if (fwBuf == 0) {
@@ -163,38 +193,15 @@ fx3_usbboot_download (
 		return -2;
 	}
 
-	// Run through each section of code, and use vendor commands to download them to RAM.
-	index    = 4;
-	checksum = 0;
-	while (index < filesize) {
-		data_p  = (unsigned int *)(fwBuf + index);
-		length  = data_p[0];
-		address = data_p[1];
-		if (length != 0) {
-			for (i = 0; i < length; i++)
-				checksum += data_p[2 + i];
-			r = fx3_ram_write (h, fwBuf + index + 8, address, length * 4);
-			if (r != 0) {
-				fprintf (stderr, "Error: Failed to download data to FX3 RAM\n");
-				free (fwBuf);
-				return -3;
-			}
-		} else {
-			if (checksum != data_p[2]) {
-				fprintf (stderr, "Error: Checksum error in firmware binary\n");
-				free (fwBuf);
-				return -4;
-			}
-
-			r = libusb_control_transfer (h, 0x40, 0xA0, GET_LSW(address), GET_MSW(address), NULL,
-					0, VENDORCMD_TIMEOUT);
-			if (r != 0)
-				printf ("Info: Ignored error in control transfer: %d\n", r);
-			break;
-		}
-
-		index += (8 + length * 4);
+	// The library checks the image and keeps several vendor commands queued at a time.
+	progress_start ("RAM", filesize);
+	r = cyusb_download_fx3_image (h, fwBuf, filesize);
+	if (r != 0) {
+		fprintf (stderr, "Error: Failed to download data to FX3 RAM\n");
+		free (fwBuf);
+		return -3;
 	}
+	progress_add (filesize);
 
 	free (fwBuf);
 	return 0;
@@ -216,22 +223,15 @@ static int check_fx3_flashprog (libusb_device_handle *handle)
 	return 0;
 }
 
-/* Get the handle to the FX3 flash programmer device, if found. */
-static int
-get_fx3_prog_handle (
-		libusb_device_handle **h)
+/* Get the path to the FX3 flash programmer image, and check that it exists. The returned
+   string has to be freed by the caller. */
+static char *
+get_fx3_prog_file (
+		void)
 {
 	char *progfile_p, *tmp;
-	libusb_device_handle *handle;
-	int i, j, r;
 	struct stat filestat;
-
-	handle = *h;
-	r = check_fx3_flashprog (handle);
-	if (r == 0)
-		return 0;
-
-	printf ("Info: Trying to download flash programmer to RAM\n");
+	int i;
 
 	tmp = getenv ("CYUSB_ROOT");
 	if (tmp != NULL) {
@@ -245,12 +245,35 @@ get_fx3_prog_handle (
 		strcpy (progfile_p, "fx3_images/cyfxflashprog.img");
 	}
 
-	r = stat (progfile_p, &filestat);
-	if (r != 0) {
+	if (stat (progfile_p, &filestat) != 0) {
 		fprintf (stderr, "Error: Failed to find cyfxflashprog.img file\n");
-		return -1;
+		free (progfile_p);
+		return NULL;
 	}
 
+	return progfile_p;
+}
+
+/* Get the handle to the FX3 flash programmer device, if found. */
+static int
+get_fx3_prog_handle (
+		libusb_device_handle **h)
+{
+	char *progfile_p;
+	libusb_device_handle *handle;
+	int i, j, r;
+
+	handle = *h;
+	r = check_fx3_flashprog (handle);
+	if (r == 0)
+		return 0;
+
+	printf ("Info: Trying to download flash programmer to RAM\n");
+
+	progfile_p = get_fx3_prog_file ();
+	if (progfile_p == NULL)
+		return -1;
+
 	r = fx3_usbboot_download (handle, progfile_p);
 	free (progfile_p);
 	if (r != 0) {
@@ -285,72 +308,102 @@ get_fx3_prog_handle (
 	return -2;
 }
 
+/* Rewrite and verify a single EEPROM page that failed the read-back. */
 static int
-fx3_i2c_write (
+fx3_i2c_retry_page (
 		libusb_device_handle  *h,
-		unsigned char *buf,
+		unsigned char *expData,
 		int            devAddr,
-		int            start,
-		int            len)
+		int            offset)
 {
-	int r = 0;
-	int index = start;
-	unsigned short address = 0;
-	int size;
-
-	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = libusb_control_transfer (h, 0x40, 0xBA, devAddr, address, &buf[index], size, VENDORCMD_TIMEOUT);
-		if (r != size) {
-			fprintf (stderr, "Error: I2C write failed\n");
-			return -1;
+	unsigned char tmpBuf[I2C_PAGE_SIZE];
+	int i, r;
+
+	for (i = 0; i < I2C_RETRY_COUNT; i++) {
+		r = libusb_control_transfer (h, 0x40, 0xBA, devAddr, offset, expData + offset, I2C_PAGE_SIZE,
+				VENDORCMD_TIMEOUT);
+		if (r != I2C_PAGE_SIZE)
+			continue;
+
+		r = libusb_control_transfer (h, 0xC0, 0xBB, devAddr, offset, tmpBuf, I2C_PAGE_SIZE,
+				VENDORCMD_TIMEOUT);
+		if ((r == I2C_PAGE_SIZE) && (memcmp (tmpBuf, expData + offset, I2C_PAGE_SIZE) == 0)) {
+			printf ("Info: Rewrote I2C EEPROM page at 0x%04x\n", offset);
+			return 0;
 		}
-
-		address += size ;
-		index   += size;
-		len     -= size;
 	}
 
-	return 0;
+	fprintf (stderr, "Error: I2C EEPROM page at 0x%04x failed to verify\n", offset);
+	return -1;
 }
 
-/* Function to read I2C data and compare against the expected value. */
+/* Write len bytes of data to one I2C slave address and verify them. The writes are batched
+   with I2C_PIPE_DEPTH requests in flight, and the read-back of each chunk is queued right
+   behind its write, so the verify pass trails the writes instead of alternating with them.
+   Control requests are handled by the device in the order in which they are queued. Pages
+   that fail the read-back are rewritten one at a time. */
 static int
-fx3_i2c_read_verify (
+fx3_i2c_write_verify (
 		libusb_device_handle  *h,
 		unsigned char *expData,
 		int            devAddr,
 		int            len)
 {
-	int r = 0;
-	int index = 0;
-	unsigned short address = 0;
-	int size;
-	unsigned char tmpBuf[MAX_WRITE_SIZE];
+	struct cyusb_control_req reqs[2 * ((I2C_SLAVE_SIZE + MAX_WRITE_SIZE - 1) / MAX_WRITE_SIZE)];
+	unsigned char *readBuf;
+	int nchunks = (len + MAX_WRITE_SIZE - 1) / MAX_WRITE_SIZE;
+	int offset, size, failed = 0;
+	int i;
+
+	readBuf = (unsigned char *)malloc (I2C_SLAVE_SIZE);
+	if (readBuf == NULL) {
+		fprintf (stderr, "Error: Failed to allocate I2C requests\n");
+		return -1;
+	}
 
-	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = libusb_control_transfer (h, 0xC0, 0xBB, devAddr, address, tmpBuf, size, VENDORCMD_TIMEOUT);
-		if (r != size) {
-			fprintf (stderr, "Error: I2C read failed\n");
-			return -1;
-		}
+	// Request 2n writes chunk n, and request 2n + 1 reads it back.
+	memset (reqs, 0, sizeof (reqs));
+	for (i = 0; i < nchunks; i++) {
+		offset = i * MAX_WRITE_SIZE;
+		size   = ((len - offset) > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : (len - offset);
+
+		reqs[2 * i].bmRequestType     = 0x40;
+		reqs[2 * i].bRequest          = 0xBA;
+		reqs[2 * i].wValue            = devAddr;
+		reqs[2 * i].wIndex            = offset;
+		reqs[2 * i].wLength           = size;
+		reqs[2 * i].data              = expData + offset;
+		reqs[2 * i].timeout           = VENDORCMD_TIMEOUT;
+
+		reqs[2 * i + 1]               = reqs[2 * i];
+		reqs[2 * i + 1].bmRequestType = 0xC0;
+		reqs[2 * i + 1].bRequest      = 0xBB;
+		reqs[2 * i + 1].data          = readBuf + offset;
+	}
 
-		if (memcmp (expData + index, tmpBuf, size) != 0) {
-			fprintf (stderr, "Error: Failed to read expected data from I2C EEPROM\n");
-			return -2;
-		}
+	if (cyusb_control_batch (h, reqs, 2 * nchunks, I2C_PIPE_DEPTH, 0) != 0) {
+		fprintf (stderr, "Error: I2C write failed\n");
+		free (readBuf);
+		return -1;
+	}
+	progress_add (len);
 
-		address += size ;
-		index   += size;
-		len     -= size;
+	for (i = 0; i < (len / I2C_PAGE_SIZE); i++) {
+		offset = i * I2C_PAGE_SIZE;
+		if ((memcmp (readBuf + offset, expData + offset, I2C_PAGE_SIZE) != 0) &&
+				(fx3_i2c_retry_page (h, expData, devAddr, offset) != 0)) {
+			failed = 2;
+			break;
+		}
 	}
 
-	return 0;
+	free (readBuf);
+	return -failed;
 }
 
-int
-fx3_i2cboot_download (
+/* Write the firmware to I2C EEPROM. h must be a handle to the FX3 flash programmer. */
+static int
+fx3_i2c_program (
 		libusb_device_handle *h,
 		const char   *filename)
 {
@@ -359,13 +412,6 @@ fx3_i2cboot_download (
 	int r, filesize;
 	unsigned char *fwBuf = 0;
 
-	// Check if we have a handle to the FX3 flash programmer.
-	r = get_fx3_prog_handle (&h);
-	if (r != 0) {
-		fprintf (stderr, "Error: FX3 flash programmer not found\n");
-		return -1;
-	}
-
 	// Allocate memory for holding the firmware binary.
 	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
 
@@ -378,42 +424,24 @@ fx3_i2cboot_download (
         printf ("Info: Writing firmware image to I2C EEPROM\n");
 
 	filesize = ROUND_UP(filesize, I2C_PAGE_SIZE);
+	progress_start ("I2C", filesize);
 	while (filesize != 0) {
 
 		size = (filesize <= romsize) ? filesize : romsize;
 		if (size > I2C_SLAVE_SIZE) {
-			r = fx3_i2c_write (h, fwBuf, address, offset, I2C_SLAVE_SIZE);
-			if (r == 0) {
-				r = fx3_i2c_read_verify (h, fwBuf + offset, address, I2C_SLAVE_SIZE);
-				if (r != 0) {
-					fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
-					free (fwBuf);
-					return -3;
-				}
-
-				r = fx3_i2c_write (h, fwBuf, address + 4, offset + I2C_SLAVE_SIZE, size - I2C_SLAVE_SIZE);
-				if (r == 0) {
-					r = fx3_i2c_read_verify (h, fwBuf + offset + I2C_SLAVE_SIZE,
-							address + 4, size - I2C_SLAVE_SIZE);
-					if (r != 0) {
-						fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
-						free (fwBuf);
-						return -3;
-					}
-				}
-			}
+			r = fx3_i2c_write_verify (h, fwBuf + offset, address, I2C_SLAVE_SIZE);
+			if (r == 0)
+				r = fx3_i2c_write_verify (h, fwBuf + offset + I2C_SLAVE_SIZE, address + 4,
+						size - I2C_SLAVE_SIZE);
 		} else {
-			r = fx3_i2c_write (h, fwBuf, address, offset, size);
-			if (r == 0) {
-				r = fx3_i2c_read_verify (h, fwBuf + offset, address, size);
-				if (r != 0) {
-					fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
-					free (fwBuf);
-					return -3;
-				}
-			}
+			r = fx3_i2c_write_verify (h, fwBuf + offset, address, size);
 		}
 
+		if (r == -2) {
+			fprintf (stderr, "Error: Read-verify from I2C EEPROM failed\n");
+			free (fwBuf);
+			return -3;
+		}
 		if (r != 0) {
 			fprintf (stderr, "Error: Write to I2C EEPROM failed\n");
 			free (fwBuf);
@@ -431,27 +459,80 @@ fx3_i2cboot_download (
 	return 0;
 }
 
+int
+fx3_i2cboot_download (
+		libusb_device_handle *h,
+		const char   *filename)
+{
+	int r;
+
+	// Check if we have a handle to the FX3 flash programmer.
+	r = get_fx3_prog_handle (&h);
+	if (r != 0) {
+		fprintf (stderr, "Error: FX3 flash programmer not found\n");
+		return -1;
+	}
+
+	return fx3_i2c_program (h, filename);
+}
+
+/* Queue the requests that transfer len bytes between buf and SPI flash, starting at page
+   page_address, with the request given (0xC2 to write, 0xC3 to read), and wait for them. */
+static int
+fx3_spi_batch (
+		libusb_device_handle  *h,
+		unsigned char  bmRequestType,
+		unsigned char  bRequest,
+		unsigned char *buf,
+		unsigned short page_address,
+		int            len)
+{
+	struct cyusb_control_req *reqs;
+	int nreqs = (len + MAX_WRITE_SIZE - 1) / MAX_WRITE_SIZE;
+	int index, i, r;
+
+	if (nreqs == 0)
+		return 0;
+
+	reqs = (struct cyusb_control_req *)calloc (nreqs, sizeof (struct cyusb_control_req));
+	if (reqs == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0, index = 0; i < nreqs; i++, index += MAX_WRITE_SIZE) {
+		reqs[i].bmRequestType = bmRequestType;
+		reqs[i].bRequest      = bRequest;
+		reqs[i].wIndex        = page_address + (index / SPI_PAGE_SIZE);
+		reqs[i].wLength       = ((len - index) > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : (len - index);
+		reqs[i].data          = &buf[index];
+		reqs[i].timeout       = VENDORCMD_TIMEOUT;
+	}
+
+	r = cyusb_control_batch (h, reqs, nreqs, 0, 0);
+	free (reqs);
+	return r;
+}
+
+/* Write len bytes from buf to SPI flash, starting at page page_address. */
 static int
 fx3_spi_write (
 		libusb_device_handle  *h,
 		unsigned char *buf,
+		unsigned short page_address,
 		int            len)
 {
-	int r = 0;
-	int index = 0;
 	int size;
-	unsigned short page_address = 0;
 
+	// Each sector is a batch of its own, so that progress is still reported for a large image.
 	while (len > 0) {
-		size = (len > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : len;
-		r = libusb_control_transfer (h, 0x40, 0xC2, 0, page_address, &buf[index], size, VENDORCMD_TIMEOUT);
-		if (r != size) {
+		size = (len > SPI_SECTOR_SIZE) ? SPI_SECTOR_SIZE : len;
+		if (fx3_spi_batch (h, 0x40, 0xC2, buf, page_address, size) != 0) {
 			fprintf (stderr, "Error: Write to SPI flash failed\n");
 			return -1;
 		}
-		index += size;
-		len   -= size;
+		buf          += size;
+		len          -= size;
 		page_address += (size / SPI_PAGE_SIZE);
+		progress_add (size);
 	}
 
 	return 0;
@@ -463,7 +544,8 @@ fx3_spi_erase_sector (
 		unsigned short  nsector)
 {
 	unsigned char stat;
-	int           timeout = 10;
+	int           interval = SPI_POLL_MIN;
+	int           waited = 0;
 	int r;
 
 	r = libusb_control_transfer (h, 0x40, 0xC4, 1, nsector, NULL, 0, VENDORCMD_TIMEOUT);
@@ -472,16 +554,21 @@ fx3_spi_erase_sector (
 		return -1;
 	}
 
-	// Wait for the SPI flash to become ready again.
-	do {
+	// Wait for the SPI flash to become ready again. A sector erase typically takes a few
+	// hundred ms, so start polling quickly and back off up to SPI_POLL_MAX.
+	for (;;) {
 		r = libusb_control_transfer (h, 0xC0, 0xC4, 0, 0, &stat, 1, VENDORCMD_TIMEOUT);
 		if (r != 1) {
 			fprintf (stderr, "Error: SPI status read failed\n");
 			return -2;
 		}
-		sleep (1);
-		timeout--;
-	} while ((stat != 0) && (timeout > 0));
+		if ((stat == 0) || (waited >= SPI_ERASE_TIMEOUT))
+			break;
+
+		usleep (interval * 1000);
+		waited  += interval;
+		interval = (interval * 2 > SPI_POLL_MAX) ? SPI_POLL_MAX : interval * 2;
+	}
 
 	if (stat != 0) {
 		fprintf (stderr, "Error: Timed out on SPI status read\n");
@@ -489,24 +576,162 @@ fx3_spi_erase_sector (
 	}
 
 	printf ("Info: Erased sector %d of SPI flash\n", nsector);
+	progress_add (SPI_SECTOR_SIZE);
 	return 0;
 }
 
-int
-fx3_spiboot_download (
+/* Read len bytes of SPI flash starting at page page_address into buf. */
+static int
+fx3_spi_read (
+		libusb_device_handle  *h,
+		unsigned char *buf,
+		unsigned short page_address,
+		int            len)
+{
+	if (fx3_spi_batch (h, 0xC0, 0xC3, buf, page_address, len) != 0) {
+		fprintf (stderr, "Error: Read from SPI flash failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Check whether a block of the image can be programmed over the current flash contents
+   without an erase, i.e. whether it only clears bits that are still set. */
+static int
+fx3_spi_programmable (
+		const unsigned char *old_data,
+		const unsigned char *new_data,
+		int                  len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if ((old_data[i] & new_data[i]) != new_data[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Check whether a block of the image is all 0xFF, so that it does not need a write after erase. */
+static int
+fx3_spi_blank (
+		const unsigned char *data,
+		int                  len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] != 0xFF)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Update one sector of SPI flash in the differential mode. The sector is read back and compared
+   page by page against the image. Sectors that already match are left alone. The sector is only
+   erased if one of the changed pages needs a bit to go from 0 to 1, and afterwards only the pages
+   that differ (or all non-blank pages, after an erase) are written.
+   Returns the number of pages written, or a negative error code. */
+static int
+fx3_spi_update_sector (
 		libusb_device_handle *h,
-		const char   *filename)
+		unsigned char        *image,
+		int                   nsector,
+		int                   len)
 {
-	unsigned char *fwBuf;
-	int r, i, filesize;
+	unsigned char  flash[SPI_SECTOR_SIZE];
+	unsigned short first_page = nsector * (SPI_SECTOR_SIZE / SPI_PAGE_SIZE);
+	int            erase = 0, changed = 0;
+	int            offset, r;
 
-	// Check if we have a handle to the FX3 flash programmer.
-	r = get_fx3_prog_handle (&h);
-	if (r != 0) {
-		fprintf (stderr, "Error: FX3 flash programmer not found\n");
+	r = fx3_spi_read (h, flash, first_page, len);
+	if (r != 0)
 		return -1;
+
+	for (offset = 0; offset < len; offset += SPI_PAGE_SIZE) {
+		if (memcmp (flash + offset, image + offset, SPI_PAGE_SIZE) != 0) {
+			changed++;
+			if (!fx3_spi_programmable (flash + offset, image + offset, SPI_PAGE_SIZE))
+				erase = 1;
+		}
+	}
+
+	if (changed == 0)
+		return 0;
+
+	if (erase) {
+		r = fx3_spi_erase_sector (h, nsector);
+		if (r != 0)
+			return -2;
+		changed = 0;
+	}
+
+	for (offset = 0; offset < len; offset += SPI_PAGE_SIZE) {
+		if (erase) {
+			if (fx3_spi_blank (image + offset, SPI_PAGE_SIZE))
+				continue;
+		} else {
+			if (memcmp (flash + offset, image + offset, SPI_PAGE_SIZE) == 0)
+				continue;
+		}
+
+		r = fx3_spi_write (h, image + offset, first_page + (offset / SPI_PAGE_SIZE), SPI_PAGE_SIZE);
+		if (r != 0)
+			return -3;
+		changed++;
 	}
 
+	return changed;
+}
+
+/* Write only the changed sectors of the firmware to SPI flash. */
+static int
+fx3_spi_diff_program (
+		libusb_device_handle *h,
+		unsigned char        *fwBuf,
+		int                   filesize)
+{
+	int nsectors = (filesize + SPI_SECTOR_SIZE - 1) / SPI_SECTOR_SIZE;
+	int i, len, r, pages = 0, sectors = 0;
+
+	// Progress goes by the part of the image that has been checked. The erases and writes of
+	// the changed sectors are not counted on top of that.
+	progress_start ("SPI update", filesize);
+	progress_held = 1;
+	for (i = 0; i < nsectors; i++) {
+		len = ((filesize - i * SPI_SECTOR_SIZE) > SPI_SECTOR_SIZE) ? SPI_SECTOR_SIZE :
+			(filesize - i * SPI_SECTOR_SIZE);
+
+		r = fx3_spi_update_sector (h, fwBuf + i * SPI_SECTOR_SIZE, i, len);
+		if (r < 0) {
+			fprintf (stderr, "Error: Failed to update sector %d of SPI flash\n", i);
+			progress_held = 0;
+			return -1;
+		}
+		if (r > 0) {
+			sectors++;
+			pages += r;
+		}
+		progress_set (i * SPI_SECTOR_SIZE + len);
+	}
+	progress_held = 0;
+
+	printf ("Info: %d of %d SPI sectors changed, %d pages written\n", sectors, nsectors, pages);
+	return 0;
+}
+
+/* Write the firmware to SPI flash. h must be a handle to the FX3 flash programmer. */
+static int
+fx3_spi_program (
+		libusb_device_handle *h,
+		const char   *filename)
+{
+	unsigned char *fwBuf;
+	int r, i, filesize;
+
 	// Allocate memory for holding the firmware binary.
 	fwBuf = (unsigned char *)calloc (1, MAX_FWIMG_SIZE);
 	if (fwBuf == 0) {
@@ -522,7 +747,16 @@ fx3_spiboot_download (
 
 	filesize = ROUND_UP(filesize, SPI_PAGE_SIZE);
 
+	if (spi_diff) {
+		r = fx3_spi_diff_program (h, fwBuf, filesize);
+		if (r == 0)
+			printf ("Info: SPI flash programming completed\n");
+		free (fwBuf);
+		return r;
+	}
+
 	// Erase as many SPI sectors as are required to hold the firmware binary.
+	progress_start ("SPI erase", ROUND_UP(filesize, SPI_SECTOR_SIZE));
 	for (i = 0; i < ((filesize + SPI_SECTOR_SIZE - 1) / SPI_SECTOR_SIZE); i++) {
 		r = fx3_spi_erase_sector (h, i);
 		if (r != 0) {
@@ -532,7 +766,8 @@ fx3_spiboot_download (
 		}
 	}
 
-	r = fx3_spi_write (h, fwBuf, filesize);
+	progress_start ("SPI write", filesize);
+	r = fx3_spi_write (h, fwBuf, 0, filesize);
 	if (r != 0) {
 		fprintf (stderr, "Error: SPI write failed\n");
 	} else {
@@ -543,6 +778,281 @@ fx3_spiboot_download (
 	return r;
 }
 
+int
+fx3_spiboot_download (
+		libusb_device_handle *h,
+		const char   *filename)
+{
+	int r;
+
+	// Check if we have a handle to the FX3 flash programmer.
+	r = get_fx3_prog_handle (&h);
+	if (r != 0) {
+		fprintf (stderr, "Error: FX3 flash programmer not found\n");
+		return -1;
+	}
+
+	return fx3_spi_program (h, filename);
+}
+
+/* Get the bus number and port path of a device, as in "2-1.4". Unlike the device address,
+   this does not change when the device re-enumerates. */
+static void
+get_port_path (
+		libusb_device_handle *h,
+		char                 *path,
+		int                   len)
+{
+	libusb_device *dev = libusb_get_device (h);
+	unsigned char  ports[MAX_PORT_DEPTH];
+	int i, n, pos;
+
+	pos = snprintf (path, len, "%d", libusb_get_bus_number (dev));
+	n   = libusb_get_port_numbers (dev, ports, MAX_PORT_DEPTH);
+	for (i = 0; (i < n) && (pos < len); i++)
+		pos += snprintf (path + pos, len - pos, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+}
+
+/* Parameters shared by all the programming threads in the --all mode. */
+static fx3_fw_target all_tgt      = FW_TARGET_NONE;
+static const char   *all_filename = NULL;
+static const char   *all_progfile = NULL;
+static int           all_prog_pass;
+
+/* Programming thread for one device in the --all mode. The first pass loads the flash
+   programmer into the devices that need it, and the second writes the firmware. */
+static void *
+fx3_flash_thread (
+		void *arg)
+{
+	fx3_flash_dev  *dev = (fx3_flash_dev *)arg;
+	struct timespec t1, t2;
+	int r = 0;
+
+	cur_dev = dev;
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+
+	if (all_prog_pass) {
+		r = fx3_usbboot_download (dev->handle, all_progfile);
+	} else {
+		switch (all_tgt) {
+			case FW_TARGET_RAM:
+				r = fx3_usbboot_download (dev->handle, all_filename);
+				break;
+			case FW_TARGET_I2C:
+				r = fx3_i2c_program (dev->handle, all_filename);
+				break;
+			case FW_TARGET_SPI:
+				r = fx3_spi_program (dev->handle, all_filename);
+				break;
+			default:
+				r = -EINVAL;
+				break;
+		}
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &t2);
+	dev->seconds += (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	dev->status   = r;
+	dev->finished = 1;
+	return NULL;
+}
+
+/* Run one programming pass on all selected devices in parallel, and print the progress of
+   each device once a second until all of them are done. */
+static void
+fx3_flash_run_pass (
+		fx3_flash_dev *devs,
+		int            count,
+		int            prog_pass)
+{
+	pthread_t *tid;
+	int       *started;
+	int        i, running;
+
+	tid     = (pthread_t *)calloc (count, sizeof (pthread_t));
+	started = (int *)calloc (count, sizeof (int));
+	if ((tid == NULL) || (started == NULL)) {
+		fprintf (stderr, "Error: Out of memory\n");
+		for (i = 0; i < count; i++) {
+			if (devs[i].status == 0)
+				devs[i].status = -ENOMEM;
+		}
+		free (tid);
+		free (started);
+		return;
+	}
+
+	all_prog_pass = prog_pass;
+	for (i = 0; i < count; i++) {
+		started[i] = 0;
+		if ((devs[i].handle == NULL) || (devs[i].status != 0) || (prog_pass && !devs[i].needs_prog))
+			continue;
+
+		devs[i].step     = "starting";
+		devs[i].done     = 0;
+		devs[i].total    = 0;
+		devs[i].finished = 0;
+		if (pthread_create (&tid[i], NULL, fx3_flash_thread, &devs[i]) != 0) {
+			fprintf (stderr, "Error: Failed to start programming thread for device %s\n", devs[i].path);
+			devs[i].status = -ENOMEM;
+			continue;
+		}
+		started[i] = 1;
+	}
+
+	do {
+		sleep (1);
+		running = 0;
+		printf ("Progress:");
+		for (i = 0; i < count; i++) {
+			if (!started[i])
+				continue;
+			if (devs[i].finished) {
+				printf ("  [%s] %s", devs[i].path, (devs[i].status == 0) ? "done" : "FAILED");
+				continue;
+			}
+			running++;
+			printf ("  [%s] %s %d%%", devs[i].path, devs[i].step,
+					(devs[i].total) ? (int)((devs[i].done * 100ULL) / devs[i].total) : 0);
+		}
+		printf ("\n");
+		fflush (stdout);
+	} while (running != 0);
+
+	for (i = 0; i < count; i++) {
+		if (started[i])
+			pthread_join (tid[i], NULL);
+	}
+
+	free (tid);
+	free (started);
+}
+
+/* Get handles to all the devices again after they have re-enumerated as the flash programmer.
+   Devices are matched up by their port path. Only the devices that have not failed yet are
+   waited for; on the last attempt, the devices that did come back are kept. */
+static void
+fx3_flash_reopen (
+		fx3_flash_dev *devs,
+		int            count)
+{
+	libusb_device_handle *handle;
+	char path[32];
+	int  i, j, k, n, expected = 0, found = 0;
+
+	cyusb_close ();
+	for (i = 0; i < count; i++) {
+		devs[i].handle = NULL;
+		if (devs[i].status == 0)
+			expected++;
+	}
+
+	for (j = 0; (j < GETHANDLE_TIMEOUT) && (found < expected); j++) {
+		sleep (1);
+		n = cyusb_open ();
+		if (n <= 0)
+			continue;
+
+		found = 0;
+		for (k = 0; k < n; k++) {
+			handle = cyusb_gethandle (k);
+			get_port_path (handle, path, sizeof (path));
+			for (i = 0; i < count; i++) {
+				if ((devs[i].status != 0) || (strcmp (devs[i].path, path) != 0))
+					continue;
+				if ((cyusb_getvendor (handle) == FLASHPROG_VID) && (check_fx3_flashprog (handle) == 0)) {
+					devs[i].handle = handle;
+					found++;
+				}
+				break;
+			}
+		}
+
+		if ((found < expected) && (j < GETHANDLE_TIMEOUT - 1)) {
+			cyusb_close ();
+			for (i = 0; i < count; i++)
+				devs[i].handle = NULL;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((devs[i].handle == NULL) && (devs[i].status == 0)) {
+			fprintf (stderr, "Error: Device %s did not come back as the flash programmer\n", devs[i].path);
+			devs[i].status = -ENODEV;
+		}
+	}
+}
+
+/* Program the firmware on all the devices found by cyusb_open(), in parallel. */
+static int
+fx3_download_all (
+		fx3_fw_target  tgt,
+		const char    *filename,
+		int            count)
+{
+	fx3_flash_dev *devs;
+	char *progfile_p = NULL;
+	int   i, failed = 0, need_prog = 0;
+
+	devs = (fx3_flash_dev *)calloc (count, sizeof (fx3_flash_dev));
+	if (devs == NULL) {
+		fprintf (stderr, "Error: Out of memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		devs[i].handle = cyusb_gethandle (i);
+		if (devs[i].handle == NULL) {
+			fprintf (stderr, "Error: Failed to open device %d\n", i);
+			strcpy (devs[i].path, "-");
+			devs[i].status = -EACCES;
+			continue;
+		}
+		get_port_path (devs[i].handle, devs[i].path, sizeof (devs[i].path));
+
+		/* I2C and SPI programming goes through the flash programmer firmware. */
+		if ((tgt != FW_TARGET_RAM) && (check_fx3_flashprog (devs[i].handle) != 0)) {
+			devs[i].needs_prog = 1;
+			need_prog++;
+		}
+	}
+
+	all_tgt      = tgt;
+	all_filename = filename;
+
+	if (need_prog) {
+		progfile_p = get_fx3_prog_file ();
+		if (progfile_p == NULL) {
+			free (devs);
+			return -ENOENT;
+		}
+
+		printf ("Info: Loading flash programmer on %d device(s)\n", need_prog);
+		all_progfile = progfile_p;
+		fx3_flash_run_pass (devs, count, 1);
+		free (progfile_p);
+		all_progfile = NULL;
+
+		fx3_flash_reopen (devs, count);
+	}
+
+	printf ("Info: Programming %d device(s)\n", count);
+	fx3_flash_run_pass (devs, count, 0);
+
+	printf ("\nSummary:\n");
+	for (i = 0; i < count; i++) {
+		printf ("\tDevice %d at %-16s : %s (%d) in %.1f seconds\n", i, devs[i].path,
+				(devs[i].status == 0) ? "OK    " : "FAILED", devs[i].status, devs[i].seconds);
+		if (devs[i].status != 0)
+			failed++;
+	}
+	printf ("\t%d of %d device(s) programmed\n", count - failed, count);
+
+	free (devs);
+	return (failed) ? -EIO : 0;
+}
+
 void
 print_usage_info (
 		const char *arg0)
@@ -556,6 +1066,8 @@ print_usage_info (
 	printf ("\t\t\t\t\"RAM\": Program to FX3 RAM\n");
 	printf ("\t\t\t\t\"I2C\": Program to I2C EEPROM\n");
 	printf ("\t\t\t\t\"SPI\": Program to SPI FLASH\n");
+	printf ("\t%s -a ...: Program all attached devices in parallel\n", arg0);
+	printf ("\t%s -d ...: Only erase and rewrite the SPI flash sectors that have changed\n", arg0);
 	printf ("\n\n");
 }
 
@@ -567,6 +1079,7 @@ int main (
 	char         *filename = NULL;
 	char         *tgt_str  = NULL;
 	fx3_fw_target tgt = FW_TARGET_NONE;
+	int all = 0;
 	int r, i;
 
 	/* Parse command line arguments. */
@@ -596,6 +1109,10 @@ int main (
 					if (argc > (i + 1))
 						filename = argv[i + 1];
 					i++;
+				} else if ((strcmp (argv[i], "-a") == 0) || (strcmp (argv[i], "--all") == 0)) {
+					all = 1;
+				} else if ((strcmp (argv[i], "-d") == 0) || (strcmp (argv[i], "--diff") == 0)) {
+					spi_diff = 1;
 				} else {
 					fprintf (stderr, "Error: Unknown parameter %s\n", argv[i]);
 					print_usage_info (argv[0]);
@@ -619,8 +1136,13 @@ int main (
 	        fprintf (stderr, "Error: No FX3 device found\n");
 		return -ENODEV;
 	}
+	else if (all) {
+		r = fx3_download_all (tgt, filename, r);
+		cyusb_close ();
+		return r;
+	}
 	else if (r > 1) {
-		fprintf (stderr, "Error: More than one Cypress device found\n");
+		fprintf (stderr, "Error: More than one Cypress device found, use -a to program all of them\n");
 		return -EINVAL;
 	}
 
@@ -0,0 +1,183 @@
+/************************************************************************************************
+ * Program Name		:	create.cpp							*
+ * Description		:	This is a CLI program which generates a binary file of test	*
+ *				data, for sending to a device with 08_cybulk or checking data	*
+ *				received from one. The data is made by the same payload	*
+ *				generators the streaming library uses, and written in large	*
+ *				blocks, so even very large files take little time.		*
+ * License		:	LGPL Ver 2.1							*
+ * Copyright		:	Cypress Semiconductors Inc. / ATR-LABS				*
+ ***********************************************************************************************/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <libusb-1.0/libusb.h>
+#include "../include/cyusb.h"
+
+/********** Cut and paste the following & modify as required  **********/
+static const char * program_name;
+static const char *const short_options = "hvn:p:fo:";
+static const struct option long_options[] = {
+		{ "help",	0,	NULL,	'h'	},
+		{ "version",	0,	NULL,	'v'	},
+		{ "size",	1,	NULL,	'n'	},
+		{ "pattern",	1,	NULL,	'p'	},
+		{ "force",	0,	NULL,	'f'	},
+		{ "output",	1,	NULL,	'o'	},
+		{ NULL,		0,	NULL,	 0	}
+};
+
+static int next_option;
+
+static void print_usage(FILE *stream, int exit_code)
+{
+	fprintf(stream, "Usage: %s options\n", program_name);
+	fprintf(stream,
+		"  -h  --help            Display this usage information.\n"
+		"  -v  --version         Print version.\n"
+		"  -n  --size <bytes>    Number of bytes to generate; K, M and G suffixes are allowed.\n"
+		"  -p  --pattern <spec>  const[:value], inc8, inc16, inc32, lfsr[:seed] or file:<path>\n"
+		"                        (default: inc8).\n"
+		"  -f  --force           Overwrite the output file if it exists.\n"
+		"  -o  --output <file>   File to write the data to.\n");
+
+	exit(exit_code);
+}
+/***********************************************************************/
+
+// Size of each block of data generated and written.
+#define CREATE_BLOCK_SIZE	(1024 * 1024)
+
+// Function: parse_size
+// Parses a byte count with an optional K, M or G suffix. Returns false if it is not valid.
+static bool
+parse_size (
+		const char         *str,
+		unsigned long long *size)
+{
+	char *end;
+
+	*size = strtoull (str, &end, 0);
+	if (end == str)
+		return false;
+
+	switch (*end) {
+		case 'k': case 'K': *size <<= 10; end++; break;
+		case 'm': case 'M': *size <<= 20; end++; break;
+		case 'g': case 'G': *size <<= 30; end++; break;
+	}
+
+	return (*end == '\0');
+}
+
+int main (
+		int argc,
+		char **argv)
+{
+	cyusb_payload *pl;
+	unsigned char *buf;
+	unsigned long long size = 0, left;
+	const char *spec = "inc8";
+	const char *outfile = NULL;
+	bool size_set = false;
+	int flags = O_WRONLY | O_CREAT | O_EXCL;
+	unsigned int len, done;
+	ssize_t n;
+	int fd;
+	int r;
+
+	program_name = argv[0];
+	while ( (next_option = getopt_long(argc, argv, short_options,
+					   long_options, NULL) ) != -1 ) {
+		switch ( next_option ) {
+			case 'h': /* -h or --help  */
+				  print_usage(stdout, 0);
+			case 'v': /* -v or --version */
+				  printf("create (Ver 1.0)\n");
+				  printf("Copyright (C) Cypress Semiconductors / ATR-LABS\n");
+				  exit(0);
+			case 'n': /* -n or --size */
+				  if ( !parse_size(optarg, &size) )
+					  print_usage(stdout, 1);
+				  size_set = true;
+				  break;
+			case 'p': /* -p or --pattern */
+				  spec = optarg;
+				  break;
+			case 'f': /* -f or --force */
+				  flags = O_WRONLY | O_CREAT | O_TRUNC;
+				  break;
+			case 'o': /* -o or --output */
+				  outfile = optarg;
+				  break;
+			case '?': /* Invalid option */
+				  print_usage(stdout, 1);
+			default : /* Something else, unexpected */
+				  abort();
+		}
+	}
+	if ( (!size_set) || (outfile == NULL) || (optind != argc) )
+		print_usage(stdout, 1);
+
+	r = cyusb_payload_create(spec, &pl);
+	if ( r != 0 ) {
+		fprintf(stderr, "Error %d in setting up pattern %s\n", r, spec);
+		cyusb_error(r);
+		return r;
+	}
+
+	buf = (unsigned char *)malloc(CREATE_BLOCK_SIZE);
+	if ( buf == NULL ) {
+		cyusb_payload_destroy(pl);
+		return -ENOMEM;
+	}
+
+	fd = open(outfile, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if ( fd < 0 ) {
+		r = -errno;
+		fprintf(stderr, "Error opening output file %s: %s\n", outfile, strerror(-r));
+		free(buf);
+		cyusb_payload_destroy(pl);
+		return r;
+	}
+
+	r = 0;
+	left = size;
+	while ( left != 0 ) {
+		len = ( left > CREATE_BLOCK_SIZE ) ? CREATE_BLOCK_SIZE : left;
+		cyusb_payload_fill(pl, buf, len);
+		left -= len;
+
+		for ( done = 0; done < len; done += n ) {
+			n = write(fd, buf + done, len - done);
+			if ( n < 0 ) {
+				if ( errno == EINTR ) {
+					n = 0;
+					continue;
+				}
+				r = -errno;
+				break;
+			}
+		}
+		if ( r != 0 )
+			break;
+	}
+
+	if ( (close(fd) != 0) && (r == 0) )
+		r = -errno;
+	if ( r != 0 )
+		fprintf(stderr, "Error writing output file %s: %s\n", outfile, strerror(-r));
+	else
+		printf("Wrote %llu bytes of %s data to %s\n", size, cyusb_payload_name(pl), outfile);
+
+	free(buf);
+	cyusb_payload_destroy(pl);
+	return r;
+}
+